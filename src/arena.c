@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include "rlite/arena.h"
+#include "rlite/util.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+typedef struct rl_arena_chunk {
+	struct rl_arena_chunk *previous;
+	size_t size;
+	size_t used;
+	// offset of the last allocation, 0 if there is none
+	size_t last;
+	unsigned char data[];
+} rl_arena_chunk;
+
+/**
+ * Precedes every allocation, to give the space back when it is freed.
+ */
+typedef struct {
+	size_t used;
+	size_t last;
+} rl_arena_header;
+
+#define HEADER_SIZE ALIGN(sizeof(rl_arena_header))
+
+void rl_arena_init(rl_arena *arena)
+{
+	arena->chunk = NULL;
+}
+
+static rl_arena_chunk *chunk_create(rl_arena_chunk *previous, size_t size)
+{
+	rl_arena_chunk *chunk = rl_malloc(ALIGN(sizeof(rl_arena_chunk)) + size);
+	if (!chunk) {
+		return NULL;
+	}
+	chunk->previous = previous;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->last = 0;
+	return chunk;
+}
+
+void *rl_arena_malloc(rl_arena *arena, size_t size)
+{
+	rl_arena_chunk *chunk = arena->chunk;
+	rl_arena_header *header;
+	size_t needed = HEADER_SIZE + ALIGN(size);
+	if (!chunk || chunk->size - chunk->used < needed) {
+		chunk = chunk_create(chunk, needed > CHUNK_SIZE ? needed : CHUNK_SIZE);
+		if (!chunk) {
+			return NULL;
+		}
+		arena->chunk = chunk;
+	}
+	header = (rl_arena_header *)&chunk->data[chunk->used];
+	header->used = chunk->used;
+	header->last = chunk->last;
+	chunk->last = chunk->used + HEADER_SIZE;
+	chunk->used += needed;
+	return &chunk->data[chunk->last];
+}
+
+void rl_arena_free(rl_arena *arena, void *ptr)
+{
+	rl_arena_chunk *chunk = arena->chunk;
+	rl_arena_header *header;
+	if (!ptr || !chunk || chunk->last == 0 || ptr != &chunk->data[chunk->last]) {
+		// not the last allocation, it waits for the reset
+		return;
+	}
+	header = (rl_arena_header *)&chunk->data[chunk->last - HEADER_SIZE];
+	chunk->used = header->used;
+	chunk->last = header->last;
+	if (chunk->used == 0 && chunk->previous) {
+		// back to the previous chunk, this one would only be used by
+		// allocations that do not fit there
+		arena->chunk = chunk->previous;
+		rl_free(chunk);
+	}
+}
+
+void rl_arena_reset(rl_arena *arena)
+{
+	rl_arena_chunk *chunk = arena->chunk, *previous;
+	while (chunk && (chunk->previous || chunk->size > CHUNK_SIZE)) {
+		previous = chunk->previous;
+		rl_free(chunk);
+		chunk = previous;
+	}
+	if (chunk) {
+		chunk->used = 0;
+		chunk->last = 0;
+	}
+	arena->chunk = chunk;
+}
+
+void rl_arena_destroy(rl_arena *arena)
+{
+	rl_arena_chunk *chunk = arena->chunk, *previous;
+	while (chunk) {
+		previous = chunk->previous;
+		rl_free(chunk);
+		chunk = previous;
+	}
+	arena->chunk = NULL;
+}
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rlite/rlite.h"
+#include "rlite/backup.h"
+#include "rlite/wal.h"
+#include "rlite/util.h"
+
+int rl_backup_init(rlite *destination, rlite *source, rl_backup **_backup)
+{
+	int retval = RL_OK;
+	rl_backup *backup;
+	if (destination == source || !rl_has_flag(destination, RLITE_OPEN_READWRITE) ||
+			destination->page_size != source->page_size) {
+		return RL_INVALID_PARAMETERS;
+	}
+	RL_MALLOC(backup, sizeof(*backup));
+	backup->source = source;
+	backup->destination = destination;
+	backup->next_page = 1;
+	backup->page_count = 0;
+	backup->change_counter = -1;
+	backup->dirty_pages = NULL;
+	backup->dirty_len = backup->dirty_alloc = 0;
+	backup->restarts = 0;
+	backup->next = source->backups;
+	source->backups = backup;
+	*_backup = backup;
+cleanup:
+	return retval;
+}
+
+/**
+ * Reads a page as it was last committed, serialized. Pages never written
+ * are zeroed.
+ */
+static int read_page(rlite *db, long page_number, unsigned char *data)
+{
+	int retval = RL_OK;
+	size_t read = 0;
+	if (db->driver_type == RL_FILE_DRIVER) {
+		rl_file_driver *driver = db->driver;
+		if (driver->log->frames > 0) {
+			RL_CALL2(rl_wal_log_read, RL_FOUND, RL_NOT_FOUND, db, page_number, data);
+			if (retval == RL_FOUND) {
+				retval = RL_OK;
+				goto cleanup;
+			}
+		}
+		RL_CALL(driver->io->read, RL_OK, driver->handle, data, db->page_size, (long long)page_number * db->page_size, &read);
+	}
+	else if (rl_is_resident(db)) {
+		rl_page *page = rl_page_cache_get(db->read_pages, page_number);
+		if (page && page->type == NULL) {
+			memcpy(data, page->obj, db->page_size);
+			read = db->page_size;
+		}
+		else if (page && page->obj) {
+			memset(data, 0, db->page_size);
+			RL_CALL(page->type->serialize, RL_OK, db, page->obj, data);
+			read = db->page_size;
+		}
+	}
+	else {
+		unsigned char *stored = rl_page_store_get(&((rl_memory_driver *)db->driver)->store, page_number);
+		if (stored) {
+			memcpy(data, stored, db->page_size);
+			read = db->page_size;
+		}
+	}
+	if (read < (size_t)db->page_size) {
+		memset(&data[read], 0, db->page_size - read);
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int copy_page(rl_backup *backup, long page_number)
+{
+	int retval;
+	unsigned char *data;
+	RL_MALLOC(data, backup->source->page_size);
+	retval = read_page(backup->source, page_number, data);
+	if (retval != RL_OK) {
+		rl_free(data);
+		goto cleanup;
+	}
+	// freed along with the page, even if writing it fails
+	RL_CALL(rl_write_raw, RL_OK, backup->destination, page_number, data);
+cleanup:
+	return retval;
+}
+
+// the destination takes the pages, free pages and databases of the source
+static int copy_header(rl_backup *backup)
+{
+	int retval = RL_OK;
+	rlite *source = backup->source, *destination = backup->destination;
+	long len = source->number_of_databases + RLITE_INTERNAL_DB_COUNT;
+	void *tmp;
+	RL_REALLOC(destination->databases, sizeof(long) * len);
+	memcpy(destination->databases, source->databases, sizeof(long) * len);
+	destination->number_of_databases = source->number_of_databases;
+	destination->number_of_pages = source->number_of_pages;
+	destination->next_empty_page = source->next_empty_page;
+	destination->freelist = source->freelist;
+	RL_CALL(rl_write, RL_OK, destination, &rl_data_type_header, 0, NULL);
+cleanup:
+	return retval;
+}
+
+int rl_backup_step(rl_backup *backup, long pages)
+{
+	int retval = RL_OK;
+	rlite *source = backup->source, *destination = backup->destination;
+	long i, end;
+	if (!source) {
+		return RL_INVALID_STATE;
+	}
+	// commits waiting for the group are copied too
+	RL_CALL(rl_flush, RL_OK, source);
+	if (source->write_pages.len > 0 || destination->write_pages.len > 0) {
+		return RL_INVALID_STATE;
+	}
+	RL_CALL(rl_begin_read, RL_OK, source);
+	if (source->change_counter != backup->change_counter) {
+		// another connection wrote to the source, or this is the first step
+		if (backup->change_counter != -1) {
+			backup->restarts++;
+		}
+		backup->next_page = 1;
+		backup->dirty_len = 0;
+		backup->change_counter = source->change_counter;
+	}
+	backup->page_count = source->number_of_pages;
+	end = source->number_of_pages;
+	if (pages >= 0 && backup->next_page + pages < end) {
+		end = backup->next_page + pages;
+	}
+
+	RL_CALL(rl_refresh, RL_OK, destination);
+	for (i = 0; i < backup->dirty_len; i++) {
+		if (backup->dirty_pages[i] < source->number_of_pages) {
+			RL_CALL(copy_page, RL_OK, backup, backup->dirty_pages[i]);
+		}
+	}
+	backup->dirty_len = 0;
+	for (i = backup->next_page; i < end; i++) {
+		RL_CALL(copy_page, RL_OK, backup, i);
+	}
+	backup->next_page = end;
+	RL_CALL(copy_header, RL_OK, backup);
+	RL_CALL(rl_commit, RL_OK, destination);
+	RL_CALL(rl_flush, RL_OK, destination);
+	retval = backup->next_page < source->number_of_pages ? RL_OK : RL_END;
+cleanup:
+	if (retval != RL_OK && retval != RL_END) {
+		rl_discard(destination);
+		// the pages copied were not committed
+		backup->change_counter = -1;
+	}
+	rl_discard(source);
+	return retval;
+}
+
+long rl_backup_remaining(rl_backup *backup)
+{
+	return backup->page_count - backup->next_page + backup->dirty_len;
+}
+
+int rl_backup_finish(rl_backup *backup)
+{
+	rl_backup **previous;
+	if (backup->source) {
+		for (previous = &backup->source->backups; *previous; previous = &(*previous)->next) {
+			if (*previous == backup) {
+				*previous = backup->next;
+				break;
+			}
+		}
+	}
+	rl_free(backup->dirty_pages);
+	rl_free(backup);
+	return RL_OK;
+}
+
+int rl_backup_update(rlite *source)
+{
+	int retval = RL_OK;
+	rl_backup *backup;
+	long i, page_number;
+	void *tmp;
+	for (backup = source->backups; backup; backup = backup->next) {
+		// it starts over if the source changed since the last step
+		if (backup->change_counter != source->change_counter - 1) {
+			continue;
+		}
+		backup->change_counter = source->change_counter;
+		for (i = 0; i < source->write_pages.len; i++) {
+			page_number = source->write_pages.pages[i]->page_number;
+			if (page_number == 0 || page_number >= backup->next_page) {
+				continue;
+			}
+			if (backup->dirty_len == backup->dirty_alloc) {
+				backup->dirty_alloc = backup->dirty_alloc ? backup->dirty_alloc * 2 : 16;
+				RL_REALLOC(backup->dirty_pages, sizeof(long) * backup->dirty_alloc);
+			}
+			backup->dirty_pages[backup->dirty_len++] = page_number;
+		}
+	}
+cleanup:
+	if (retval != RL_OK) {
+		// copying everything again is always right
+		backup->change_counter = -1;
+	}
+	return retval;
+}
+
+void rl_backup_detach(rlite *source)
+{
+	rl_backup *backup;
+	for (backup = source->backups; backup; backup = backup->next) {
+		backup->source = NULL;
+	}
+	source->backups = NULL;
+}
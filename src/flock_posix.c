@@ -1,32 +1,207 @@
-#include <sys/fcntl.h>
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
 #include <sys/file.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "rlite/rlite.h"
+#include "rlite/flock.h"
 
 int rl_flock(FILE *fp, int type)
 {
-	int fd = fileno(fp);
-	int locktype;
+	return rl_flock_fd(fileno(fp), type);
+}
+
+#ifdef F_OFD_SETLK
+/**
+ * Locks are byte ranges past the end of any file rlite writes, and locks
+ * are advisory, so the bytes do not need to exist. Page numbers take 4 bytes
+ * and pages at most 64 KiB, so the pager never writes past 2^48. With a 32
+ * bit off_t the bytes are at 1 GiB instead, and databases must stay below it.
+ * A shared lock is a read lock on one of the reader slots, taken while
+ * holding a read lock on the pending byte. An exclusive lock is a write
+ * lock on every reader slot, taken after the pending byte: once a
+ * connection waits for it, new readers wait too, and the ones already in
+ * can only leave.
+ * The writer byte is taken apart from those, by connections that will
+ * write.
+ */
+#define LOCK_PENDING ((off_t)1 << (sizeof(off_t) > 4 ? 62 : 30))
+#define LOCK_WRITER (LOCK_PENDING + 1)
+#define LOCK_READERS (LOCK_PENDING + 2)
+#define LOCK_READER_SLOTS 16
+
+static int lock_range(int fd, short type, off_t start, off_t len, int wait)
+{
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) != 0) {
+		if (errno == EAGAIN || errno == EACCES) {
+			return RL_BUSY;
+		}
+		if (errno != EINTR) {
+			return RL_UNEXPECTED;
+		}
+	}
+	return RL_OK;
+}
+
+static int lock_test(int fd, short type, off_t start, off_t len, short *holder)
+{
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	if (fcntl(fd, F_OFD_GETLK, &lock) != 0) {
+		return RL_UNEXPECTED;
+	}
+	*holder = lock.l_type;
+	return RL_OK;
+}
+
+// the same descriptor always gets the same slot
+static off_t reader_slot(int fd)
+{
+	return LOCK_READERS + ((unsigned long)getpid() * 31 + fd) % LOCK_READER_SLOTS;
+}
+
+static int lock_shared(int fd, int wait)
+{
+	off_t slot = reader_slot(fd);
+	int retval;
+	retval = lock_range(fd, F_RDLCK, LOCK_PENDING, 1, wait);
+	if (retval != RL_OK) {
+		return retval;
+	}
+	// converts the exclusive lock of the slot, if there is one, then drops
+	// the rest; a length of 0 would mean up to the end of the file
+	retval = lock_range(fd, F_RDLCK, slot, 1, wait);
+	if (retval == RL_OK && slot > LOCK_READERS) {
+		retval = lock_range(fd, F_UNLCK, LOCK_READERS, slot - LOCK_READERS, 0);
+	}
+	if (retval == RL_OK && slot + 1 < LOCK_READERS + LOCK_READER_SLOTS) {
+		retval = lock_range(fd, F_UNLCK, slot + 1, LOCK_READERS + LOCK_READER_SLOTS - slot - 1, 0);
+	}
+	lock_range(fd, F_UNLCK, LOCK_PENDING, 1, 0);
+	return retval;
+}
+
+static int lock_exclusive(int fd, int wait)
+{
+	int retval;
+	retval = lock_range(fd, F_WRLCK, LOCK_PENDING, 1, wait);
+	if (retval != RL_OK) {
+		return retval;
+	}
+	// without waiting, the pending byte is kept until the next call to keep
+	// new readers out meanwhile
+	retval = lock_range(fd, F_WRLCK, LOCK_READERS, LOCK_READER_SLOTS, wait);
+	if (retval == RL_OK) {
+		lock_range(fd, F_UNLCK, LOCK_PENDING, 1, 0);
+	}
+	return retval;
+}
+
+int rl_flock_fd(int fd, int type)
+{
+	int wait = (type & RLITE_FLOCK_NB) == 0;
+	switch (type & ~RLITE_FLOCK_NB) {
+		case RLITE_FLOCK_SH:
+			return lock_shared(fd, wait);
+		case RLITE_FLOCK_EX:
+			return lock_exclusive(fd, wait);
+		case RLITE_FLOCK_WRITER:
+			return lock_range(fd, F_WRLCK, LOCK_WRITER, 1, wait);
+		case RLITE_FLOCK_UN:
+			return lock_range(fd, F_UNLCK, LOCK_PENDING, LOCK_READERS + LOCK_READER_SLOTS - LOCK_PENDING, 0);
+	}
+	return RL_UNEXPECTED;
+}
+
+int rl_is_flocked(const char *path, int type)
+{
+	int retval, oflags;
+	short holder;
+
 	if (type == RLITE_FLOCK_SH) {
-		locktype = LOCK_SH;
+		oflags = O_RDONLY;
 	} else if (type == RLITE_FLOCK_EX) {
+		oflags = O_WRONLY;
+	} else {
+		return RL_UNEXPECTED;
+	}
+	int fd = open(path, oflags);
+	if (fd == -1) {
+		// if the file does not exist, the lock is not found
+		if (errno == ENOENT || errno == EACCES) {
+			return RL_NOT_FOUND;
+		}
+		return RL_UNEXPECTED;
+	}
+
+	// a read lock on every slot conflicts only with an exclusive lock
+	RL_CALL(lock_test, RL_OK, fd, F_RDLCK, LOCK_READERS, LOCK_READER_SLOTS, &holder);
+	if (type == RLITE_FLOCK_EX) {
+		retval = holder == F_UNLCK ? RL_NOT_FOUND : RL_FOUND;
+		goto cleanup;
+	}
+	if (holder != F_UNLCK) {
+		// exclusive, not shared
+		retval = RL_NOT_FOUND;
+		goto cleanup;
+	}
+	// and a write lock with any lock
+	RL_CALL(lock_test, RL_OK, fd, F_WRLCK, LOCK_READERS, LOCK_READER_SLOTS, &holder);
+	retval = holder == F_UNLCK ? RL_NOT_FOUND : RL_FOUND;
+cleanup:
+	close(fd);
+	return retval;
+}
+
+#else
+/**
+ * Without open file description locks, process-associated ones would not
+ * exclude connections of the same process, so the whole file is locked with
+ * flock() instead, without a pending state. A descriptor has a single
+ * flock() lock, so there is no writer lock either; callers take it on a
+ * file of its own.
+ */
+int rl_flock_fd(int fd, int type)
+{
+	int locktype;
+	if ((type & ~RLITE_FLOCK_NB) == RLITE_FLOCK_SH) {
+		locktype = LOCK_SH;
+	} else if ((type & ~RLITE_FLOCK_NB) == RLITE_FLOCK_EX) {
 		locktype = LOCK_EX;
+	} else if ((type & ~RLITE_FLOCK_NB) == RLITE_FLOCK_WRITER) {
+		return RL_NOT_IMPLEMENTED;
 	} else if (type == RLITE_FLOCK_UN) {
 		locktype = LOCK_UN;
 	} else {
 		return RL_UNEXPECTED;
 	}
-	// all documented error codes for flock do not apply
-	// EWOULDBLOCK because we are not using LOCK_NB
-	// ENOTSUP, EBADF and EINVAL because we received the fileno from a FILE*
-	if (flock(fd, locktype) == 0) {
-		return RL_OK;
-	} else {
-		return RL_UNEXPECTED;
+	if (type & RLITE_FLOCK_NB) {
+		locktype |= LOCK_NB;
+	}
+	// the other documented error codes for flock do not apply
+	// ENOTSUP, EBADF and EINVAL because we received an open file descriptor
+	while (flock(fd, locktype) != 0) {
+		if (errno == EWOULDBLOCK) {
+			return RL_BUSY;
+		}
+		if (errno != EINTR) {
+			return RL_UNEXPECTED;
+		}
 	}
+	return RL_OK;
 }
 
 int rl_is_flocked(const char *path, int type)
@@ -83,3 +258,4 @@ cleanup:
 	close(fd);
 	return retval;
 }
+#endif
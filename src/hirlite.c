@@ -1,3 +1,4 @@
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include "rlite/constants.h"
 #include <assert.h>
@@ -55,6 +56,10 @@
 	if (retval == RL_NAN) {\
 		c->reply = createErrorObject("ERR resulting score is not a number (NaN)");\
 		goto cleanup;\
+	}\
+	if (retval == RL_BUSY) {\
+		c->reply = createErrorObject(RLITE_BUSYERR);\
+		goto cleanup;\
 	}
 
 #define RLITE_SERVER_ERR(c, retval, expected)\
@@ -673,12 +678,17 @@ int rliteFormatCommandArgv(rliteClient *client, int argc, char **argv, size_t *a
 	return RLITE_OK;
 }
 
-static int refresh_rlite_fp(rliteContext* context) {
+static int refresh_rlite_fp(rliteContext* context, struct rliteCommand *command) {
+	// read commands run on a snapshot and do not wait for writers; commands
+	// that may subscribe or run scripts can write even if flagged as reads
+	if (command && strchr(command->sflags, 'r') && !strpbrk(command->sflags, "psa")) {
+		return rl_begin_read(context->db);
+	}
 	return rl_refresh(context->db);
 }
 
 #define DEFAULT_REPLIES_SIZE 16
-static rliteContext *_rliteConnect(const char *path) {
+static rliteContext *createContext(const char *path) {
 	rliteContext *context = rl_malloc(sizeof(*context));
 	if (!context) {
 		return NULL;
@@ -686,16 +696,14 @@ static rliteContext *_rliteConnect(const char *path) {
 	context->replies = rl_malloc(sizeof(rliteReply*) * DEFAULT_REPLIES_SIZE);
 	if (!context->replies) {
 		rl_free(context);
-		context = NULL;
-		goto cleanup;
+		return NULL;
 	}
 	size_t pathlen = 1 + strlen(path);
 	context->path = rl_malloc(sizeof(char) * pathlen);
 	if (!context->path) {
 		rl_free(context->replies);
 		rl_free(context);
-		context = NULL;
-		goto cleanup;
+		return NULL;
 	}
 	memcpy(context->path, path, pathlen);
 	context->err = 0;
@@ -715,54 +723,86 @@ static rliteContext *_rliteConnect(const char *path) {
 	context->watchedKeys = NULL;
 	context->enqueuedCommands = NULL;
 	context->db = NULL;
-	int retval = rl_open(context->path, &context->db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);;
+	return context;
+}
+
+static void freeContext(rliteContext *context) {
+	rl_free(context->path);
+	rl_free(context->replies);
+	rl_free(context);
+}
+
+static rliteContext *_rliteConnect(const char *path, const rl_open_options *_options) {
+	rl_open_options options;
+	if (_options) {
+		options = *_options;
+	} else {
+		memset(&options, 0, sizeof(options));
+	}
+	if (options.flags == 0) {
+		options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE;
+	}
+	rliteContext *context = createContext(path);
+	if (!context) {
+		return NULL;
+	}
+	int retval = rl_open_v2(context->path, &context->db, &options);
 	if (retval != RL_OK) {
-		rl_free(context->path);
-		rl_free(context->replies);
-		rl_free(context);
-		context = NULL;
-		goto cleanup;
+		freeContext(context);
+		return NULL;
 	}
 	// if created, need to release locks
 	retval = rl_commit(context->db);
 	if (retval != RL_OK) {
 		rl_close(context->db);
-		rl_free(context->path);
-		rl_free(context->replies);
-		rl_free(context);
-		context = NULL;
-		goto cleanup;
+		freeContext(context);
+		return NULL;
+	}
+	return context;
+}
+
+rliteContext *rliteConnectThread(rliteContext *c) {
+	rliteContext *context = createContext(c->path);
+	if (!context) {
+		return NULL;
+	}
+	if (rl_open_thread(c->db, &context->db) != RL_OK) {
+		freeContext(context);
+		return NULL;
 	}
-cleanup:
 	return context;
 }
 
 rliteContext *rliteConnect(const char *ip, int UNUSED(port)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, NULL);
+}
+
+rliteContext *rliteConnectWithOptions(const char *path, const rl_open_options *options) {
+	return _rliteConnect(path, options);
 }
 
 rliteContext *rliteConnectWithTimeout(const char *ip, int UNUSED(port), const struct timeval UNUSED(tv)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, NULL);
 }
 
 rliteContext *rliteConnectNonBlock(const char *ip, int UNUSED(port)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, NULL);
 }
 
 rliteContext *rliteConnectBindNonBlock(const char *ip, int UNUSED(port), const char *UNUSED(source_addr)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, NULL);
 }
 
 rliteContext *rliteConnectUnix(const char *path) {
-	return _rliteConnect(path);
+	return _rliteConnect(path, NULL);
 }
 
 rliteContext *rliteConnectUnixWithTimeout(const char *path, const struct timeval UNUSED(tv)) {
-	return _rliteConnect(path);
+	return _rliteConnect(path, NULL);
 }
 
 rliteContext *rliteConnectUnixNonBlock(const char *path) {
-	return _rliteConnect(path);
+	return _rliteConnect(path, NULL);
 }
 
 rliteContext *rliteConnectFd(int UNUSED(fd)) {
@@ -854,11 +894,37 @@ static void discardCommand(rliteClient *c) {
 	c->reply = createStatusObject(RLITE_STR_OK);
 }
 
+/**
+ * Whether a command run since write_sequence was read modified the database,
+ * and has to be sent to writeCommand. In debug builds, it also compares the
+ * dirty pages hash taken before the command, to catch a page modified
+ * without calling rl_write.
+ */
+static int commandChangedDatabase(rlite *db, long write_sequence, unsigned char *oldhash, int *changed) {
+	int retval = RL_OK;
+	*changed = db->write_sequence != write_sequence && db->write_pages.len > 0;
+#ifdef RL_DEBUG
+	unsigned char *newhash = NULL;
+	RL_CALL(rl_dirty_hash, RL_OK, db, &newhash);
+	if (!*changed && newhash && (!oldhash || memcmp(newhash, oldhash, 20) != 0)) {
+		fprintf(stderr, "Dirty pages changed without a write\n");
+		retval = RL_UNEXPECTED;
+	}
+cleanup:
+	rl_free(newhash);
+#else
+	(void)oldhash;
+#endif
+	return retval;
+}
+
 static void execCommand(rliteClient *c) {
 	short written = 0;
 	int retval;
 	size_t i;
-	unsigned char *oldhash = NULL, *newhash = NULL;
+	int changed;
+	long write_sequence = 0;
+	unsigned char *oldhash = NULL;
 	if (!c->context->inTransaction) {
 		c->reply = createErrorObject("ERR EXEC without MULTI");
 		return;
@@ -867,7 +933,7 @@ static void execCommand(rliteClient *c) {
 		c->reply = createErrorObject("EXECABORT Transaction discarded because of previous errors.");
 		goto cleanup;
 	}
-	RL_CALL(refresh_rlite_fp, RL_OK, c->context);
+	RL_CALL(refresh_rlite_fp, RL_OK, c->context, NULL);
 	retval = rl_check_watched_keys(c->context->db, c->context->watchedKeysLength, c->context->watchedKeys);
 	RLITE_SERVER_ERR2(c, retval, RL_OK, RL_OUTDATED);
 	if (retval == RL_OUTDATED) {
@@ -891,7 +957,10 @@ static void execCommand(rliteClient *c) {
 		command = rliteLookupCommand(client->argv[0], client->argvlen[0]);
 
 		if (client->context->writeCommand) {
+			write_sequence = client->context->db->write_sequence;
+#ifdef RL_DEBUG
 			RL_CALL(rl_dirty_hash, RL_OK, client->context->db, &oldhash);
+#endif
 		}
 
 		command->proc(client);
@@ -913,15 +982,13 @@ static void execCommand(rliteClient *c) {
 					}
 				}
 			}
-			RL_CALL(rl_dirty_hash, RL_OK, client->context->db, &newhash);
-			if (newhash && (!oldhash || memcmp(newhash, oldhash, 20) != 0)) {
+			RL_CALL(commandChangedDatabase, RL_OK, client->context->db, write_sequence, oldhash, &changed);
+			if (changed) {
 				client->context->writeCommand(rl_get_selected_db(client->context->db), client->argc, client->argv, client->argvlen);
 			}
 		}
 		rl_free(oldhash);
-		rl_free(newhash);
 		oldhash = NULL;
-		newhash = NULL;
 	}
 
 	if (written) {
@@ -934,7 +1001,6 @@ static void execCommand(rliteClient *c) {
 	RLITE_SERVER_OK(c, retval);
 cleanup:
 	rl_free(oldhash);
-	rl_free(newhash);
 	discard(c);
 	return;
 }
@@ -1033,7 +1099,9 @@ int rliteAppendCommandClient(rliteClient *c) {
 		return RLITE_ERR;
 	}
 
-	unsigned char *oldhash = NULL, *newhash = NULL;
+	unsigned char *oldhash = NULL;
+	long write_sequence = 0;
+	int changed;
 	char *cmd;
 	void *tmp;
 	size_t newAlloc;
@@ -1055,7 +1123,16 @@ int rliteAppendCommandClient(rliteClient *c) {
 		retval = addReplyErrorFormat(c->context, "wrong number of arguments for '%s' command", command->name);
 		flagTransactions(c);
 	} else {
-		RL_CALL(refresh_rlite_fp, RL_OK, c->context);
+		retval = refresh_rlite_fp(c->context, command);
+		if (retval == RL_BUSY) {
+			// another connection kept the database locked past the busy timeout
+			retval = addReplyErrorFormat(c->context, RLITE_BUSYERR);
+			flagTransactions(c);
+			goto cleanup;
+		}
+		else if (retval != RL_OK) {
+			goto cleanup;
+		}
 
 		if (c->context->inTransaction && (command->proc != execCommand && command->proc != discardCommand &&
 					command->proc != multiCommand && command->proc != watchCommand)) {
@@ -1092,7 +1169,10 @@ int rliteAppendCommandClient(rliteClient *c) {
 			c->reply = NULL;
 
 			if (c->context->writeCommand) {
+				write_sequence = c->context->db->write_sequence;
+#ifdef RL_DEBUG
 				RL_CALL(rl_dirty_hash, RL_OK, c->context->db, &oldhash);
+#endif
 			}
 
 			command->proc(c);
@@ -1101,8 +1181,8 @@ int rliteAppendCommandClient(rliteClient *c) {
 			}
 
 			if (c->context->writeCommand) {
-				RL_CALL(rl_dirty_hash, RL_OK, c->context->db, &newhash);
-				if (newhash && (!oldhash || memcmp(newhash, oldhash, 20) != 0)) {
+				RL_CALL(commandChangedDatabase, RL_OK, c->context->db, write_sequence, oldhash, &changed);
+				if (changed) {
 					c->context->writeCommand(rl_get_selected_db(c->context->db), c->argc, c->argv, c->argvlen);
 				}
 			}
@@ -1111,7 +1191,6 @@ int rliteAppendCommandClient(rliteClient *c) {
 	}
 cleanup:
 	rl_free(oldhash);
-	rl_free(newhash);
 	return retval;
 }
 
@@ -3134,6 +3213,132 @@ cleanup:
 	return;
 }
 
+static void vacuumCommand(rliteClient *c) {
+	rlite *db = c->context->db;
+	long max_pages = 0, number_of_pages;
+	int retval;
+	if (c->argc > 2) {
+		c->reply = createErrorObject(RLITE_SYNTAXERR);
+		return;
+	}
+	if (c->argc == 2) {
+		if (getLongFromObjectOrReply(c, c->argv[1], c->argvlen[1], &max_pages, NULL) != RLITE_OK) {
+			return;
+		}
+		if (max_pages <= 0) {
+			c->reply = createErrorObject("ERR value is out of range");
+			return;
+		}
+	}
+	number_of_pages = db->number_of_pages;
+	retval = rl_vacuum(db, max_pages);
+	RLITE_SERVER_OK(c, retval);
+	// bytes given back to the file system once the transaction is committed
+	c->reply = createLongLongObject((number_of_pages - db->number_of_pages) * db->page_size);
+cleanup:
+	return;
+}
+
+static void checkpointCommand(rliteClient *c) {
+	long pages;
+	int retval = rl_checkpoint(c->context->db, &pages);
+	RLITE_SERVER_OK(c, retval);
+	c->reply = createLongLongObject(pages);
+cleanup:
+	return;
+}
+
+#define BACKUP_STEP_PAGES 1024
+#define BACKUP_MAX_RESTARTS 4
+
+static void backupCommand(rliteClient *c) {
+	rlite *db = c->context->db, *destination = NULL;
+	rl_backup *backup = NULL;
+	rl_open_options options;
+	char *path = NULL;
+	long pages = BACKUP_STEP_PAGES;
+	int retval;
+	if (db->write_pages.len > 0) {
+		c->reply = createErrorObject("ERR BACKUP inside a transaction with writes");
+		return;
+	}
+	MALLOC(path, sizeof(char) * (c->argvlen[1] + 1));
+	memcpy(path, c->argv[1], c->argvlen[1]);
+	path[c->argvlen[1]] = '\0';
+	if (strcmp(path, c->context->path) == 0) {
+		c->reply = createErrorObject("ERR BACKUP destination is the database itself");
+		goto cleanup;
+	}
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE;
+	options.page_size = db->page_size;
+	retval = rl_open_v2(path, &destination, &options);
+	RLITE_SERVER_OK(c, retval);
+	// if created, the header is waiting to be committed
+	retval = rl_commit(destination);
+	RLITE_SERVER_OK(c, retval);
+	retval = rl_backup_init(destination, db, &backup);
+	if (retval == RL_INVALID_PARAMETERS) {
+		c->reply = createErrorObject("ERR BACKUP destination has a different page size");
+		goto cleanup;
+	}
+	RLITE_SERVER_OK(c, retval);
+	// other writers get a turn between steps, unless they keep restarting it
+	while ((retval = rl_backup_step(backup, pages)) == RL_OK) {
+		if (backup->restarts >= BACKUP_MAX_RESTARTS) {
+			pages = -1;
+		}
+	}
+	RLITE_SERVER_ERR(c, retval, RL_END);
+	c->reply = createStatusObject(RLITE_STR_OK);
+cleanup:
+	if (backup) {
+		rl_backup_finish(backup);
+	}
+	rl_close(destination);
+	rl_free(path);
+	return;
+}
+
+static const char *syncNames[] = {"off", "normal", "full"};
+
+static void configCommand(rliteClient *c) {
+	int sync;
+	char err[128];
+	if (c->argc == 3 && ARGVCASEEQ(c, 1, "get")) {
+		if (ARGVCASEEQ(c, 2, "sync")) {
+			c->reply = createArrayObject(2);
+			if (!c->reply) {
+				return;
+			}
+			c->reply->element[0] = createCStringObject("sync");
+			c->reply->element[1] = createCStringObject(syncNames[c->context->db->sync]);
+		} else {
+			c->reply = createArrayObject(0);
+		}
+	} else if (c->argc == 4 && ARGVCASEEQ(c, 1, "set")) {
+		if (!ARGVCASEEQ(c, 2, "sync")) {
+			// the name is not NUL terminated, and may not fit
+			snprintf(err, sizeof(err), "ERR Unsupported CONFIG parameter: %.*s", (int)c->argvlen[2], c->argv[2]);
+			c->reply = createErrorObject(err);
+			return;
+		}
+		for (sync = RLITE_SYNC_OFF; sync <= RLITE_SYNC_FULL; sync++) {
+			if (ARGVCASEEQ(c, 3, syncNames[sync])) {
+				break;
+			}
+		}
+		if (sync > RLITE_SYNC_FULL) {
+			c->reply = createErrorObject("ERR Invalid argument for CONFIG SET 'sync'");
+			return;
+		}
+		rl_set_sync(c->context->db, sync);
+		c->reply = createStatusObject(RLITE_STR_OK);
+	} else {
+		c->reply = createErrorObject("ERR CONFIG subcommand must be one of GET, SET");
+	}
+}
+
 static void delCommand(rliteClient *c) {
 	int deleted = 0, j, retval;
 
@@ -3194,17 +3399,14 @@ static void pttlCommand(rliteClient *c) {
 static void persistCommand(rliteClient *c) {
 	unsigned char *key = UNSIGN(c->argv[1]);
 	long keylen = c->argvlen[1];
-	long page;
-	unsigned char type;
 	unsigned long long expires;
-	long version = 0;
-	int retval = rl_key_get(c->context->db, key, keylen, &type, NULL, &page, &expires, &version);
+	int retval = rl_key_get(c->context->db, key, keylen, NULL, NULL, NULL, &expires, NULL);
 	RLITE_SERVER_ERR2(c, retval, RL_FOUND, RL_NOT_FOUND);
 	if (retval == RL_NOT_FOUND || expires == 0) {
 		c->reply = createLongLongObject(0);
 		goto cleanup;
 	}
-	retval = rl_key_set(c->context->db, key, keylen, type, page, 0, version + 1);
+	retval = rl_key_expires(c->context->db, key, keylen, 0);
 	RLITE_SERVER_OK(c, retval);
 	c->reply = createLongLongObject(1);
 cleanup:
@@ -3302,11 +3504,13 @@ cleanup:
 
 static void getKeyEncoding(rliteClient *c, char *encoding, unsigned char *key, long keylen)
 {
+	rl_key record;
 	unsigned char type;
 	encoding[0] = 0;
-	if (rl_key_get(c->context->db, UNSIGN(key), keylen, &type, NULL, NULL, NULL, NULL)) {
+	if (rl_key_get_record(c->context->db, UNSIGN(key), keylen, &record) == RL_FOUND) {
+		type = record.type;
 		if (type == RL_TYPE_STRING) {
-			const char *enc = "int";
+			const char *enc = RL_KEY_VALUE_INLINE(&record) && record.encoding == RL_KEY_ENCODING_INT ? "int" : "raw";
 			memcpy(encoding, enc, (strlen(enc) + 1) * sizeof(char));
 		}
 		else if (type == RL_TYPE_ZSET) {
@@ -3908,6 +4112,9 @@ static struct rliteCommand rliteCommandTable[] = {
 	// {"replconf",replconfCommand,-1,"arslt",0,NULL,0,0,0,0,0},
 	{"flushdb",flushdbCommand,1,"w",0,0,0,0,0,0},
 	{"flushall",flushallCommand,1,"w",0,0,0,0,0,0},
+	{"vacuum",vacuumCommand,-1,"w",0,0,0,0,0,0},
+	{"checkpoint",checkpointCommand,1,"w",0,0,0,0,0,0},
+	{"backup",backupCommand,2,"as",0,0,0,0,0,0},
 	{"sort",sortCommand,-2,"wm",0,1,1,1,0,0},
 	// {"info",infoCommand,-1,"rlt",0,NULL,0,0,0,0,0},
 	// {"monitor",monitorCommand,1,"ars",0,NULL,0,0,0,0,0},
@@ -3917,7 +4124,7 @@ static struct rliteCommand rliteCommandTable[] = {
 	// {"slaveof",slaveofCommand,3,"ast",0,NULL,0,0,0,0,0},
 	// {"role",roleCommand,1,"last",0,NULL,0,0,0,0,0},
 	{"debug",debugCommand,-2,"as",0,0,0,0,0,0},
-	// {"config",configCommand,-2,"art",0,NULL,0,0,0,0,0},
+	{"config",configCommand,-2,"art",0,0,0,0,0,0},
 	{"subscribe",subscribeCommand,-2,"rpslt",0,0,0,0,0,0},
 	{"unsubscribe",unsubscribeCommand,-1,"rpslt",0,0,0,0,0,0},
 	{"psubscribe",psubscribeCommand,-2,"rpslt",0,0,0,0,0,0},
@@ -0,0 +1,460 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "rlite/rlite.h"
+#include "rlite/flock.h"
+#include "rlite/io.h"
+#include "rlite/util.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+typedef struct {
+	int fd;
+} rl_io_positional_handle;
+
+static int open_fd(const char *filename, int flags, int *fd)
+{
+	int oflags = (flags & RLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY;
+	if (flags & RLITE_OPEN_CREATE) {
+		oflags |= O_CREAT;
+	}
+	*fd = open(filename, oflags, 0644);
+	if (*fd == -1) {
+		fprintf(stderr, "Cannot open file %s, errno %d\n", filename, errno);
+		return errno == ENOENT ? RL_INVALID_PARAMETERS : RL_UNEXPECTED;
+	}
+	return RL_OK;
+}
+
+static int positional_open(const char *filename, int flags, void **_handle)
+{
+	int retval = RL_OK;
+	rl_io_positional_handle *handle = NULL;
+	RL_MALLOC(handle, sizeof(*handle));
+	RL_CALL(open_fd, RL_OK, filename, flags, &handle->fd);
+	*_handle = handle;
+cleanup:
+	if (retval != RL_OK) {
+		rl_free(handle);
+	}
+	return retval;
+}
+
+static int positional_close(void *_handle)
+{
+	rl_io_positional_handle *handle = _handle;
+	close(handle->fd);
+	rl_free(handle);
+	return RL_OK;
+}
+
+static int positional_lock(void *_handle, int type)
+{
+	rl_io_positional_handle *handle = _handle;
+	return rl_flock_fd(handle->fd, type);
+}
+
+static int positional_read(void *_handle, void *data, size_t size, long long offset, size_t *_read)
+{
+	rl_io_positional_handle *handle = _handle;
+	size_t total = 0;
+	ssize_t read;
+	while (total < size) {
+		read = pread(handle->fd, (char *)data + total, size - total, offset + total);
+		if (read == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return RL_UNEXPECTED;
+		}
+		if (read == 0) {
+			break;
+		}
+		total += read;
+	}
+	*_read = total;
+	return RL_OK;
+}
+
+static int positional_writev(int fd, struct iovec *iov, int iovcnt, long long offset)
+{
+	ssize_t written;
+	while (iovcnt > 0) {
+		written = pwritev(fd, iov, iovcnt, offset);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return RL_UNEXPECTED;
+		}
+		offset += written;
+		// skip what was written, it is not necessarily whole buffers
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return RL_OK;
+}
+
+static int positional_write_pages(void *_handle, long page_size, long count, const long *page_numbers, unsigned char **pages)
+{
+	rl_io_positional_handle *handle = _handle;
+	struct iovec iov[IOV_MAX];
+	int iovcnt = 0, retval = RL_OK;
+	long i, first = 0;
+	for (i = 0; i < count; i++) {
+		if (iovcnt > 0 && (page_numbers[i] != first + iovcnt || iovcnt == IOV_MAX)) {
+			RL_CALL(positional_writev, RL_OK, handle->fd, iov, iovcnt, (long long)first * page_size);
+			iovcnt = 0;
+		}
+		if (iovcnt == 0) {
+			first = page_numbers[i];
+		}
+		iov[iovcnt].iov_base = pages[i];
+		iov[iovcnt].iov_len = page_size;
+		iovcnt++;
+	}
+	if (iovcnt > 0) {
+		RL_CALL(positional_writev, RL_OK, handle->fd, iov, iovcnt, (long long)first * page_size);
+	}
+cleanup:
+	return retval;
+}
+
+static int positional_flush(void *UNUSED(handle))
+{
+	// nothing is buffered
+	return RL_OK;
+}
+
+int rl_io_sync_fd(int fd)
+{
+	int retval;
+	do {
+#ifdef __linux__
+		retval = fdatasync(fd);
+#else
+		retval = fsync(fd);
+#endif
+	} while (retval == -1 && errno == EINTR);
+	return retval == 0 ? RL_OK : RL_UNEXPECTED;
+}
+
+static int positional_sync(void *_handle)
+{
+	rl_io_positional_handle *handle = _handle;
+	return rl_io_sync_fd(handle->fd);
+}
+
+int rl_io_sync_dir(const char *filename)
+{
+	int retval = RL_OK, fd;
+	const char *slash = strrchr(filename, '/');
+	char *dir = NULL;
+	if (slash) {
+		RL_MALLOC(dir, sizeof(char) * (slash - filename + 2));
+		memcpy(dir, filename, slash - filename + 1);
+		dir[slash - filename + 1] = 0;
+	}
+	fd = open(dir ? dir : ".", O_RDONLY);
+	if (fd == -1) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	do {
+		retval = fsync(fd);
+	} while (retval == -1 && errno == EINTR);
+	retval = retval == 0 ? RL_OK : RL_UNEXPECTED;
+	close(fd);
+cleanup:
+	rl_free(dir);
+	return retval;
+}
+
+static int truncate_fd(int fd, long long size)
+{
+	int retval;
+	do {
+		retval = ftruncate(fd, (off_t)size);
+	} while (retval == -1 && errno == EINTR);
+	return retval == 0 ? RL_OK : RL_UNEXPECTED;
+}
+
+static int positional_truncate(void *_handle, long long size)
+{
+	rl_io_positional_handle *handle = _handle;
+	return truncate_fd(handle->fd, size);
+}
+
+rl_io_ops rl_io_positional = {
+	"positional",
+	positional_open,
+	positional_close,
+	positional_lock,
+	positional_read,
+	positional_write_pages,
+	positional_flush,
+	positional_sync,
+	positional_truncate,
+	NULL,
+};
+
+typedef struct {
+	// first member, so positional functions can be used on it
+	rl_io_positional_handle positional;
+	unsigned char *map;
+	size_t maplen;
+	// the file may have changed size since it was mapped
+	int stale;
+} rl_io_mmap_handle;
+
+static int mmap_open(const char *filename, int flags, void **_handle)
+{
+	int retval = RL_OK;
+	rl_io_mmap_handle *handle = NULL;
+	RL_MALLOC(handle, sizeof(*handle));
+	RL_CALL(open_fd, RL_OK, filename, flags, &handle->positional.fd);
+	handle->map = NULL;
+	handle->maplen = 0;
+	handle->stale = 1;
+	*_handle = handle;
+cleanup:
+	if (retval != RL_OK) {
+		rl_free(handle);
+	}
+	return retval;
+}
+
+static int mmap_close(void *_handle)
+{
+	rl_io_mmap_handle *handle = _handle;
+	if (handle->map) {
+		munmap(handle->map, handle->maplen);
+	}
+	close(handle->positional.fd);
+	rl_free(handle);
+	return RL_OK;
+}
+
+static int mmap_lock(void *_handle, int type)
+{
+	rl_io_mmap_handle *handle = _handle;
+	if (type != RLITE_FLOCK_UN) {
+		// other connections may have written while it was unlocked
+		handle->stale = 1;
+	}
+	return rl_flock_fd(handle->positional.fd, type);
+}
+
+static int mmap_remap(rl_io_mmap_handle *handle)
+{
+	struct stat st;
+	void *map;
+	if (fstat(handle->positional.fd, &st) != 0) {
+		return RL_UNEXPECTED;
+	}
+	handle->stale = 0;
+	if ((size_t)st.st_size == handle->maplen) {
+		return RL_OK;
+	}
+	if (handle->map) {
+		munmap(handle->map, handle->maplen);
+		handle->map = NULL;
+		handle->maplen = 0;
+	}
+	if (st.st_size == 0) {
+		return RL_OK;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, handle->positional.fd, 0);
+	if (map == MAP_FAILED) {
+		handle->stale = 1;
+		return RL_UNEXPECTED;
+	}
+	handle->map = map;
+	handle->maplen = st.st_size;
+	return RL_OK;
+}
+
+static int mmap_map(void *_handle, long long offset, size_t size, unsigned char **data)
+{
+	rl_io_mmap_handle *handle = _handle;
+	int retval = RL_OK;
+	if (handle->stale) {
+		RL_CALL(mmap_remap, RL_OK, handle);
+	}
+	if (offset < 0 || offset + size > handle->maplen) {
+		*data = NULL;
+	}
+	else {
+		*data = &handle->map[offset];
+	}
+cleanup:
+	return retval;
+}
+
+static int mmap_read(void *_handle, void *data, size_t size, long long offset, size_t *read)
+{
+	rl_io_mmap_handle *handle = _handle;
+	int retval = RL_OK;
+	if (handle->stale) {
+		RL_CALL(mmap_remap, RL_OK, handle);
+	}
+	if (offset < 0 || (size_t)offset >= handle->maplen) {
+		*read = 0;
+		goto cleanup;
+	}
+	if (offset + size > handle->maplen) {
+		size = handle->maplen - offset;
+	}
+	memcpy(data, &handle->map[offset], size);
+	*read = size;
+cleanup:
+	return retval;
+}
+
+static int mmap_write_pages(void *_handle, long page_size, long count, const long *page_numbers, unsigned char **pages)
+{
+	rl_io_mmap_handle *handle = _handle;
+	// writes go through the file, the shared mapping sees them, but the
+	// file may have grown past it
+	handle->stale = 1;
+	return positional_write_pages(&handle->positional, page_size, count, page_numbers, pages);
+}
+
+static int mmap_truncate(void *_handle, long long size)
+{
+	rl_io_mmap_handle *handle = _handle;
+	int retval;
+	// pages past the new end must not be touched through the old mapping
+	if (handle->map) {
+		munmap(handle->map, handle->maplen);
+		handle->map = NULL;
+		handle->maplen = 0;
+	}
+	handle->stale = 1;
+	RL_CALL(truncate_fd, RL_OK, handle->positional.fd, size);
+cleanup:
+	return retval;
+}
+
+rl_io_ops rl_io_mmap = {
+	"mmap",
+	mmap_open,
+	mmap_close,
+	mmap_lock,
+	mmap_read,
+	mmap_write_pages,
+	positional_flush,
+	positional_sync,
+	mmap_truncate,
+	mmap_map,
+};
+
+static int stdio_open(const char *filename, int flags, void **_handle)
+{
+	FILE *fp;
+	char *mode = "r+";
+	if ((flags & RLITE_OPEN_READWRITE) == 0) {
+		mode = "r";
+	}
+	else if ((flags & RLITE_OPEN_CREATE) && access(filename, F_OK) != 0) {
+		mode = "w+";
+	}
+	fp = fopen(filename, mode);
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open file %s, errno %d, mode %s\n", filename, errno, mode);
+		return errno == ENOENT ? RL_INVALID_PARAMETERS : RL_UNEXPECTED;
+	}
+	// the file is kept open between transactions, a stdio buffer would
+	// keep data other connections may change while it is unlocked
+	setvbuf(fp, NULL, _IONBF, 0);
+	*_handle = fp;
+	return RL_OK;
+}
+
+static int stdio_close(void *handle)
+{
+	fclose(handle);
+	return RL_OK;
+}
+
+static int stdio_lock(void *handle, int type)
+{
+	return rl_flock(handle, type);
+}
+
+static int stdio_read(void *handle, void *data, size_t size, long long offset, size_t *read)
+{
+	if (fseek(handle, offset, SEEK_SET) != 0) {
+		return RL_UNEXPECTED;
+	}
+	*read = fread(data, sizeof(unsigned char), size, handle);
+	return RL_OK;
+}
+
+static int stdio_write_pages(void *handle, long page_size, long count, const long *page_numbers, unsigned char **pages)
+{
+	long i;
+	for (i = 0; i < count; i++) {
+		fseek(handle, page_numbers[i] * page_size, SEEK_SET);
+		if (fwrite(pages[i], sizeof(unsigned char), page_size, handle) != (size_t)page_size) {
+			return RL_UNEXPECTED;
+		}
+	}
+	return RL_OK;
+}
+
+static int stdio_flush(void *handle)
+{
+	return fflush(handle) == 0 ? RL_OK : RL_UNEXPECTED;
+}
+
+static int stdio_sync(void *handle)
+{
+	int retval;
+	RL_CALL(stdio_flush, RL_OK, handle);
+	RL_CALL(rl_io_sync_fd, RL_OK, fileno(handle));
+cleanup:
+	return retval;
+}
+
+static int stdio_truncate(void *handle, long long size)
+{
+	int retval;
+	RL_CALL(stdio_flush, RL_OK, handle);
+	RL_CALL(truncate_fd, RL_OK, fileno(handle), size);
+cleanup:
+	return retval;
+}
+
+rl_io_ops rl_io_stdio = {
+	"stdio",
+	stdio_open,
+	stdio_close,
+	stdio_lock,
+	stdio_read,
+	stdio_write_pages,
+	stdio_flush,
+	stdio_sync,
+	stdio_truncate,
+	NULL,
+};
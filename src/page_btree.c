@@ -7,6 +7,10 @@
 #include "rlite/rlite.h"
 #include "rlite/util.h"
 
+// in place of the length of a string value in a key record, for a value
+// stored as the 8 bytes of an integer
+#define RL_KEY_VALUE_INT_MARKER 0xff
+
 rl_btree_type rl_btree_type_hash_sha1_key = {
 	&rl_data_type_btree_hash_sha1_key,
 	&rl_data_type_btree_node_hash_sha1_key,
@@ -102,6 +106,7 @@ int rl_btree_node_create(rlite *UNUSED(db), rl_btree *btree, rl_btree_node **_no
 	node->children = NULL;
 	RL_MALLOC(node->values, sizeof(void *) * btree->max_node_size);
 	node->size = 0;
+	node->view = NULL;
 	*_node = node;
 cleanup:
 	if (retval != RL_OK && node) {
@@ -111,6 +116,77 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Creates a node for `size` elements read from a page. The score and value
+ * pointers, the values and the scores are all in `node->view`; the values go
+ * first since their structs need the alignment.
+ */
+static int rl_btree_node_create_view(rlite *UNUSED(db), rl_btree *btree, long size, rl_btree_node **_node)
+{
+	int retval = RL_OK;
+	rl_btree_node *node;
+	unsigned char *values, *scores;
+	long i;
+	RL_MALLOC(node, sizeof(rl_btree_node));
+	node->view = rl_malloc(sizeof(void *) * btree->max_node_size * 2 + size * (btree->type->value_size + btree->type->score_size));
+	if (!node->view) {
+		rl_free(node);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	node->scores = node->view;
+	node->values = &node->scores[btree->max_node_size];
+	node->children = NULL;
+	node->size = size;
+	values = (unsigned char *)&node->values[btree->max_node_size];
+	scores = &values[size * btree->type->value_size];
+	for (i = 0; i < size; i++) {
+		node->values[i] = &values[i * btree->type->value_size];
+		node->scores[i] = &scores[i * btree->type->score_size];
+	}
+	*_node = node;
+cleanup:
+	return retval;
+}
+
+int rl_btree_node_materialize(rlite *UNUSED(db), rl_btree *btree, rl_btree_node *node)
+{
+	int retval = RL_OK;
+	void **scores = NULL, **values = NULL;
+	long i, allocated = 0;
+	if (!node->view) {
+		goto cleanup;
+	}
+	RL_MALLOC(scores, sizeof(void *) * btree->max_node_size);
+	RL_MALLOC(values, sizeof(void *) * btree->max_node_size);
+	for (; allocated < node->size; allocated++) {
+		scores[allocated] = rl_malloc(btree->type->score_size);
+		values[allocated] = rl_malloc(btree->type->value_size);
+		if (!scores[allocated] || !values[allocated]) {
+			rl_free(scores[allocated]);
+			rl_free(values[allocated]);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(scores[allocated], node->scores[allocated], btree->type->score_size);
+		memcpy(values[allocated], node->values[allocated], btree->type->value_size);
+	}
+	rl_free(node->view);
+	node->view = NULL;
+	node->scores = scores;
+	node->values = values;
+	scores = values = NULL;
+	allocated = 0;
+cleanup:
+	for (i = 0; i < allocated; i++) {
+		rl_free(scores[i]);
+		rl_free(values[i]);
+	}
+	rl_free(scores);
+	rl_free(values);
+	return retval;
+}
+
 int rl_btree_node_destroy(rlite *UNUSED(db), void *_node)
 {
 	rl_btree_node *node = _node;
@@ -118,17 +194,22 @@ int rl_btree_node_destroy(rlite *UNUSED(db), void *_node)
 		return RL_OK;
 	}
 	long i;
-	if (node->scores) {
-		for (i = 0; i < node->size; i++) {
-			rl_free(node->scores[i]);
-		}
-		rl_free(node->scores);
+	if (node->view) {
+		rl_free(node->view);
 	}
-	if (node->values) {
-		for (i = 0; i < node->size; i++) {
-			rl_free(node->values[i]);
+	else {
+		if (node->scores) {
+			for (i = 0; i < node->size; i++) {
+				rl_free(node->scores[i]);
+			}
+			rl_free(node->scores);
+		}
+		if (node->values) {
+			for (i = 0; i < node->size; i++) {
+				rl_free(node->values[i]);
+			}
+			rl_free(node->values);
 		}
-		rl_free(node->values);
 	}
 	if (node->children) {
 		rl_free(node->children);
@@ -255,7 +336,7 @@ int rl_btree_random_element(rlite *db, rl_btree *btree, void **score, void **val
 	void *_node;
 	rl_btree_node *node;
 
-	RL_MALLOC(acc, sizeof(long) * h);
+	RL_ARENA_MALLOC(&db->arena, acc, sizeof(long) * h);
 	acc[0] = 1;
 	for (i = 1; i < h; i++) {
 		acc[i] = acc[i - 1] + ceil(acc[i - 1] * 0.75 * btree->max_node_size);
@@ -284,7 +365,7 @@ int rl_btree_random_element(rlite *db, rl_btree *btree, void **score, void **val
 	}
 	retval = RL_OK;
 cleanup:
-	rl_free(acc);
+	rl_arena_free(&db->arena, acc);
 	return retval;
 }
 
@@ -294,8 +375,8 @@ int rl_btree_add_element(rlite *db, rl_btree *btree, long btree_page, void *scor
 	long *positions = NULL;
 	rl_btree_node *right;
 	rl_btree_node **nodes;
-	RL_MALLOC(nodes, sizeof(rl_btree_node *) * btree->height);
-	RL_MALLOC(positions, sizeof(long) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, nodes, sizeof(rl_btree_node *) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, positions, sizeof(long) * btree->height);
 	void *tmp;
 	long i, pos;
 	long node_page = 0;
@@ -311,6 +392,7 @@ int rl_btree_add_element(rlite *db, rl_btree *btree, long btree_page, void *scor
 			node_page = nodes[i - 1]->children[positions[i - 1]];
 		}
 		node = nodes[i];
+		RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, node);
 
 		if (node->size < btree->max_node_size) {
 			memmove(&node->scores[positions[i] + 1], &node->scores[positions[i]], sizeof(void *) * (node->size - positions[i]));
@@ -443,8 +525,8 @@ cleanup:
 		rl_free(value);
 		rl_free(score);
 	}
-	rl_free(nodes);
-	rl_free(positions);
+	rl_arena_free(&db->arena, positions);
+	rl_arena_free(&db->arena, nodes);
 
 	return retval;
 }
@@ -454,8 +536,8 @@ int rl_btree_update_element(rlite *db, rl_btree *btree, void *score, void *value
 	int retval;
 	long *positions = NULL;
 	rl_btree_node **nodes;
-	RL_MALLOC(nodes, sizeof(rl_btree_node *) * btree->height);
-	RL_MALLOC(positions, sizeof(long) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, nodes, sizeof(rl_btree_node *) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, positions, sizeof(long) * btree->height);
 	long i;
 	long node_page;
 	RL_CALL(rl_btree_find_score, RL_FOUND, db, btree, score, NULL, nodes, positions);
@@ -473,6 +555,7 @@ int rl_btree_update_element(rlite *db, rl_btree *btree, void *score, void *value
 		else {
 			node_page = nodes[i - 1]->children[positions[i - 1]];
 		}
+		RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, node);
 		if (node->values[positions[i]] != value) {
 			rl_free(node->values[positions[i]]);
 			node->values[positions[i]] = value;
@@ -481,8 +564,8 @@ int rl_btree_update_element(rlite *db, rl_btree *btree, void *score, void *value
 		break;
 	}
 cleanup:
-	rl_free(nodes);
-	rl_free(positions);
+	rl_arena_free(&db->arena, positions);
+	rl_arena_free(&db->arena, nodes);
 	return retval;
 }
 
@@ -492,8 +575,8 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 	int retval;
 	long *positions = NULL;
 	rl_btree_node **nodes;
-	RL_MALLOC(nodes, sizeof(rl_btree_node *) * btree->height);
-	RL_MALLOC(positions, sizeof(long) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, nodes, sizeof(rl_btree_node *) * btree->height);
+	RL_ARENA_MALLOC(&db->arena, positions, sizeof(long) * btree->height);
 	long i, j;
 	long node_page = 0, child_node_page, sibling_node_page, parent_node_page;
 	RL_CALL(rl_btree_find_score, RL_FOUND, db, btree, score, NULL, nodes, positions);
@@ -513,6 +596,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 			node_page = nodes[i - 1]->children[positions[i - 1]];
 		}
 
+		RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, node);
 		rl_free(node->scores[positions[i]]);
 		rl_free(node->values[positions[i]]);
 		if (node->children) {
@@ -534,6 +618,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 			}
 
 			// only the leaf node loses an element, to replace the deleted one
+			RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, child_node);
 			child_node->size--;
 			node->scores[positions[j]] = child_node->scores[child_node->size];
 			node->values[positions[j]] = child_node->values[child_node->size];
@@ -575,6 +660,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				btree->height--;
 				if (node->children) {
 					btree->root = node->children[0];
+					RL_CALL(rl_delete, RL_OK, db, node_page);
 				}
 				else {
 					RL_CALL(rl_delete, RL_OK, db, btree->root);
@@ -599,11 +685,15 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				retval = RL_UNEXPECTED;
 				goto cleanup;
 			}
+			// elements move between the node, its parent and a sibling
+			RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, node);
+			RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, parent_node);
 			if (positions[i - 1] > 0) {
 				sibling_node_page = parent_node->children[positions[i - 1] - 1];
 				RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, parent_node->children[positions[i - 1] - 1], btree, &tmp, 1);
 				sibling_node = tmp;
 				if (sibling_node->size > btree->max_node_size / 2) {
+					RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, sibling_node);
 					memmove(&node->scores[1], &node->scores[0], sizeof(void *) * (node->size));
 					memmove(&node->values[1], &node->values[0], sizeof(void *) * (node->size));
 					if (node->children) {
@@ -629,6 +719,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, parent_node->children[positions[i - 1] + 1], btree, &tmp, 1);
 				sibling_node = tmp;
 				if (sibling_node->size > btree->max_node_size / 2) {
+					RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, sibling_node);
 					node->scores[node->size] = parent_node->scores[positions[i - 1]];
 					node->values[node->size] = parent_node->values[positions[i - 1]];
 
@@ -657,6 +748,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				sibling_node_page = parent_node->children[positions[i - 1] - 1];
 				RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, parent_node->children[positions[i - 1] - 1], btree, &tmp, 1);
 				sibling_node = tmp;
+				RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, sibling_node);
 				sibling_node->scores[sibling_node->size] = parent_node->scores[positions[i - 1] - 1];
 				sibling_node->values[sibling_node->size] = parent_node->values[positions[i - 1] - 1];
 				memmove(&sibling_node->scores[sibling_node->size + 1], &node->scores[0], sizeof(void *) * (node->size));
@@ -685,6 +777,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				sibling_node_page = parent_node->children[positions[i - 1] + 1];
 				RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, parent_node->children[positions[i - 1] + 1], btree, &tmp, 1);
 				sibling_node = tmp;
+				RL_CALL(rl_btree_node_materialize, RL_OK, db, btree, sibling_node);
 				node->scores[node->size] = parent_node->scores[positions[i - 1]];
 				node->values[node->size] = parent_node->values[positions[i - 1]];
 				memmove(&node->scores[node->size + 1], &sibling_node->scores[0], sizeof(void *) * (sibling_node->size));
@@ -727,8 +820,8 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 		retval = RL_OK;
 	}
 cleanup:
-	rl_free(nodes);
-	rl_free(positions);
+	rl_arena_free(&db->arena, positions);
+	rl_arena_free(&db->arena, nodes);
 
 	return retval;
 }
@@ -763,6 +856,70 @@ cleanup:
 	return retval;
 }
 
+static int rl_btree_find_parent(rlite *db, rl_btree *btree, long page, long child_page, long *parent_page, long *position)
+{
+	void *tmp;
+	int retval;
+	long i;
+	rl_btree_node *node;
+	RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, page, btree, &tmp, 1);
+	node = tmp;
+	retval = RL_NOT_FOUND;
+	if (!node->children) {
+		goto cleanup;
+	}
+	for (i = 0; i < node->size + 1; i++) {
+		if (node->children[i] == child_page) {
+			*parent_page = page;
+			*position = i;
+			retval = RL_FOUND;
+			goto cleanup;
+		}
+	}
+	for (i = 0; i < node->size + 1; i++) {
+		retval = rl_btree_find_parent(db, btree, node->children[i], child_page, parent_page, position);
+		if (retval != RL_NOT_FOUND) {
+			goto cleanup;
+		}
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Moves the node in `node_page` to the next free page, used to compact the
+ * file.
+ */
+int rl_btree_move_node(rlite *db, rl_btree *btree, long btree_page, long node_page)
+{
+	void *tmp;
+	int retval;
+	long parent_page = 0, position = 0, new_page = db->next_empty_page;
+	rl_btree_node *node;
+	if (node_page != btree->root) {
+		RL_CALL(rl_btree_find_parent, RL_FOUND, db, btree, btree->root, node_page, &parent_page, &position);
+	}
+	RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, node_page, btree, &tmp, 1);
+	node = tmp;
+	// the node now belongs to the new page, deleting the old one must not
+	// destroy it
+	RL_CALL(rl_purge_cache, RL_OK, db, node_page);
+	RL_CALL(rl_write, RL_OK, db, btree->type->btree_node_type, new_page, node);
+	RL_CALL(rl_delete, RL_OK, db, node_page);
+	if (node_page == btree->root) {
+		btree->root = new_page;
+		RL_CALL(rl_write, RL_OK, db, btree->type->btree_type, btree_page, btree);
+	}
+	else {
+		RL_CALL(rl_read, RL_FOUND, db, btree->type->btree_node_type, parent_page, btree, &tmp, 1);
+		node = tmp;
+		node->children[position] = new_page;
+		RL_CALL(rl_write, RL_OK, db, btree->type->btree_node_type, parent_page, node);
+	}
+cleanup:
+	return retval;
+}
+
 int rl_btree_node_delete(struct rlite *db, rl_btree *btree, rl_btree_node *node)
 {
 	void *tmp;
@@ -955,15 +1112,35 @@ int rl_flatten_btree(rlite *db, rl_btree *btree, void *** scores, long *size)
 	return rl_flatten_btree_node(db, btree, node, scores, size);
 }
 
-int rl_btree_node_serialize_hash_sha1_key(rlite *UNUSED(db), void *obj, unsigned char *data)
+/**
+ * Bytes `key` takes in a node: digest, type, pages, expires, version and
+ * child, then the name and the value when they are in the record.
+ */
+static long key_record_size(rl_key *key)
+{
+	long size = 45;
+	if (key->string_page == 0) {
+		size += 1 + key->namelen;
+	}
+	if (RL_KEY_VALUE_INLINE(key)) {
+		size += key->encoding == RL_KEY_ENCODING_INT ? 9 : 1 + key->valuelen;
+	}
+	return size;
+}
+
+int rl_btree_node_serialize_hash_sha1_key(rlite *db, void *obj, unsigned char *data)
 {
 	rl_btree_node *node = (rl_btree_node *)obj;
 	put_4bytes(data, node->size);
 	long i, pos = 4;
 	rl_key *key;
 	for (i = 0; i < node->size; i++) {
-		memcpy(&data[pos], node->scores[i], sizeof(unsigned char) * 20);
 		key = node->values[i];
+		if (pos + key_record_size(key) + 4 > db->page_size) {
+			// more than the room records have, see key_room in page_key.c
+			return RL_UNEXPECTED;
+		}
+		memcpy(&data[pos], node->scores[i], sizeof(unsigned char) * 20);
 		data[pos + 20] = key->type;
 		put_4bytes(&data[pos + 21], key->string_page);
 		put_4bytes(&data[pos + 25], key->value_page);
@@ -971,6 +1148,21 @@ int rl_btree_node_serialize_hash_sha1_key(rlite *UNUSED(db), void *obj, unsigned
 		put_4bytes(&data[pos + 37], key->version);
 		put_4bytes(&data[pos + 41], node->children ? node->children[i] : 0);
 		pos += 45;
+		if (key->string_page == 0) {
+			data[pos] = key->namelen;
+			memcpy(&data[pos + 1], key->name, key->namelen);
+			pos += 1 + key->namelen;
+		}
+		if (RL_KEY_VALUE_INLINE(key) && key->encoding == RL_KEY_ENCODING_INT) {
+			data[pos] = RL_KEY_VALUE_INT_MARKER;
+			put_8bytes(&data[pos + 1], (unsigned long long)key->number);
+			pos += 9;
+		}
+		else if (RL_KEY_VALUE_INLINE(key)) {
+			data[pos] = key->valuelen;
+			memcpy(&data[pos + 1], key->value, key->valuelen);
+			pos += 1 + key->valuelen;
+		}
 	}
 	put_4bytes(&data[pos], node->children ? node->children[node->size] : 0);
 	return RL_OK;
@@ -981,25 +1173,16 @@ int rl_btree_node_deserialize_hash_sha1_key(rlite *db, void **obj, void *context
 	rl_btree_node *node = NULL;
 	rl_btree *btree = (rl_btree *) context;
 	int retval;
-	RL_CALL(rl_btree_node_create, RL_OK, db, btree, &node);
-	node->size = (long)get_4bytes(data);
+	RL_CALL(rl_btree_node_create_view, RL_OK, db, btree, (long)get_4bytes(data), &node);
 	long i, pos = 4, child;
 	rl_key *key;
 	for (i = 0; i < node->size; i++) {
-		node->scores[i] = rl_malloc(sizeof(unsigned char) * 20);
-		if (!node->scores[i]) {
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
+		if (pos + 45 + 4 > db->page_size) {
+			retval = RL_UNEXPECTED;
 			goto cleanup;
 		}
 		memcpy(node->scores[i], &data[pos], sizeof(unsigned char) * 20);
-		key = node->values[i] = rl_malloc(sizeof(rl_key));
-		if (!node->values[i]) {
-			rl_free(node->scores[i]);
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
+		key = node->values[i];
 		key->type = data[pos + 20];
 		key->string_page = get_4bytes(&data[pos + 21]);
 		key->value_page = get_4bytes(&data[pos + 25]);
@@ -1008,18 +1191,50 @@ int rl_btree_node_deserialize_hash_sha1_key(rlite *db, void **obj, void *context
 		child = get_4bytes(&data[pos + 41]);
 		if (child != 0) {
 			if (!node->children) {
-				node->children = rl_malloc(sizeof(long) * (btree->max_node_size + 1));
-				if (!node->children) {
-					rl_free(node->scores[i]);
-					rl_free(node->values[i]);
-					node->size = i;
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
+				RL_MALLOC(node->children, sizeof(long) * (btree->max_node_size + 1));
 			}
 			node->children[i] = child;
 		}
 		pos += 45;
+		if (db->legacy_keys && (key->string_page == 0 || RL_KEY_VALUE_INLINE(key))) {
+			// rlite0.0 records have neither
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		key->namelen = 0;
+		if (key->string_page == 0) {
+			key->namelen = data[pos];
+			if (key->namelen > RL_KEY_NAME_INLINE_SIZE || pos + 1 + key->namelen + 4 > db->page_size) {
+				retval = RL_UNEXPECTED;
+				goto cleanup;
+			}
+			memcpy(key->name, &data[pos + 1], key->namelen);
+			pos += 1 + key->namelen;
+		}
+		key->encoding = RL_KEY_ENCODING_RAW;
+		key->valuelen = 0;
+		if (RL_KEY_VALUE_INLINE(key) && pos + 1 + 4 > db->page_size) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		if (RL_KEY_VALUE_INLINE(key) && data[pos] == RL_KEY_VALUE_INT_MARKER) {
+			if (pos + 9 + 4 > db->page_size) {
+				retval = RL_UNEXPECTED;
+				goto cleanup;
+			}
+			key->encoding = RL_KEY_ENCODING_INT;
+			key->number = (long long)get_8bytes(&data[pos + 1]);
+			pos += 9;
+		}
+		else if (RL_KEY_VALUE_INLINE(key)) {
+			key->valuelen = data[pos];
+			if (key->valuelen > RL_KEY_INLINE_SIZE || pos + 1 + key->valuelen + 4 > db->page_size) {
+				retval = RL_UNEXPECTED;
+				goto cleanup;
+			}
+			memcpy(key->value, &data[pos + 1], key->valuelen);
+			pos += 1 + key->valuelen;
+		}
 	}
 	child = get_4bytes(&data[pos]);
 	if (child != 0) {
@@ -1056,38 +1271,18 @@ int rl_btree_node_deserialize_hash_sha1_hashkey(rlite *db, void **obj, void *con
 	rl_btree_node *node = NULL;
 	rl_btree *btree = (rl_btree *) context;
 	int retval;
-	RL_CALL(rl_btree_node_create, RL_OK, db, btree, &node);
-	node->size = (long)get_4bytes(data);
+	RL_CALL(rl_btree_node_create_view, RL_OK, db, btree, (long)get_4bytes(data), &node);
 	long i, pos = 4, child;
 	rl_hashkey *hashkey;
 	for (i = 0; i < node->size; i++) {
-		node->scores[i] = rl_malloc(sizeof(unsigned char) * 20);
-		if (!node->scores[i]) {
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		memcpy(node->scores[i], &data[pos], sizeof(unsigned char) * 20);
-		hashkey = node->values[i] = rl_malloc(sizeof(rl_hashkey));
-		if (!node->values[i]) {
-			rl_free(node->scores[i]);
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
+		hashkey = node->values[i];
 		hashkey->string_page = get_4bytes(&data[pos + 20]);
 		hashkey->value_page = get_4bytes(&data[pos + 24]);
 		child = get_4bytes(&data[pos + 28]);
 		if (child != 0) {
 			if (!node->children) {
-				node->children = rl_malloc(sizeof(long) * (btree->max_node_size + 1));
-				if (!node->children) {
-					rl_free(node->scores[i]);
-					rl_free(node->values[i]);
-					node->size = i;
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
+				RL_MALLOC(node->children, sizeof(long) * (btree->max_node_size + 1));
 			}
 			node->children[i] = child;
 		}
@@ -1126,36 +1321,16 @@ int rl_btree_node_deserialize_hash_long_long(struct rlite *db, void **obj, void
 	rl_btree_node *node = NULL;
 	long i, pos = 4, child;
 	int retval;
-	RL_CALL(rl_btree_node_create, RL_OK, db, btree, &node);
-	node->size = (long)get_4bytes(data);
+	RL_CALL(rl_btree_node_create_view, RL_OK, db, btree, (long)get_4bytes(data), &node);
 	for (i = 0; i < node->size; i++) {
-		node->scores[i] = rl_malloc(sizeof(long));
-		if (!node->scores[i]) {
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		*(long *)node->scores[i] = get_4bytes(&data[pos]);
 		child = get_4bytes(&data[pos + 4]);
 		if (child != 0) {
 			if (!node->children) {
-				node->children = rl_malloc(sizeof(long) * (btree->max_node_size + 1));
-				if (!node->children) {
-					rl_free(node->scores[i]);
-					node->size = i;
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
+				RL_MALLOC(node->children, sizeof(long) * (btree->max_node_size + 1));
 			}
 			node->children[i] = child;
 		}
-		node->values[i] = rl_malloc(sizeof(long));
-		if (!node->values[i]) {
-			rl_free(node->scores[i]);
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		*(long *)node->values[i] = get_4bytes(&data[pos + 8]);
 		pos += 12;
 	}
@@ -1191,34 +1366,14 @@ int rl_btree_node_deserialize_hash_sha1_long(struct rlite *db, void **obj, void
 	rl_btree_node *node = NULL;
 	long i, pos = 4, child;
 	int retval;
-	RL_CALL(rl_btree_node_create, RL_OK, db, btree, &node);
-	node->size = (long)get_4bytes(data);
+	RL_CALL(rl_btree_node_create_view, RL_OK, db, btree, (long)get_4bytes(data), &node);
 	for (i = 0; i < node->size; i++) {
-		node->scores[i] = rl_malloc(sizeof(unsigned char) * 20);
-		if (!node->scores[i]) {
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		memcpy(node->scores[i], &data[pos], sizeof(unsigned char) * 20);
-		node->values[i] = rl_malloc(sizeof(double));
-		if (!node->values[i]) {
-			rl_free(node->scores[i]);
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		*(long *)node->values[i] = get_double(&data[pos + 20]);
 		child = get_4bytes(&data[pos + 24]);
 		if (child != 0) {
 			if (!node->children) {
-				node->children = rl_malloc(sizeof(long) * (btree->max_node_size + 1));
-				if (!node->children) {
-					rl_free(node->scores[i]);
-					node->size = i;
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
+				RL_MALLOC(node->children, sizeof(long) * (btree->max_node_size + 1));
 			}
 			node->children[i] = child;
 		}
@@ -1257,34 +1412,14 @@ int rl_btree_node_deserialize_hash_sha1_double(struct rlite *db, void **obj, voi
 	rl_btree_node *node = NULL;
 	long i, pos = 4, child;
 	int retval;
-	RL_CALL(rl_btree_node_create, RL_OK, db, btree, &node);
-	node->size = (long)get_4bytes(data);
+	RL_CALL(rl_btree_node_create_view, RL_OK, db, btree, (long)get_4bytes(data), &node);
 	for (i = 0; i < node->size; i++) {
-		node->scores[i] = rl_malloc(sizeof(unsigned char) * 20);
-		if (!node->scores[i]) {
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		memcpy(node->scores[i], &data[pos], sizeof(unsigned char) * 20);
-		node->values[i] = rl_malloc(sizeof(double));
-		if (!node->values[i]) {
-			rl_free(node->scores[i]);
-			node->size = i;
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
 		*(double *)node->values[i] = get_double(&data[pos + 20]);
 		child = get_4bytes(&data[pos + 28]);
 		if (child != 0) {
 			if (!node->children) {
-				node->children = rl_malloc(sizeof(long) * (btree->max_node_size + 1));
-				if (!node->children) {
-					rl_free(node->scores[i]);
-					node->size = i;
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
+				RL_MALLOC(node->children, sizeof(long) * (btree->max_node_size + 1));
 			}
 			node->children[i] = child;
 		}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rlite/rlite.h"
+#include "rlite/page_cache.h"
+#include "rlite/util.h"
+
+#define MIN_INDEX_ALLOC 16
+
+static long index_slot(rl_page_cache *cache, long page_number)
+{
+	// fibonacci hashing, page numbers tend to be consecutive
+	unsigned long long hash = (unsigned long long)page_number * 11400714819323198485ULL;
+	return (long)((hash >> 32) & (cache->index_alloc - 1));
+}
+
+static long index_find(rl_page_cache *cache, long page_number)
+{
+	long slot = index_slot(cache, page_number);
+	while (cache->index[slot]) {
+		if (cache->pages[cache->index[slot] - 1]->page_number == page_number) {
+			return slot;
+		}
+		slot = (slot + 1) & (cache->index_alloc - 1);
+	}
+	return -1;
+}
+
+static void index_insert(rl_page_cache *cache, long position)
+{
+	long slot = index_slot(cache, cache->pages[position]->page_number);
+	while (cache->index[slot]) {
+		slot = (slot + 1) & (cache->index_alloc - 1);
+	}
+	cache->index[slot] = position + 1;
+}
+
+static void index_delete(rl_page_cache *cache, long slot)
+{
+	// backward shift deletion, so lookups never need tombstones
+	long mask = cache->index_alloc - 1, next = slot, home;
+	cache->index[slot] = 0;
+	while (1) {
+		next = (next + 1) & mask;
+		if (!cache->index[next]) {
+			break;
+		}
+		home = index_slot(cache, cache->pages[cache->index[next] - 1]->page_number);
+		// move the entry back unless its home is cyclically in (slot, next]
+		if ((next > slot && (home <= slot || home > next)) ||
+				(next < slot && (home <= slot && home > next))) {
+			cache->index[slot] = cache->index[next];
+			cache->index[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+int rl_page_cache_reindex(rl_page_cache *cache)
+{
+	int retval = RL_OK;
+	long i, index_alloc = MIN_INDEX_ALLOC;
+	while (index_alloc < cache->len * 2) {
+		index_alloc *= 2;
+	}
+	if (index_alloc != cache->index_alloc) {
+		rl_free(cache->index);
+		cache->index_alloc = 0;
+		RL_MALLOC(cache->index, sizeof(long) * index_alloc);
+		cache->index_alloc = index_alloc;
+	}
+	memset(cache->index, 0, sizeof(long) * cache->index_alloc);
+	for (i = 0; i < cache->len; i++) {
+		index_insert(cache, i);
+	}
+cleanup:
+	return retval;
+}
+
+int rl_page_cache_init(rl_page_cache *cache, long alloc)
+{
+	int retval = RL_OK;
+	cache->pages = NULL;
+	cache->index = NULL;
+	cache->len = cache->alloc = cache->index_alloc = 0;
+	if (alloc > 0) {
+		RL_MALLOC(cache->pages, sizeof(struct rl_page *) * alloc);
+		cache->alloc = alloc;
+	}
+	RL_CALL(rl_page_cache_reindex, RL_OK, cache);
+cleanup:
+	return retval;
+}
+
+void rl_page_cache_destroy(rl_page_cache *cache)
+{
+	rl_free(cache->pages);
+	rl_free(cache->index);
+	cache->pages = NULL;
+	cache->index = NULL;
+	cache->len = cache->alloc = cache->index_alloc = 0;
+}
+
+rl_page *rl_page_cache_get(rl_page_cache *cache, long page_number)
+{
+	if (cache->len == 0) {
+		return NULL;
+	}
+	long slot = index_find(cache, page_number);
+	return slot == -1 ? NULL : cache->pages[cache->index[slot] - 1];
+}
+
+int rl_page_cache_add(rl_page_cache *cache, rl_page *page)
+{
+	int retval = RL_OK;
+	void *tmp;
+	if (cache->len == cache->alloc) {
+		long alloc = cache->alloc > 0 ? cache->alloc * 2 : MIN_INDEX_ALLOC;
+		RL_REALLOC(cache->pages, sizeof(rl_page *) * alloc);
+		cache->alloc = alloc;
+	}
+	cache->pages[cache->len++] = page;
+	if (cache->len * 2 > cache->index_alloc) {
+		retval = rl_page_cache_reindex(cache);
+		if (retval != RL_OK) {
+			cache->len--;
+			goto cleanup;
+		}
+	}
+	else {
+		index_insert(cache, cache->len - 1);
+	}
+cleanup:
+	return retval;
+}
+
+rl_page *rl_page_cache_remove(rl_page_cache *cache, long page_number)
+{
+	if (cache->len == 0) {
+		return NULL;
+	}
+	long slot = index_find(cache, page_number), position, last_slot;
+	if (slot == -1) {
+		return NULL;
+	}
+	position = cache->index[slot] - 1;
+	rl_page *page = cache->pages[position];
+	index_delete(cache, slot);
+	if (position != cache->len - 1) {
+		// fill the gap with the last page
+		last_slot = index_find(cache, cache->pages[cache->len - 1]->page_number);
+		cache->pages[position] = cache->pages[cache->len - 1];
+		cache->index[last_slot] = position + 1;
+	}
+	cache->len--;
+	return page;
+}
+
+void rl_page_cache_reset(rl_page_cache *cache)
+{
+	cache->len = 0;
+	if (cache->index) {
+		memset(cache->index, 0, sizeof(long) * cache->index_alloc);
+	}
+}
+
+int rl_page_cache_shrink(rl_page_cache *cache, long alloc)
+{
+	int retval = RL_OK;
+	void *tmp;
+	if (alloc < cache->len) {
+		alloc = cache->len;
+	}
+	if (alloc > 0 && cache->alloc > alloc * 2) {
+		RL_REALLOC(cache->pages, sizeof(rl_page *) * alloc);
+		cache->alloc = alloc;
+		RL_CALL(rl_page_cache_reindex, RL_OK, cache);
+	}
+cleanup:
+	return retval;
+}
+
+static int page_number_cmp(const void *a, const void *b)
+{
+	long pa = (*(rl_page * const *)a)->page_number;
+	long pb = (*(rl_page * const *)b)->page_number;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/**
+ * Sorts `pages` by page number, for callers that need to iterate them in
+ * order, like the wal writer.
+ */
+int rl_page_cache_sort(rl_page_cache *cache)
+{
+	qsort(cache->pages, cache->len, sizeof(rl_page *), page_number_cmp);
+	return rl_page_cache_reindex(cache);
+}
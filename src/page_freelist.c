@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rlite/rlite.h"
+#include "rlite/page_freelist.h"
+#include "rlite/page_long.h"
+#include "rlite/util.h"
+
+static long trunk_capacity(rlite *db)
+{
+	return (db->page_size - 8) / 4;
+}
+
+static int trunk_create(rlite *db, rl_freelist_trunk **_trunk)
+{
+	int retval;
+	rl_freelist_trunk *trunk;
+	RL_MALLOC(trunk, sizeof(*trunk));
+	trunk->pages = rl_malloc(sizeof(long) * trunk_capacity(db));
+	if (!trunk->pages) {
+		rl_free(trunk);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	trunk->next = 0;
+	trunk->size = 0;
+	*_trunk = trunk;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+int rl_freelist_trunk_serialize(rlite *UNUSED(db), void *obj, unsigned char *data)
+{
+	rl_freelist_trunk *trunk = obj;
+	long i;
+	put_4bytes(data, trunk->next);
+	put_4bytes(&data[4], trunk->size);
+	for (i = 0; i < trunk->size; i++) {
+		put_4bytes(&data[8 + i * 4], trunk->pages[i]);
+	}
+	return RL_OK;
+}
+
+int rl_freelist_trunk_deserialize(rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	int retval;
+	rl_freelist_trunk *trunk;
+	long i;
+	RL_CALL(trunk_create, RL_OK, db, &trunk);
+	trunk->next = get_4bytes(data);
+	trunk->size = get_4bytes(&data[4]);
+	if (trunk->size < 0 || trunk->size > trunk_capacity(db)) {
+		rl_freelist_trunk_destroy(db, trunk);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	for (i = 0; i < trunk->size; i++) {
+		trunk->pages[i] = get_4bytes(&data[8 + i * 4]);
+	}
+	*obj = trunk;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+int rl_freelist_trunk_destroy(rlite *UNUSED(db), void *obj)
+{
+	rl_freelist_trunk *trunk = obj;
+	rl_free(trunk->pages);
+	rl_free(trunk);
+	return RL_OK;
+}
+
+static int trunk_get(rlite *db, long page_number, rl_freelist_trunk **trunk)
+{
+	void *obj;
+	int retval;
+	*trunk = NULL;
+	retval = rl_read(db, &rl_data_type_freelist_trunk, page_number, NULL, &obj, 1);
+	if (retval == RL_NOT_FOUND) {
+		// the header or the previous trunk points past the file
+		retval = RL_UNEXPECTED;
+	}
+	if (retval != RL_FOUND) {
+		goto cleanup;
+	}
+	*trunk = obj;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+/**
+ * Sets db->next_empty_page to the page the next allocation returns.
+ */
+static int update_next_empty_page(rlite *db)
+{
+	rl_freelist_trunk *trunk = NULL;
+	int retval = RL_OK;
+	if (db->freelist == 0) {
+		db->next_empty_page = db->number_of_pages;
+		goto cleanup;
+	}
+	RL_CALL(trunk_get, RL_OK, db, db->freelist, &trunk);
+	db->next_empty_page = trunk->size > 0 ? trunk->pages[trunk->size - 1] : db->freelist;
+cleanup:
+	return retval;
+}
+
+/**
+ * Takes db->next_empty_page out of the free pages.
+ */
+int rl_freelist_alloc(rlite *db)
+{
+	rl_freelist_trunk *trunk = NULL;
+	int retval = RL_OK;
+	if (db->freelist == 0) {
+		if (db->next_empty_page == db->number_of_pages) {
+			db->next_empty_page++;
+			db->number_of_pages++;
+		}
+		else {
+			// free pages chained one per page, as older versions did
+			RL_CALL(rl_long_get, RL_OK, db, &db->next_empty_page, db->next_empty_page);
+		}
+		goto cleanup;
+	}
+	RL_CALL(trunk_get, RL_OK, db, db->freelist, &trunk);
+	if (trunk->size > 0) {
+		trunk->size--;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_freelist_trunk, db->freelist, trunk);
+	}
+	else {
+		// the trunk itself is being allocated, the caller overwrites it
+		db->freelist = trunk->next;
+	}
+	RL_CALL(update_next_empty_page, RL_OK, db);
+cleanup:
+	return retval;
+}
+
+static int freelist_push(rlite *db, long page_number)
+{
+	rl_freelist_trunk *trunk = NULL;
+	long lo, hi, mid;
+	int retval = RL_OK;
+	if (db->freelist != 0) {
+		RL_CALL(trunk_get, RL_OK, db, db->freelist, &trunk);
+		if (trunk->size < trunk_capacity(db)) {
+			lo = 0;
+			hi = trunk->size;
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+				if (trunk->pages[mid] > page_number) {
+					lo = mid + 1;
+				}
+				else {
+					hi = mid;
+				}
+			}
+			memmove(&trunk->pages[lo + 1], &trunk->pages[lo], sizeof(long) * (trunk->size - lo));
+			trunk->pages[lo] = page_number;
+			trunk->size++;
+			// the trunk is no longer the next page to allocate, writing it
+			// must not allocate it
+			db->next_empty_page = trunk->pages[trunk->size - 1];
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_freelist_trunk, db->freelist, trunk);
+			goto cleanup;
+		}
+	}
+	RL_CALL(trunk_create, RL_OK, db, &trunk);
+	trunk->next = db->freelist;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_freelist_trunk, page_number, trunk);
+	db->freelist = page_number;
+	db->next_empty_page = page_number;
+cleanup:
+	return retval;
+}
+
+/**
+ * Moves the pages freed by older versions, one per page starting at
+ * db->next_empty_page, to trunks.
+ */
+static int freelist_migrate_chain(rlite *db)
+{
+	long *chain = NULL, chain_len = 0, chain_alloc = 0, page, i;
+	void *tmp;
+	int retval = RL_OK;
+	if (db->freelist != 0 || db->next_empty_page == db->number_of_pages) {
+		goto cleanup;
+	}
+	page = db->next_empty_page;
+	while (page != db->number_of_pages) {
+		if (chain_len == chain_alloc) {
+			chain_alloc = chain_alloc ? chain_alloc * 2 : 16;
+			RL_REALLOC(chain, sizeof(long) * chain_alloc);
+		}
+		chain[chain_len++] = page;
+		RL_CALL(rl_long_get, RL_OK, db, &page, page);
+	}
+	db->next_empty_page = db->number_of_pages;
+	for (i = 0; i < chain_len; i++) {
+		RL_CALL(freelist_push, RL_OK, db, chain[i]);
+	}
+cleanup:
+	rl_free(chain);
+	return retval;
+}
+
+/**
+ * Adds `page_number` to the free pages. Pages freed by older versions are
+ * moved to trunks first.
+ */
+int rl_freelist_free(rlite *db, long page_number)
+{
+	int retval;
+	RL_CALL(freelist_migrate_chain, RL_OK, db);
+	RL_CALL(freelist_push, RL_OK, db, page_number);
+cleanup:
+	return retval;
+}
+
+int rl_freelist_alloc_run(rlite *db, long max_pages, long *start, long *pages)
+{
+	int retval;
+	RL_CALL(freelist_migrate_chain, RL_OK, db);
+	*start = db->next_empty_page;
+	*pages = 0;
+	// free pages are handed out in increasing order, and past the last one
+	// they come from the end of the file
+	do {
+		RL_CALL(rl_freelist_alloc, RL_OK, db);
+		(*pages)++;
+	} while (*pages < max_pages && db->next_empty_page == *start + *pages);
+cleanup:
+	return retval;
+}
+
+int rl_freelist_alloc_end(rlite *db, long pages, long *start)
+{
+	int retval;
+	RL_CALL(freelist_migrate_chain, RL_OK, db);
+	*start = db->number_of_pages;
+	if (db->next_empty_page == db->number_of_pages) {
+		db->next_empty_page += pages;
+	}
+	db->number_of_pages += pages;
+cleanup:
+	return retval;
+}
+
+static int compare_page(const void *a, const void *b)
+{
+	long pa = *(const long *)a, pb = *(const long *)b;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/**
+ * Rewrites the free pages so the lowest ones are allocated first, and takes
+ * the free pages at the end of the file out of db->number_of_pages. The file
+ * is truncated when the transaction is committed.
+ */
+int rl_freelist_compact(rlite *db)
+{
+	long *free_pages = NULL, len = 0, alloc = 0, page, capacity, first, last, j;
+	rl_freelist_trunk *trunk = NULL;
+	void *tmp;
+	int retval = RL_OK;
+
+	page = db->freelist;
+	while (page != 0) {
+		RL_CALL(trunk_get, RL_OK, db, page, &trunk);
+		if (len + trunk->size + 1 > alloc) {
+			alloc = (len + trunk->size + 1) * 2;
+			RL_REALLOC(free_pages, sizeof(long) * alloc);
+		}
+		free_pages[len++] = page;
+		memcpy(&free_pages[len], trunk->pages, sizeof(long) * trunk->size);
+		len += trunk->size;
+		page = trunk->next;
+	}
+	if (db->freelist == 0) {
+		page = db->next_empty_page;
+		while (page != db->number_of_pages) {
+			if (len == alloc) {
+				alloc = alloc ? alloc * 2 : 16;
+				RL_REALLOC(free_pages, sizeof(long) * alloc);
+			}
+			free_pages[len++] = page;
+			RL_CALL(rl_long_get, RL_OK, db, &page, page);
+		}
+	}
+	if (len == 0) {
+		goto cleanup;
+	}
+	qsort(free_pages, len, sizeof(long), compare_page);
+	// whatever the free pages held is about to be overwritten or cut off
+	for (j = 0; j < len; j++) {
+		RL_CALL(rl_cache_drop, RL_OK, db, free_pages[j]);
+	}
+	while (len > 0 && free_pages[len - 1] == db->number_of_pages - 1) {
+		len--;
+		db->number_of_pages--;
+	}
+
+	// each trunk is the highest page among its entries, and trunks are
+	// chained lowest first, so pages are handed out in increasing order
+	capacity = trunk_capacity(db);
+	db->freelist = 0;
+	db->next_empty_page = db->number_of_pages;
+	for (first = (len - 1) / (capacity + 1) * (capacity + 1); len > 0 && first >= 0; first -= capacity + 1) {
+		last = first + capacity < len - 1 ? first + capacity : len - 1;
+		RL_CALL(trunk_create, RL_OK, db, &trunk);
+		trunk->next = db->freelist;
+		trunk->size = last - first;
+		for (j = 0; j < trunk->size; j++) {
+			trunk->pages[j] = free_pages[last - 1 - j];
+		}
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_freelist_trunk, free_pages[last], trunk);
+		db->freelist = free_pages[last];
+	}
+	RL_CALL(update_next_empty_page, RL_OK, db);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+cleanup:
+	rl_free(free_pages);
+	return retval;
+}
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
 #include "rlite/rlite.h"
 #include "rlite/util.h"
 #include "rlite/page_btree.h"
@@ -50,29 +52,197 @@ static int get_type(char identifier, rl_type **type)
 	return RL_UNEXPECTED;
 }
 
-int rl_key_set(rlite *db, const unsigned char *key, long keylen, unsigned char type, long value_page, unsigned long long expires, long version)
+/**
+ * Bytes left in any record of `btree` after its fixed part, for the name and
+ * the value. Trees holding more records per node have less room per record,
+ * and none when it is negative.
+ */
+static long key_room(rlite *db, rl_btree *btree)
 {
-	int retval;
+	if (db->legacy_keys) {
+		return 0;
+	}
+	// digest, type, pages, expires, version and child
+	return (db->page_size - 8) / btree->max_node_size - 45;
+}
 
-	rl_key *key_obj = NULL;
-	unsigned char *digest = NULL;
-	RL_CALL2(rl_key_delete, RL_OK, RL_NOT_FOUND, db, key, keylen);
+/**
+ * New key trees keep the fan-out they had before records held names, 64
+ * bytes a record; short names and values use what is left of it past the
+ * fixed part.
+ */
+int rl_key_btree_create(rlite *db, rl_btree **btree)
+{
+	long size = (db->page_size - 12) / 64;
+	if (size % 2 != 0) {
+		size--;
+	}
+	if (size < 2) {
+		return RL_UNEXPECTED;
+	}
+	return rl_btree_create_size(db, btree, &rl_btree_type_hash_sha1_key, size);
+}
+
+int rl_key_name(rlite *db, rl_key *key, unsigned char **name, long *namelen)
+{
+	int retval = RL_OK;
+	if (key->string_page != 0) {
+		return rl_multi_string_get(db, key->string_page, name, namelen);
+	}
+	*name = NULL;
+	*namelen = key->namelen;
+	if (key->namelen > 0) {
+		// NUL terminated, like rl_multi_string_get
+		RL_MALLOC(*name, sizeof(unsigned char) * (key->namelen + 1));
+		memcpy(*name, key->name, key->namelen);
+		(*name)[key->namelen] = 0;
+	}
+cleanup:
+	return retval;
+}
+
+int rl_key_name_delete(rlite *db, rl_key *key)
+{
+	if (key->string_page == 0) {
+		return RL_OK;
+	}
+	return rl_multi_string_delete(db, key->string_page);
+}
+
+/**
+ * Whether `value` is the canonical text of a 64 bit integer, the text
+ * rl_key_inline_value would give back for it.
+ */
+static int value_to_number(const unsigned char *value, long valuelen, long long *number)
+{
+	char buffer[MAX_LLONG_DIGITS], *end;
+	if (valuelen == 0 || valuelen >= MAX_LLONG_DIGITS || (value[0] != '-' && !(value[0] >= '0' && value[0] <= '9'))) {
+		return 0;
+	}
+	memcpy(buffer, value, valuelen);
+	buffer[valuelen] = 0;
+	errno = 0;
+	*number = strtoll(buffer, &end, 10);
+	if (*end != '\0' || errno == ERANGE) {
+		return 0;
+	}
+	// no sign, leading zeros or "-0"
+	return snprintf(buffer, MAX_LLONG_DIGITS, "%lld", *number) == valuelen && memcmp(buffer, value, valuelen) == 0;
+}
+
+unsigned char *rl_key_inline_value(rl_key *key, unsigned char *buffer, long *valuelen)
+{
+	if (key->encoding == RL_KEY_ENCODING_INT) {
+		*valuelen = snprintf((char *)buffer, MAX_LLONG_DIGITS, "%lld", key->number);
+		return buffer;
+	}
+	*valuelen = key->valuelen;
+	return key->value;
+}
+
+/**
+ * Sets a key with the type, value page, expiration and version of `record`.
+ * When `value` is not NULL the key is a string with that value, and when
+ * the value of `record` is stored in it, the key gets that value. A string
+ * value is stored in the record if it fits there and in a multi string
+ * otherwise, written over the one of `record` when it has one.
+ * An existing key has its record replaced in place, keeping the pages of its
+ * name; the pages of its value are left to the caller.
+ */
+static int key_set(rlite *db, const unsigned char *key, long keylen, rl_key *record, const unsigned char *value, long valuelen)
+{
+	int retval;
+	rl_key *key_obj = NULL, *existing;
+	unsigned char *digest = NULL, buffer[MAX_LLONG_DIGITS];
+	rl_btree *btree;
+	long room;
+	long long number = 0;
+	int is_number = 0, exists;
+	void *tmp;
+	if (db->read_snapshot) {
+		// fails before changing a node other handles may be reading
+		return RL_INVALID_STATE;
+	}
 	RL_MALLOC(digest, sizeof(unsigned char) * 20);
 	RL_CALL(sha1, RL_OK, key, keylen, digest);
-	rl_btree *btree;
 	RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 1);
 	RL_MALLOC(key_obj, sizeof(*key_obj))
-	RL_CALL(rl_multi_string_set, RL_OK, db, &key_obj->string_page, key, keylen);
-	key_obj->type = type;
-	key_obj->value_page = value_page;
-	key_obj->expires = expires;
+	key_obj->type = record->type;
+	key_obj->value_page = record->value_page;
+	key_obj->expires = record->expires;
 	// reserving version=0 for non existent keys
-	if (version == 0) {
-		version = 1;
+	key_obj->version = record->version == 0 ? 1 : record->version;
+	key_obj->string_page = 0;
+	key_obj->namelen = 0;
+	key_obj->encoding = RL_KEY_ENCODING_RAW;
+	key_obj->valuelen = 0;
+	room = key_room(db, btree);
+	if (room < 0) {
+		// the node does not even fit the fixed part of its records
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	RL_CALL2(rl_btree_find_score, RL_FOUND, RL_NOT_FOUND, db, btree, digest, &tmp, NULL, NULL);
+	exists = retval == RL_FOUND;
+	if (exists) {
+		existing = tmp;
+		key_obj->string_page = existing->string_page;
+		if (existing->string_page == 0) {
+			key_obj->namelen = existing->namelen;
+			memcpy(key_obj->name, existing->name, existing->namelen);
+			room -= 1 + existing->namelen;
+		}
+	}
+	else if (keylen <= RL_KEY_NAME_INLINE_SIZE && 1 + keylen <= room) {
+		key_obj->namelen = keylen;
+		memcpy(key_obj->name, key, keylen);
+		room -= 1 + keylen;
+	}
+	else {
+		RL_CALL(rl_multi_string_set, RL_OK, db, &key_obj->string_page, key, keylen);
+	}
+
+	if (value) {
+		is_number = value_to_number(value, valuelen, &number);
+	}
+	else if (RL_KEY_VALUE_INLINE(record)) {
+		is_number = record->encoding == RL_KEY_ENCODING_INT;
+		number = record->number;
+		value = rl_key_inline_value(record, buffer, &valuelen);
+	}
+	if (value) {
+		key_obj->type = RL_TYPE_STRING;
+		key_obj->value_page = 0;
+		if (is_number && 9 <= room) {
+			key_obj->encoding = RL_KEY_ENCODING_INT;
+			key_obj->number = number;
+		}
+		else if (valuelen <= RL_KEY_INLINE_SIZE && 1 + valuelen <= room) {
+			key_obj->valuelen = valuelen;
+			memcpy(key_obj->value, value, valuelen);
+		}
+		else if (record->value_page != 0) {
+			key_obj->value_page = record->value_page;
+			RL_CALL(rl_multi_string_replace, RL_OK, db, &key_obj->value_page, value, valuelen);
+		}
+		else {
+			RL_CALL(rl_multi_string_set, RL_OK, db, &key_obj->value_page, value, valuelen);
+		}
+		if (record->value_page != 0 && key_obj->value_page == 0) {
+			RL_CALL(rl_multi_string_delete, RL_OK, db, record->value_page);
+		}
 	}
-	key_obj->version = version;
 
-	RL_CALL(rl_btree_add_element, RL_OK, db, btree, db->databases[rl_get_selected_db(db)], digest, key_obj);
+	if (exists) {
+		RL_CALL(rl_btree_update_element, RL_OK, db, btree, digest, key_obj);
+		// the node has the record, and its own copy of the digest
+		key_obj = NULL;
+		rl_free(digest);
+		digest = NULL;
+	}
+	else {
+		RL_CALL(rl_btree_add_element, RL_OK, db, btree, db->databases[rl_get_selected_db(db)], digest, key_obj);
+	}
 	retval = RL_OK;
 cleanup:
 	if (retval != RL_OK) {
@@ -82,7 +252,46 @@ cleanup:
 	return retval;
 }
 
-static int rl_key_get_hash_ignore_expire(struct rlite *db, unsigned char digest[20], unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version, int ignore_expire)
+int rl_key_set(rlite *db, const unsigned char *key, long keylen, unsigned char type, long value_page, unsigned long long expires, long version)
+{
+	rl_key record;
+	record.type = type;
+	record.value_page = value_page;
+	record.expires = expires;
+	record.version = version;
+	record.encoding = RL_KEY_ENCODING_RAW;
+	record.valuelen = 0;
+	return key_set(db, key, keylen, &record, NULL, 0);
+}
+
+int rl_key_set_string(rlite *db, const unsigned char *key, long keylen, const unsigned char *value, long valuelen, unsigned long long expires, long version)
+{
+	rl_key record;
+	record.type = RL_TYPE_STRING;
+	record.value_page = 0;
+	record.expires = expires;
+	record.version = version;
+	record.encoding = RL_KEY_ENCODING_RAW;
+	record.valuelen = 0;
+	return key_set(db, key, keylen, &record, value, valuelen);
+}
+
+int rl_key_set_string_record(rlite *db, const unsigned char *key, long keylen, rl_key *record, const unsigned char *value, long valuelen)
+{
+	if (record->type != RL_TYPE_STRING) {
+		return RL_INVALID_PARAMETERS;
+	}
+	return key_set(db, key, keylen, record, value, valuelen);
+}
+
+int rl_key_set_record(rlite *db, const unsigned char *key, long keylen, rl_key *record)
+{
+	// the name may leave less room in the record for its value, or the
+	// database may have less room per record
+	return key_set(db, key, keylen, record, NULL, 0);
+}
+
+static int rl_key_get_hash_ignore_expire(struct rlite *db, unsigned char digest[20], rl_key *record, unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version, int ignore_expire)
 {
 	int retval;
 	rl_btree *btree;
@@ -97,6 +306,9 @@ static int rl_key_get_hash_ignore_expire(struct rlite *db, unsigned char digest[
 			goto cleanup;
 		}
 		else {
+			if (record) {
+				*record = *key_obj;
+			}
 			if (type) {
 				*type = key_obj->type;
 			}
@@ -118,14 +330,17 @@ cleanup:
 	return retval;
 }
 
-static int rl_key_get_ignore_expire(struct rlite *db, const unsigned char *key, long keylen, unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version, int ignore_expire)
+static int rl_key_get_ignore_expire(struct rlite *db, const unsigned char *key, long keylen, rl_key *record, unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version, int ignore_expire)
 {
 	unsigned char digest[20];
 	int retval;
 	RL_CALL(sha1, RL_OK, key, keylen, digest);
-	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_DELETED, db, digest, type, string_page, value_page, expires, version, ignore_expire);
+	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_DELETED, db, digest, record, type, string_page, value_page, expires, version, ignore_expire);
 	if (retval == RL_DELETED) {
-		rl_key_delete_with_value(db, key, keylen);
+		// read transactions leave it to the next writer
+		if (!db->read_snapshot) {
+			rl_key_delete_with_value(db, key, keylen);
+		}
 		if (version) {
 			*version = 0;
 		}
@@ -143,7 +358,7 @@ static int rl_key_sha_check_version(struct rlite *db, struct watched_key* key) {
 	// it seems to be relevant to redis being stateful and single process
 	// I don't think it is possible to replicate exactly the behavior, but
 	// this is pretty close.
-	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, key->digest, NULL, NULL, NULL, NULL, &version, 1);
+	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, key->digest, NULL, NULL, NULL, NULL, NULL, &version, 1);
 	if (retval == RL_NOT_FOUND) {
 		version = 0;
 	}
@@ -174,7 +389,7 @@ int rl_watch(struct rlite *db, struct watched_key** _watched_key, const unsigned
 	wkey->database = rl_get_selected_db(db);
 
 	RL_CALL(sha1, RL_OK, key, keylen, wkey->digest);
-	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, wkey->digest, NULL, NULL, NULL, NULL, &wkey->version, 1);
+	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, wkey->digest, NULL, NULL, NULL, NULL, NULL, &wkey->version, 1);
 	if (retval == RL_NOT_FOUND) {
 		wkey->version = 0;
 	}
@@ -190,7 +405,12 @@ cleanup:
 
 int rl_key_get(struct rlite *db, const unsigned char *key, long keylen, unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version)
 {
-	return rl_key_get_ignore_expire(db, key, keylen, type, string_page, value_page, expires, version, 0);
+	return rl_key_get_ignore_expire(db, key, keylen, NULL, type, string_page, value_page, expires, version, 0);
+}
+
+int rl_key_get_record(struct rlite *db, const unsigned char *key, long keylen, rl_key *record)
+{
+	return rl_key_get_ignore_expire(db, key, keylen, record, NULL, NULL, NULL, NULL, NULL, 0);
 }
 
 int rl_key_get_or_create(struct rlite *db, const unsigned char *key, long keylen, unsigned char type, long *page, long *version)
@@ -223,6 +443,11 @@ int rl_key_delete(struct rlite *db, const unsigned char *key, long keylen)
 	unsigned char *digest;
 	rl_btree *btree = NULL;
 	rl_key *key_obj = NULL;
+	if (db->read_snapshot) {
+		// fails before changing a node other handles may be reading, a key
+		// stored in its record has no pages of its own to fail on first
+		return RL_INVALID_STATE;
+	}
 	RL_MALLOC(digest, sizeof(unsigned char) * 20);
 	RL_CALL(sha1, RL_OK, key, keylen, digest);
 	RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 0);
@@ -230,7 +455,7 @@ int rl_key_delete(struct rlite *db, const unsigned char *key, long keylen)
 	if (retval == RL_FOUND) {
 		int selected_database = rl_get_selected_db(db);
 		key_obj = tmp;
-		RL_CALL(rl_multi_string_delete, RL_OK, db, key_obj->string_page);
+		RL_CALL(rl_key_name_delete, RL_OK, db, key_obj);
 		retval = rl_btree_remove_element(db, btree, db->databases[selected_database], digest);
 		if (retval == RL_DELETED) {
 			db->databases[selected_database] = 0;
@@ -248,10 +473,11 @@ cleanup:
 int rl_key_expires(struct rlite *db, const unsigned char *key, long keylen, unsigned long long expires)
 {
 	int retval;
-	unsigned char type;
-	long string_page, value_page, version;
-	RL_CALL(rl_key_get, RL_FOUND, db, key, keylen, &type, &string_page, &value_page, NULL, &version);
-	RL_CALL(rl_key_set, RL_OK, db, key, keylen, type, value_page, expires, version + 1);
+	rl_key record;
+	RL_CALL(rl_key_get_record, RL_FOUND, db, key, keylen, &record);
+	record.expires = expires;
+	record.version++;
+	RL_CALL(rl_key_set_record, RL_OK, db, key, keylen, &record);
 cleanup:
 	return retval;
 }
@@ -270,10 +496,10 @@ cleanup:
 int rl_key_delete_with_value(struct rlite *db, const unsigned char *key, long keylen)
 {
 	int retval;
-	unsigned char identifier;
-	long value_page;
-	unsigned long long expires;
-	RL_CALL(rl_key_get_ignore_expire, RL_FOUND, db, key, keylen, &identifier, NULL, &value_page, &expires, NULL, 1);
+	unsigned char identifier = 0;
+	long value_page = 0;
+	unsigned long long expires = 0;
+	RL_CALL(rl_key_get_ignore_expire, RL_FOUND, db, key, keylen, NULL, &identifier, NULL, &value_page, &expires, NULL, 1);
 	RL_CALL(rl_key_delete_value, RL_OK, db, identifier, value_page);
 	RL_CALL(rl_key_delete, RL_OK, db, key, keylen);
 	retval = expires != 0 && expires <= rl_mstime() ? RL_NOT_FOUND : RL_OK;
@@ -5,8 +5,14 @@
 #include "rlite/page_list.h"
 #include "rlite/page_string.h"
 #include "rlite/page_multi_string.h"
+#include "rlite/page_freelist.h"
 #include "rlite/util.h"
 
+// bytes compared or hashed at a time for values stored in extents
+#define CHUNK_PAGES 64
+
+#define IS_EXTENTS(list) ((list)->max_node_size == 0)
+
 int rl_normalize_string_range(long totalsize, long *start, long *stop)
 {
 	if (*start < 0) {
@@ -30,6 +36,390 @@ int rl_normalize_string_range(long totalsize, long *start, long *stop)
 	return RL_OK;
 }
 
+static long extents_capacity(rlite *db)
+{
+	return (db->page_size - 4) / 8;
+}
+
+static int extents_create(rlite *db, rl_multi_string_extents **_extents)
+{
+	int retval;
+	rl_multi_string_extents *extents;
+	RL_MALLOC(extents, sizeof(*extents));
+	extents->size = 0;
+	extents->start = rl_malloc(sizeof(long) * extents_capacity(db));
+	extents->pages = rl_malloc(sizeof(long) * extents_capacity(db));
+	if (!extents->start || !extents->pages) {
+		rl_multi_string_extents_destroy(db, extents);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	*_extents = extents;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+int rl_multi_string_extents_serialize(rlite *UNUSED(db), void *obj, unsigned char *data)
+{
+	rl_multi_string_extents *extents = obj;
+	long i;
+	put_4bytes(data, extents->size);
+	for (i = 0; i < extents->size; i++) {
+		put_4bytes(&data[4 + i * 8], extents->start[i]);
+		put_4bytes(&data[8 + i * 8], extents->pages[i]);
+	}
+	return RL_OK;
+}
+
+int rl_multi_string_extents_deserialize(rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	int retval;
+	rl_multi_string_extents *extents = NULL;
+	long i;
+	RL_CALL(extents_create, RL_OK, db, &extents);
+	extents->size = get_4bytes(data);
+	if (extents->size < 0 || extents->size > extents_capacity(db)) {
+		rl_multi_string_extents_destroy(db, extents);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	for (i = 0; i < extents->size; i++) {
+		extents->start[i] = get_4bytes(&data[4 + i * 8]);
+		extents->pages[i] = get_4bytes(&data[8 + i * 8]);
+	}
+	*obj = extents;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+int rl_multi_string_extents_destroy(rlite *UNUSED(db), void *obj)
+{
+	rl_multi_string_extents *extents = obj;
+	rl_free(extents->start);
+	rl_free(extents->pages);
+	rl_free(extents);
+	return RL_OK;
+}
+
+static int extents_get(rlite *db, rl_list *list, rl_multi_string_extents **extents)
+{
+	void *tmp;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_multi_string_extents, list->left, NULL, &tmp, 1);
+	*extents = tmp;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static long extents_total_pages(rl_multi_string_extents *extents)
+{
+	long i, pages = 0;
+	for (i = 0; i < extents->size; i++) {
+		pages += extents->pages[i];
+	}
+	return pages;
+}
+
+// the page holding the byte `index * db->page_size` of the value
+static long extents_page(rl_multi_string_extents *extents, long index)
+{
+	long i;
+	for (i = 0; i < extents->size; i++) {
+		if (index < extents->pages[i]) {
+			return extents->start[i] + index;
+		}
+		index -= extents->pages[i];
+	}
+	return 0;
+}
+
+/**
+ * Moves the pages of the last extent past the end of the file, where it can
+ * grow.
+ */
+static int extents_move_last(rlite *db, rl_multi_string_extents *extents)
+{
+	long last = extents->size - 1, start, i;
+	unsigned char *data, *copy;
+	int retval;
+	RL_CALL(rl_freelist_alloc_end, RL_OK, db, extents->pages[last], &start);
+	for (i = 0; i < extents->pages[last]; i++) {
+		RL_CALL(rl_string_get, RL_OK, db, &data, extents->start[last] + i);
+		RL_MALLOC(copy, db->page_size);
+		memcpy(copy, data, db->page_size);
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_string, start + i, copy);
+		RL_CALL(rl_delete, RL_OK, db, extents->start[last] + i);
+	}
+	extents->start[last] = start;
+cleanup:
+	return retval;
+}
+
+/**
+ * Adds `pages` pages to the value, taking runs of free pages first. The
+ * last extent grows in place if it is at the end of the file.
+ */
+static int extents_grow(rlite *db, long descriptor_page, rl_multi_string_extents *extents, long pages)
+{
+	long last, start, count;
+	int retval = RL_OK;
+	while (pages > 0) {
+		last = extents->size - 1;
+		if (last >= 0 && extents->start[last] + extents->pages[last] == db->number_of_pages) {
+			RL_CALL(rl_freelist_alloc_end, RL_OK, db, pages, &start);
+			extents->pages[last] += pages;
+			break;
+		}
+		if (extents->size >= extents_capacity(db) - 1) {
+			// no room for more extents, the last one is the rest of the value
+			if (extents->size == extents_capacity(db)) {
+				RL_CALL(extents_move_last, RL_OK, db, extents);
+				continue;
+			}
+			RL_CALL(rl_freelist_alloc_end, RL_OK, db, pages, &start);
+			count = pages;
+		}
+		else {
+			RL_CALL(rl_freelist_alloc_run, RL_OK, db, pages, &start, &count);
+		}
+		if (last >= 0 && extents->start[last] + extents->pages[last] == start) {
+			extents->pages[last] += count;
+		}
+		else {
+			extents->start[extents->size] = start;
+			extents->pages[extents->size] = count;
+			extents->size++;
+		}
+		pages -= count;
+	}
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string_extents, descriptor_page, extents);
+cleanup:
+	return retval;
+}
+
+/**
+ * Writes `data` at `offset`, which is not past the end of the value, and
+ * grows the value if needed.
+ */
+static int extents_write(rlite *db, long number, rl_list *list, long offset, const unsigned char *data, long size)
+{
+	rl_multi_string_extents *extents = NULL;
+	unsigned char *page_data;
+	long length = list->size, end = offset + size, index, page, pagestart, len, pages;
+	int retval;
+	RL_CALL(extents_get, RL_OK, db, list, &extents);
+	pages = (end + db->page_size - 1) / db->page_size - extents_total_pages(extents);
+	if (pages > 0) {
+		RL_CALL(extents_grow, RL_OK, db, list->left, extents, pages);
+	}
+	index = offset / db->page_size;
+	pagestart = offset % db->page_size;
+	while (size > 0) {
+		page = extents_page(extents, index);
+		len = db->page_size - pagestart < size ? db->page_size - pagestart : size;
+		if (index * db->page_size < length && len < db->page_size) {
+			// keeps the rest of the page
+			RL_CALL(rl_string_get, RL_OK, db, &page_data, page);
+		}
+		else {
+			page_data = calloc(db->page_size, sizeof(unsigned char));
+			if (!page_data) {
+				retval = RL_OUT_OF_MEMORY;
+				goto cleanup;
+			}
+		}
+		memcpy(&page_data[pagestart], data, len);
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_string, page, page_data);
+		data += len;
+		size -= len;
+		pagestart = 0;
+		index++;
+	}
+	if (end > length) {
+		list->size = end;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_long, number, list);
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int extents_read(rlite *db, rl_list *list, long offset, long size, unsigned char *data)
+{
+	rl_multi_string_extents *extents = NULL;
+	long i, extent_size, len, pos = 0;
+	int retval;
+	RL_CALL(extents_get, RL_OK, db, list, &extents);
+	for (i = 0; i < extents->size && pos < size; i++) {
+		extent_size = extents->pages[i] * db->page_size;
+		if (offset >= extent_size) {
+			offset -= extent_size;
+			continue;
+		}
+		len = extent_size - offset < size - pos ? extent_size - offset : size - pos;
+		RL_CALL(rl_read_pages, RL_OK, db, extents->start[i], offset, len, &data[pos]);
+		pos += len;
+		offset = 0;
+	}
+	retval = pos == size ? RL_OK : RL_UNEXPECTED;
+cleanup:
+	return retval;
+}
+
+static int extents_set(rlite *db, long *number, const unsigned char *data, long size)
+{
+	rl_list *list;
+	rl_multi_string_extents *extents = NULL;
+	int retval;
+	RL_MALLOC(list, sizeof(*list));
+	list->type = &rl_list_type_long;
+	list->max_node_size = 0;
+	list->size = 0;
+	list->left = list->right = 0;
+	*number = db->next_empty_page;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_long, *number, list);
+	RL_CALL(extents_create, RL_OK, db, &extents);
+	list->left = db->next_empty_page;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string_extents, list->left, extents);
+	RL_CALL(extents_write, RL_OK, db, *number, list, 0, data, size);
+cleanup:
+	return retval;
+}
+
+/**
+ * Writes `data` over the pages of the value, freeing the pages past its new
+ * end, from the last extent.
+ */
+static int extents_replace(rlite *db, long number, rl_list *list, const unsigned char *data, long size)
+{
+	rl_multi_string_extents *extents = NULL;
+	long excess, last, count, i;
+	int retval;
+	RL_CALL(extents_get, RL_OK, db, list, &extents);
+	excess = extents_total_pages(extents) - (size + db->page_size - 1) / db->page_size;
+	if (excess > 0) {
+		while (excess > 0) {
+			last = extents->size - 1;
+			count = excess < extents->pages[last] ? excess : extents->pages[last];
+			for (i = extents->pages[last] - count; i < extents->pages[last]; i++) {
+				RL_CALL(rl_delete, RL_OK, db, extents->start[last] + i);
+			}
+			extents->pages[last] -= count;
+			if (extents->pages[last] == 0) {
+				extents->size--;
+			}
+			excess -= count;
+		}
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string_extents, list->left, extents);
+	}
+	// nothing of the old value is kept, no page is read
+	list->size = 0;
+	RL_CALL(extents_write, RL_OK, db, number, list, 0, data, size);
+cleanup:
+	return retval;
+}
+
+static int extents_sha1(rlite *db, SHA1_CTX *sha, rl_list *list)
+{
+	unsigned char *data;
+	long pos, len, chunk = CHUNK_PAGES * db->page_size;
+	int retval;
+	RL_MALLOC(data, chunk);
+	for (pos = 0; pos < list->size; pos += len) {
+		len = chunk < list->size - pos ? chunk : list->size - pos;
+		RL_CALL(extents_read, RL_OK, db, list, pos, len, data);
+		SHA1Update(sha, data, len);
+	}
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+static int extents_pages(rlite *db, rl_list *list, short *pages)
+{
+	rl_multi_string_extents *extents = NULL;
+	long i, j;
+	int retval;
+	RL_CALL(extents_get, RL_OK, db, list, &extents);
+	pages[list->left] = 1;
+	for (i = 0; i < extents->size; i++) {
+		for (j = 0; j < extents->pages[i]; j++) {
+			pages[extents->start[i] + j] = 1;
+		}
+	}
+cleanup:
+	return retval;
+}
+
+static int extents_delete(rlite *db, rl_list *list)
+{
+	rl_multi_string_extents *extents = NULL;
+	long i, j;
+	int retval;
+	RL_CALL(extents_get, RL_OK, db, list, &extents);
+	for (i = 0; i < extents->size; i++) {
+		for (j = 0; j < extents->pages[i]; j++) {
+			RL_CALL(rl_delete, RL_OK, db, extents->start[i] + j);
+		}
+	}
+	// frees extents
+	RL_CALL(rl_delete, RL_OK, db, list->left);
+cleanup:
+	return retval;
+}
+
+static int string_length(rlite *db, rl_list *list, long *length)
+{
+	void *tmp;
+	int retval = RL_OK;
+	if (IS_EXTENTS(list)) {
+		*length = list->size;
+		goto cleanup;
+	}
+	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
+	*length = *(long *)tmp;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+/**
+ * Compares `size` bytes of two values a few pages at a time, either may be
+ * stored in extents.
+ */
+static int chunked_cmp(rlite *db, long p1, long p2, const unsigned char *str, long size, int *cmp)
+{
+	unsigned char *data1 = NULL, *data2 = NULL;
+	long pos, len, chunk = CHUNK_PAGES * db->page_size;
+	int retval;
+	RL_MALLOC(data1, chunk);
+	if (!str) {
+		RL_MALLOC(data2, chunk);
+	}
+	*cmp = 0;
+	for (pos = 0; pos < size && *cmp == 0; pos += len) {
+		len = chunk < size - pos ? chunk : size - pos;
+		RL_CALL(rl_multi_string_cpyrange, RL_OK, db, p1, data1, NULL, pos, pos + len - 1);
+		if (str) {
+			*cmp = memcmp(data1, &str[pos], len);
+		}
+		else {
+			RL_CALL(rl_multi_string_cpyrange, RL_OK, db, p2, data2, NULL, pos, pos + len - 1);
+			*cmp = memcmp(data1, data2, len);
+		}
+	}
+	*cmp = *cmp < 0 ? -1 : (*cmp > 0 ? 1 : 0);
+	retval = RL_OK;
+cleanup:
+	rl_free(data1);
+	rl_free(data2);
+	return retval;
+}
+
 int rl_multi_string_cmp(struct rlite *db, long p1, long p2, int *cmp)
 {
 	rl_list *list1 = NULL, *list2 = NULL;
@@ -43,8 +433,17 @@ int rl_multi_string_cmp(struct rlite *db, long p1, long p2, int *cmp)
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, p2, &rl_list_type_long, &_list, 0);
 	list2 = _list;
 
-	long node_number1 = list1->left, node_number2 = list2->left, i;
+	long node_number1 = list1->left, node_number2 = list2->left, i, length1 = 0, length2 = 0;
 	int first = 1;
+	if (IS_EXTENTS(list1) || IS_EXTENTS(list2)) {
+		RL_CALL(string_length, RL_OK, db, list1, &length1);
+		RL_CALL(string_length, RL_OK, db, list2, &length2);
+		RL_CALL(chunked_cmp, RL_OK, db, p1, p2, NULL, length1 < length2 ? length1 : length2, cmp);
+		if (*cmp == 0 && length1 != length2) {
+			*cmp = length1 < length2 ? -1 : 1;
+		}
+		goto cleanup;
+	}
 	while (1) {
 		if (node_number1 == 0 || node_number2 == 0) {
 			if (node_number1 == 0 && node_number2 == 0) {
@@ -124,6 +523,14 @@ int rl_multi_string_cmp_str(struct rlite *db, long p1, unsigned char *str, long
 	long cmplen;
 	long stored_length = 0;
 	*cmp = 0;
+	if (IS_EXTENTS(list1)) {
+		stored_length = list1->size;
+		RL_CALL(chunked_cmp, RL_OK, db, p1, 0, str, stored_length < len ? stored_length : len, cmp);
+		if (*cmp == 0 && stored_length != len) {
+			*cmp = stored_length > len ? 1 : -1;
+		}
+		goto cleanup;
+	}
 	do {
 		if (node_number1 == 0) {
 			*cmp = len == 0 ? 0 : -1;
@@ -209,8 +616,15 @@ int rl_multi_string_append(struct rlite *db, long number, const unsigned char *d
 	long size, cpsize;
 	long string_page_number;
 
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &tmp, 0);
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &tmp, 1);
 	list = tmp;
+	if (IS_EXTENTS(list)) {
+		RL_CALL(extents_write, RL_OK, db, number, list, list->size, data, datasize);
+		if (newlength) {
+			*newlength = list->size;
+		}
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
 	size = *(long *)tmp;
@@ -249,7 +663,7 @@ cleanup:
 
 int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data, long *_size, long start, long stop)
 {
-	long totalsize;
+	long totalsize = 0;
 	rl_list *list = NULL;
 	rl_list_node *node = NULL;
 	void *_list, *tmp;
@@ -260,8 +674,7 @@ int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data,
 	long i, pos = 0, pagesize, pagestart;
 	long size;
 
-	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
-	totalsize = *(long *)tmp;
+	RL_CALL(string_length, RL_OK, db, list, &totalsize);
 	if (totalsize == 0) {
 		if (_size) {
 			*_size = 0;
@@ -281,6 +694,10 @@ int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data,
 	if (_size) {
 		*_size = size;
 	}
+	if (IS_EXTENTS(list)) {
+		RL_CALL(extents_read, RL_OK, db, list, start, size, data);
+		goto cleanup;
+	}
 
 	i = start / db->page_size;
 	pagestart = start % db->page_size;
@@ -310,7 +727,7 @@ cleanup:
 
 int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_data, long *size, long start, long stop)
 {
-	long totalsize;
+	long totalsize = 0;
 	rl_list *list = NULL;
 	rl_list_node *node = NULL;
 	void *_list, *tmp;
@@ -321,8 +738,7 @@ int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_dat
 	unsigned char *tmp_data;
 	long i, pos = 0, pagesize, pagestart;
 
-	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
-	totalsize = *(long *)tmp;
+	RL_CALL(string_length, RL_OK, db, list, &totalsize);
 	if (totalsize == 0) {
 		*size = 0;
 		if (_data) {
@@ -347,6 +763,12 @@ int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_dat
 	}
 
 	RL_MALLOC(data, sizeof(unsigned char) * (*size + 1));
+	if (IS_EXTENTS(list)) {
+		RL_CALL(extents_read, RL_OK, db, list, start, *size, data);
+		data[*size] = 0;
+		*_data = data;
+		goto cleanup;
+	}
 
 	i = start / db->page_size;
 	pagestart = start % db->page_size;
@@ -394,6 +816,9 @@ int rl_multi_string_set(struct rlite *db, long *number, const unsigned char *dat
 	int retval;
 	long *page = NULL;
 	rl_list *list = NULL;
+	if (size > RL_MULTI_STRING_EXTENT_MIN_PAGES * db->page_size) {
+		return extents_set(db, number, data, size);
+	}
 	RL_CALL(rl_list_create, RL_OK, db, &list, &rl_list_type_long);
 	*number = db->next_empty_page;
 	RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_long, *number, list);
@@ -405,6 +830,60 @@ int rl_multi_string_set(struct rlite *db, long *number, const unsigned char *dat
 cleanup:
 	return retval;
 }
+int rl_multi_string_replace(struct rlite *db, long *number, const unsigned char *data, long size)
+{
+	rl_list *list;
+	void *tmp;
+	unsigned char *page_data;
+	long pages, oldpages, i, len, *length = NULL;
+	int retval, extents = size > RL_MULTI_STRING_EXTENT_MIN_PAGES * db->page_size;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, *number, &rl_list_type_long, &tmp, 1);
+	list = tmp;
+	if (IS_EXTENTS(list) != extents) {
+		RL_CALL(rl_multi_string_delete, RL_OK, db, *number);
+		RL_CALL(rl_multi_string_set, RL_OK, db, number, data, size);
+		goto cleanup;
+	}
+	if (extents) {
+		RL_CALL(extents_replace, RL_OK, db, *number, list, data, size);
+		goto cleanup;
+	}
+
+	pages = (size + db->page_size - 1) / db->page_size;
+	oldpages = list->size - 1;
+	for (i = oldpages; i > pages; i--) {
+		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, i);
+		RL_CALL(rl_delete, RL_OK, db, *(long *)tmp);
+		RL_CALL(rl_list_remove_element, RL_OK, db, list, *number, i);
+	}
+	for (i = 0; i < pages && i < oldpages; i++) {
+		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, i + 1);
+		page_data = calloc(db->page_size, sizeof(unsigned char));
+		if (!page_data) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		len = size - i * db->page_size < db->page_size ? size - i * db->page_size : db->page_size;
+		memcpy(page_data, &data[i * db->page_size], len);
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_string, *(long *)tmp, page_data);
+	}
+	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
+	if (*(long *)tmp != size) {
+		RL_MALLOC(length, sizeof(long));
+		*length = size;
+		RL_CALL(rl_list_add_element, RL_OK, db, list, *number, length, 0);
+		length = NULL;
+		RL_CALL(rl_list_remove_element, RL_OK, db, list, *number, 1);
+	}
+	if (pages > oldpages) {
+		RL_CALL(append, RL_OK, db, list, *number, &data[oldpages * db->page_size], size - oldpages * db->page_size);
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(length);
+	return retval;
+}
+
 int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char *data, long size, long offset, long *newlength)
 {
 	long oldsize, newsize;
@@ -419,6 +898,23 @@ int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char
 		retval = RL_INVALID_PARAMETERS;
 		goto cleanup;
 	}
+	if (IS_EXTENTS(list)) {
+		oldsize = list->size;
+		if (oldsize < offset) {
+			RL_MALLOC(tmp_data, sizeof(char) * (size + offset - oldsize));
+			memset(tmp_data, 0, offset - oldsize);
+			memcpy(&tmp_data[offset - oldsize], data, sizeof(char) * size);
+			retval = extents_write(db, number, list, oldsize, tmp_data, size + offset - oldsize);
+			rl_free(tmp_data);
+		}
+		else {
+			retval = extents_write(db, number, list, offset, data, size);
+		}
+		if (retval == RL_OK && newlength) {
+			*newlength = list->size;
+		}
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
 	oldsize = *(long *)tmp;
@@ -491,6 +987,12 @@ int rl_multi_string_sha1(struct rlite *db, unsigned char digest[20], long number
 	int retval;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &tmp, 0);
 	list = tmp;
+	if (IS_EXTENTS(list)) {
+		RL_CALL(extents_sha1, RL_OK, db, &sha, list);
+		RL_CALL(rl_list_nocache_destroy, RL_OK, db, list);
+		SHA1Final(digest, &sha);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
 
@@ -532,6 +1034,11 @@ int rl_multi_string_pages(struct rlite *db, long page, short *pages)
 	int retval;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 0);
 	list = tmp;
+	if (IS_EXTENTS(list)) {
+		retval = extents_pages(db, list, pages);
+		rl_list_nocache_destroy(db, list);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_pages, RL_OK, db, list, pages);
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
@@ -570,6 +1077,11 @@ int rl_multi_string_delete(struct rlite *db, long page)
 	int retval;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 1);
 	list = tmp;
+	if (IS_EXTENTS(list)) {
+		RL_CALL(extents_delete, RL_OK, db, list);
+		RL_CALL(rl_delete, RL_OK, db, page);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
 
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rlite/status.h"
+#include "rlite/page_store.h"
+#include "rlite/util.h"
+
+#define CHUNK_SIZE (1024 * 1024)
+#define MIN_CHUNKS_ALLOC 16
+
+void rl_page_store_init(rl_page_store *store, long page_size)
+{
+	store->chunks = NULL;
+	store->chunks_alloc = 0;
+	store->page_size = page_size;
+	// page sizes are powers of two, up to a chunk
+	store->chunk_pages = page_size < CHUNK_SIZE ? CHUNK_SIZE / page_size : 1;
+	store->number_of_pages = 0;
+}
+
+void rl_page_store_destroy(rl_page_store *store)
+{
+	long i;
+	for (i = 0; i < store->chunks_alloc; i++) {
+		rl_free(store->chunks[i]);
+	}
+	rl_free(store->chunks);
+	store->chunks = NULL;
+	store->chunks_alloc = 0;
+	store->number_of_pages = 0;
+}
+
+unsigned char *rl_page_store_get(rl_page_store *store, long page_number)
+{
+	unsigned char *chunk;
+	if (page_number < 0 || page_number >= store->number_of_pages) {
+		return NULL;
+	}
+	chunk = store->chunks[page_number / store->chunk_pages];
+	if (!chunk) {
+		return NULL;
+	}
+	return &chunk[(page_number % store->chunk_pages) * store->page_size];
+}
+
+int rl_page_store_put(rl_page_store *store, long page_number, unsigned char **data)
+{
+	int retval = RL_OK;
+	long chunk = page_number / store->chunk_pages, alloc;
+	void *tmp;
+	if (page_number < 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	if (chunk >= store->chunks_alloc) {
+		// only the directory is copied
+		alloc = store->chunks_alloc > 0 ? store->chunks_alloc : MIN_CHUNKS_ALLOC;
+		while (alloc <= chunk) {
+			alloc *= 2;
+		}
+		RL_REALLOC(store->chunks, sizeof(unsigned char *) * alloc);
+		memset(&store->chunks[store->chunks_alloc], 0, sizeof(unsigned char *) * (alloc - store->chunks_alloc));
+		store->chunks_alloc = alloc;
+	}
+	if (!store->chunks[chunk]) {
+		RL_MALLOC(store->chunks[chunk], store->chunk_pages * store->page_size);
+	}
+	if (page_number >= store->number_of_pages) {
+		store->number_of_pages = page_number + 1;
+	}
+	*data = &store->chunks[chunk][(page_number % store->chunk_pages) * store->page_size];
+cleanup:
+	return retval;
+}
+
+void rl_page_store_truncate(rl_page_store *store, long number_of_pages)
+{
+	long i;
+	if (number_of_pages >= store->number_of_pages) {
+		return;
+	}
+	// the chunk holding the last page is kept, even if partially used
+	for (i = (number_of_pages + store->chunk_pages - 1) / store->chunk_pages; i < store->chunks_alloc; i++) {
+		rl_free(store->chunks[i]);
+		store->chunks[i] = NULL;
+	}
+	store->number_of_pages = number_of_pages;
+}
@@ -206,6 +206,7 @@ int rl_poll_wait(rlite *db, int *elementc, unsigned char ***_elements, long **_e
 		// can we atomically do both without locking the database?
 		ENSURE_SUBSCRIBER_ID(RL_UNEXPECTED);
 		char *filename = get_signal_filename(db, db->subscriber_id);
+		rl_flush(db);
 		rl_discard(db);
 		rl_create_signal(filename);
 		rl_read_signal(filename, timeout, NULL, NULL);
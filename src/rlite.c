@@ -1,12 +1,17 @@
+#define _XOPEN_SOURCE 700
 #include <sys/file.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include "rlite/page_btree.h"
 #include "rlite/page_list.h"
 #include "rlite/page_long.h"
+#include "rlite/page_freelist.h"
 #include "rlite/page_string.h"
 #include "rlite/page_skiplist.h"
 #include "rlite/page_multi_string.h"
@@ -26,10 +31,18 @@
 #define DEFAULT_READ_PAGES_LEN 16
 #define DEFAULT_WRITE_PAGES_LEN 8
 #define DEFAULT_PAGE_SIZE 1024
+#define DEFAULT_PAGE_CACHE_SIZE 1024
+// milliseconds, longest sleep between two attempts to take a busy lock
+#define MAX_BUSY_DELAY 100
+// most pages at the end of the file an incremental vacuum maps at once
+#define MAX_VACUUM_WINDOW 1024
+#define DEFAULT_WAL_AUTOCHECKPOINT 1000
 #define HEADER_SIZE 200
 
 int rl_header_serialize(struct rlite *db, void *obj, unsigned char *data);
-int rl_has_flag(rlite *db, int flag);
+static void rl_page_destroy(struct rlite *db, rl_page *page);
+static void rl_cache_destroy(struct rlite *db);
+static int rl_resident_save(struct rlite *db, long page_number);
 
 rl_data_type rl_data_type_btree_hash_sha1_long = {
 	"rl_data_type_btree_hash_sha1_long",
@@ -141,41 +154,415 @@ rl_data_type rl_data_type_long = {
 	rl_long_deserialize,
 	rl_long_destroy,
 };
+rl_data_type rl_data_type_freelist_trunk = {
+	"rl_data_type_freelist_trunk",
+	rl_freelist_trunk_serialize,
+	rl_freelist_trunk_deserialize,
+	rl_freelist_trunk_destroy,
+};
+
+rl_data_type rl_data_type_multi_string_extents = {
+	"rl_data_type_multi_string_extents",
+	rl_multi_string_extents_serialize,
+	rl_multi_string_extents_deserialize,
+	rl_multi_string_extents_destroy,
+};
 
 rl_data_type rl_data_type_skiplist_node;
 
-static const unsigned char *identifier = (unsigned char *)"rlite0.0";
+// pages copied as they are serialized, see rl_write_raw
+static int rl_raw_serialize(struct rlite *db, void *obj, unsigned char *data)
+{
+	memcpy(data, obj, db->page_size);
+	return RL_OK;
+}
+
+static int rl_raw_deserialize(struct rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	int retval = RL_OK;
+	unsigned char *copy;
+	RL_MALLOC(copy, db->page_size);
+	memcpy(copy, data, db->page_size);
+	*obj = copy;
+cleanup:
+	return retval;
+}
+
+static int rl_raw_destroy(struct rlite *UNUSED(db), void *obj)
+{
+	rl_free(obj);
+	return RL_OK;
+}
+
+static rl_data_type rl_data_type_raw = {
+	"rl_data_type_raw",
+	rl_raw_serialize,
+	rl_raw_deserialize,
+	rl_raw_destroy,
+};
+
+/**
+ * Version 0.1 stores short key names and string values in the key btree
+ * records. Files of version 0.0 are read as they are, with names and values
+ * refused in their records, and upgraded by the next write of the header;
+ * versions that only know 0.0 refuse the upgraded files instead of
+ * misreading their keys.
+ */
+static const unsigned char *identifier = (unsigned char *)"rlite0.1";
+static const unsigned char *identifier_v0 = (unsigned char *)"rlite0.0";
+
+/**
+ * State of a database opened with RLITE_OPEN_SHARED, along with the driver
+ * and the read cache its handles point to.
+ */
+struct rl_shared {
+	// held shared by read transactions, and exclusively by any other
+	pthread_rwlock_t lock;
+	// guards everything below, and the read cache while readers share it
+	pthread_mutex_t mutex;
+	long handles;
+	long page_cache_clock;
+	// the header of the last commit, for the other handles to start from
+	unsigned char *header;
+	long change_counter;
+	// a reader may have modified cached pages, the next writer drops them
+	int cache_stale;
+};
+
+static int rl_shared_create(rlite *db)
+{
+	struct rl_shared *shared;
+	int retval = RL_OK;
+	RL_MALLOC(shared, sizeof(*shared));
+	if (pthread_rwlock_init(&shared->lock, NULL) != 0) {
+		rl_free(shared);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (pthread_mutex_init(&shared->mutex, NULL) != 0) {
+		pthread_rwlock_destroy(&shared->lock);
+		rl_free(shared);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	shared->handles = 1;
+	shared->page_cache_clock = 0;
+	shared->header = NULL;
+	shared->change_counter = -1;
+	shared->cache_stale = 0;
+	db->shared = shared;
+cleanup:
+	return retval;
+}
+
+static void rl_shared_destroy(struct rl_shared *shared)
+{
+	pthread_rwlock_destroy(&shared->lock);
+	pthread_mutex_destroy(&shared->mutex);
+	rl_free(shared->header);
+	rl_free(shared);
+}
+
+// keeps the header just committed for the other handles
+static int rl_shared_publish(rlite *db)
+{
+	struct rl_shared *shared = db->shared;
+	int retval = RL_OK;
+	pthread_mutex_lock(&shared->mutex);
+	if (!shared->header) {
+		shared->header = rl_malloc(sizeof(unsigned char) * db->page_size);
+		if (!shared->header) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+	}
+	memset(shared->header, 0, db->page_size);
+	RL_CALL(rl_header_serialize, RL_OK, db, NULL, shared->header);
+	shared->change_counter = db->change_counter;
+cleanup:
+	pthread_mutex_unlock(&shared->mutex);
+	return retval;
+}
 
-static int file_driver_fp(rlite *db)
+/**
+ * Starts the transaction of a handle in the other threads' lock. Writers
+ * have the read cache for themselves, and drop it if a reader left it
+ * untrusted. If another handle committed since the last transaction, its
+ * header is read again.
+ */
+static int rl_shared_lock(rlite *db, int type)
 {
+	struct rl_shared *shared = db->shared;
 	int retval = RL_OK;
+	if (db->shared_locked) {
+		return RL_OK;
+	}
+	if ((type == RLITE_FLOCK_SH ? pthread_rwlock_rdlock(&shared->lock) : pthread_rwlock_wrlock(&shared->lock)) != 0) {
+		return RL_UNEXPECTED;
+	}
+	db->shared_locked = type;
+	if (type == RLITE_FLOCK_EX) {
+		if (shared->cache_stale) {
+			rl_cache_clear(db);
+			shared->cache_stale = 0;
+		}
+		if (shared->page_cache_clock > db->page_cache_clock) {
+			db->page_cache_clock = shared->page_cache_clock;
+		}
+	}
+	if (db->page_cache_change_counter != shared->change_counter) {
+		RL_CALL(rl_header_deserialize, RL_OK, db, NULL, NULL, shared->header);
+		db->page_cache_change_counter = shared->change_counter;
+	}
+cleanup:
+	return retval;
+}
+
+static int rl_cache_trim(struct rlite *db);
+
+static void rl_shared_unlock(rlite *db)
+{
+	struct rl_shared *shared = db->shared;
+	int type = db->shared_locked, over_budget = 0;
+	if (!type) {
+		return;
+	}
+	if (type == RLITE_FLOCK_EX && db->page_cache_clock > shared->page_cache_clock) {
+		shared->page_cache_clock = db->page_cache_clock;
+	}
+	if (type == RLITE_FLOCK_SH && db->page_cache_size > 0) {
+		pthread_mutex_lock(&shared->mutex);
+		over_budget = db->read_pages->len > db->page_cache_size;
+		pthread_mutex_unlock(&shared->mutex);
+	}
+	db->shared_locked = 0;
+	pthread_rwlock_unlock(&shared->lock);
+	// readers only add to the cache, the first one to find no one else
+	// using it brings it back to its budget
+	if (over_budget && pthread_rwlock_trywrlock(&shared->lock) == 0) {
+		rl_cache_trim(db);
+		pthread_rwlock_unlock(&shared->lock);
+	}
+}
+
+// readers of a shared database look up and add pages one at a time
+static void rl_cache_lock(rlite *db)
+{
+	if (db->shared_locked == RLITE_FLOCK_SH) {
+		pthread_mutex_lock(&db->shared->mutex);
+		if (db->shared->page_cache_clock > db->page_cache_clock) {
+			db->page_cache_clock = db->shared->page_cache_clock;
+		}
+	}
+}
+
+static void rl_cache_unlock(rlite *db)
+{
+	if (db->shared_locked == RLITE_FLOCK_SH) {
+		if (db->page_cache_clock > db->shared->page_cache_clock) {
+			db->shared->page_cache_clock = db->page_cache_clock;
+		}
+		pthread_mutex_unlock(&db->shared->mutex);
+	}
+}
+
+/**
+ * Reads the header from the file, applying the wal first if there is one.
+ * The cached pages are dropped since they might be outdated.
+ */
+static int file_driver_read_header(rlite *db)
+{
+	int retval;
+	RL_CALL(rl_cache_clear, RL_OK, db);
+	db->page_size = HEADER_SIZE;
+	RL_CALL(rl_apply_wal, RL_OK, db);
+	retval = rl_read(db, &rl_data_type_header, 0, NULL, NULL, 1);
+	if (retval == RL_FOUND) {
+		db->page_cache_change_counter = db->change_counter;
+		retval = RL_OK;
+	}
+cleanup:
+	return retval;
+}
+
+// the change counter in the header of the database file, -1 if it is empty
+static int file_driver_read_change_counter(rlite *db, long *counter)
+{
+	rl_file_driver *driver = db->driver;
+	unsigned char data[4];
+	long position = strlen((char *)identifier) + 16 + 4 * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT);
+	size_t read;
+	int retval;
+	RL_CALL(driver->io->read, RL_OK, driver->handle, data, 4, position, &read);
+	*counter = read == 4 ? get_4bytes(data) : -1;
+cleanup:
+	return retval;
+}
+
+/**
+ * Called after locking the file. If the change counter in the header is the
+ * one seen when the file was unlocked, nobody else wrote in between: the
+ * header properties and the cached pages are still valid, and a single read
+ * was enough to know it.
+ */
+static int file_driver_check_header(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	long counter;
+	int retval, changed;
+	RL_CALL(rl_wal_log_refresh, RL_OK, db, &changed);
+	if (db->page_cache_change_counter != -1 && !changed && driver->log->frames > 0) {
+		// every commit writes the header, so the log has the latest one and
+		// nobody committed since it was read
+		return RL_OK;
+	}
+	if (db->page_cache_change_counter != -1 && !changed &&
+			file_driver_read_change_counter(db, &counter) == RL_OK && counter == db->page_cache_change_counter) {
+		return RL_OK;
+	}
+	retval = file_driver_read_header(db);
+	if (retval == RL_NOT_FOUND) {
+		// empty file, nobody committed the database rl_read_header created
+		// yet; it keeps the page size it was created with
+		db->page_size = db->create_page_size;
+		retval = RL_OK;
+	}
+cleanup:
+	return retval;
+}
+
+static int file_driver_try_lock(rlite *db, int type)
+{
 	rl_file_driver *driver = db->driver;
-	if (driver->fp == NULL) {
-		char *mode;
-		if (access(driver->filename, F_OK) == 0) {
-			mode = "r+";
+	if ((type & ~RLITE_FLOCK_NB) == RLITE_FLOCK_WRITER && driver->writer_fd != -1) {
+		return rl_flock_fd(driver->writer_fd, RLITE_FLOCK_EX | (type & RLITE_FLOCK_NB));
+	}
+	return driver->io->lock(driver->handle, type);
+}
+
+/**
+ * Waits for a lock held by another connection, retrying it with a growing
+ * sleep until busy_timeout passes.
+ */
+static int file_driver_wait_lock(rlite *db, int type)
+{
+	unsigned long long now, deadline;
+	long delay = 1;
+	struct timespec nap;
+	int retval;
+	if (db->busy_timeout == 0) {
+		return file_driver_try_lock(db, type);
+	}
+	deadline = rl_mstime() + db->busy_timeout;
+	while ((retval = file_driver_try_lock(db, type | RLITE_FLOCK_NB)) == RL_BUSY) {
+		now = rl_mstime();
+		if (now >= deadline) {
+			break;
 		}
-		else {
-			if ((driver->mode & RLITE_OPEN_READWRITE) == 0) {
-				fprintf(stderr, "Opening unexisting file in readonly mode\n");
-				retval = RL_INVALID_PARAMETERS;
-				goto cleanup;
-			}
-			mode = "w+";
+		if ((unsigned long long)delay > deadline - now) {
+			delay = deadline - now;
 		}
-		driver->fp = fopen(driver->filename, mode);
-		if (driver->fp == NULL) {
-			fprintf(stderr, "Cannot open file %s, errno %d, mode %s\n", driver->filename, errno, mode);
-			perror(NULL);
+		nap.tv_sec = delay / 1000;
+		nap.tv_nsec = (delay % 1000) * 1000000;
+		nanosleep(&nap, NULL);
+		delay = delay < MAX_BUSY_DELAY / 2 ? delay * 2 : MAX_BUSY_DELAY;
+	}
+	return retval;
+}
+
+/**
+ * Takes the writer lock on the ".lock" file next to the database, for
+ * backends that have no writer lock. The file is never deleted: a writer
+ * waiting on a deleted file would not exclude the ones opening a new one.
+ */
+static int file_driver_lock_writer_file(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	char *path = NULL;
+	int retval = RL_OK;
+	if (driver->writer_fd == -1) {
+		path = rl_get_filename_with_suffix(driver->filename, ".lock");
+		if (!path) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		driver->writer_fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (driver->writer_fd == -1) {
 			retval = RL_UNEXPECTED;
 			goto cleanup;
 		}
-		retval = rl_flock(driver->fp, (driver->mode & RLITE_OPEN_READWRITE) ? RLITE_FLOCK_EX : RLITE_FLOCK_SH);
+	}
+	retval = file_driver_wait_lock(db, RLITE_FLOCK_WRITER);
+cleanup:
+	rl_free(path);
+	return retval;
+}
+
+static int file_driver_unlock(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	if (driver->writer_fd != -1) {
+		rl_flock_fd(driver->writer_fd, RLITE_FLOCK_UN);
+	}
+	return driver->io->lock(driver->handle, RLITE_FLOCK_UN);
+}
+
+/**
+ * Read-only connections and read transactions share the file. Writers take
+ * the writer lock first, so only one of them is ever waiting for the file.
+ * In wal mode they only append to the log, so they share the file too;
+ * writers in delete mode change the file and need it for themselves.
+ */
+static int file_driver_lock(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	int retval = RL_OK, type = RLITE_FLOCK_SH;
+	if ((driver->mode & RLITE_OPEN_READWRITE) && (driver->mode & RLITE_OPEN_EXCLUSIVE)) {
+		// kept until rl_close, later transactions may write
+		type = RLITE_FLOCK_EX;
+	}
+	else if ((driver->mode & RLITE_OPEN_READWRITE) && !db->read_snapshot) {
+		// always before the file, a checkpoint waits for the file while
+		// holding the writer lock
+		retval = file_driver_wait_lock(db, RLITE_FLOCK_WRITER);
+		if (retval == RL_NOT_IMPLEMENTED) {
+			retval = file_driver_lock_writer_file(db);
+		}
 		if (retval != RL_OK) {
-			fclose(driver->fp);
-			driver->fp = NULL;
 			goto cleanup;
 		}
+		if (db->journal_mode != RLITE_JOURNAL_WAL) {
+			type = RLITE_FLOCK_EX;
+		}
+	}
+	RL_CALL(file_driver_wait_lock, RL_OK, db, type);
+	driver->locked = type;
+cleanup:
+	if (retval != RL_OK) {
+		file_driver_unlock(db);
+	}
+	return retval;
+}
+
+static int file_driver_open(rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	if (driver->handle == NULL) {
+		if ((driver->mode & RLITE_OPEN_READWRITE) == 0 && access(driver->filename, F_OK) != 0) {
+			fprintf(stderr, "Opening unexisting file in readonly mode\n");
+			retval = RL_INVALID_PARAMETERS;
+			goto cleanup;
+		}
+		// read-write connections create the file if it is missing
+		RL_CALL(driver->io->open, RL_OK, driver->filename,
+				(driver->mode & RLITE_OPEN_READWRITE) ? driver->mode | RLITE_OPEN_CREATE : driver->mode,
+				&driver->handle);
+		driver->locked = 0;
+	}
+	if (!driver->locked) {
+		RL_CALL(file_driver_lock, RL_OK, db);
+		RL_CALL(file_driver_check_header, RL_OK, db);
 	}
 cleanup:
 	return retval;
@@ -196,6 +583,8 @@ int rl_header_serialize(struct rlite *db, void *UNUSED(obj), unsigned char *data
 		}
 		pos += 4;
 	}
+	put_4bytes(&data[pos], db->change_counter);
+	put_4bytes(&data[pos + 4], db->freelist);
 	return RL_OK;
 }
 
@@ -203,10 +592,11 @@ int rl_header_deserialize(struct rlite *db, void **UNUSED(obj), void *UNUSED(con
 {
 	int retval = RL_OK;
 	int identifier_len = strlen((char *)identifier);
-	if (memcmp(data, identifier, identifier_len) != 0) {
+	if (memcmp(data, identifier, identifier_len) != 0 && memcmp(data, identifier_v0, identifier_len) != 0) {
 		fprintf(stderr, "Unexpected header, expecting %s\n", identifier);
 		return RL_INVALID_STATE;
 	}
+	db->legacy_keys = memcmp(data, identifier, identifier_len) != 0;
 	db->page_size = get_4bytes(&data[identifier_len]);
 	db->initial_next_empty_page =
 	db->next_empty_page = get_4bytes(&data[identifier_len + 4]);
@@ -225,32 +615,42 @@ int rl_header_deserialize(struct rlite *db, void **UNUSED(obj), void *UNUSED(con
 		db->databases[i] = get_4bytes(&data[pos]);
 		pos += 4;
 	}
+	db->change_counter = get_4bytes(&data[pos]);
+	db->initial_freelist =
+	db->freelist = get_4bytes(&data[pos + 4]);
 cleanup:
 	return retval;
 }
 
-int rl_ensure_pages(rlite *db)
+int rl_open(const char *filename, rlite **db, int flags)
 {
-	int retval = RL_OK;
-	void *tmp;
-	if (rl_has_flag(db, RLITE_OPEN_READWRITE)) {
-		if (db->write_pages_len == db->write_pages_alloc) {
-			RL_REALLOC(db->write_pages, sizeof(rl_page *) * db->write_pages_alloc * 2)
-			db->write_pages_alloc *= 2;
-		}
-	}
-	if (db->read_pages_len == db->read_pages_alloc) {
-		RL_REALLOC(db->read_pages, sizeof(rl_page *) * db->read_pages_alloc * 2)
-		db->read_pages_alloc *= 2;
-	}
-cleanup:
-	return retval;
+	rl_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.flags = flags;
+	return rl_open_v2(filename, db, &options);
 }
 
-int rl_open(const char *filename, rlite **_db, int flags)
+static int valid_page_size(long page_size)
+{
+	return page_size >= RLITE_MIN_PAGE_SIZE && page_size <= RLITE_MAX_PAGE_SIZE &&
+		(page_size & (page_size - 1)) == 0;
+}
+
+int rl_open_v2(const char *filename, rlite **_db, const rl_open_options *options)
 {
 	int retval = RL_OK;
 	rlite *db;
+	int flags = options->flags;
+	if ((options->page_size != 0 && !valid_page_size(options->page_size)) ||
+			options->cache_size < 0 || options->busy_timeout < 0 ||
+			options->sync < RLITE_SYNC_OFF || options->sync > RLITE_SYNC_FULL ||
+			(options->lock_mode != RLITE_LOCK_NORMAL && options->lock_mode != RLITE_LOCK_EXCLUSIVE) ||
+			(options->journal_mode != RLITE_JOURNAL_DELETE && options->journal_mode != RLITE_JOURNAL_WAL)) {
+		return RL_INVALID_PARAMETERS;
+	}
+	if (options->lock_mode == RLITE_LOCK_EXCLUSIVE) {
+		flags |= RLITE_OPEN_EXCLUSIVE;
+	}
 	RL_MALLOC(db, sizeof(*db));
 
 	db->subscriber_lock_filename = NULL;
@@ -260,24 +660,48 @@ int rl_open(const char *filename, rlite **_db, int flags)
 	db->selected_database = 0;
 	db->selected_internal = RLITE_INTERNAL_DB_NO;
 	db->page_size = DEFAULT_PAGE_SIZE;
-	db->read_pages = db->write_pages = NULL;
-	db->read_pages_alloc = db->read_pages_len = db->write_pages_len = db->write_pages_alloc = 0;
+	db->legacy_keys = 0;
+	db->read_pages = NULL;
+	db->write_pages.pages = NULL;
+	db->write_pages.index = NULL;
+	db->undo_pages.pages = NULL;
+	db->undo_pages.index = NULL;
+	db->shared = NULL;
+	db->shared_locked = 0;
+	db->backups = NULL;
+	rl_arena_init(&db->arena);
+	db->write_sequence = 0;
+	db->read_snapshot = 0;
+	db->group_commit_max_commits = 0;
+	db->group_commit_max_pages = 0;
+	db->group_commit_max_delay = 0;
+	db->group_commits = 0;
 	db->initial_number_of_pages = db->number_of_pages = 0;
 	db->initial_number_of_databases =
 	db->number_of_databases = 0;
 	db->driver = NULL;
 	db->driver_type = -1;
-
-	RL_MALLOC(db->read_pages, sizeof(rl_page *) * DEFAULT_READ_PAGES_LEN)
-	db->read_pages_len = 0;
-	db->read_pages_alloc = DEFAULT_READ_PAGES_LEN;
-	db->write_pages_len = 0;
-	if ((flags & RLITE_OPEN_READWRITE) > 0) {
-		db->write_pages_alloc = DEFAULT_WRITE_PAGES_LEN;
-		RL_MALLOC(db->write_pages, sizeof(rl_page *) * DEFAULT_WRITE_PAGES_LEN);
-	}
-	else {
-		db->write_pages_alloc = 0;
+	db->page_cache_size = DEFAULT_PAGE_CACHE_SIZE;
+	db->page_cache_clock = 0;
+	db->change_counter = 0;
+	db->page_cache_change_counter = -1;
+	db->create_page_size = options->page_size ? options->page_size : DEFAULT_PAGE_SIZE;
+	db->sync = options->sync;
+	db->journal_mode = options->journal_mode;
+	db->wal_autocheckpoint = options->wal_autocheckpoint ? options->wal_autocheckpoint : DEFAULT_WAL_AUTOCHECKPOINT;
+	db->busy_timeout = options->busy_timeout;
+
+	RL_MALLOC(db->read_pages, sizeof(*db->read_pages));
+	db->read_pages->pages = NULL;
+	db->read_pages->index = NULL;
+	RL_CALL(rl_page_cache_init, RL_OK, db->read_pages, DEFAULT_READ_PAGES_LEN);
+	RL_CALL(rl_page_cache_init, RL_OK, &db->write_pages, (flags & RLITE_OPEN_READWRITE) ? DEFAULT_WRITE_PAGES_LEN : 0);
+	RL_CALL(rl_page_cache_init, RL_OK, &db->undo_pages, 0);
+	if (flags & RLITE_OPEN_SHARED) {
+		// other processes could change the file under the cache of a
+		// reader, while other threads use it
+		flags |= RLITE_OPEN_EXCLUSIVE;
+		RL_CALL(rl_shared_create, RL_OK, db);
 	}
 
 	if (strcmp(filename, ":memory:") == 0) {
@@ -285,8 +709,8 @@ int rl_open(const char *filename, rlite **_db, int flags)
 		RL_MALLOC(driver, sizeof(*driver));
 		db->driver_type = RL_MEMORY_DRIVER;
 		db->driver = driver;
-		driver->data = NULL;
-		driver->datalen = 0;
+		rl_page_store_init(&driver->store, db->create_page_size);
+		driver->resident = (flags & RLITE_OPEN_RESIDENT) != 0;
 	}
 	else {
 		if ((flags & RLITE_OPEN_CREATE) == 0) {
@@ -305,7 +729,12 @@ int rl_open(const char *filename, rlite **_db, int flags)
 
 		rl_file_driver *driver;
 		RL_MALLOC(driver, sizeof(*driver));
-		driver->fp = NULL;
+		// readers share the pages the OS caches for the file
+		driver->io = (flags & RLITE_OPEN_READWRITE) ? &rl_io_positional : &rl_io_mmap;
+		driver->handle = NULL;
+		driver->locked = 0;
+		driver->writer_fd = -1;
+		driver->log = NULL;
 		driver->filename = rl_malloc(sizeof(char) * (strlen(filename) + 1));
 		if (!driver->filename) {
 			rl_free(driver);
@@ -316,9 +745,18 @@ int rl_open(const char *filename, rlite **_db, int flags)
 		driver->mode = flags;
 		db->driver = driver;
 		db->driver_type = RL_FILE_DRIVER;
+		RL_CALL(rl_wal_log_init, RL_OK, db);
 	}
 
 	RL_CALL(rl_read_header, RL_OK, db);
+	if (options->cache_size) {
+		// the budget is in bytes, the page size is known once the header is read
+		db->page_cache_size = options->cache_size / db->page_size;
+	}
+	if (db->shared) {
+		// other handles start from the committed header, create it now
+		RL_CALL(rl_commit, RL_OK, db);
+	}
 
 	*_db = db;
 cleanup:
@@ -331,16 +769,153 @@ cleanup:
 int rl_refresh(rlite *db)
 {
 	int retval = RL_OK;
-	if (db->driver_type == RL_FILE_DRIVER) {
+	// with commits pending, the file is locked and nobody else changed it
+	if (db->shared && db->group_commits == 0) {
+		// the file is locked for as long as the database is open
+		RL_CALL(rl_discard, RL_OK, db);
+		RL_CALL(rl_shared_lock, RL_OK, db, RLITE_FLOCK_EX);
+	}
+	else if (db->driver_type == RL_FILE_DRIVER && db->group_commits == 0) {
+		RL_CALL(rl_discard, RL_OK, db);
+		RL_CALL(rl_read_header, RL_OK, db);
+	}
+	else if (db->read_snapshot) {
+		// a resident database after rl_begin_read, nothing to roll back
+		RL_CALL(rl_discard, RL_OK, db);
+	}
+cleanup:
+	return retval;
+}
+
+int rl_begin_read(rlite *db)
+{
+	int retval = RL_OK;
+	if (db->shared && db->group_commits == 0) {
+		RL_CALL(rl_discard, RL_OK, db);
+		db->read_snapshot = 1;
+		RL_CALL(rl_shared_lock, RL_OK, db, RLITE_FLOCK_SH);
+	}
+	else if (db->driver_type == RL_FILE_DRIVER && db->group_commits == 0) {
 		RL_CALL(rl_discard, RL_OK, db);
+		db->read_snapshot = 1;
 		RL_CALL(rl_read_header, RL_OK, db);
 	}
+	else if (rl_is_resident(db) && db->group_commits == 0) {
+		// the pages are used as they are, with no image to restore them
+		RL_CALL(rl_discard, RL_OK, db);
+		db->read_snapshot = 1;
+	}
+cleanup:
+	return retval;
+}
+
+int rl_open_thread(rlite *db, rlite **_thread_db)
+{
+	struct rl_shared *shared = db->shared;
+	rlite *thread_db;
+	int retval = RL_OK;
+	if (!shared) {
+		return RL_INVALID_STATE;
+	}
+	RL_MALLOC(thread_db, sizeof(*thread_db));
+	memcpy(thread_db, db, sizeof(*thread_db));
+	thread_db->subscriber_lock_filename = NULL;
+	thread_db->subscriber_id = NULL;
+	thread_db->subscriber_lock_fp = NULL;
+	thread_db->databases = NULL;
+	thread_db->initial_databases = NULL;
+	thread_db->selected_database = 0;
+	thread_db->selected_internal = RLITE_INTERNAL_DB_NO;
+	thread_db->write_pages.pages = NULL;
+	thread_db->write_pages.index = NULL;
+	thread_db->undo_pages.pages = NULL;
+	thread_db->undo_pages.index = NULL;
+	rl_arena_init(&thread_db->arena);
+	thread_db->write_sequence = 0;
+	thread_db->read_snapshot = 0;
+	thread_db->group_commit_max_commits = 0;
+	thread_db->group_commit_max_pages = 0;
+	thread_db->group_commit_max_delay = 0;
+	thread_db->group_commits = 0;
+	thread_db->page_cache_clock = 0;
+	thread_db->shared_locked = 0;
+	thread_db->backups = NULL;
+	retval = rl_page_cache_init(&thread_db->write_pages, rl_has_flag(db, RLITE_OPEN_READWRITE) ? DEFAULT_WRITE_PAGES_LEN : 0);
+	if (retval == RL_OK) {
+		retval = rl_page_cache_init(&thread_db->undo_pages, 0);
+	}
+	if (retval != RL_OK) {
+		rl_page_cache_destroy(&thread_db->write_pages);
+		rl_free(thread_db);
+		goto cleanup;
+	}
+
+	// the other handles may be in a transaction, but the last committed
+	// header does not change without the mutex
+	pthread_mutex_lock(&shared->mutex);
+	retval = rl_header_deserialize(thread_db, NULL, NULL, shared->header);
+	if (retval == RL_OK) {
+		thread_db->page_cache_change_counter = shared->change_counter;
+		shared->handles++;
+	}
+	pthread_mutex_unlock(&shared->mutex);
+	if (retval != RL_OK) {
+		rl_page_cache_destroy(&thread_db->write_pages);
+		rl_page_cache_destroy(&thread_db->undo_pages);
+		rl_arena_destroy(&thread_db->arena);
+		rl_free(thread_db->databases);
+		rl_free(thread_db->initial_databases);
+		rl_free(thread_db);
+		goto cleanup;
+	}
+	*_thread_db = thread_db;
 cleanup:
 	return retval;
 }
 
+// closes what the handles of a shared database have in common
+static void rl_close_driver(rlite *db)
+{
+	if (db->driver_type == RL_FILE_DRIVER && db->journal_mode == RLITE_JOURNAL_WAL &&
+			rl_has_flag(db, RLITE_OPEN_READWRITE) && ((rl_file_driver *)db->driver)->log) {
+		// leave a database that does not need the log, unless readers are
+		// still using it
+		if (rl_lock_checkpoint(db, 0) == RL_OK) {
+			rl_wal_log_remove(db, db->number_of_pages);
+		}
+		rl_discard(db);
+	}
+	if (db->read_pages) {
+		rl_cache_destroy(db);
+	}
+	if (db->driver_type == RL_FILE_DRIVER) {
+		rl_file_driver *driver = db->driver;
+		rl_wal_log_destroy(db);
+		if (driver->handle) {
+			driver->io->close(driver->handle);
+		}
+		if (driver->writer_fd != -1) {
+			close(driver->writer_fd);
+		}
+		rl_free(driver->filename);
+	}
+	else if (db->driver_type == RL_MEMORY_DRIVER) {
+		rl_memory_driver* driver = db->driver;
+		rl_page_store_destroy(&driver->store);
+	}
+	rl_free(db->driver);
+	if (db->read_pages) {
+		rl_page_cache_destroy(db->read_pages);
+		rl_free(db->read_pages);
+	}
+	if (db->shared) {
+		rl_shared_destroy(db->shared);
+	}
+}
+
 int rl_close(rlite *db)
 {
+	long handles = 0;
 	if (!db) {
 		return RL_OK;
 	}
@@ -348,24 +923,26 @@ int rl_close(rlite *db)
 	if (db->driver_type == RL_FILE_DRIVER) {
 		rl_unsubscribe_all(db);
 	}
+	rl_backup_detach(db);
+	rl_flush(db);
 	// discard before removing the driver, since we need to release locks
 	rl_discard(db);
-	if (db->driver_type == RL_FILE_DRIVER) {
-		rl_file_driver *driver = db->driver;
-		rl_free(driver->filename);
+	if (db->shared) {
+		pthread_mutex_lock(&db->shared->mutex);
+		handles = --db->shared->handles;
+		pthread_mutex_unlock(&db->shared->mutex);
 	}
-	else if (db->driver_type == RL_MEMORY_DRIVER) {
-		rl_memory_driver* driver = db->driver;
-		rl_free(driver->data);
+	if (handles == 0) {
+		rl_close_driver(db);
 	}
 	if (db->subscriber_lock_filename) {
 		remove(db->subscriber_lock_filename);
 		rl_free(db->subscriber_lock_filename);
 	}
-	rl_free(db->driver);
 	rl_free(db->subscriber_id);
-	rl_free(db->read_pages);
-	rl_free(db->write_pages);
+	rl_page_cache_destroy(&db->write_pages);
+	rl_page_cache_destroy(&db->undo_pages);
+	rl_arena_destroy(&db->arena);
 	rl_free(db->databases);
 	rl_free(db->initial_databases);
 	rl_free(db);
@@ -386,8 +963,7 @@ int rl_has_flag(rlite *db, int flag)
 
 int rl_create_db(rlite *db)
 {
-	int retval, i;
-	RL_CALL(rl_ensure_pages, RL_OK, db);
+	int retval = RL_OK, i;
 	db->initial_next_empty_page =
 	db->next_empty_page = 1;
 	db->initial_number_of_pages =
@@ -396,6 +972,10 @@ int rl_create_db(rlite *db)
 	db->selected_internal = RLITE_INTERNAL_DB_NO;
 	db->initial_number_of_databases =
 	db->number_of_databases = 16;
+	db->change_counter = 0;
+	db->initial_freelist =
+	db->freelist = 0;
+	db->legacy_keys = 0;
 	RL_MALLOC(db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 	RL_MALLOC(db->initial_databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 	for (i = 0; i < db->number_of_databases + RLITE_INTERNAL_DB_COUNT; i++) {
@@ -424,7 +1004,7 @@ int rl_get_key_btree(rlite *db, rl_btree **retbtree, int create)
 			return RL_NOT_FOUND;
 		}
 		rl_btree *btree;
-		RL_CALL(rl_btree_create, RL_OK, db, &btree, &rl_btree_type_hash_sha1_key);
+		RL_CALL(rl_key_btree_create, RL_OK, db, &btree);
 		db->databases[selected_database] = db->next_empty_page;
 		RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_key, db->databases[selected_database], btree);
 	}
@@ -437,23 +1017,24 @@ cleanup:
 
 int rl_read_header(rlite *db)
 {
-	db->page_size = HEADER_SIZE;
 	int retval;
 	if (db->driver_type == RL_MEMORY_DRIVER) {
-		db->page_size = DEFAULT_PAGE_SIZE;
+		db->page_size = db->create_page_size;
 		RL_CALL(rl_create_db, RL_OK, db);
 	}
 	else if (db->driver_type == RL_FILE_DRIVER) {
-		RL_CALL(file_driver_fp, RL_OK, db);
-		RL_CALL(rl_apply_wal, RL_OK, db);
-		retval = rl_read(db, &rl_data_type_header, 0, NULL, NULL, 1);
-		if (retval == RL_NOT_FOUND && rl_has_flag(db, RLITE_OPEN_CREATE)) {
-			db->page_size = DEFAULT_PAGE_SIZE;
-			RL_CALL(rl_create_db, RL_OK, db);
-			RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
-		}
-		else if (retval != RL_FOUND) {
-			goto cleanup;
+		// locking the file reads the header if it changed since last time
+		RL_CALL(file_driver_open, RL_OK, db);
+		if (db->page_cache_change_counter == -1) {
+			retval = file_driver_read_header(db);
+			if (retval == RL_NOT_FOUND && rl_has_flag(db, RLITE_OPEN_CREATE)) {
+				db->page_size = db->create_page_size;
+				RL_CALL(rl_create_db, RL_OK, db);
+				RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+			}
+			else if (retval != RL_OK) {
+				goto cleanup;
+			}
 		}
 	} else {
 		fprintf(stderr, "Unknown driver type %d\n", db->driver_type);
@@ -471,113 +1052,57 @@ void print_cache(rlite *db)
 	printf("Cache read pages:");
 	long i;
 	rl_page *page;
-	for (i = 0; i < db->read_pages_len; i++) {
-		page = db->read_pages[i];
+	for (i = 0; i < db->read_pages->len; i++) {
+		page = db->read_pages->pages[i];
 		printf("%ld, ", page->page_number);
 	}
 	printf("\nCache write pages:");
-	for (i = 0; i < db->write_pages_len; i++) {
-		page = db->write_pages[i];
+	for (i = 0; i < db->write_pages.len; i++) {
+		page = db->write_pages.pages[i];
 		printf("%ld, ", page->page_number);
 	}
 	printf("\n");
 }
 #endif
 
-#ifdef RL_DEBUG
-int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len)
-#else
-static int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len)
-#endif
+static int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, rl_page **_page, void *context, rl_page_cache *cache)
 {
-	long pos, min = 0, max = page_len - 1;
-	rl_page *page;
-	if (max >= 0) {
-		do {
-			pos = min + (max - min) / 2;
-			page = pages[pos];
-			if (page->page_number == page_number) {
-				if (obj) {
-					if (page->type == NULL) {
-						// This happens when we are in read-only mode, and have a wal file
-						unsigned char *serialize_data = page->obj;
-						int retval = type->deserialize(db, &page->obj, context, serialize_data);
-						if (retval != RL_OK) {
-							return retval;
-						}
-						page->type = type;
-						rl_free(serialize_data);
-					}
-					*obj = page->obj;
-#ifdef RL_DEBUG
-				if (page->type != &rl_data_type_long && type != &rl_data_type_long && type != NULL && page->type != type) {
-					fprintf(stderr, "Type of page in cache (%s) doesn't match the asked one (%s)\n", page->type->name, type->name);
-					return RL_UNEXPECTED;
-				}
-#endif
-				}
-				if (position) {
-					*position = pos;
-				}
-				return RL_FOUND;
-			}
-			else if (page->page_number > page_number) {
-				max = pos - 1;
-			}
-			else {
-				min = pos + 1;
+	rl_page *page = rl_page_cache_get(cache, page_number);
+	if (!page) {
+		return RL_NOT_FOUND;
+	}
+	if (obj) {
+		if (page->type == NULL) {
+			// This happens when we are in read-only mode, and have a wal file,
+			// or for resident pages restored by a rollback
+			unsigned char *serialize_data = page->obj;
+			int retval = type->deserialize(db, &page->obj, context ? context : type, serialize_data);
+			if (retval != RL_OK) {
+				return retval;
 			}
+			page->type = type;
+			rl_free(serialize_data);
 		}
-		while (max >= min);
-		if (position) {
-			if (pages[pos]->page_number > page_number && pos > 0) {
-				pos--;
-			}
-			if (pages[pos]->page_number < page_number && pos < page_len) {
-				pos++;
-			}
+		*obj = page->obj;
 #ifdef RL_DEBUG
-			long i, prev;
-			rl_page *p;
-			for (i = 0; i < db->read_pages_len; i++) {
-				p = db->read_pages[i];
-				if (i > 0) {
-					if (prev >= p->page_number) {
-						fprintf(stderr, "Reading cache is broken\n");
-						print_cache(db);
-						return RL_UNEXPECTED;
-					}
-				}
-				prev = p->page_number;
-			}
-			for (i = 0; i < db->write_pages_len; i++) {
-				p = db->write_pages[i];
-				if (i > 0) {
-					if (prev >= p->page_number) {
-						fprintf(stderr, "Writing cache is broken\n");
-						print_cache(db);
-						return RL_UNEXPECTED;
-					}
-				}
-				prev = p->page_number;
-			}
-#endif
-			*position = pos;
+		if (page->type != &rl_data_type_long && type != &rl_data_type_long && type != NULL && page->type != type) {
+			fprintf(stderr, "Type of page in cache (%s) doesn't match the asked one (%s)\n", page->type->name, type->name);
+			return RL_UNEXPECTED;
 		}
+#endif
 	}
-	else {
-		if (position) {
-			*position = 0;
-		}
+	if (_page) {
+		*_page = page;
 	}
-	return RL_NOT_FOUND;
+	page->last_access = ++db->page_cache_clock;
+	return RL_FOUND;
 }
 
 int rl_read_from_cache(rlite *db, rl_data_type *type, long page_number, void *context, void **obj)
 {
-	int retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->write_pages, db->write_pages_len);
+	int retval = rl_search_cache(db, type, page_number, obj, NULL, context, &db->write_pages);
 	if (retval == RL_NOT_FOUND) {
-		retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->read_pages, db->read_pages_len);
+		retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->read_pages);
 	}
 	return retval;
 }
@@ -586,7 +1111,6 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 {
 	// fprintf(stderr, "r %ld %s\n", page, type->name);
 #ifdef RL_DEBUG
-	int keep = 0;
 	long initial_page_size = db->page_size;
 	if (page == 0 && type != &rl_data_type_header) {
 		VALGRIND_PRINTF_BACKTRACE("Unexpected");
@@ -594,19 +1118,34 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 	}
 #endif
 	unsigned char *data = NULL;
-	int retval;
+	int retval, mapped = 0;
 	unsigned char *serialize_data;
+	rl_page *cached;
+	if (db->shared) {
+		RL_CALL(rl_shared_lock, RL_OK, db, db->read_snapshot ? RLITE_FLOCK_SH : RLITE_FLOCK_EX);
+	}
+	if (db->driver_type == RL_FILE_DRIVER) {
+		// even if the page is cached, the file must be locked and the cache
+		// validated before using it
+		RL_CALL(file_driver_open, RL_OK, db);
+	}
+	else if (cache && !db->read_snapshot && rl_is_resident(db)) {
+		// the caller may modify the page in place
+		RL_CALL(rl_resident_save, RL_OK, db, page);
+	}
+	rl_cache_lock(db);
 	retval = rl_read_from_cache(db, type, page, context, obj);
+	rl_cache_unlock(db);
 	if (retval != RL_NOT_FOUND) {
 		if (!cache) {
-			RL_MALLOC(serialize_data, db->page_size * sizeof(unsigned char));
+			RL_ARENA_MALLOC(&db->arena, serialize_data, db->page_size * sizeof(unsigned char));
 			retval = type->serialize(db, *obj, serialize_data);
 			if (retval != RL_OK) {
-				rl_free(serialize_data);
+				rl_arena_free(&db->arena, serialize_data);
 				return retval;
 			}
 			retval = type->deserialize(db, obj, context, serialize_data);
-			rl_free(serialize_data);
+			rl_arena_free(&db->arena, serialize_data);
 			if (retval != RL_OK) {
 				return retval;
 			}
@@ -614,12 +1153,42 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		}
 		return retval;
 	}
-	RL_MALLOC(data, db->page_size * sizeof(unsigned char));
 	if (db->driver_type == RL_FILE_DRIVER) {
 		rl_file_driver *driver = db->driver;
-		RL_CALL(file_driver_fp, RL_OK, db);
-		fseek(driver->fp, page * db->page_size, SEEK_SET);
-		size_t read = fread(data, sizeof(unsigned char), db->page_size, driver->fp);
+		size_t read;
+		retval = RL_NOT_FOUND;
+		if (driver->log->frames > 0) {
+			// the latest committed version of the page may be in the log
+			RL_ARENA_MALLOC(&db->arena, data, db->page_size * sizeof(unsigned char));
+			retval = rl_wal_log_read(db, page, data);
+			if (retval != RL_FOUND && retval != RL_NOT_FOUND) {
+				goto cleanup;
+			}
+			read = db->page_size;
+		}
+		if (retval == RL_NOT_FOUND && driver->io->map) {
+			rl_arena_free(&db->arena, data);
+			// deserialize straight from the mapped file
+			RL_CALL(driver->io->map, RL_OK, driver->handle, (long long)page * db->page_size, db->page_size, &data);
+			read = data ? (size_t)db->page_size : 0;
+			mapped = data != NULL;
+#ifdef RL_DEBUG
+			if (mapped) {
+				// checked against the copy kept with the cached page
+				serialize_data = data;
+				data = NULL;
+				mapped = 0;
+				RL_ARENA_MALLOC(&db->arena, data, db->page_size * sizeof(unsigned char));
+				memcpy(data, serialize_data, db->page_size);
+			}
+#endif
+		}
+		else if (retval == RL_NOT_FOUND) {
+			if (!data) {
+				RL_ARENA_MALLOC(&db->arena, data, db->page_size * sizeof(unsigned char));
+			}
+			RL_CALL(driver->io->read, RL_OK, driver->handle, data, db->page_size, (long long)page * db->page_size, &read);
+		}
 		if (read != (size_t)db->page_size) {
 			if (page > 0) {
 #ifdef RL_DEBUG
@@ -634,12 +1203,14 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 	}
 	else if (db->driver_type == RL_MEMORY_DRIVER) {
 		rl_memory_driver *driver = db->driver;
-		if ((page + 1) * db->page_size > driver->datalen) {
+		data = driver->resident ? NULL : rl_page_store_get(&driver->store, page);
+		if (!data) {
 			fprintf(stderr, "Unable to read page %ld on line %d\n", page, __LINE__);
 			retval = RL_NOT_FOUND;
 			goto cleanup;
 		}
-		memcpy(data, &driver->data[page * db->page_size], sizeof(unsigned char) * db->page_size);
+		// deserialized where it is stored, like a mapped file
+		mapped = 1;
 	}
 	else {
 		fprintf(stderr, "Unexpected driver %d when asking for page %ld\n", db->driver_type, page);
@@ -647,21 +1218,12 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		goto cleanup;
 	}
 
-	long pos;
-	retval = rl_search_cache(db, type, page, NULL, &pos, context, db->read_pages, db->read_pages_len);
-	if (retval != RL_NOT_FOUND) {
-		fprintf(stderr, "Unexpectedly found page in cache\n");
-		retval = RL_UNEXPECTED;
-		goto cleanup;
-	}
-
 	retval = type->deserialize(db, obj, context ? context : type, data);
 	if (retval != RL_OK) {
 		goto cleanup;
 	}
 
 	if (cache) {
-		rl_ensure_pages(db);
 		rl_page *page_obj;
 		page_obj = rl_malloc(sizeof(*page_obj));
 		if (!page_obj) {
@@ -677,22 +1239,18 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		page_obj->page_number = page;
 		page_obj->type = type;
 		page_obj->obj = obj ? *obj : NULL;
+		page_obj->last_access = ++db->page_cache_clock;
 #ifdef RL_DEBUG
-		keep = 1;
-		if (initial_page_size != db->page_size) {
-			page_obj->serialized_data = rl_realloc(data, db->page_size * sizeof(unsigned char));
-			if (page_obj->serialized_data == NULL) {
-				rl_free(page_obj);
-				retval = RL_OUT_OF_MEMORY;
-				goto cleanup;
-			}
-			data = page_obj->serialized_data;
-			if (db->page_size > initial_page_size) {
-				memset(&data[initial_page_size], 0, db->page_size - initial_page_size);
-			}
+		page_obj->serialized_data = rl_malloc(db->page_size * sizeof(unsigned char));
+		if (page_obj->serialized_data == NULL) {
+			rl_free(page_obj);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
 		}
-		else {
-			page_obj->serialized_data = data;
+		// reading the header may have changed the page size
+		memcpy(page_obj->serialized_data, data, initial_page_size < db->page_size ? initial_page_size : db->page_size);
+		if (db->page_size > initial_page_size) {
+			memset(&page_obj->serialized_data[initial_page_size], 0, db->page_size - initial_page_size);
 		}
 
 		serialize_data = calloc(db->page_size, sizeof(unsigned char));
@@ -704,49 +1262,162 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		if (retval != RL_OK) {
 			goto cleanup;
 		}
-		if (memcmp(data, serialize_data, db->page_size) != 0) {
+		if (memcmp(page_obj->serialized_data, serialize_data, db->page_size) != 0) {
 			fprintf(stderr, "serialize unserialized data mismatch\n");
 			long i;
 			for (i = 0; i < db->page_size; i++) {
-				if (serialize_data[i] != data[i]) {
-					fprintf(stderr, "at position %ld expected %d, got %d\n", i, serialize_data[i], data[i]);
+				if (serialize_data[i] != page_obj->serialized_data[i]) {
+					fprintf(stderr, "at position %ld expected %d, got %d\n", i, serialize_data[i], page_obj->serialized_data[i]);
 				}
 			}
 		}
 		rl_free(serialize_data);
 #endif
-		if (pos < db->read_pages_len) {
-			memmove(&db->read_pages[pos + 1], &db->read_pages[pos], sizeof(rl_page *) * (db->read_pages_len - pos));
+		rl_cache_lock(db);
+		cached = db->shared_locked == RLITE_FLOCK_SH ? rl_page_cache_get(db->read_pages, page) : NULL;
+		if (cached) {
+			// another reader cached the page meanwhile, theirs may be in use
+			retval = RL_FOUND;
+			if (obj) {
+				if (type->destroy && *obj) {
+					type->destroy(db, *obj);
+				}
+				retval = rl_search_cache(db, type, page, obj, NULL, context, db->read_pages);
+			}
+			rl_cache_unlock(db);
+#ifdef RL_DEBUG
+			rl_free(page_obj->serialized_data);
+#endif
+			rl_free(page_obj);
+			goto cleanup;
+		}
+		retval = rl_page_cache_add(db->read_pages, page_obj);
+		rl_cache_unlock(db);
+		if (retval != RL_OK) {
+#ifdef RL_DEBUG
+			rl_free(page_obj->serialized_data);
+#endif
+			rl_free(page_obj);
+			if (obj) {
+				if (type->destroy && *obj) {
+					type->destroy(db, *obj);
+				}
+				*obj = NULL;
+			}
+			goto cleanup;
 		}
-		db->read_pages[pos] = page_obj;
-		db->read_pages_len++;
 	}
 	if (retval == RL_OK) {
 		retval = RL_FOUND;
 	}
 cleanup:
-#ifdef RL_DEBUG
-	if (retval != RL_FOUND || !keep) {
-		rl_free(data);
+	if (!mapped) {
+		rl_arena_free(&db->arena, data);
 	}
-#endif
-#ifndef RL_DEBUG
-	rl_free(data);
-#endif
 	return retval;
 }
 
-int rl_alloc_page_number(rlite *db, long *_page_number)
+// a page as it was last written, serialized in `data`
+static int rl_cached_page_copy(rlite *db, long page_number, unsigned char *data, int *found)
 {
+	rl_page *page = rl_page_cache_get(&db->write_pages, page_number);
 	int retval = RL_OK;
-	long page_number = db->next_empty_page;
-	if (page_number == db->number_of_pages) {
-		db->next_empty_page++;
-		db->number_of_pages++;
+	if (!page || !page->obj) {
+		page = rl_page_cache_get(db->read_pages, page_number);
+	}
+	*found = page && page->obj;
+	if (!*found) {
+		goto cleanup;
+	}
+	if (page->type == NULL) {
+		memcpy(data, page->obj, db->page_size);
 	}
 	else {
-		RL_CALL(rl_long_get, RL_OK, db, &db->next_empty_page, db->next_empty_page);
+		memset(data, 0, db->page_size);
+		RL_CALL(page->type->serialize, RL_OK, db, page->obj, data);
+	}
+cleanup:
+	return retval;
+}
+
+int rl_read_pages(struct rlite *db, long page, long offset, long size, unsigned char *data)
+{
+	unsigned char *scratch = NULL, *stored;
+	long pos = 0, len, run;
+	size_t read;
+	int retval = RL_OK, found;
+	page += offset / db->page_size;
+	offset %= db->page_size;
+	if (db->shared) {
+		RL_CALL(rl_shared_lock, RL_OK, db, db->read_snapshot ? RLITE_FLOCK_SH : RLITE_FLOCK_EX);
+	}
+	if (db->driver_type == RL_FILE_DRIVER) {
+		RL_CALL(file_driver_open, RL_OK, db);
+	}
+	RL_ARENA_MALLOC(&db->arena, scratch, db->page_size);
+	while (pos < size) {
+		len = db->page_size - offset < size - pos ? db->page_size - offset : size - pos;
+		run = 1;
+		rl_cache_lock(db);
+		retval = rl_cached_page_copy(db, page, scratch, &found);
+		rl_cache_unlock(db);
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+		if (!found && db->driver_type == RL_FILE_DRIVER) {
+			rl_file_driver *driver = db->driver;
+			if (driver->log->frames > 0) {
+				RL_CALL2(rl_wal_log_read, RL_FOUND, RL_NOT_FOUND, db, page, scratch);
+				found = retval == RL_FOUND;
+				retval = RL_OK;
+			}
+			if (!found) {
+				// the following pages nobody has a newer version of are read
+				// along with this one
+				rl_cache_lock(db);
+				while (pos + len < size && driver->log->frames == 0 &&
+						!rl_page_cache_get(&db->write_pages, page + run) &&
+						!rl_page_cache_get(db->read_pages, page + run)) {
+					len += db->page_size < size - pos - len ? db->page_size : size - pos - len;
+					run++;
+				}
+				rl_cache_unlock(db);
+				RL_CALL(driver->io->read, RL_OK, driver->handle, &data[pos], len, (long long)page * db->page_size + offset, &read);
+				if (read != (size_t)len) {
+					retval = RL_NOT_FOUND;
+					goto cleanup;
+				}
+			}
+		}
+		else if (!found && !rl_is_resident(db)) {
+			stored = rl_page_store_get(&((rl_memory_driver *)db->driver)->store, page);
+			if (!stored) {
+				retval = RL_NOT_FOUND;
+				goto cleanup;
+			}
+			memcpy(&data[pos], &stored[offset], len);
+		}
+		else if (!found) {
+			retval = RL_NOT_FOUND;
+			goto cleanup;
+		}
+		if (found) {
+			memcpy(&data[pos], &scratch[offset], len);
+		}
+		pos += len;
+		page += run;
+		offset = 0;
 	}
+cleanup:
+	rl_arena_free(&db->arena, scratch);
+	return retval;
+}
+
+int rl_alloc_page_number(rlite *db, long *_page_number)
+{
+	int retval = RL_OK;
+	long page_number = db->next_empty_page;
+	RL_CALL(rl_freelist_alloc, RL_OK, db);
 	if (_page_number) {
 		*_page_number = page_number;
 	}
@@ -754,14 +1425,22 @@ cleanup:
 	return retval;
 }
 
-int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
+static int rl_write_page(struct rlite *db, rl_data_type *type, long page_number, void *obj, int allocate)
 {
 	// fprintf(stderr, "w %ld %s\n", page_number, type->name);
-	rl_page *page = NULL;
-	long pos;
+	rl_page *page = NULL, *read_page;
 	int retval;
 
-	if (page_number == db->next_empty_page) {
+	if (db->read_snapshot) {
+		// pages in the read cache may have been modified in place already
+		db->page_cache_change_counter = -1;
+		return RL_INVALID_STATE;
+	}
+	if (db->shared) {
+		RL_CALL(rl_shared_lock, RL_OK, db, RLITE_FLOCK_EX);
+	}
+	db->write_sequence++;
+	if (allocate && page_number == db->next_empty_page) {
 		RL_CALL(rl_alloc_page_number, RL_OK, db, NULL);
 		retval = rl_write(db, &rl_data_type_header, 0, NULL);
 		if (retval != RL_OK) {
@@ -769,22 +1448,22 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 		}
 	}
 
-	retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->write_pages, db->write_pages_len);
-	if (retval == RL_FOUND) {
-		if (obj != db->write_pages[pos]->obj) {
-			if (db->write_pages[pos]->obj) {
-				db->write_pages[pos]->type->destroy(db, db->write_pages[pos]->obj);
+	page = rl_page_cache_get(&db->write_pages, page_number);
+	if (page) {
+		if (obj != page->obj) {
+			if (page->obj) {
+				page->type->destroy(db, page->obj);
 			}
-			db->write_pages[pos]->obj = obj;
-			db->write_pages[pos]->type = type;
+			page->obj = obj;
+			page->type = type;
 		}
+		page->last_access = ++db->page_cache_clock;
 		retval = RL_OK;
 	}
-	else if (retval == RL_NOT_FOUND) {
+	else {
 		if (db->driver_type == RL_FILE_DRIVER) {
-			RL_CALL(file_driver_fp, RL_OK, db);
+			RL_CALL(file_driver_open, RL_OK, db);
 		}
-		rl_ensure_pages(db);
 		RL_MALLOC(page, sizeof(*page));
 #ifdef RL_DEBUG
 		page->serialized_data = NULL;
@@ -792,27 +1471,31 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 		page->page_number = page_number;
 		page->type = type;
 		page->obj = obj;
-		if (pos < db->write_pages_len) {
-			memmove(&db->write_pages[pos + 1], &db->write_pages[pos], sizeof(rl_page *) * (db->write_pages_len - pos));
+		page->last_access = ++db->page_cache_clock;
+		retval = rl_page_cache_add(&db->write_pages, page);
+		if (retval != RL_OK) {
+			rl_free(page);
+			goto cleanup;
 		}
-		db->write_pages[pos] = page;
-		db->write_pages_len++;
 
-		retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->read_pages, db->read_pages_len);
-		if (retval == RL_FOUND) {
+		if (rl_is_resident(db)) {
+			RL_CALL(rl_resident_save, RL_OK, db, page_number);
+		}
+		read_page = rl_page_cache_remove(db->read_pages, page_number);
+		if (read_page) {
 #ifdef RL_DEBUG
-			rl_free(db->read_pages[pos]->serialized_data);
+			rl_free(read_page->serialized_data);
 #endif
-			if (db->read_pages[pos]->obj != obj) {
-				db->read_pages[pos]->type->destroy(db, db->read_pages[pos]->obj);
+			if (read_page->obj != obj) {
+				if (read_page->type == NULL) {
+					// never deserialized, see rl_search_cache
+					rl_free(read_page->obj);
+				}
+				else {
+					read_page->type->destroy(db, read_page->obj);
+				}
 			}
-			rl_free(db->read_pages[pos]);
-			memmove(&db->read_pages[pos], &db->read_pages[pos + 1], sizeof(rl_page *) * (db->read_pages_len - pos));
-			db->read_pages_len--;
-			retval = RL_OK;
-		}
-		else if (retval != RL_NOT_FOUND) {
-			goto cleanup;
+			rl_free(read_page);
 		}
 		retval = RL_OK;
 	}
@@ -830,23 +1513,47 @@ cleanup:
 	return retval;
 }
 
+int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
+{
+	return rl_write_page(db, type, page_number, obj, 1);
+}
+
+int rl_write_raw(struct rlite *db, long page_number, unsigned char *data)
+{
+	return rl_write_page(db, &rl_data_type_raw, page_number, data, 0);
+}
+
 int rl_purge_cache(struct rlite *db, long page_number)
 {
-	long pos;
-	int retval;
-	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->write_pages, db->write_pages_len);
-	if (retval == RL_FOUND) {
-		db->write_pages[pos]->obj = NULL;
+	rl_page *page;
+	page = rl_page_cache_get(&db->write_pages, page_number);
+	if (page) {
+		page->obj = NULL;
 	}
-	else if (retval != RL_NOT_FOUND) {
-		goto cleanup;
+	if (rl_is_resident(db)) {
+		rl_resident_save(db, page_number);
 	}
-	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->read_pages, db->read_pages_len);
-	if (retval == RL_FOUND) {
-		db->read_pages[pos]->obj = NULL;
+	page = rl_page_cache_get(db->read_pages, page_number);
+	if (page) {
+		page->obj = NULL;
 	}
-	else if (retval != RL_NOT_FOUND) {
-		goto cleanup;
+	return RL_OK;
+}
+
+int rl_cache_drop(struct rlite *db, long page_number)
+{
+	rl_page *page;
+	int retval;
+	page = rl_page_cache_remove(&db->write_pages, page_number);
+	if (page) {
+		rl_page_destroy(db, page);
+	}
+	if (rl_is_resident(db)) {
+		RL_CALL(rl_resident_save, RL_OK, db, page_number);
+	}
+	page = rl_page_cache_remove(db->read_pages, page_number);
+	if (page) {
+		rl_page_destroy(db, page);
 	}
 	retval = RL_OK;
 cleanup:
@@ -856,14 +1563,23 @@ cleanup:
 int rl_delete(struct rlite *db, long page_number)
 {
 	int retval, i;
+	if (db->read_snapshot) {
+		db->page_cache_change_counter = -1;
+		return RL_INVALID_STATE;
+	}
+	if (db->shared) {
+		RL_CALL(rl_shared_lock, RL_OK, db, RLITE_FLOCK_EX);
+	}
+	db->write_sequence++;
+	// free pages are not written until they are reused
+	RL_CALL(rl_cache_drop, RL_OK, db, page_number);
 	for (i = 0; i < db->number_of_databases + RLITE_INTERNAL_DB_COUNT; i++) {
 		if (db->databases[i] == page_number) {
 			db->databases[i] = 0;
 			RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
 		}
 	}
-	RL_CALL(rl_long_set, RL_OK, db, db->next_empty_page, page_number);
-	db->next_empty_page = page_number;
+	RL_CALL(rl_freelist_free, RL_OK, db, page_number);
 cleanup:
 	return retval;
 }
@@ -876,7 +1592,7 @@ int rl_dirty_hash(struct rlite *db, unsigned char **hash)
 	SHA1_CTX sha;
 	unsigned char *data = NULL;
 
-	if (db->write_pages_len == 0) {
+	if (db->write_pages.len == 0) {
 		*hash = NULL;
 		goto cleanup;
 	}
@@ -884,8 +1600,8 @@ int rl_dirty_hash(struct rlite *db, unsigned char **hash)
 	RL_MALLOC(data, db->page_size * sizeof(unsigned char));
 	RL_MALLOC(*hash, sizeof(unsigned char) * 20);
 	SHA1Init(&sha);
-	for (i = 0; i < db->write_pages_len; i++) {
-		page = db->write_pages[i];
+	for (i = 0; i < db->write_pages.len; i++) {
+		page = db->write_pages.pages[i];
 		memset(data, 0, db->page_size);
 		if (page->type) {
 			retval = page->type->serialize(db, page->obj, data);
@@ -902,66 +1618,420 @@ cleanup:
 	return retval;
 }
 
+static void rl_page_destroy(struct rlite *db, rl_page *page)
+{
+	if (page->type == NULL) {
+		// read only, from wal
+		rl_free(page->obj);
+	} else if (page->type->destroy && page->obj) {
+		page->type->destroy(db, page->obj);
+	}
+#ifdef RL_DEBUG
+	rl_free(page->serialized_data);
+#endif
+	rl_free(page);
+}
+
+int rl_set_page_cache_size(struct rlite *db, long page_cache_size)
+{
+	if (page_cache_size < 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	// the cache is trimmed when the current transaction ends
+	db->page_cache_size = page_cache_size;
+	return RL_OK;
+}
+
+int rl_set_io(struct rlite *db, rl_io_ops *io)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		return RL_INVALID_PARAMETERS;
+	}
+	driver = db->driver;
+	RL_CALL(rl_discard, RL_OK, db);
+	if (driver->handle) {
+		if (driver->locked) {
+			RL_CALL(file_driver_unlock, RL_OK, db);
+		}
+		driver->io->close(driver->handle);
+		driver->handle = NULL;
+		driver->locked = 0;
+	}
+	// the file is opened with the new backend by the next transaction
+	driver->io = io;
+cleanup:
+	return retval;
+}
+
+static void rl_cache_destroy(struct rlite *db)
+{
+	long i;
+	for (i = 0; i < db->read_pages->len; i++) {
+		rl_page_destroy(db, db->read_pages->pages[i]);
+	}
+	rl_page_cache_reset(db->read_pages);
+}
+
+int rl_cache_clear(struct rlite *db)
+{
+	if (rl_is_resident(db)) {
+		// there is nowhere else to read the pages from
+		return RL_OK;
+	}
+	rl_cache_destroy(db);
+	// pages read from now on are validated by the next header read
+	db->page_cache_change_counter = -1;
+	return RL_OK;
+}
+
+int rl_is_resident(struct rlite *db)
+{
+	return db->driver_type == RL_MEMORY_DRIVER && ((rl_memory_driver *)db->driver)->resident;
+}
+
+/**
+ * Keeps the image of a resident page before the transaction uses it, unless
+ * it already did.
+ */
+static int rl_resident_save(struct rlite *db, long page_number)
+{
+	int retval = RL_OK;
+	rl_page *page, *undo;
+	unsigned char *data;
+	if (rl_page_cache_get(&db->undo_pages, page_number)) {
+		return RL_OK;
+	}
+	page = rl_page_cache_get(db->read_pages, page_number);
+	if (!page) {
+		return RL_OK;
+	}
+	RL_ARENA_MALLOC(&db->arena, undo, sizeof(*undo) + db->page_size);
+	data = (unsigned char *)(undo + 1);
+	if (page->type == NULL) {
+		// not deserialized since it was last restored
+		memcpy(data, page->obj, db->page_size);
+	}
+	else {
+		memset(data, 0, db->page_size);
+		if (page->obj) {
+			RL_CALL(page->type->serialize, RL_OK, db, page->obj, data);
+		}
+	}
+	undo->page_number = page_number;
+	undo->type = page->type;
+	undo->obj = page->obj ? data : NULL;
+	RL_CALL(rl_page_cache_add, RL_OK, &db->undo_pages, undo);
+cleanup:
+	return retval;
+}
+
+// resident pages past the end are no longer used, like the end of a file
+static void rl_resident_truncate(struct rlite *db)
+{
+	long i;
+	rl_page *page;
+	for (i = db->read_pages->len - 1; i >= 0; i--) {
+		page = db->read_pages->pages[i];
+		if (page->page_number >= db->number_of_pages) {
+			rl_page_cache_remove(db->read_pages, page->page_number);
+			rl_page_destroy(db, page);
+		}
+	}
+}
+
+/**
+ * Puts back the pages used by a transaction that is rolled back. They are
+ * left serialized, like the pages of a wal, to be deserialized by the next
+ * read with the right context.
+ */
+static int rl_resident_restore(struct rlite *db)
+{
+	int retval = RL_OK;
+	long i;
+	rl_page *undo, *page;
+	for (i = 0; i < db->undo_pages.len; i++) {
+		undo = db->undo_pages.pages[i];
+		page = rl_page_cache_remove(db->read_pages, undo->page_number);
+		if (page) {
+			rl_page_destroy(db, page);
+		}
+		if (!undo->obj) {
+			continue;
+		}
+		RL_MALLOC(page, sizeof(*page));
+		page->page_number = undo->page_number;
+		page->type = NULL;
+		page->last_access = ++db->page_cache_clock;
+		page->obj = rl_malloc(db->page_size);
+#ifdef RL_DEBUG
+		page->serialized_data = rl_malloc(db->page_size);
+		if (page->serialized_data) {
+			memcpy(page->serialized_data, undo->obj, db->page_size);
+		}
+#endif
+		if (!page->obj) {
+			rl_page_destroy(db, page);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(page->obj, undo->obj, db->page_size);
+		retval = rl_page_cache_add(db->read_pages, page);
+		if (retval != RL_OK) {
+			rl_page_destroy(db, page);
+			goto cleanup;
+		}
+	}
+cleanup:
+	rl_page_cache_reset(&db->undo_pages);
+	return retval;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+/**
+ * Drops the pages that cannot be reused by the next transaction and, if there
+ * are more than page_cache_size left, the least recently used ones.
+ */
+static int rl_cache_trim(struct rlite *db)
+{
+	int retval = RL_OK;
+	long i, j, min_access = 0, *access = NULL;
+	rl_page *page;
+
+	if (rl_is_resident(db)) {
+		return RL_OK;
+	}
+	if (db->read_pages->len > db->page_cache_size && db->page_cache_size > 0) {
+		access = rl_malloc(sizeof(long) * db->read_pages->len);
+		if (!access) {
+			rl_cache_clear(db);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		for (i = 0; i < db->read_pages->len; i++) {
+			access[i] = db->read_pages->pages[i]->last_access;
+		}
+		qsort(access, db->read_pages->len, sizeof(long), compare_long);
+		min_access = access[db->read_pages->len - db->page_cache_size];
+	}
+
+	for (i = j = 0; i < db->read_pages->len; i++) {
+		page = db->read_pages->pages[i];
+		// the header is never kept, it has to be read by every transaction
+		// to know whether another connection changed the file
+		if (page->page_number == 0 || page->type == NULL || page->obj == NULL ||
+				db->page_cache_size == 0 || page->last_access < min_access) {
+			rl_page_destroy(db, page);
+		}
+		else {
+			db->read_pages->pages[j++] = page;
+		}
+	}
+	if (j != db->read_pages->len) {
+		db->read_pages->len = j;
+		if (rl_page_cache_reindex(db->read_pages) != RL_OK) {
+			rl_cache_clear(db);
+			retval = RL_OUT_OF_MEMORY;
+		}
+	}
+cleanup:
+	rl_free(access);
+	return retval;
+}
+
+/**
+ * Moves the committed write pages into the read cache, so the next
+ * transaction can use them without reading them again.
+ */
+static int rl_cache_promote_write_pages(struct rlite *db)
+{
+	int retval = RL_OK;
+	long i;
+	rl_page *page;
+
+	for (i = 0; i < db->write_pages.len; i++) {
+		page = db->write_pages.pages[i];
+		if (retval != RL_OK || page->page_number == 0 || page->type == NULL || page->obj == NULL) {
+			rl_page_destroy(db, page);
+			continue;
+		}
+#ifdef RL_DEBUG
+		page->serialized_data = calloc(db->page_size, sizeof(unsigned char));
+		if (!page->serialized_data) {
+			rl_page_destroy(db, page);
+			continue;
+		}
+		page->type->serialize(db, page->obj, page->serialized_data);
+#endif
+		if (page->type == &rl_data_type_raw) {
+			// deserialized by the next read, which knows its type
+			page->type = NULL;
+		}
+		page->last_access = ++db->page_cache_clock;
+		retval = rl_page_cache_add(db->read_pages, page);
+		if (retval != RL_OK) {
+			rl_page_destroy(db, page);
+		}
+	}
+	rl_page_cache_reset(&db->write_pages);
+	return retval;
+}
+
+static int rl_commit_transaction(struct rlite *db)
+{
+	int retval;
+	if (db->read_snapshot) {
+		// a failed write may have left the cache untrusted, see rl_write
+		return rl_discard(db);
+	}
+	if (db->write_pages.len > 0) {
+		// let other connections know their cached pages are no longer valid
+		db->change_counter++;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+		if (db->backups) {
+			RL_CALL(rl_backup_update, RL_OK, db);
+		}
+	}
+	RL_CALL(rl_write_apply_wal, RL_OK, db);
+	if (rl_is_resident(db) && db->number_of_pages < db->initial_number_of_pages) {
+		rl_resident_truncate(db);
+	}
+	db->page_cache_change_counter = db->change_counter;
+	if (db->shared) {
+		RL_CALL(rl_shared_publish, RL_OK, db);
+	}
+	db->initial_next_empty_page = db->next_empty_page;
+	db->initial_number_of_pages = db->number_of_pages;
+	db->initial_freelist = db->freelist;
+	db->initial_number_of_databases = db->number_of_databases;
+	rl_free(db->initial_databases);
+	RL_MALLOC(db->initial_databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
+	memcpy(db->initial_databases, db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
+	if (rl_cache_promote_write_pages(db) != RL_OK) {
+		rl_cache_clear(db);
+	}
+	// nothing to roll back anymore
+	rl_page_cache_reset(&db->undo_pages);
+	rl_discard(db);
+cleanup:
+	return retval;
+}
+
 int rl_commit(struct rlite *db)
 {
-	int retval;
-	RL_CALL(rl_write_apply_wal, RL_OK, db);
-	db->initial_next_empty_page = db->next_empty_page;
-	db->initial_number_of_pages = db->number_of_pages;
-	db->initial_number_of_databases = db->number_of_databases;
-	rl_free(db->initial_databases);
-	RL_MALLOC(db->initial_databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
-	memcpy(db->initial_databases, db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
-	rl_discard(db);
-cleanup:
-	return retval;
+	if ((db->group_commit_max_commits || db->group_commit_max_pages || db->group_commit_max_delay) &&
+			db->write_pages.len > 0) {
+		if (db->group_commits++ == 0) {
+			db->group_commit_start = rl_mstime();
+		}
+		if ((!db->group_commit_max_commits || db->group_commits < db->group_commit_max_commits) &&
+				(!db->group_commit_max_pages || db->write_pages.len < db->group_commit_max_pages) &&
+				(!db->group_commit_max_delay || rl_mstime() < db->group_commit_start + db->group_commit_max_delay)) {
+			return RL_OK;
+		}
+	}
+	return rl_commit_transaction(db);
+}
+
+int rl_flush(struct rlite *db)
+{
+	if (db->group_commits == 0) {
+		return RL_OK;
+	}
+	return rl_commit_transaction(db);
+}
+
+int rl_set_group_commit(struct rlite *db, long max_commits, long max_pages, long max_delay)
+{
+	if (max_commits < 0 || max_pages < 0 || max_delay < 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	db->group_commit_max_commits = max_commits;
+	db->group_commit_max_pages = max_pages;
+	db->group_commit_max_delay = max_delay;
+	if (!max_commits && !max_pages && !max_delay) {
+		return rl_flush(db);
+	}
+	return RL_OK;
+}
+
+int rl_set_sync(struct rlite *db, int sync)
+{
+	if (sync < RLITE_SYNC_OFF || sync > RLITE_SYNC_FULL) {
+		return RL_INVALID_PARAMETERS;
+	}
+	db->sync = sync;
+	return RL_OK;
+}
+
+int rl_set_busy_timeout(struct rlite *db, long busy_timeout)
+{
+	if (busy_timeout < 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	db->busy_timeout = busy_timeout;
+	return RL_OK;
 }
 
 int rl_discard(struct rlite *db)
 {
 	long i;
-	void *tmp;
 	int retval = RL_OK;
+	// other threads may be reading the cache of a shared database
+	int own_cache = db->read_pages && (!db->shared || db->shared_locked == RLITE_FLOCK_EX);
 
-	rl_page *page;
+	db->group_commits = 0;
+	db->read_snapshot = 0;
 
 	if (db->driver_type == RL_FILE_DRIVER) {
 		rl_file_driver *driver = db->driver;
-		if (driver->fp) {
-			RL_CALL(rl_flock, RL_OK, driver->fp, RLITE_FLOCK_UN);
-			fclose(driver->fp);
-			driver->fp = NULL;
+		// the file stays open, the next transaction only needs to lock it
+		if (driver->handle && driver->locked && !rl_has_flag(db, RLITE_OPEN_EXCLUSIVE)) {
+			RL_CALL(file_driver_unlock, RL_OK, db);
+			driver->locked = 0;
 		}
 	}
 
-	for (i = 0; i < db->read_pages_len; i++) {
-		page = db->read_pages[i];
-		if (page->type == NULL) {
-			// read only, from wal
-			rl_free(page->obj);
-		} else if (page->type->destroy && page->obj) {
-			page->type->destroy(db, page->obj);
+	if (!own_cache) {
+		if (db->shared_locked && db->page_cache_change_counter == -1) {
+			pthread_mutex_lock(&db->shared->mutex);
+			db->shared->cache_stale = 1;
+			pthread_mutex_unlock(&db->shared->mutex);
 		}
-#ifdef RL_DEBUG
-		rl_free(page->serialized_data);
-#endif
-		rl_free(page);
 	}
-	for (i = 0; i < db->write_pages_len; i++) {
-		page = db->write_pages[i];
-		if (page->type && page->type->destroy && page->obj) {
-			page->type->destroy(db, page->obj);
-		}
-#ifdef RL_DEBUG
-		rl_free(page->serialized_data);
-#endif
-		rl_free(page);
+	else if (db->write_pages.len > 0 && rl_is_resident(db)) {
+		rl_resident_restore(db);
+	}
+	else if (db->write_pages.len > 0) {
+		// rolling back a transaction, pages in the read cache may have been
+		// modified in place before being written
+		rl_cache_clear(db);
+	}
+	else if (db->driver_type == RL_FILE_DRIVER && db->page_cache_change_counter == -1) {
+		// pages were read without checking the header, they cannot be
+		// trusted once the lock is released
+		rl_cache_clear(db);
 	}
-	db->read_pages_len = 0;
-	db->write_pages_len = 0;
+	for (i = 0; i < db->write_pages.len; i++) {
+		rl_page_destroy(db, db->write_pages.pages[i]);
+	}
+	rl_page_cache_reset(&db->write_pages);
+	// the images are in the arena
+	rl_page_cache_reset(&db->undo_pages);
+	if (own_cache) {
+		rl_cache_trim(db);
+	}
+	rl_arena_reset(&db->arena);
 
 	db->next_empty_page = db->initial_next_empty_page;
 	db->number_of_pages = db->initial_number_of_pages;
+	db->freelist = db->initial_freelist;
 	db->number_of_databases = db->initial_number_of_databases;
 	rl_free(db->databases);
 	RL_MALLOC(db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT)); // ?
@@ -969,25 +2039,48 @@ int rl_discard(struct rlite *db)
 		memcpy(db->databases, db->initial_databases, sizeof(long) *  (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 	}
 
-	if (db->read_pages_alloc != DEFAULT_READ_PAGES_LEN) {
-		tmp = rl_realloc(db->read_pages, sizeof(rl_page *) * DEFAULT_READ_PAGES_LEN);
-		if (!tmp) {
-			retval = RL_OUT_OF_MEMORY;
-			goto cleanup;
-		}
-		db->read_pages = tmp;
-		db->read_pages_alloc = DEFAULT_READ_PAGES_LEN;
+	if (own_cache) {
+		RL_CALL(rl_page_cache_shrink, RL_OK, db->read_pages, DEFAULT_READ_PAGES_LEN);
 	}
-	if (db->write_pages_alloc > 0) {
-		if (db->write_pages_alloc != DEFAULT_WRITE_PAGES_LEN) {
-			db->write_pages_alloc = DEFAULT_WRITE_PAGES_LEN;
-			tmp = rl_realloc(db->write_pages, sizeof(rl_page *) * DEFAULT_WRITE_PAGES_LEN);
-			if (!tmp) {
-				retval = RL_OUT_OF_MEMORY;
-				goto cleanup;
-			}
-			db->write_pages = tmp;
-		}
+	RL_CALL(rl_page_cache_shrink, RL_OK, &db->write_pages, DEFAULT_WRITE_PAGES_LEN);
+cleanup:
+	if (db->shared) {
+		rl_shared_unlock(db);
+	}
+	return retval;
+}
+
+/**
+ * Marks in `pages` every page used by `key`, its name and its value.
+ */
+static int rl_key_pages(rlite *db, rl_key *key, short *pages)
+{
+	int retval;
+	if (key->value_page != 0) {
+		pages[key->value_page] = 1;
+	}
+	if (key->string_page != 0) {
+		pages[key->string_page] = 1;
+		RL_CALL(rl_multi_string_pages, RL_OK, db, key->string_page, pages);
+	}
+	if (key->type == RL_TYPE_ZSET) {
+		retval = rl_zset_pages(db, key->value_page, pages);
+	}
+	else if (key->type == RL_TYPE_HASH) {
+		retval = rl_hash_pages(db, key->value_page, pages);
+	}
+	else if (key->type == RL_TYPE_SET) {
+		retval = rl_set_pages(db, key->value_page, pages);
+	}
+	else if (key->type == RL_TYPE_LIST) {
+		retval = rl_llist_pages(db, key->value_page, pages);
+	}
+	else if (key->type == RL_TYPE_STRING) {
+		retval = rl_string_pages(db, key->value_page, pages);
+	}
+	else {
+		fprintf(stderr, "Unknown type %d\n", key->type);
+		retval = RL_UNEXPECTED;
 	}
 cleanup:
 	return retval;
@@ -1014,31 +2107,7 @@ int rl_database_is_balanced(rlite *db, short *pages)
 
 	while ((retval = rl_btree_iterator_next(iterator, NULL, &tmp)) == RL_OK) {
 		key = tmp;
-		pages[key->string_page] = 1;
-		pages[key->value_page] = 1;
-		RL_CALL(rl_multi_string_pages, RL_OK, db, key->string_page, pages);
-		if (key->type == RL_TYPE_ZSET) {
-			retval = rl_zset_pages(db, key->value_page, pages);
-		}
-		else if (key->type == RL_TYPE_HASH) {
-			retval = rl_hash_pages(db, key->value_page, pages);
-		}
-		else if (key->type == RL_TYPE_SET) {
-			retval = rl_set_pages(db, key->value_page, pages);
-		}
-		else if (key->type == RL_TYPE_LIST) {
-			retval = rl_llist_pages(db, key->value_page, pages);
-		}
-		else if (key->type == RL_TYPE_STRING) {
-			retval = rl_string_pages(db, key->value_page, pages);
-		}
-		else {
-			fprintf(stderr, "Unknown type %d\n", key->type);
-			goto cleanup;
-		}
-		if (retval != RL_OK) {
-			goto cleanup;
-		}
+		RL_CALL(rl_key_pages, RL_OK, db, key, pages);
 		rl_free(tmp);
 	}
 	tmp = NULL;
@@ -1079,7 +2148,20 @@ int rl_is_balanced(rlite *db)
 
 	RL_CALL(rl_select, RL_OK, db, selected_database);
 
-	long page_number = db->next_empty_page;
+	long page_number = db->freelist;
+	rl_freelist_trunk *trunk;
+	void *obj;
+	while (page_number != 0) {
+		pages[page_number] = 1;
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_freelist_trunk, page_number, NULL, &obj, 1);
+		trunk = obj;
+		for (i = 0; i < trunk->size; i++) {
+			pages[trunk->pages[i]] = 1;
+		}
+		page_number = trunk->next;
+	}
+	retval = RL_OK;
+	page_number = db->freelist ? db->number_of_pages : db->next_empty_page;
 	while (page_number != db->number_of_pages) {
 		pages[page_number] = 1;
 		RL_CALL(rl_long_get, RL_OK, db, &page_number, page_number);
@@ -1120,17 +2202,16 @@ int rl_move(struct rlite *db, unsigned char *key, long keylen, int database)
 {
 	int retval;
 	int olddb = db->selected_database;
-	unsigned char type;
-	unsigned long long expires;
-	long value_page;
+	rl_key record;
 	// this could be more efficient, if we don't delete the value page
-	RL_CALL(rl_key_get, RL_FOUND, db, key, keylen, &type, NULL, &value_page, &expires, NULL);
+	RL_CALL(rl_key_get_record, RL_FOUND, db, key, keylen, &record);
 	RL_CALL(rl_select, RL_OK, db, database);
 	RL_CALL(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
 	RL_CALL(rl_select, RL_OK, db, olddb);
 	RL_CALL(rl_key_delete, RL_OK, db, key, keylen);
 	RL_CALL(rl_select, RL_OK, db, database);
-	RL_CALL(rl_key_set, RL_OK, db, key, keylen, type, value_page, expires, 0);
+	record.version = 0;
+	RL_CALL(rl_key_set_record, RL_OK, db, key, keylen, &record);
 	retval = RL_OK;
 cleanup:
 	rl_select(db, olddb);
@@ -1140,9 +2221,7 @@ cleanup:
 int rl_rename(struct rlite *db, const unsigned char *src, long srclen, const unsigned char *target, long targetlen, int overwrite)
 {
 	int retval;
-	unsigned char type;
-	unsigned long long expires;
-	long value_page;
+	rl_key record;
 	long version = 0;
 	if (overwrite) {
 		RL_CALL2(rl_key_get, RL_FOUND, RL_NOT_FOUND, db, target, targetlen, NULL, NULL, NULL, NULL, &version);
@@ -1155,9 +2234,10 @@ int rl_rename(struct rlite *db, const unsigned char *src, long srclen, const uns
 		RL_CALL(rl_key_get, RL_NOT_FOUND, db, target, targetlen, NULL, NULL, NULL, NULL, NULL);
 	}
 	// this could be more efficient, if we don't delete the value page
-	RL_CALL(rl_key_get, RL_FOUND, db, src, srclen, &type, NULL, &value_page, &expires, NULL);
+	RL_CALL(rl_key_get_record, RL_FOUND, db, src, srclen, &record);
 	RL_CALL(rl_key_delete, RL_OK, db, src, srclen);
-	RL_CALL(rl_key_set, RL_OK, db, target, targetlen, type, value_page, expires, version);
+	record.version = version;
+	RL_CALL(rl_key_set_record, RL_OK, db, target, targetlen, &record);
 	retval = RL_OK;
 cleanup:
 	return retval;
@@ -1213,7 +2293,7 @@ int rl_keys(struct rlite *db, unsigned char *pattern, long patternlen, long *_le
 	int allkeys = patternlen == 1 && pattern[0] == '*';
 	while ((retval = rl_btree_iterator_next(iterator, NULL, &tmp)) == RL_OK) {
 		key = tmp;
-		RL_CALL(rl_multi_string_get, RL_OK, db, key->string_page, &keystr, &keystrlen);
+		RL_CALL(rl_key_name, RL_OK, db, key, &keystr, &keystrlen);
 		if (allkeys || rl_stringmatchlen((char *)pattern, patternlen, (char *)keystr, keystrlen, 0)) {
 			if (len + 1 == alloc) {
 				RL_REALLOC(result, sizeof(unsigned char *) * alloc * 2)
@@ -1255,7 +2335,7 @@ int rl_randomkey(struct rlite *db, unsigned char **key, long *keylen)
 	rl_key *key_obj;
 	RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 0);
 	RL_CALL(rl_btree_random_element, RL_OK, db, btree, NULL, (void **)&key_obj);
-	RL_CALL(rl_multi_string_get, RL_OK, db, key_obj->string_page, key, keylen);
+	RL_CALL(rl_key_name, RL_OK, db, key_obj, key, keylen);
 cleanup:
 	return retval;
 }
@@ -1278,7 +2358,7 @@ int rl_flushdb(struct rlite *db)
 	while ((retval = rl_btree_iterator_next(iterator, NULL, &tmp)) == RL_OK) {
 		key = tmp;
 		RL_CALL(rl_key_delete_value, RL_OK, db, key->type, key->value_page);
-		RL_CALL(rl_multi_string_delete, RL_OK, db, key->string_page);
+		RL_CALL(rl_key_name_delete, RL_OK, db, key);
 		rl_free(key);
 	}
 	if (retval != RL_END) {
@@ -1306,3 +2386,470 @@ int rl_flushall(struct rlite *db)
 cleanup:
 	return retval;
 }
+
+typedef struct {
+	int database;
+	unsigned char *key;
+	long keylen;
+	unsigned long long expires;
+	unsigned char *data;
+	long datalen;
+} rl_vacuum_key;
+
+static void vacuum_key_free(rl_vacuum_key *vkey)
+{
+	rl_free(vkey->key);
+	rl_free(vkey->data);
+	vkey->key = NULL;
+	vkey->data = NULL;
+}
+
+/**
+ * Dumps the value of `vkey->key`, returns RL_NOT_FOUND if it has expired.
+ */
+static int vacuum_key_dump(rlite *db, rl_vacuum_key *vkey)
+{
+	int retval;
+	vkey->database = db->selected_database;
+	vkey->data = NULL;
+	RL_CALL(rl_key_get, RL_FOUND, db, vkey->key, vkey->keylen, NULL, NULL, NULL, &vkey->expires, NULL);
+	RL_CALL(rl_dump, RL_OK, db, vkey->key, vkey->keylen, &vkey->data, &vkey->datalen);
+cleanup:
+	return retval;
+}
+
+/**
+ * Writes every key again in an empty file, so no page is left free and the
+ * pages of each key are next to each other.
+ */
+static int vacuum_all(rlite *db)
+{
+	rl_vacuum_key *vkeys = NULL;
+	unsigned char **keys = NULL;
+	long *keyslen = NULL, keys_len = 0, len = 0, alloc = 0, i, j;
+	void *tmp;
+	int retval = RL_OK;
+
+	for (i = 0; i < db->number_of_databases + RLITE_INTERNAL_DB_COUNT; i++) {
+		if (db->databases[i] == 0) {
+			continue;
+		}
+		db->selected_database = i;
+		RL_CALL(rl_keys, RL_OK, db, (unsigned char *)"*", 1, &keys_len, &keys, &keyslen);
+		if (len + keys_len > alloc) {
+			alloc = (len + keys_len) * 2;
+			RL_REALLOC(vkeys, sizeof(rl_vacuum_key) * alloc);
+		}
+		for (j = 0; j < keys_len; j++) {
+			vkeys[len].key = keys[j];
+			vkeys[len].keylen = keyslen[j];
+			keys[j] = NULL;
+			retval = vacuum_key_dump(db, &vkeys[len]);
+			if (retval == RL_NOT_FOUND) {
+				vacuum_key_free(&vkeys[len]);
+				continue;
+			}
+			len++;
+			if (retval != RL_OK) {
+				goto cleanup;
+			}
+		}
+		rl_free(keys);
+		rl_free(keyslen);
+		keys = NULL;
+		keyslen = NULL;
+		keys_len = 0;
+	}
+
+	// nothing in the file is needed anymore, every page is written again
+	while (db->write_pages.len > 0) {
+		RL_CALL(rl_cache_drop, RL_OK, db, db->write_pages.pages[db->write_pages.len - 1]->page_number);
+	}
+	RL_CALL(rl_cache_clear, RL_OK, db);
+	db->number_of_pages = 1;
+	db->next_empty_page = 1;
+	db->freelist = 0;
+	for (i = 0; i < db->number_of_databases + RLITE_INTERNAL_DB_COUNT; i++) {
+		db->databases[i] = 0;
+	}
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+	for (i = 0; i < len; i++) {
+		db->selected_database = vkeys[i].database;
+		RL_CALL(rl_restore, RL_OK, db, vkeys[i].key, vkeys[i].keylen, vkeys[i].expires, vkeys[i].data, vkeys[i].datalen);
+	}
+cleanup:
+	for (i = 0; i < keys_len; i++) {
+		rl_free(keys[i]);
+	}
+	rl_free(keys);
+	rl_free(keyslen);
+	for (i = 0; i < len; i++) {
+		vacuum_key_free(&vkeys[i]);
+	}
+	rl_free(vkeys);
+	return retval;
+}
+
+/**
+ * Owners of the pages in a window at the end of the file, found with one walk
+ * of every key, so each page vacuum_tail moves does not need one.
+ */
+typedef struct {
+	long start;
+	long len;
+	// per page of the window: 0 unknown or free, -1 - database for the nodes
+	// of its key btree, 1 + position in `keys` for the pages of a key
+	long *owners;
+	rl_vacuum_key *keys;
+	long keys_len;
+	long keys_alloc;
+	// for the walkers, which only set the pages they find
+	short *pages;
+	long pages_len;
+	// no key was written again since the map was built
+	int fresh;
+} rl_vacuum_map;
+
+static void vacuum_map_clear(rl_vacuum_map *map)
+{
+	long i;
+	for (i = 0; i < map->keys_len; i++) {
+		vacuum_key_free(&map->keys[i]);
+	}
+	map->keys_len = 0;
+}
+
+static void vacuum_map_destroy(rl_vacuum_map *map)
+{
+	vacuum_map_clear(map);
+	rl_free(map->keys);
+	rl_free(map->owners);
+	rl_free(map->pages);
+}
+
+/**
+ * Grows `map->pages` to the file, its pages in the window stay clear between
+ * walks.
+ */
+static int vacuum_map_pages(rlite *db, rl_vacuum_map *map)
+{
+	void *tmp;
+	int retval = RL_OK;
+	if (map->pages_len < db->number_of_pages) {
+		RL_REALLOC(map->pages, sizeof(short) * db->number_of_pages);
+		map->pages_len = db->number_of_pages;
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Gives `owner` the pages of the window the last walk found, and clears them.
+ * Returns how many there were.
+ */
+static long vacuum_map_claim(rl_vacuum_map *map, long owner)
+{
+	long i, claimed = 0;
+	for (i = 0; i < map->len; i++) {
+		if (map->pages[map->start + i]) {
+			map->pages[map->start + i] = 0;
+			map->owners[i] = owner;
+			claimed++;
+		}
+	}
+	return claimed;
+}
+
+/**
+ * Finds again the nodes of the key btree of the selected database, after a
+ * key was written again.
+ */
+static int vacuum_map_key_btree(rlite *db, rl_vacuum_map *map)
+{
+	rl_btree *btree;
+	long i, owner = -1 - db->selected_database;
+	int retval = RL_OK;
+	for (i = 0; i < map->len; i++) {
+		if (map->owners[i] == owner) {
+			map->owners[i] = 0;
+		}
+	}
+	if (db->databases[db->selected_database] == 0) {
+		goto cleanup;
+	}
+	RL_CALL(vacuum_map_pages, RL_OK, db, map);
+	RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 0);
+	RL_CALL(rl_btree_pages, RL_OK, db, btree, map->pages);
+	vacuum_map_claim(map, owner);
+cleanup:
+	return retval;
+}
+
+/**
+ * Walks every key btree and every key, for the owners of the last `window`
+ * pages.
+ */
+static int vacuum_map_build(rlite *db, rl_vacuum_map *map, long window)
+{
+	rl_btree *btree;
+	rl_btree_iterator *iterator = NULL;
+	rl_key *key;
+	void *obj = NULL, *tmp;
+	long i;
+	int retval = RL_OK;
+
+	vacuum_map_clear(map);
+	map->start = db->number_of_pages - window > 1 ? db->number_of_pages - window : 1;
+	map->len = db->number_of_pages - map->start;
+	RL_REALLOC(map->owners, sizeof(long) * (map->len > 0 ? map->len : 1));
+	memset(map->owners, 0, sizeof(long) * map->len);
+	RL_CALL(vacuum_map_pages, RL_OK, db, map);
+	memset(&map->pages[map->start], 0, sizeof(short) * map->len);
+	for (i = 0; i < db->number_of_databases + RLITE_INTERNAL_DB_COUNT; i++) {
+		if (db->databases[i] == 0) {
+			continue;
+		}
+		db->selected_database = i;
+		RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 0);
+		RL_CALL(rl_btree_pages, RL_OK, db, btree, map->pages);
+		vacuum_map_claim(map, -1 - i);
+		RL_CALL(rl_btree_iterator_create, RL_OK, db, btree, &iterator);
+		while ((retval = rl_btree_iterator_next(iterator, NULL, &obj)) == RL_OK) {
+			key = obj;
+			RL_CALL(rl_key_pages, RL_OK, db, key, map->pages);
+			if (vacuum_map_claim(map, map->keys_len + 1) > 0) {
+				if (map->keys_len == map->keys_alloc) {
+					map->keys_alloc = map->keys_alloc ? map->keys_alloc * 2 : 16;
+					RL_REALLOC(map->keys, sizeof(rl_vacuum_key) * map->keys_alloc);
+				}
+				map->keys[map->keys_len].database = db->selected_database;
+				map->keys[map->keys_len].data = NULL;
+				RL_CALL(rl_key_name, RL_OK, db, key, &map->keys[map->keys_len].key, &map->keys[map->keys_len].keylen);
+				map->keys_len++;
+			}
+			rl_free(obj);
+			obj = NULL;
+		}
+		iterator = NULL;
+		if (retval != RL_END) {
+			goto cleanup;
+		}
+	}
+	map->fresh = 1;
+	retval = RL_OK;
+cleanup:
+	rl_free(obj);
+	rl_btree_iterator_destroy(iterator);
+	return retval;
+}
+
+/**
+ * Looks up what uses `page` in the map. Returns RL_FOUND with the name of the
+ * key in `vkey`, or RL_OK if it is part of the key btree of `vkey->database`,
+ * both selected; RL_NOT_FOUND if the map does not know.
+ */
+static int vacuum_map_owner(rlite *db, rl_vacuum_map *map, long page, rl_vacuum_key *vkey)
+{
+	rl_vacuum_key *owner;
+	long i = page - map->start;
+	int retval = RL_OK;
+	if (i < 0 || i >= map->len || map->owners[i] == 0) {
+		retval = RL_NOT_FOUND;
+		goto cleanup;
+	}
+	if (map->owners[i] < 0) {
+		vkey->database = -1 - map->owners[i];
+		db->selected_database = vkey->database;
+		goto cleanup;
+	}
+	owner = &map->keys[map->owners[i] - 1];
+	vkey->database = owner->database;
+	db->selected_database = owner->database;
+	RL_MALLOC(vkey->key, sizeof(unsigned char) * (owner->keylen > 0 ? owner->keylen : 1));
+	memcpy(vkey->key, owner->key, owner->keylen);
+	vkey->keylen = owner->keylen;
+	retval = RL_FOUND;
+cleanup:
+	return retval;
+}
+
+/**
+ * Moves `page`, part of the key btree of the selected database, to the next
+ * free page.
+ */
+static int vacuum_move_key_btree_page(rlite *db, long page)
+{
+	rl_btree *btree;
+	int retval, selected_database = rl_get_selected_db(db);
+	long new_page = db->next_empty_page;
+	RL_CALL(rl_get_key_btree, RL_OK, db, &btree, 0);
+	if (page != db->databases[selected_database]) {
+		RL_CALL(rl_btree_move_node, RL_OK, db, btree, db->databases[selected_database], page);
+		goto cleanup;
+	}
+	RL_CALL(rl_purge_cache, RL_OK, db, page);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_key, new_page, btree);
+	db->databases[selected_database] = new_page;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+	RL_CALL(rl_delete, RL_OK, db, page);
+cleanup:
+	return retval;
+}
+
+/**
+ * Writes again the keys using the last pages of the file, while there are
+ * free pages before them, until about `max_pages` pages were written.
+ */
+static int vacuum_tail(rlite *db, long max_pages)
+{
+	rl_vacuum_map map;
+	rl_vacuum_key vkey;
+	long moved = 0, page, new_page, owner, window, written, i;
+	int retval;
+
+	memset(&map, 0, sizeof(map));
+	vkey.key = NULL;
+	vkey.data = NULL;
+	while (1) {
+		RL_CALL(rl_freelist_compact, RL_OK, db);
+		if (moved >= max_pages || db->freelist == 0) {
+			break;
+		}
+		page = db->number_of_pages - 1;
+		retval = vacuum_map_owner(db, &map, page, &vkey);
+		if (retval == RL_NOT_FOUND && (!map.fresh || page < map.start || page >= map.start + map.len)) {
+			// about the pages this call can still move, with some room for
+			// the free ones cut off between them
+			window = max_pages - moved < MAX_VACUUM_WINDOW / 2 ? (max_pages - moved) * 2 + 16 : MAX_VACUUM_WINDOW;
+			RL_CALL(vacuum_map_build, RL_OK, db, &map, window);
+			retval = vacuum_map_owner(db, &map, page, &vkey);
+		}
+		if (retval == RL_OK) {
+			new_page = db->next_empty_page;
+			RL_CALL(vacuum_move_key_btree_page, RL_OK, db, page);
+			if (new_page >= map.start && new_page < map.start + map.len) {
+				map.owners[new_page - map.start] = map.owners[page - map.start];
+			}
+			map.owners[page - map.start] = 0;
+			moved++;
+			continue;
+		}
+		else if (retval == RL_NOT_FOUND) {
+			// a page nothing refers to, only a full vacuum gets rid of it
+			break;
+		}
+		else if (retval != RL_FOUND) {
+			goto cleanup;
+		}
+		map.fresh = 0;
+		retval = vacuum_key_dump(db, &vkey);
+		if (retval == RL_OK) {
+			RL_CALL(rl_key_delete_with_value, RL_OK, db, vkey.key, vkey.keylen);
+			// the key takes the lowest free pages
+			RL_CALL(rl_freelist_compact, RL_OK, db);
+			written = db->write_pages.len;
+			RL_CALL(rl_restore, RL_OK, db, vkey.key, vkey.keylen, vkey.expires, vkey.data, vkey.datalen);
+			// freed pages leave the write cache, the ones it takes are new in it
+			written = db->write_pages.len - written;
+			moved += written > 1 ? written : 1;
+		}
+		else if (retval == RL_NOT_FOUND) {
+			moved++;
+		}
+		else {
+			goto cleanup;
+		}
+		// its old pages are free now, and the key btree may have changed
+		owner = map.owners[page - map.start];
+		for (i = 0; i < map.len; i++) {
+			if (map.owners[i] == owner) {
+				map.owners[i] = 0;
+			}
+		}
+		RL_CALL(vacuum_map_key_btree, RL_OK, db, &map);
+		vacuum_key_free(&vkey);
+	}
+	retval = RL_OK;
+cleanup:
+	vacuum_key_free(&vkey);
+	vacuum_map_destroy(&map);
+	return retval;
+}
+
+/**
+ * Moves the live pages to the start of the file, the free pages left at its
+ * end are cut off when the transaction is committed.
+ * Keys are moved by writing them again, with their pages next to each other.
+ * With `max_pages` 0 every key is written again in an empty file. Otherwise
+ * the keys and key btree nodes at the end of the file are moved one at a
+ * time, until about `max_pages` pages were written.
+ */
+int rl_vacuum(struct rlite *db, long max_pages)
+{
+	int retval;
+	int selected_database = db->selected_database;
+	int selected_internal = db->selected_internal;
+	if (max_pages < 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	db->selected_internal = RLITE_INTERNAL_DB_NO;
+	if (max_pages == 0) {
+		RL_CALL(vacuum_all, RL_OK, db);
+	}
+	else {
+		RL_CALL(vacuum_tail, RL_OK, db, max_pages);
+	}
+cleanup:
+	db->selected_database = selected_database;
+	db->selected_internal = selected_internal;
+	return retval;
+}
+
+// copies the frames committed to the log back to the database file, as of
+// the last commit, and empties the log; `*pages` is the number of pages copied
+int rl_checkpoint(struct rlite *db, long *pages)
+{
+	int retval = RL_OK;
+	*pages = 0;
+	if (db->shared) {
+		RL_CALL(rl_shared_lock, RL_OK, db, RLITE_FLOCK_EX);
+	}
+	if (db->driver_type == RL_FILE_DRIVER) {
+		RL_CALL(rl_lock_checkpoint, RL_OK, db, 1);
+		// the header of the transaction in progress is not committed yet
+		RL_CALL(rl_wal_checkpoint, RL_OK, db, db->initial_number_of_pages, pages);
+	}
+cleanup:
+	return retval;
+}
+
+// converts the writer lock to an exclusive one, so no reader is left on the
+// log while it is emptied
+int rl_lock_checkpoint(struct rlite *db, int wait)
+{
+	rl_file_driver *driver = db->driver;
+	int retval;
+	RL_CALL(file_driver_open, RL_OK, db);
+	if (driver->locked == RLITE_FLOCK_EX) {
+		goto cleanup;
+	}
+	if (db->read_snapshot || (driver->mode & RLITE_OPEN_READWRITE) == 0) {
+		// without the writer lock
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
+	// holding the writer lock, nobody else can convert their lock meanwhile
+	retval = wait ? file_driver_wait_lock(db, RLITE_FLOCK_EX) : driver->io->lock(driver->handle, RLITE_FLOCK_EX | RLITE_FLOCK_NB);
+	if (retval == RL_BUSY) {
+		// lets new readers in again
+		RL_CALL(driver->io->lock, RL_OK, driver->handle, RLITE_FLOCK_SH);
+		retval = RL_BUSY;
+		goto cleanup;
+	}
+	else if (retval != RL_OK) {
+		goto cleanup;
+	}
+	driver->locked = RLITE_FLOCK_EX;
+cleanup:
+	return retval;
+}
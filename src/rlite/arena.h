@@ -0,0 +1,34 @@
+#ifndef _RL_ARENA_H
+#define _RL_ARENA_H
+
+#include <stddef.h>
+
+struct rl_arena_chunk;
+
+/**
+ * Bump allocator for buffers that do not outlive the transaction they are
+ * allocated in, like the pages read before deserializing them.
+ * Freeing the last allocation gives its space back, so buffers freed in the
+ * reverse order they were allocated can be reused within the transaction.
+ * Everything else is released at once by rl_arena_reset, when the
+ * transaction is committed or discarded.
+ */
+typedef struct rl_arena {
+	struct rl_arena_chunk *chunk;
+} rl_arena;
+
+#define RL_ARENA_MALLOC(arena, obj, size)\
+	obj = rl_arena_malloc(arena, size);\
+	if (!obj) {\
+		retval = RL_OUT_OF_MEMORY;\
+		goto cleanup;\
+	}
+
+void rl_arena_init(rl_arena *arena);
+void *rl_arena_malloc(rl_arena *arena, size_t size);
+void rl_arena_free(rl_arena *arena, void *ptr);
+// keeps the first chunk, so the next transaction does not need to allocate
+void rl_arena_reset(rl_arena *arena);
+void rl_arena_destroy(rl_arena *arena);
+
+#endif
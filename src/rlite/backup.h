@@ -0,0 +1,53 @@
+#ifndef _RL_BACKUP_H
+#define _RL_BACKUP_H
+
+struct rlite;
+
+/**
+ * Copies a database to another one page by page, a few pages at a time, so
+ * writers only wait for one step. Every step reads the source in a read
+ * transaction and commits what it copied to the destination, which is not
+ * a usable database until the last step.
+ * Commits made through the source handle between steps are copied again by
+ * the next step. If another connection writes to the source, the copy starts
+ * over.
+ */
+typedef struct rl_backup {
+	struct rlite *source;
+	struct rlite *destination;
+	// pages before it are in the destination
+	long next_page;
+	// pages in the source when the last step started
+	long page_count;
+	// change_counter of the source the copied pages belong to, -1 before the
+	// first step
+	long change_counter;
+	// pages committed through the source since they were copied
+	long *dirty_pages;
+	long dirty_len;
+	long dirty_alloc;
+	// times the copy started over
+	long restarts;
+	// next backup of the same source
+	struct rl_backup *next;
+} rl_backup;
+
+/**
+ * Both databases must have the same page size and `destination` must be
+ * open for writing. Neither handle can be in a transaction with writes when
+ * a step runs.
+ */
+int rl_backup_init(struct rlite *destination, struct rlite *source, rl_backup **backup);
+// copies up to `pages` pages, or all of them if negative; RL_END once the
+// destination has every page, RL_OK if there are more
+int rl_backup_step(rl_backup *backup, long pages);
+// pages left to copy as of the last step
+long rl_backup_remaining(rl_backup *backup);
+// frees the backup, the destination is left as the last step left it
+int rl_backup_finish(rl_backup *backup);
+// called by rl_commit on the source, marks the pages written as dirty
+int rl_backup_update(struct rlite *source);
+// called by rl_close on the source, steps fail with RL_INVALID_STATE then
+void rl_backup_detach(struct rlite *source);
+
+#endif
@@ -131,6 +131,12 @@ typedef struct rliteContext {
 } rliteContext;
 
 rliteContext *rliteConnect(const char *ip, int port);
+// path is the database file, options as in rl_open_v2 and flags default to
+// RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE
+rliteContext *rliteConnectWithOptions(const char *path, const rl_open_options *options);
+// another context on the database of `c`, opened with RLITE_OPEN_SHARED, for
+// another thread to use, see rl_open_thread
+rliteContext *rliteConnectThread(rliteContext *c);
 rliteContext *rliteConnectWithTimeout(const char *ip, int port, const struct timeval tv);
 rliteContext *rliteConnectNonBlock(const char *ip, int port);
 rliteContext *rliteConnectBindNonBlock(const char *ip, int port, const char *source_addr);
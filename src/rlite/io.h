@@ -0,0 +1,47 @@
+#ifndef _RL_IO_H
+#define _RL_IO_H
+
+#include <stddef.h>
+
+/**
+ * Backend used by the file driver to access the database file.
+ * All functions return RL_OK on success.
+ */
+typedef struct rl_io_ops {
+	const char *name;
+	// flags are RLITE_OPEN_READWRITE and RLITE_OPEN_CREATE
+	int (*open)(const char *filename, int flags, void **handle);
+	int (*close)(void *handle);
+	// type is one of RLITE_FLOCK_SH, RLITE_FLOCK_EX, RLITE_FLOCK_WRITER or
+	// RLITE_FLOCK_UN, or'ed with RLITE_FLOCK_NB it returns RL_BUSY if the
+	// lock is taken. Backends without a writer lock return RL_NOT_IMPLEMENTED
+	// for it, and writers lock a file next to the database instead
+	int (*lock)(void *handle, int type);
+	// reads up to `size` bytes, `*read` is smaller at the end of the file
+	int (*read)(void *handle, void *data, size_t size, long long offset, size_t *read);
+	// writes `count` pages, sorted by page number
+	int (*write_pages)(void *handle, long page_size, long count, const long *page_numbers, unsigned char **pages);
+	int (*flush)(void *handle);
+	// waits until the written data is on disk
+	int (*sync)(void *handle);
+	// cuts the file down to `size` bytes
+	int (*truncate)(void *handle, long long size);
+	// optional, points `*data` to `size` bytes of the file that stay valid
+	// until the next call on the handle, or NULL past the end of the file
+	int (*map)(void *handle, long long offset, size_t size, unsigned char **data);
+} rl_io_ops;
+
+// pread, and pwritev with adjacent pages coalesced in a single call
+extern rl_io_ops rl_io_positional;
+// fseek and fread/fwrite on a FILE*
+extern rl_io_ops rl_io_stdio;
+// reads from a shared read-only mapping of the file, remapped lazily after
+// the file changes size, writes like rl_io_positional
+extern rl_io_ops rl_io_mmap;
+
+// fdatasync where available, fsync elsewhere
+int rl_io_sync_fd(int fd);
+// makes the files created or deleted next to `filename` durable
+int rl_io_sync_dir(const char *filename);
+
+#endif
@@ -30,14 +30,36 @@ typedef struct rl_hashkey {
 	long value_page;
 } rl_hashkey;
 
+// longest string value stored in a key btree record instead of in pages of
+// its own, if the record has room for it next to the name
+#define RL_KEY_INLINE_SIZE 64
+// longest key name stored in the record
+#define RL_KEY_NAME_INLINE_SIZE 32
+
+// how a string value in the record is stored, as its bytes or, when they
+// are the canonical text of a 64 bit integer, as the integer
+#define RL_KEY_ENCODING_RAW 0
+#define RL_KEY_ENCODING_INT 1
+
 typedef struct rl_key {
 	unsigned char type;
+	// 0 when the name is in `name`
 	long string_page;
+	// 0 for a string when the value is in `value`
 	long value_page;
 	unsigned long long expires;
 	long version;
+	long namelen;
+	unsigned char name[RL_KEY_NAME_INLINE_SIZE];
+	unsigned char encoding;
+	long valuelen;
+	unsigned char value[RL_KEY_INLINE_SIZE];
+	// the value when encoding is RL_KEY_ENCODING_INT
+	long long number;
 } rl_key;
 
+#define RL_KEY_VALUE_INLINE(key) ((key)->type == RL_TYPE_STRING && (key)->value_page == 0)
+
 extern rl_btree_type rl_btree_type_hash_long_long;
 extern rl_btree_type rl_btree_type_hash_sha1_key;
 extern rl_btree_type rl_btree_type_hash_sha1_long;
@@ -52,6 +74,9 @@ typedef struct rl_btree_node {
 	void **values;
 	// size is the number of children used; allocs the maximum on creation
 	long size;
+	// when not null, scores, values and what they point to live in this
+	// single allocation, as read from the page
+	void *view;
 } rl_btree_node;
 
 typedef struct rl_btree {
@@ -79,6 +104,12 @@ int rl_btree_create_size(struct rlite *db, rl_btree **btree, rl_btree_type *type
 int rl_btree_create(struct rlite *db, rl_btree **btree, rl_btree_type *type);
 int rl_btree_destroy(struct rlite *db, void *btree);
 int rl_btree_node_destroy(struct rlite *db, void *node);
+/**
+ * Nodes read from a page keep their scores and values in one block. Before
+ * moving or freeing any of them, the node needs one allocation per score and
+ * per value, like the nodes that are created.
+ */
+int rl_btree_node_materialize(struct rlite *db, rl_btree *btree, rl_btree_node *node);
 int rl_btree_add_element(struct rlite *db, rl_btree *btree, long btree_page, void *score, void *value);
 int rl_btree_update_element(struct rlite *db, rl_btree *btree, void *score, void *value);
 int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page, void *score);
@@ -124,6 +155,7 @@ int rl_btree_node_serialize_hash_sha1_double(struct rlite *db, void *obj, unsign
 int rl_btree_node_deserialize_hash_sha1_double(struct rlite *db, void **obj, void *context, unsigned char *data);
 
 int rl_btree_pages(struct rlite *db, rl_btree *btree, short *pages);
+int rl_btree_move_node(struct rlite *db, rl_btree *btree, long btree_page, long node_page);
 int rl_btree_delete(struct rlite *db, rl_btree *btree);
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef _RL_PAGE_CACHE_H
+#define _RL_PAGE_CACHE_H
+
+struct rl_page;
+
+/**
+ * Set of pages indexed by page number.
+ * `pages` is a dense array in no particular order (see rl_page_cache_sort),
+ * and `index` an open addressing table, with linear probing, holding for
+ * every page its position in `pages` plus one, or 0 for empty slots.
+ */
+typedef struct rl_page_cache {
+	struct rl_page **pages;
+	long len;
+	long alloc;
+	long *index;
+	long index_alloc;
+} rl_page_cache;
+
+int rl_page_cache_init(rl_page_cache *cache, long alloc);
+void rl_page_cache_destroy(rl_page_cache *cache);
+struct rl_page *rl_page_cache_get(rl_page_cache *cache, long page_number);
+int rl_page_cache_add(rl_page_cache *cache, struct rl_page *page);
+struct rl_page *rl_page_cache_remove(rl_page_cache *cache, long page_number);
+void rl_page_cache_reset(rl_page_cache *cache);
+int rl_page_cache_reindex(rl_page_cache *cache);
+int rl_page_cache_shrink(rl_page_cache *cache, long alloc);
+int rl_page_cache_sort(rl_page_cache *cache);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _RL_PAGE_FREELIST_H
+#define _RL_PAGE_FREELIST_H
+
+struct rlite;
+
+/**
+ * Free pages are listed in trunk pages, chained from the header. Each trunk
+ * holds as many page numbers as fit in a page, so a single read hands out
+ * many pages. Once a trunk has no entries left, the trunk page itself is
+ * the next one allocated.
+ */
+typedef struct rl_freelist_trunk {
+	// next trunk page, 0 for the last one
+	long next;
+	long size;
+	// sorted in decreasing order, so pages are allocated in increasing order
+	// and consecutive free pages end up next to each other in the file
+	long *pages;
+} rl_freelist_trunk;
+
+int rl_freelist_trunk_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_freelist_trunk_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_freelist_trunk_destroy(struct rlite *db, void *obj);
+int rl_freelist_alloc(struct rlite *db);
+int rl_freelist_free(struct rlite *db, long page_number);
+// takes up to `max_pages` consecutive pages starting at db->next_empty_page,
+// at least one
+int rl_freelist_alloc_run(struct rlite *db, long max_pages, long *start, long *pages);
+// takes `pages` pages past the end of the file, leaving the free pages alone
+int rl_freelist_alloc_end(struct rlite *db, long pages, long *start);
+int rl_freelist_compact(struct rlite *db);
+
+#endif
@@ -12,10 +12,33 @@ typedef struct {
 
 extern rl_type types[];
 
+struct rl_btree;
+struct rl_key;
+
+// key btree for a new database; its records have room for short names and
+// values, how much depends on the page size
+int rl_key_btree_create(struct rlite *db, struct rl_btree **btree);
+// copy of the name of `key`, wherever it is stored
+int rl_key_name(struct rlite *db, struct rl_key *key, unsigned char **name, long *namelen);
+int rl_key_name_delete(struct rlite *db, struct rl_key *key);
 int rl_key_get_or_create(struct rlite *db, const unsigned char *key, long keylen, unsigned char type, long *page, long *version);
 int rl_key_get(struct rlite *db, const unsigned char *key, long keylen, unsigned char *type, long *string_page, long *value_page, unsigned long long *expires, long *version);
 int rl_check_watched_keys(struct rlite *db, int watched_count, struct watched_key** keys);
 int rl_key_set(struct rlite *db, const unsigned char *key, long keylen, unsigned char type, long page, unsigned long long expires, long version);
+// a string key, with the value in the key record when it fits
+int rl_key_set_string(struct rlite *db, const unsigned char *key, long keylen, const unsigned char *value, long valuelen, unsigned long long expires, long version);
+// like rl_key_set_string for the string key `record` was read from, the
+// pages of its value are written over if the new value needs pages too
+int rl_key_set_string_record(struct rlite *db, const unsigned char *key, long keylen, struct rl_key *record, const unsigned char *value, long valuelen);
+// the record of the key as it is stored, including a value stored in it
+int rl_key_get_record(struct rlite *db, const unsigned char *key, long keylen, struct rl_key *record);
+// sets a key from a record read with rl_key_get_record, under any name; an
+// existing key is updated in place and keeps its name pages, the pages of its
+// old value are left to the caller
+int rl_key_set_record(struct rlite *db, const unsigned char *key, long keylen, struct rl_key *record);
+// text of a string value stored in the record, either `value` or `buffer`,
+// which needs room for MAX_LLONG_DIGITS bytes
+unsigned char *rl_key_inline_value(struct rl_key *key, unsigned char *buffer, long *valuelen);
 int rl_key_delete(struct rlite *db, const unsigned char *key, long keylen);
 int rl_key_expires(struct rlite *db, const unsigned char *key, long keylen, unsigned long long expires);
 int rl_key_delete_value(struct rlite *db, unsigned char identifier, long value_page);
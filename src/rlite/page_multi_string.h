@@ -3,6 +3,26 @@
 
 struct rlite;
 
+/**
+ * Values longer than RL_MULTI_STRING_EXTENT_MIN_PAGES pages are stored in
+ * extents, runs of consecutive pages, listed in a descriptor page. Their
+ * first page looks like the header of a list with no room for elements,
+ * max_node_size 0, pointing to the descriptor with `left` and holding the
+ * length of the value in `size`. Shorter values are a list of pages, whose
+ * first element is their length.
+ */
+#define RL_MULTI_STRING_EXTENT_MIN_PAGES 4
+
+typedef struct rl_multi_string_extents {
+	long size;
+	long *start;
+	long *pages;
+} rl_multi_string_extents;
+
+int rl_multi_string_extents_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_multi_string_extents_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_multi_string_extents_destroy(struct rlite *db, void *obj);
+
 int rl_normalize_string_range(long totalsize, long *start, long *stop);
 int rl_multi_string_cmp(struct rlite *db, long p1, long p2, int *cmp);
 int rl_multi_string_cmp_str(struct rlite *db, long p1, unsigned char *str, long len, int *cmp);
@@ -10,6 +30,10 @@ int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_dat
 int rl_multi_string_get(struct rlite *db, long number, unsigned char **data, long *size);
 int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char *data, long size, long offset, long *newlength);
 int rl_multi_string_set(struct rlite *db, long *number, const unsigned char *data, long size);
+// sets the value of an existing multi string, writing over its pages and
+// adding or freeing pages at its end; `number` changes only when the value
+// goes from a list of pages to extents or back
+int rl_multi_string_replace(struct rlite *db, long *number, const unsigned char *data, long size);
 int rl_multi_string_append(struct rlite *db, long number, const unsigned char *data, long datasize, long *newlength);
 int rl_multi_string_sha1(struct rlite *db, unsigned char data[20], long number);
 int rl_multi_string_pages(struct rlite *db, long page, short *pages);
@@ -0,0 +1,27 @@
+#ifndef _RL_PAGE_STORE_H
+#define _RL_PAGE_STORE_H
+
+/**
+ * Serialized pages of a memory database, in chunks of a fixed size found
+ * through a directory indexed by page number. Growing allocates the new
+ * chunks only, pages already stored are never moved, and truncating frees
+ * the chunks past the end.
+ */
+typedef struct rl_page_store {
+	unsigned char **chunks;
+	long chunks_alloc;
+	long page_size;
+	long chunk_pages;
+	// pages stored, the highest one written plus one
+	long number_of_pages;
+} rl_page_store;
+
+void rl_page_store_init(rl_page_store *store, long page_size);
+void rl_page_store_destroy(rl_page_store *store);
+// NULL if the page was never written or has been truncated
+unsigned char *rl_page_store_get(rl_page_store *store, long page_number);
+// where to write the page, allocating its chunk the first time
+int rl_page_store_put(rl_page_store *store, long page_number, unsigned char **data);
+void rl_page_store_truncate(rl_page_store *store, long number_of_pages);
+
+#endif
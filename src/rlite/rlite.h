@@ -13,6 +13,11 @@
 #include "sort.h"
 #include "restore.h"
 #include "dump.h"
+#include "page_cache.h"
+#include "page_store.h"
+#include "arena.h"
+#include "io.h"
+#include "backup.h"
 #include "util.h"
 
 #define REDIS_RDB_VERSION 6
@@ -49,10 +54,42 @@
 #define RLITE_OPEN_READONLY  0x00000001
 #define RLITE_OPEN_READWRITE 0x00000002
 #define RLITE_OPEN_CREATE    0x00000004
+// keep the file locked from the first access until rl_close, so other
+// connections cannot use it and refreshing does not need to check the file
+#define RLITE_OPEN_EXCLUSIVE 0x00000008
+// the handle can be used to open more handles for other threads, see
+// rl_open_thread. Implies RLITE_OPEN_EXCLUSIVE.
+#define RLITE_OPEN_SHARED    0x00000010
+// with ":memory:", pages are kept as the objects the last commit left
+// instead of being serialized, see rl_memory_driver
+#define RLITE_OPEN_RESIDENT  0x00000020
+
+// page sizes a database can be created with, powers of two
+#define RLITE_MIN_PAGE_SIZE 1024
+#define RLITE_MAX_PAGE_SIZE 65536
+
+// how much rl_commit waits for the disk, see rl_open_options
+#define RLITE_SYNC_OFF 0
+#define RLITE_SYNC_NORMAL 1
+#define RLITE_SYNC_FULL 2
+
+// how commits reach the database file, see rl_open_options
+#define RLITE_JOURNAL_DELETE 0
+#define RLITE_JOURNAL_WAL 1
+
+#define RLITE_LOCK_NORMAL 0
+#define RLITE_LOCK_EXCLUSIVE 1
 
 #define RLITE_FLOCK_SH 1
 #define RLITE_FLOCK_EX 2
 #define RLITE_FLOCK_UN 3
+// taken by writers before RLITE_FLOCK_SH or RLITE_FLOCK_EX, released with
+// RLITE_FLOCK_UN
+#define RLITE_FLOCK_WRITER 4
+// or'ed with the other types, fails with RL_BUSY instead of waiting for the
+// lock. A connection that gave up on RLITE_FLOCK_EX keeps others from
+// starting a shared lock until it asks for another lock.
+#define RLITE_FLOCK_NB 0x10
 
 #define RLITE_INTERNAL_DB_COUNT 6
 #define RLITE_INTERNAL_DB_NO 0
@@ -70,6 +107,7 @@
 
 struct rlite;
 struct rl_btree;
+struct rl_shared;
 
 typedef struct rl_data_type {
 	const char *name;
@@ -79,20 +117,38 @@ typedef struct rl_data_type {
 } rl_data_type;
 
 typedef struct {
-	FILE *fp;
+	rl_io_ops *io;
+	void *handle;
 	char *filename;
 	int mode;
+	// the file is kept open between transactions, but only locked during
+	// them, RLITE_FLOCK_SH or RLITE_FLOCK_EX while it is
+	int locked;
+	// the ".lock" file next to the database when the backend has no writer
+	// lock, -1 until it is needed
+	int writer_fd;
+	// persistent wal, if a connection in wal mode created it
+	struct rl_wal_log *log;
 } rl_file_driver;
 
+/**
+ * Resident databases have no data: the read cache is their storage, it is
+ * never trimmed nor cleared, and commits move the written pages into it as
+ * they are. Transactions that can write keep an image of every page they
+ * use, put back if they are rolled back.
+ */
 typedef struct {
-	char *data;
-	long datalen;
+	rl_page_store store;
+	int resident;
 } rl_memory_driver;
 
-typedef struct {
+typedef struct rl_page {
 	long page_number;
 	rl_data_type *type;
 	void *obj;
+	// value of page_cache_clock the last time the page was used, to pick
+	// which pages to evict when the cache is over its budget
+	long last_access;
 #ifdef RL_DEBUG
 	unsigned char *serialized_data;
 #endif
@@ -106,28 +162,109 @@ typedef struct rlite {
 	long initial_number_of_pages;
 	int initial_number_of_databases;
 	long *initial_databases;
+	long initial_freelist;
 
 	long number_of_pages;
+	// the page the next allocation returns, writing to it allocates it
 	long next_empty_page;
+	// first freelist trunk page, see page_freelist.h
+	long freelist;
 	long page_size;
+	// the header read is rlite0.0, from before key records held names and
+	// values; none are stored there until a commit upgrades the header
+	int legacy_keys;
 	void *driver;
 	int driver_type;
 	int selected_internal;
 	int selected_database;
 	int number_of_databases;
 	long *databases;
-	long read_pages_alloc;
-	long read_pages_len;
-	rl_page **read_pages;
-	long write_pages_alloc;
-	long write_pages_len;
-	rl_page **write_pages;
+	// shared with the other handles of the database when it was opened with
+	// RLITE_OPEN_SHARED, like the driver
+	rl_page_cache *read_pages;
+	rl_page_cache write_pages;
+	// with a resident memory driver, the pages the current transaction used
+	// as they were before, serialized in the arena
+	rl_page_cache undo_pages;
+	// scratch buffers of the current transaction
+	rl_arena arena;
+	// incremented by every page written or deleted, a command that leaves it
+	// unchanged did not modify the database
+	long write_sequence;
+	// the transaction was started by rl_begin_read and cannot write
+	int read_snapshot;
+
+	// read_pages are kept after a transaction ends, up to page_cache_size
+	// pages. They are dropped when change_counter, stored in the header and
+	// incremented by every commit, does not match page_cache_change_counter.
+	long page_cache_size;
+	long page_cache_clock;
+	long change_counter;
+	long page_cache_change_counter;
+
+	// page size used if the database is created, existing databases keep
+	// the one in their header
+	long create_page_size;
+	int sync;
+	int journal_mode;
+	long wal_autocheckpoint;
+	// milliseconds to retry a busy lock before failing with RL_BUSY, 0 waits
+	// for as long as it takes
+	long busy_timeout;
+
+	// group commit limits, see rl_set_group_commit
+	long group_commit_max_commits;
+	long group_commit_max_pages;
+	long group_commit_max_delay;
+	// commits waiting in the current transaction and when the first one was
+	long group_commits;
+	unsigned long long group_commit_start;
 
 	char *subscriber_id;
 	char *subscriber_lock_filename;
 	FILE *subscriber_lock_fp;
+
+	// NULL unless opened with RLITE_OPEN_SHARED
+	struct rl_shared *shared;
+	// RLITE_FLOCK_SH or RLITE_FLOCK_EX while the handle holds the lock of
+	// the other threads, 0 otherwise
+	int shared_locked;
+	// backups reading from this handle, see backup.h
+	struct rl_backup *backups;
 } rlite;
 
+/**
+ * Options for rl_open_v2. Fields left as 0 take their default value.
+ */
+typedef struct rl_open_options {
+	// RLITE_OPEN_* flags
+	int flags;
+	// for new databases, a power of two between RLITE_MIN_PAGE_SIZE and
+	// RLITE_MAX_PAGE_SIZE, 1024 by default
+	long page_size;
+	// bytes of pages kept cached between transactions, 1024 pages by default
+	long cache_size;
+	// RLITE_SYNC_OFF does not sync at all, RLITE_SYNC_NORMAL syncs the wal
+	// (or the log) on commit, RLITE_SYNC_FULL also syncs the database file
+	// before the wal is deleted, and the directory when the wal or the log
+	// is created or deleted
+	int sync;
+	// RLITE_LOCK_EXCLUSIVE is the same as RLITE_OPEN_EXCLUSIVE
+	int lock_mode;
+	// RLITE_JOURNAL_DELETE writes every commit to a wal that is applied to
+	// the database and deleted right away. RLITE_JOURNAL_WAL appends commits
+	// to a log kept next to the database, and copies them to the database in
+	// checkpoints; a commit is as durable as the log after it. Connections
+	// in either mode read the log when there is one.
+	int journal_mode;
+	// with RLITE_JOURNAL_WAL, log frames that trigger a checkpoint after a
+	// commit, 1000 by default, negative to only checkpoint with rl_checkpoint
+	long wal_autocheckpoint;
+	// milliseconds to wait for a lock held by another connection before
+	// failing with RL_BUSY, 0 to wait for as long as it takes
+	long busy_timeout;
+} rl_open_options;
+
 typedef struct watched_key {
 	unsigned char digest[20];
 	long version;
@@ -135,21 +272,80 @@ typedef struct watched_key {
 } watched_key;
 
 int rl_open(const char *filename, rlite **db, int flags);
+int rl_open_v2(const char *filename, rlite **db, const rl_open_options *options);
 int rl_refresh(rlite *db);
+/**
+ * Like rl_refresh, but the transaction started only reads: the file is
+ * locked shared even by read-write connections, and with RLITE_JOURNAL_WAL
+ * it does not wait for, nor block, writers. It sees the last commit before
+ * it started until it ends; rl_write and rl_delete fail with
+ * RL_INVALID_STATE.
+ */
+int rl_begin_read(rlite *db);
+/**
+ * Opens another handle on a database opened with RLITE_OPEN_SHARED, to be
+ * used by another thread. Handles share the page cache, the driver and the
+ * file lock, and each one has its own selected database and transaction.
+ * Transactions started with rl_begin_read run at the same time; any other
+ * waits until every other transaction ended, so every transaction must start
+ * with rl_refresh or rl_begin_read and end with rl_commit or rl_discard.
+ * The database is closed along with its last handle.
+ */
+int rl_open_thread(rlite *db, rlite **thread_db);
 int rl_close(rlite *db);
 
-int rl_ensure_pages(rlite *db);
 int rl_read_header(rlite *db);
 int rl_header_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
 int rl_read(struct rlite *db, rl_data_type *type, long page, void *context, void **obj, int cache);
+/**
+ * Copies `size` bytes of consecutive pages, starting `offset` bytes into
+ * `page`, as the transaction sees them. Pages nobody cached or wrote since
+ * the last checkpoint are read from the file at once, and are not cached.
+ */
+int rl_read_pages(struct rlite *db, long page, long offset, long size, unsigned char *data);
 int rl_get_key_btree(rlite *db, struct rl_btree **btree, int create);
 int rl_alloc_page_number(rlite *db, long *page_number);
 int rl_write(struct rlite *db, rl_data_type *type, long page, void *obj);
+// writes a serialized page, `data` is freed with the page. Unlike rl_write,
+// writing the next empty page does not allocate it.
+int rl_write_raw(struct rlite *db, long page, unsigned char *data);
 int rl_purge_cache(struct rlite *db, long page);
+int rl_cache_drop(struct rlite *db, long page);
 int rl_delete(struct rlite *db, long page);
+// serializes every dirty page, compare write_sequence to detect writes
 int rl_dirty_hash(struct rlite *db, unsigned char **hash);
 int rl_commit(struct rlite *db);
 int rl_discard(struct rlite *db);
+/**
+ * Batches commits to write many of them at once. rl_commit keeps the
+ * transaction open until it has been called max_commits times, the
+ * transaction has max_pages dirty pages, or max_delay milliseconds passed
+ * since the first commit of the group; then everything is written with a
+ * single wal. Limits set to 0 are not checked; all of them set to 0, the
+ * default, writes every commit right away.
+ *
+ * A commit is only durable once its group is written. Until then, its changes
+ * are visible to this connection only, the file stays locked, and they are
+ * lost if the process dies or if a failing command discards the transaction.
+ * Nothing runs in the background: the delay is checked by rl_commit, so call
+ * rl_flush to write a group when no more commands are coming. rl_close
+ * flushes too.
+ */
+int rl_set_group_commit(struct rlite *db, long max_commits, long max_pages, long max_delay);
+// writes the commits pending in the current group, if any
+int rl_flush(struct rlite *db);
+// one of RLITE_SYNC_OFF, RLITE_SYNC_NORMAL or RLITE_SYNC_FULL, see rl_open_options
+int rl_set_sync(struct rlite *db, int sync);
+// see rl_open_options
+int rl_set_busy_timeout(struct rlite *db, long busy_timeout);
+int rl_set_page_cache_size(struct rlite *db, long page_cache_size);
+// does nothing if the database is resident, its cache is all there is
+int rl_cache_clear(struct rlite *db);
+// whether the database was opened with RLITE_OPEN_RESIDENT
+int rl_is_resident(struct rlite *db);
+// whether the database was opened with `flag`, memory databases have them all
+int rl_has_flag(struct rlite *db, int flag);
+int rl_set_io(struct rlite *db, rl_io_ops *io);
 int rl_is_balanced(struct rlite *db);
 int rl_get_selected_db(struct rlite *db);
 int rl_select(struct rlite *db, int selected_database);
@@ -161,6 +357,16 @@ int rl_keys(struct rlite *db, unsigned char *pattern, long patternlen, long *siz
 int rl_randomkey(struct rlite *db, unsigned char **key, long *keylen);
 int rl_flushall(struct rlite *db);
 int rl_flushdb(struct rlite *db);
+int rl_vacuum(struct rlite *db, long max_pages);
+/**
+ * Copies the pages committed to the log to the database file and empties
+ * the log. `pages` is set to the number of pages copied. Readers are waited
+ * for, up to the busy timeout; RL_BUSY if they still hold the file then.
+ */
+int rl_checkpoint(struct rlite *db, long *pages);
+// takes the file for a checkpoint, RL_BUSY if readers have it and `wait` is 0
+// or the busy timeout passed
+int rl_lock_checkpoint(struct rlite *db, int wait);
 
 extern rl_data_type rl_data_type_header;
 extern rl_data_type rl_data_type_btree_hash_sha1_hashkey;
@@ -182,6 +388,8 @@ extern rl_data_type rl_data_type_list_node_long;
 extern rl_data_type rl_data_type_list_node_key;
 extern rl_data_type rl_data_type_string;
 extern rl_data_type rl_data_type_long;
+extern rl_data_type rl_data_type_freelist_trunk;
+extern rl_data_type rl_data_type_multi_string_extents;
 extern rl_data_type rl_data_type_skiplist;
 extern rl_data_type rl_data_type_skiplist_node;
 
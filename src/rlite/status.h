@@ -16,5 +16,6 @@
 #define RL_OVERFLOW 12
 #define RL_OUTDATED 13
 #define RL_TIMEOUT 14
+#define RL_BUSY 15
 
 #endif
@@ -1,8 +1,56 @@
 #ifndef _RL_WAL_H
 #define _RL_WAL_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Persistent wal, used by connections opened with RLITE_JOURNAL_WAL.
+ * Commits append their pages as frames to the log file instead of writing
+ * them to the database. Connections find the latest committed frame of a page
+ * with an in-memory index, brought up to date every time they lock the
+ * database. A checkpoint copies the frames to the database and empties the
+ * log.
+ * Writers in wal mode only share the database lock with readers, after
+ * taking the writer lock: readers never wait for a commit, and see the log
+ * as it was when their transaction started. A checkpoint needs the
+ * database for itself, and is skipped while readers hold it.
+ */
+typedef struct rl_wal_log {
+	char *path;
+	// -1 while there is no log
+	int fd;
+	// to notice the log was deleted and created again
+	ino_t ino;
+	long page_size;
+	unsigned long salt;
+	// offset and running checksum after the last committed frame
+	long long end;
+	uint64_t checksum;
+	long frames;
+	// open addressing, page number to the offset of its latest frame data,
+	// -1 in empty slots
+	long index_alloc;
+	long index_len;
+	long *index_pages;
+	long long *index_offsets;
+} rl_wal_log;
+
 int rl_write_apply_wal(rlite *db);
 int rl_write_wal(const char *wal_path, rlite *db, unsigned char **_data, size_t *_datalen);
 int rl_apply_wal(rlite *db);
 
+int rl_wal_log_init(rlite *db);
+void rl_wal_log_destroy(rlite *db);
+// reads the frames committed since the last call, `changed` is set if there
+// were any or if the log was emptied or deleted by another connection
+int rl_wal_log_refresh(rlite *db, int *changed);
+// RL_FOUND when the page is in the log, reading db->page_size bytes of it
+int rl_wal_log_read(rlite *db, long page, unsigned char *data);
+// copies every frame to the database, which is then truncated to
+// number_of_pages, and empties the log. The database must be locked.
+int rl_wal_checkpoint(rlite *db, long number_of_pages, long *pages);
+// checkpoints and deletes the log
+int rl_wal_log_remove(rlite *db, long number_of_pages);
+
 #endif
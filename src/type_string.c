@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <math.h>
 #include <ctype.h>
@@ -8,46 +9,81 @@
 #include "rlite/util.h"
 #include "rlite/hyperloglog.h"
 
-static int rl_string_get_objects(rlite *db, const unsigned char *key, long keylen, long *_page_number, unsigned long long *expires, long *version)
+static int rl_string_get_objects(rlite *db, const unsigned char *key, long keylen, rl_key *record)
 {
-	long page_number;
 	int retval;
-	unsigned char type;
-	retval = rl_key_get(db, key, keylen, &type, NULL, &page_number, expires, version);
+	retval = rl_key_get_record(db, key, keylen, record);
 	if (retval != RL_FOUND) {
 		goto cleanup;
 	}
-	if (type != RL_TYPE_STRING) {
+	if (record->type != RL_TYPE_STRING) {
 		retval = RL_WRONG_TYPE;
 		goto cleanup;
 	}
-	if (_page_number) {
-		*_page_number = page_number;
-	}
 	retval = RL_OK;
 cleanup:
 	return retval;
 }
 
+/**
+ * Like rl_multi_string_getrange, for the value of a string key wherever it
+ * is stored.
+ */
+static int string_getrange(rlite *db, rl_key *record, unsigned char **_value, long *valuelen, long start, long stop)
+{
+	unsigned char *value, *inline_value, buffer[MAX_LLONG_DIGITS];
+	long inline_valuelen;
+	int retval = RL_OK;
+	if (!RL_KEY_VALUE_INLINE(record)) {
+		return rl_multi_string_getrange(db, record->value_page, _value, valuelen, start, stop);
+	}
+	*valuelen = 0;
+	if (_value) {
+		*_value = NULL;
+	}
+	inline_value = rl_key_inline_value(record, buffer, &inline_valuelen);
+	if (inline_valuelen == 0) {
+		goto cleanup;
+	}
+	rl_normalize_string_range(inline_valuelen, &start, &stop);
+	if (stop < start) {
+		goto cleanup;
+	}
+	*valuelen = stop - start + 1;
+	if (_value) {
+		RL_MALLOC(value, sizeof(unsigned char) * (*valuelen + 1));
+		memcpy(value, &inline_value[start], *valuelen);
+		value[*valuelen] = 0;
+		*_value = value;
+	}
+cleanup:
+	return retval;
+}
+
 int rl_set(struct rlite *db, const unsigned char *key, long keylen, unsigned char *value, long valuelen, int nx, unsigned long long expires)
 {
 	int retval;
-	long page_number;
-	unsigned char type;
-	long value_page, version;
-	retval = rl_key_get(db, key, keylen, &type, NULL, &value_page, NULL, &version);
+	rl_key record;
+	retval = rl_key_get_record(db, key, keylen, &record);
 	if (retval == RL_FOUND) {
 		if (nx) {
 			goto cleanup;
 		}
-		else {
-			RL_CALL(rl_key_delete_with_value, RL_OK, db, key, keylen);
+		// the key keeps its record and the pages of its name, and a string
+		// the pages of its value
+		if (record.type != RL_TYPE_STRING) {
+			RL_CALL(rl_key_delete_value, RL_OK, db, record.type, record.value_page);
+			record.type = RL_TYPE_STRING;
+			record.value_page = 0;
 		}
 	} else {
-		version = rand();
+		record.type = RL_TYPE_STRING;
+		record.value_page = 0;
+		record.version = rand();
 	}
-	RL_CALL(rl_multi_string_set, RL_OK, db, &page_number, value, valuelen);
-	RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, page_number, expires, version + 1);
+	record.expires = expires;
+	record.version++;
+	RL_CALL(rl_key_set_string_record, RL_OK, db, key, keylen, &record, value, valuelen);
 	retval = RL_OK;
 cleanup:
 	return retval;
@@ -55,11 +91,11 @@ cleanup:
 
 int rl_get(struct rlite *db, const unsigned char *key, long keylen, unsigned char **value, long *valuelen)
 {
-	long page_number;
+	rl_key record;
 	int retval;
-	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &page_number, NULL, NULL);
+	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &record);
 	if (valuelen) {
-		RL_CALL(rl_multi_string_get, RL_OK, db, page_number, value, valuelen);
+		RL_CALL(string_getrange, RL_OK, db, &record, value, valuelen, 0, -1);
 	}
 	retval = RL_OK;
 cleanup:
@@ -68,11 +104,22 @@ cleanup:
 
 int rl_get_cpy(struct rlite *db, const unsigned char *key, long keylen, unsigned char *value, long *valuelen)
 {
-	long page_number;
+	rl_key record;
+	unsigned char *inline_value, buffer[MAX_LLONG_DIGITS];
+	long inline_valuelen;
 	int retval;
-	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &page_number, NULL, NULL);
-	if (value || valuelen) {
-		RL_CALL(rl_multi_string_cpy, RL_OK, db, page_number, value, valuelen);
+	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &record);
+	if (RL_KEY_VALUE_INLINE(&record)) {
+		inline_value = rl_key_inline_value(&record, buffer, &inline_valuelen);
+		if (value) {
+			memcpy(value, inline_value, inline_valuelen);
+		}
+		if (valuelen) {
+			*valuelen = inline_valuelen;
+		}
+	}
+	else if (value || valuelen) {
+		RL_CALL(rl_multi_string_cpy, RL_OK, db, record.value_page, value, valuelen);
 	}
 	retval = RL_OK;
 cleanup:
@@ -82,32 +129,44 @@ cleanup:
 int rl_append(struct rlite *db, const unsigned char *key, long keylen, unsigned char *value, long valuelen, long *newlength)
 {
 	int retval;
-	long page_number;
-	long version;
-	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &page_number, NULL, &version);
+	rl_key record;
+	unsigned char *newvalue = NULL, *inline_value, buffer[MAX_LLONG_DIGITS];
+	long newvaluelen, inline_valuelen;
+	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &record);
 	if (retval == RL_NOT_FOUND) {
-		RL_CALL(rl_multi_string_set, RL_OK, db, &page_number, value, valuelen);
-		version = rand();
-		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, page_number, 0, version);
+		RL_CALL(rl_key_set_string, RL_OK, db, key, keylen, value, valuelen, 0, rand());
 		if (newlength) {
 			*newlength = valuelen;
 		}
 	}
+	else if (RL_KEY_VALUE_INLINE(&record)) {
+		// moved to a multi string if it no longer fits in the record
+		inline_value = rl_key_inline_value(&record, buffer, &inline_valuelen);
+		newvaluelen = inline_valuelen + valuelen;
+		RL_MALLOC(newvalue, sizeof(unsigned char) * (newvaluelen + 1));
+		memcpy(newvalue, inline_value, inline_valuelen);
+		memcpy(&newvalue[inline_valuelen], value, valuelen);
+		RL_CALL(rl_key_set_string, RL_OK, db, key, keylen, newvalue, newvaluelen, 0, record.version + 1);
+		if (newlength) {
+			*newlength = newvaluelen;
+		}
+	}
 	else {
-		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, page_number, 0, version + 1);
-		RL_CALL(rl_multi_string_append, RL_OK, db, page_number, value, valuelen, newlength);
+		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, record.value_page, 0, record.version + 1);
+		RL_CALL(rl_multi_string_append, RL_OK, db, record.value_page, value, valuelen, newlength);
 	}
 	retval = RL_OK;
 cleanup:
+	rl_free(newvalue);
 	return retval;
 }
 
 int rl_getrange(struct rlite *db, const unsigned char *key, long keylen, long start, long stop, unsigned char **value, long *valuelen)
 {
-	long page_number;
+	rl_key record;
 	int retval;
-	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &page_number, NULL, NULL);
-	RL_CALL(rl_multi_string_getrange, RL_OK, db, page_number, value, valuelen, start, stop);
+	RL_CALL(rl_string_get_objects, RL_OK, db, key, keylen, &record);
+	RL_CALL(string_getrange, RL_OK, db, &record, value, valuelen, start, stop);
 	retval = RL_OK;
 cleanup:
 	return retval;
@@ -115,15 +174,15 @@ cleanup:
 
 int rl_setrange(struct rlite *db, const unsigned char *key, long keylen, long index, unsigned char *value, long valuelen, long *newlength)
 {
-	long page_number;
-	long version;
-	unsigned long long expires;
+	rl_key record;
+	unsigned char *newvalue = NULL, *inline_value, buffer[MAX_LLONG_DIGITS];
+	long newvaluelen, inline_valuelen;
 	int retval;
 	if (valuelen + index > 512*1024*1024) {
 		retval = RL_INVALID_PARAMETERS;
 		goto cleanup;
 	}
-	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &page_number, &expires, &version);
+	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &record);
 	if (retval == RL_NOT_FOUND) {
 		unsigned char *padding;
 		RL_MALLOC(padding, sizeof(unsigned char) * index);
@@ -132,25 +191,40 @@ int rl_setrange(struct rlite *db, const unsigned char *key, long keylen, long in
 		rl_free(padding);
 		RL_CALL(rl_append, RL_OK, db, key, keylen, value, valuelen, newlength);
 	}
-	else if (retval == RL_OK) {
-		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, page_number, expires, version + 1);
-		RL_CALL(rl_multi_string_setrange, RL_OK, db, page_number, value, valuelen, index, newlength);
+	else if (RL_KEY_VALUE_INLINE(&record)) {
+		inline_value = rl_key_inline_value(&record, buffer, &inline_valuelen);
+		newvaluelen = index + valuelen > inline_valuelen ? index + valuelen : inline_valuelen;
+		newvalue = calloc(newvaluelen + 1, sizeof(unsigned char));
+		if (!newvalue) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(newvalue, inline_value, inline_valuelen);
+		memcpy(&newvalue[index], value, valuelen);
+		RL_CALL(rl_key_set_string, RL_OK, db, key, keylen, newvalue, newvaluelen, record.expires, record.version + 1);
+		if (newlength) {
+			*newlength = newvaluelen;
+		}
+	}
+	else {
+		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_STRING, record.value_page, record.expires, record.version + 1);
+		RL_CALL(rl_multi_string_setrange, RL_OK, db, record.value_page, value, valuelen, index, newlength);
 	}
 	retval = RL_OK;
 cleanup:
+	rl_free(newvalue);
 	return retval;
 }
 
 int rl_incr(struct rlite *db, const unsigned char *key, long keylen, long long increment, long long *newvalue)
 {
-	long page_number;
+	rl_key record;
 	int retval;
 	unsigned char *value = NULL;
 	char *end;
 	long valuelen;
 	long long lvalue;
-	unsigned long long expires;
-	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &page_number, &expires, NULL);
+	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &record);
 	if (retval == RL_NOT_FOUND) {
 		RL_MALLOC(value, sizeof(unsigned char) * MAX_LLONG_DIGITS);
 		valuelen = snprintf((char *)value, MAX_LLONG_DIGITS, "%lld", increment);
@@ -160,18 +234,21 @@ int rl_incr(struct rlite *db, const unsigned char *key, long keylen, long long i
 		retval = rl_set(db, key, keylen, value, valuelen, 1, 0);
 		goto cleanup;
 	}
-	RL_CALL(rl_multi_string_getrange, RL_OK, db, page_number, &value, &valuelen, 0, MAX_LLONG_DIGITS + 1);
-	if (valuelen == MAX_LLONG_DIGITS + 1) {
-		retval = RL_NAN;
-		goto cleanup;
+	if (RL_KEY_VALUE_INLINE(&record) && record.encoding == RL_KEY_ENCODING_INT) {
+		lvalue = record.number;
 	}
-	lvalue = strtoll((char *)value, &end, 10);
-	if (isspace(((char *)value)[0]) || end[0] != '\0' || errno == ERANGE) {
-		retval = RL_NAN;
-		goto cleanup;
+	else {
+		RL_CALL(string_getrange, RL_OK, db, &record, &value, &valuelen, 0, MAX_LLONG_DIGITS + 1);
+		if (valuelen == MAX_LLONG_DIGITS + 1) {
+			retval = RL_NAN;
+			goto cleanup;
+		}
+		lvalue = strtoll((char *)value, &end, 10);
+		if (isspace(((char *)value)[0]) || end[0] != '\0' || errno == ERANGE) {
+			retval = RL_NAN;
+			goto cleanup;
+		}
 	}
-	rl_free(value);
-	value = NULL;
 	if ((increment < 0 && lvalue < 0 && increment < (LLONG_MIN - lvalue)) ||
 	        (increment > 0 && lvalue > 0 && increment > (LLONG_MAX - lvalue))) {
 		retval = RL_OVERFLOW;
@@ -181,9 +258,13 @@ int rl_incr(struct rlite *db, const unsigned char *key, long keylen, long long i
 	if (newvalue) {
 		*newvalue = lvalue;
 	}
-	RL_MALLOC(value, sizeof(unsigned char) * MAX_LLONG_DIGITS);
-	valuelen = snprintf((char *)value, MAX_LLONG_DIGITS, "%lld", lvalue);
-	RL_CALL(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, expires);
+	// the record is updated where it is, with the value stored as a number
+	RL_CALL(rl_string_delete, RL_OK, db, record.value_page);
+	record.value_page = 0;
+	record.encoding = RL_KEY_ENCODING_INT;
+	record.number = lvalue;
+	record.version++;
+	RL_CALL(rl_key_set_record, RL_OK, db, key, keylen, &record);
 	retval = RL_OK;
 cleanup:
 	rl_free(value);
@@ -192,14 +273,13 @@ cleanup:
 
 int rl_incrbyfloat(struct rlite *db, const unsigned char *key, long keylen, double increment, double *newvalue)
 {
-	long page_number;
+	rl_key record;
 	int retval;
 	unsigned char *value = NULL;
 	char *end;
 	long valuelen;
 	double dvalue;
-	unsigned long long expires;
-	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &page_number, &expires, NULL);
+	RL_CALL2(rl_string_get_objects, RL_OK, RL_NOT_FOUND, db, key, keylen, &record);
 	if (retval == RL_NOT_FOUND) {
 		RL_MALLOC(value, sizeof(unsigned char) * MAX_DOUBLE_DIGITS);
 		valuelen = snprintf((char *)value, MAX_DOUBLE_DIGITS, "%lf", increment);
@@ -209,7 +289,7 @@ int rl_incrbyfloat(struct rlite *db, const unsigned char *key, long keylen, doub
 		retval = rl_set(db, key, keylen, value, valuelen, 1, 0);
 		goto cleanup;
 	}
-	RL_CALL(rl_multi_string_getrange, RL_OK, db, page_number, &value, &valuelen, 0, MAX_DOUBLE_DIGITS + 1);
+	RL_CALL(string_getrange, RL_OK, db, &record, &value, &valuelen, 0, MAX_DOUBLE_DIGITS + 1);
 	if (valuelen == MAX_DOUBLE_DIGITS + 1) {
 		retval = RL_NAN;
 		goto cleanup;
@@ -231,7 +311,7 @@ int rl_incrbyfloat(struct rlite *db, const unsigned char *key, long keylen, doub
 	}
 	RL_MALLOC(value, sizeof(unsigned char) * MAX_DOUBLE_DIGITS);
 	valuelen = snprintf((char *)value, MAX_DOUBLE_DIGITS, "%lf", dvalue);
-	RL_CALL(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, expires);
+	RL_CALL(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, record.expires);
 	retval = RL_OK;
 cleanup:
 	rl_free(value);
@@ -617,10 +697,17 @@ cleanup:
 
 int rl_string_pages(struct rlite *db, long page, short *pages)
 {
+	// 0 when the value is in the key record
+	if (page == 0) {
+		return RL_OK;
+	}
 	return rl_multi_string_pages(db, page, pages);
 }
 
 int rl_string_delete(struct rlite *db, long value_page)
 {
+	if (value_page == 0) {
+		return RL_OK;
+	}
 	return rl_multi_string_delete(db, value_page);
 }
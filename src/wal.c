@@ -1,17 +1,23 @@
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "rlite/rlite.h"
+#include "rlite/crc64.h"
 #include "rlite/flock.h"
 #include "rlite/sha1.h"
-
-#ifdef RL_DEBUG
-int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len);
-#endif
+#include "rlite/util.h"
+#include "rlite/wal.h"
 
 static const char *identifier = "rlwal0.0";
 
+static int rl_wal_log_append(rlite *db);
+
 static char *get_wal_filename(const char *filename) {
 	return rl_get_filename_with_suffix(filename, ".wal");
 }
@@ -30,7 +36,8 @@ static int rl_read_wal(const char *wal_path, unsigned char **_data, size_t *_dat
 		// file does not exist! empty data, retval=ok are set
 		goto cleanup;
 	}
-	RL_CALL(rl_flock, RL_OK, fp, RLITE_FLOCK_EX);
+	// waits for the writer to finish it
+	RL_CALL(rl_flock, RL_OK, fp, RLITE_FLOCK_SH);
 	fseek(fp, 0, SEEK_END);
 	datalen = (size_t)ftell(fp);
 	fseek(fp, 0, SEEK_SET);
@@ -68,24 +75,34 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 	}
 	int retval;
 	rl_file_driver *driver = db->driver;
-	size_t written, position = 28;
+	size_t position = 28;
 	long page_number;
 	long i, write_pages_len = get_4bytes(&data[position]);
+	long *page_numbers = NULL;
+	unsigned char **pages = NULL;
 	position += 4;
-	int readwrite = (driver->mode & RLITE_OPEN_READWRITE) != 0;
+	// read transactions do not hold the writer lock, and leave the file alone
+	int readwrite = (driver->mode & RLITE_OPEN_READWRITE) != 0 && !db->read_snapshot;
 	rl_page *page_obj;
+	if (readwrite && write_pages_len > 0) {
+		RL_ARENA_MALLOC(&db->arena, page_numbers, sizeof(long) * write_pages_len);
+		RL_ARENA_MALLOC(&db->arena, pages, sizeof(unsigned char *) * write_pages_len);
+	}
 	for (i = 0; i < write_pages_len; i++) {
 		page_number = get_4bytes(&data[position]);
 		position += 4;
+		if (page_number == 0) {
+			// header has changed! need to parse it before using db->page_size
+			RL_CALL(rl_header_deserialize, RL_OK, db, NULL, NULL, &data[position]);
+		}
+		if (position + db->page_size > datalen) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
 		if (readwrite) {
-			fseek(driver->fp, page_number * db->page_size, SEEK_SET);
-			written = fwrite(&data[position], sizeof(unsigned char), db->page_size, driver->fp);
-			if ((size_t)db->page_size != written) {
-				// at this point we have corrupted the database
-				// we have written something, but not all of it
-				retval = RL_UNEXPECTED;
-				goto cleanup;
-			}
+			// pages are written together once the whole wal is parsed
+			page_numbers[i] = page_number;
+			pages[i] = &data[position];
 		} else {
 			/**
 			 * Since we are in read-only mode, but the wal is fully written,
@@ -96,7 +113,6 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 			 */
 
 			// TODO: better cleanup on OOM
-			rl_ensure_pages(db);
 			RL_MALLOC(page_obj, sizeof(*page_obj));
 #ifdef RL_DEBUG
 			RL_MALLOC(page_obj->serialized_data, db->page_size * sizeof(unsigned char));
@@ -104,29 +120,38 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 #endif
 			page_obj->page_number = page_number;
 			page_obj->type = NULL;
+			page_obj->last_access = ++db->page_cache_clock;
 			page_obj->obj = rl_malloc(sizeof(unsigned char) * db->page_size);
 			if (page_obj->obj == NULL) {
 				rl_free(page_obj);
-				return RL_OUT_OF_MEMORY;
+				retval = RL_OUT_OF_MEMORY;
+				goto cleanup;
 			}
 			memcpy(page_obj->obj, &data[position], db->page_size);
-			db->read_pages[db->read_pages_len] = page_obj;
-			db->read_pages_len++;
-		}
-		if (page_number == 0) {
-			// header has changed! need to parse it before using db->page_size
-			RL_CALL(rl_header_deserialize, RL_OK, db, NULL, NULL, &data[position]);
+			retval = rl_page_cache_add(db->read_pages, page_obj);
+			if (retval != RL_OK) {
+				rl_free(page_obj->obj);
+				rl_free(page_obj);
+				goto cleanup;
+			}
 		}
 		position += db->page_size;
 	}
+	if (readwrite && write_pages_len > 0) {
+		// a failure at this point may leave the database partially written,
+		// the wal is not deleted and will be applied again
+		RL_CALL(driver->io->write_pages, RL_OK, driver->handle, db->page_size, write_pages_len, page_numbers, pages);
+	}
 	retval = RL_OK;
 cleanup:
+	rl_arena_free(&db->arena, pages);
+	rl_arena_free(&db->arena, page_numbers);
 	return retval;
 }
 
 static int create_wal_data(rlite *db, unsigned char **_data, size_t *_datalen) {
 	// 20 (sha1) + 8 (header) + 4 (number of pages)
-	size_t datalen = db->write_pages_len * (db->page_size + 4) + 32;
+	size_t datalen = db->write_pages.len * (db->page_size + 4) + 32;
 	unsigned char *data;
 	int i, retval = RL_OK;
 	rl_page *page;
@@ -136,10 +161,10 @@ static int create_wal_data(rlite *db, unsigned char **_data, size_t *_datalen) {
 	size_t position = strlen(identifier);
 	memcpy(data, identifier, position);
 	position += 20; // leaving space blank for sha1
-	put_4bytes(&data[position], db->write_pages_len);
+	put_4bytes(&data[position], db->write_pages.len);
 	position += 4;
-	for (i = 0; i < db->write_pages_len; i++) {
-		page = db->write_pages[i];
+	for (i = 0; i < db->write_pages.len; i++) {
+		page = db->write_pages.pages[i];
 		put_4bytes(&data[position], page->page_number);
 		position += 4;
 		memset(&data[position], 0, db->page_size);
@@ -189,16 +214,19 @@ cleanup:
 
 int rl_write_apply_wal(rlite *db) {
 	FILE *fp = NULL;
-	int retval = RL_OK;
-	long i, page_number;
+	int retval = RL_OK, shrunk;
+	long i;
 	rl_page *page;
 	char *wal_path = NULL;
 	unsigned char *data = NULL;
 	size_t datalen;
 #ifdef RL_DEBUG
-	for (i = 0; i < db->read_pages_len; i++) {
+	for (i = 0; i < db->read_pages->len; i++) {
+		page = db->read_pages->pages[i];
+		if (page->type == NULL) {
+			continue;
+		}
 		RL_MALLOC(data, db->page_size * sizeof(unsigned char));
-		page = db->read_pages[i];
 		memset(data, 0, db->page_size);
 		retval = page->type->serialize(db, page->obj, data);
 		if (retval != RL_OK) {
@@ -211,8 +239,7 @@ int rl_write_apply_wal(rlite *db) {
 					fprintf(stderr, "Different data in position %ld (expected %d, got %d)\n", i, page->serialized_data[i], data[i]);
 				}
 			}
-			retval = rl_search_cache(db, page->type, page->page_number, NULL, NULL, NULL, db->write_pages, db->write_pages_len);
-			if (retval == RL_FOUND) {
+			if (rl_page_cache_get(&db->write_pages, page->page_number)) {
 				fprintf(stderr, "Page found in write_pages\n");
 			}
 			else {
@@ -224,8 +251,32 @@ int rl_write_apply_wal(rlite *db) {
 		data = NULL;
 	}
 #endif
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (db->write_pages.len > 1) {
+		// the wal is written, and applied, in page order
+		RL_CALL(rl_page_cache_sort, RL_OK, &db->write_pages);
+	}
+	if (db->driver_type == RL_FILE_DRIVER && db->journal_mode == RLITE_JOURNAL_WAL) {
+		rl_file_driver *driver = db->driver;
+		if (db->write_pages.len > 0) {
+			RL_CALL(rl_wal_log_append, RL_OK, db);
+			if (db->wal_autocheckpoint > 0 && driver->log->frames >= db->wal_autocheckpoint) {
+				// skipped while readers use the log, the next commit tries again
+				RL_CALL2(rl_lock_checkpoint, RL_OK, RL_BUSY, db, 0);
+				if (retval == RL_OK) {
+					RL_CALL(rl_wal_checkpoint, RL_OK, db, db->number_of_pages, NULL);
+				}
+				retval = RL_OK;
+			}
+		}
+	}
+	else if (db->driver_type == RL_FILE_DRIVER && db->write_pages.len > 0) {
+		// transactions that did not write anything have nothing to sync
 		rl_file_driver *driver = db->driver;
+		if (driver->log->fd != -1) {
+			// left by a connection in wal mode, its frames would hide the
+			// pages written next
+			RL_CALL(rl_wal_log_remove, RL_OK, db, db->initial_number_of_pages);
+		}
 		wal_path = get_wal_filename(driver->filename);
 		if (wal_path == NULL) {
 			retval = RL_OUT_OF_MEMORY;
@@ -238,39 +289,53 @@ int rl_write_apply_wal(rlite *db) {
 		}
 		RL_CALL(rl_flock, RL_OK, fp, RLITE_FLOCK_EX);
 		RL_CALL(rl_write_wal_file, RL_OK, fp, db, &data, &datalen);
+		if (db->sync != RLITE_SYNC_OFF) {
+			// the wal must be complete on disk before the database is touched
+			if (fflush(fp) != 0) {
+				retval = RL_UNEXPECTED;
+				goto cleanup;
+			}
+			RL_CALL(rl_io_sync_fd, RL_OK, fileno(fp));
+		}
+		if (db->sync == RLITE_SYNC_FULL) {
+			// a crash must not lose the wal entry in the directory either
+			RL_CALL(rl_io_sync_dir, RL_OK, wal_path);
+		}
+		// applying the header resets initial_number_of_pages
+		shrunk = db->number_of_pages < db->initial_number_of_pages;
 		RL_CALL(rl_apply_wal_data, RL_OK, db, data, datalen, 1);
+		RL_CALL(driver->io->flush, RL_OK, driver->handle);
+		if (shrunk) {
+			// the header no longer refers to the pages at the end
+			RL_CALL(driver->io->truncate, RL_OK, driver->handle, (long long)db->number_of_pages * db->page_size);
+		}
+		if (db->sync == RLITE_SYNC_FULL) {
+			// and the database before the wal is gone
+			RL_CALL(driver->io->sync, RL_OK, driver->handle);
+		}
 		ftruncate(fileno(fp), 0);
 		fclose(fp);
 		fp = NULL;
 		RL_CALL(rl_delete_wal, RL_OK, wal_path);
-		if (db->write_pages_len > 0) {
-			fflush(driver->fp);
+		if (db->sync == RLITE_SYNC_FULL) {
+			RL_CALL(rl_io_sync_dir, RL_OK, wal_path);
 		}
 		rl_free(data);
 		data = NULL;
 	}
-	else if (db->driver_type == RL_MEMORY_DRIVER) {
+	// resident databases commit by moving the written pages to the read cache
+	else if (db->driver_type == RL_MEMORY_DRIVER && !rl_is_resident(db)) {
 		rl_memory_driver *driver = db->driver;
-		if (db->write_pages_len > 0) {
-			page = db->write_pages[db->write_pages_len - 1];
-			if ((page->page_number + 1) * db->page_size > driver->datalen) {
-				void *tmp = rl_realloc(driver->data, (page->page_number + 1) * db->page_size * sizeof(unsigned char));
-				if (!tmp) {
-					retval = RL_OUT_OF_MEMORY;
-					goto cleanup;
-				}
-				driver->data = tmp;
-				driver->datalen = (page->page_number + 1) * db->page_size;
-			}
-		}
-		for (i = 0; i < db->write_pages_len; i++) {
-			page = db->write_pages[i];
-			page_number = page->page_number;
-			memset(&driver->data[page_number * db->page_size], 0, db->page_size);
+		unsigned char *page_data;
+		for (i = 0; i < db->write_pages.len; i++) {
+			page = db->write_pages.pages[i];
+			RL_CALL(rl_page_store_put, RL_OK, &driver->store, page->page_number, &page_data);
+			memset(page_data, 0, db->page_size);
 			if (page->type) {
-				retval = page->type->serialize(db, page->obj, (unsigned char *)&driver->data[page_number * db->page_size]);
+				RL_CALL(page->type->serialize, RL_OK, db, page->obj, page_data);
 			}
 		}
+		rl_page_store_truncate(&driver->store, db->number_of_pages);
 	}
 cleanup:
 	if (fp) {
@@ -295,13 +360,24 @@ int rl_apply_wal(rlite *db) {
 		retval = RL_OK;
 		goto cleanup;
 	}
+	if ((driver->mode & RLITE_OPEN_READWRITE) != 0 && !db->read_snapshot && driver->locked != RLITE_FLOCK_EX) {
+		// left by a writer in delete mode that crashed, applying it changes
+		// pages readers may be reading
+		RL_CALL(rl_lock_checkpoint, RL_OK, db, 1);
+		if (access(wal_path, F_OK) != 0) {
+			retval = RL_OK;
+			goto cleanup;
+		}
+	}
 
+	// the file is about to change under the cached pages
+	RL_CALL(rl_cache_clear, RL_OK, db);
 	RL_CALL(rl_read_wal, RL_OK, wal_path, &data, &datalen);
 	if (data != NULL) {
 		// regardless the data applies or not, the wal file needs to go away
 		// do not goto cleanup if it fails!
 		rl_apply_wal_data(db, data, datalen, 0);
-		if ((driver->mode & RLITE_OPEN_READWRITE) != 0) {
+		if ((driver->mode & RLITE_OPEN_READWRITE) != 0 && !db->read_snapshot) {
 			RL_CALL(rl_delete_wal, RL_OK, wal_path);
 		}
 	}
@@ -311,3 +387,471 @@ cleanup:
 	rl_free(data);
 	return retval;
 }
+
+#define LOG_HEADER_SIZE 16
+// page number, commit flag, salt and checksum
+#define FRAME_HEADER_SIZE 20
+#define CHECKPOINT_BATCH 256
+
+static const char *log_identifier = "rllog0.0";
+
+static void log_index_reset(rl_wal_log *log)
+{
+	if (log->index_pages) {
+		memset(log->index_pages, 0xff, sizeof(long) * log->index_alloc);
+	}
+	log->index_len = 0;
+	log->frames = 0;
+}
+
+static int log_index_set(rl_wal_log *log, long page, long long offset)
+{
+	int retval = RL_OK;
+	long i, alloc, mask, *old_pages = NULL;
+	long long *old_offsets = NULL;
+	if ((log->index_len + 1) * 2 > log->index_alloc) {
+		old_pages = log->index_pages;
+		old_offsets = log->index_offsets;
+		alloc = log->index_alloc ? log->index_alloc * 2 : 64;
+		RL_MALLOC(log->index_pages, sizeof(long) * alloc);
+		log->index_offsets = rl_malloc(sizeof(long long) * alloc);
+		if (!log->index_offsets) {
+			rl_free(log->index_pages);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memset(log->index_pages, 0xff, sizeof(long) * alloc);
+		i = log->index_alloc;
+		log->index_alloc = alloc;
+		log->index_len = 0;
+		while (i-- > 0) {
+			if (old_pages[i] != -1) {
+				log_index_set(log, old_pages[i], old_offsets[i]);
+			}
+		}
+		rl_free(old_pages);
+		rl_free(old_offsets);
+		old_pages = NULL;
+		old_offsets = NULL;
+	}
+	mask = log->index_alloc - 1;
+	for (i = (page * 2654435761UL) & mask; log->index_pages[i] != -1 && log->index_pages[i] != page; i = (i + 1) & mask);
+	if (log->index_pages[i] == -1) {
+		log->index_pages[i] = page;
+		log->index_len++;
+	}
+	log->index_offsets[i] = offset;
+cleanup:
+	if (retval != RL_OK) {
+		log->index_pages = old_pages;
+		log->index_offsets = old_offsets;
+	}
+	return retval;
+}
+
+static long long log_index_get(rl_wal_log *log, long page)
+{
+	long i, mask;
+	if (log->index_len == 0) {
+		return -1;
+	}
+	mask = log->index_alloc - 1;
+	for (i = (page * 2654435761UL) & mask; log->index_pages[i] != -1; i = (i + 1) & mask) {
+		if (log->index_pages[i] == page) {
+			return log->index_offsets[i];
+		}
+	}
+	return -1;
+}
+
+static int log_pread(int fd, unsigned char *data, size_t size, long long offset, size_t *_read)
+{
+	ssize_t r;
+	size_t read = 0;
+	while (read < size) {
+		r = pread(fd, &data[read], size - read, (off_t)(offset + read));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0) {
+			return RL_UNEXPECTED;
+		}
+		if (r == 0) {
+			break;
+		}
+		read += r;
+	}
+	*_read = read;
+	return RL_OK;
+}
+
+static int log_pwrite(int fd, const unsigned char *data, size_t size, long long offset)
+{
+	ssize_t r;
+	size_t written = 0;
+	while (written < size) {
+		r = pwrite(fd, &data[written], size - written, (off_t)(offset + written));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return RL_UNEXPECTED;
+		}
+		written += r;
+	}
+	return RL_OK;
+}
+
+static void log_close(rl_wal_log *log)
+{
+	if (log->fd != -1) {
+		close(log->fd);
+		log->fd = -1;
+	}
+	log->salt = 0;
+	log->end = 0;
+	log_index_reset(log);
+}
+
+/**
+ * Starts an empty log, writing its header. The salt changes every time, so
+ * frames left after the header by a previous log do not pass as committed.
+ */
+static int log_start(rlite *db, rl_wal_log *log)
+{
+	int retval;
+	unsigned char header[LOG_HEADER_SIZE];
+	memcpy(header, log_identifier, 8);
+	put_4bytes(&header[8], db->page_size);
+	log->salt = (log->salt + 1 + (rl_mstime() & 0xffff)) & 0xffffffff;
+	put_4bytes(&header[12], log->salt);
+	RL_CALL(log_pwrite, RL_OK, log->fd, header, LOG_HEADER_SIZE, 0);
+	if (ftruncate(log->fd, LOG_HEADER_SIZE) != 0) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	log->page_size = db->page_size;
+	log->end = LOG_HEADER_SIZE;
+	log->checksum = rl_crc64(0, header, LOG_HEADER_SIZE);
+	log_index_reset(log);
+cleanup:
+	return retval;
+}
+
+int rl_wal_log_init(rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log;
+	RL_MALLOC(log, sizeof(*log));
+	log->path = rl_get_filename_with_suffix(driver->filename, ".log");
+	if (!log->path) {
+		rl_free(log);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	log->fd = -1;
+	log->salt = 0;
+	log->end = 0;
+	log->index_alloc = 0;
+	log->index_pages = NULL;
+	log->index_offsets = NULL;
+	log_index_reset(log);
+	driver->log = log;
+cleanup:
+	return retval;
+}
+
+void rl_wal_log_destroy(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = driver->log;
+	if (!log) {
+		return;
+	}
+	log_close(log);
+	rl_free(log->index_pages);
+	rl_free(log->index_offsets);
+	rl_free(log->path);
+	rl_free(log);
+	driver->log = NULL;
+}
+
+/**
+ * Reads the frames after log->end. Frames become visible when the one
+ * flagged as the last of its commit is read; a torn or stale frame, found by
+ * its salt or checksum, ends the log.
+ */
+static int log_scan(rl_wal_log *log, int *changed)
+{
+	int retval = RL_OK;
+	long i, pending = 0, pending_alloc = 0, *pending_pages = NULL;
+	size_t frame_size = FRAME_HEADER_SIZE + log->page_size, read;
+	long long position = log->end;
+	uint64_t checksum = log->checksum;
+	unsigned char *frame = NULL;
+	void *tmp;
+	RL_MALLOC(frame, frame_size);
+	while (1) {
+		RL_CALL(log_pread, RL_OK, log->fd, frame, frame_size, position, &read);
+		if (read != frame_size || (unsigned long)get_4bytes(&frame[8]) != log->salt) {
+			break;
+		}
+		checksum = rl_crc64(checksum, frame, 12);
+		checksum = rl_crc64(checksum, &frame[FRAME_HEADER_SIZE], log->page_size);
+		if (get_8bytes(&frame[12]) != checksum) {
+			break;
+		}
+		if (pending == pending_alloc) {
+			pending_alloc = pending_alloc ? pending_alloc * 2 : 16;
+			tmp = rl_realloc(pending_pages, sizeof(long) * pending_alloc);
+			if (!tmp) {
+				retval = RL_OUT_OF_MEMORY;
+				goto cleanup;
+			}
+			pending_pages = tmp;
+		}
+		pending_pages[pending++] = get_4bytes(frame);
+		position += frame_size;
+		if (get_4bytes(&frame[4])) {
+			for (i = 0; i < pending; i++) {
+				RL_CALL(log_index_set, RL_OK, log, pending_pages[i], position - (pending - i) * frame_size + FRAME_HEADER_SIZE);
+			}
+			log->frames += pending;
+			log->end = position;
+			log->checksum = checksum;
+			pending = 0;
+			*changed = 1;
+		}
+	}
+cleanup:
+	rl_free(frame);
+	rl_free(pending_pages);
+	return retval;
+}
+
+int rl_wal_log_refresh(rlite *db, int *changed)
+{
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = driver->log;
+	struct stat st;
+	unsigned char header[LOG_HEADER_SIZE];
+	size_t read;
+	int retval = RL_OK;
+	*changed = 0;
+	if (stat(log->path, &st) != 0) {
+		if (log->fd != -1) {
+			// checkpointed and deleted by another connection
+			*changed = 1;
+			log_close(log);
+		}
+		goto cleanup;
+	}
+	if (log->fd != -1 && st.st_ino != log->ino) {
+		*changed = 1;
+		log_close(log);
+	}
+	if (log->fd == -1) {
+		log->fd = open(log->path, (driver->mode & RLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY);
+		if (log->fd == -1) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		log->ino = st.st_ino;
+	}
+	RL_CALL(log_pread, RL_OK, log->fd, header, LOG_HEADER_SIZE, 0, &read);
+	if (read != LOG_HEADER_SIZE || memcmp(header, log_identifier, 8) != 0) {
+		// created but never written, the next commit starts it
+		if (log->end != 0) {
+			*changed = 1;
+		}
+		log->end = 0;
+		log_index_reset(log);
+		goto cleanup;
+	}
+	if ((unsigned long)get_4bytes(&header[12]) != log->salt || log->end == 0) {
+		// emptied by a checkpoint, or just opened
+		if (log->frames > 0) {
+			*changed = 1;
+		}
+		log_index_reset(log);
+		log->page_size = get_4bytes(&header[8]);
+		log->salt = get_4bytes(&header[12]);
+		log->end = LOG_HEADER_SIZE;
+		log->checksum = rl_crc64(0, header, LOG_HEADER_SIZE);
+	}
+	if (st.st_size > log->end) {
+		RL_CALL(log_scan, RL_OK, log, changed);
+	}
+cleanup:
+	return retval;
+}
+
+int rl_wal_log_read(rlite *db, long page, unsigned char *data)
+{
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = driver->log;
+	long long offset = log_index_get(log, page);
+	size_t read, size = db->page_size < log->page_size ? db->page_size : log->page_size;
+	int retval;
+	if (offset == -1) {
+		return RL_NOT_FOUND;
+	}
+	RL_CALL(log_pread, RL_OK, log->fd, data, size, offset, &read);
+	if (read != size) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (size < (size_t)db->page_size) {
+		memset(&data[size], 0, db->page_size - size);
+	}
+	retval = RL_FOUND;
+cleanup:
+	return retval;
+}
+
+/**
+ * Appends the pages written in the transaction as a single commit, with one
+ * write and, unless sync is off, one sync of the log.
+ */
+static int rl_wal_log_append(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = driver->log;
+	struct stat st;
+	unsigned char *data = NULL, *frame;
+	size_t frame_size = FRAME_HEADER_SIZE + db->page_size;
+	uint64_t checksum;
+	rl_page *page;
+	long i;
+	int retval = RL_OK;
+	if (log->fd == -1) {
+		log->fd = open(log->path, O_RDWR | O_CREAT, 0644);
+		if (log->fd == -1 || fstat(log->fd, &st) != 0) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		log->ino = st.st_ino;
+		if (db->sync == RLITE_SYNC_FULL) {
+			RL_CALL(rl_io_sync_dir, RL_OK, log->path);
+		}
+	}
+	if (log->end == 0) {
+		RL_CALL(log_start, RL_OK, db, log);
+	}
+	RL_ARENA_MALLOC(&db->arena, data, frame_size * db->write_pages.len);
+	checksum = log->checksum;
+	for (i = 0; i < db->write_pages.len; i++) {
+		page = db->write_pages.pages[i];
+		frame = &data[frame_size * i];
+		put_4bytes(frame, page->page_number);
+		put_4bytes(&frame[4], i == db->write_pages.len - 1);
+		put_4bytes(&frame[8], log->salt);
+		memset(&frame[FRAME_HEADER_SIZE], 0, db->page_size);
+		if (page->type) {
+			RL_CALL(page->type->serialize, RL_OK, db, page->obj, &frame[FRAME_HEADER_SIZE]);
+		}
+		checksum = rl_crc64(checksum, frame, 12);
+		checksum = rl_crc64(checksum, &frame[FRAME_HEADER_SIZE], db->page_size);
+		put_8bytes(&frame[12], checksum);
+	}
+	RL_CALL(log_pwrite, RL_OK, log->fd, data, frame_size * db->write_pages.len, log->end);
+	if (db->sync != RLITE_SYNC_OFF) {
+		RL_CALL(rl_io_sync_fd, RL_OK, log->fd);
+	}
+	for (i = 0; i < db->write_pages.len; i++) {
+		RL_CALL(log_index_set, RL_OK, log, db->write_pages.pages[i]->page_number, log->end + frame_size * i + FRAME_HEADER_SIZE);
+	}
+	log->frames += db->write_pages.len;
+	log->end += frame_size * db->write_pages.len;
+	log->checksum = checksum;
+cleanup:
+	rl_arena_free(&db->arena, data);
+	return retval;
+}
+
+static int compare_page_offsets(const void *a, const void *b)
+{
+	long pa = ((const long *)a)[0], pb = ((const long *)b)[0];
+	return pa < pb ? -1 : pa > pb;
+}
+
+int rl_wal_checkpoint(rlite *db, long number_of_pages, long *_pages)
+{
+	rl_file_driver *driver;
+	rl_wal_log *log;
+	long i, j, count, pages = 0, *entries = NULL, page_numbers[CHECKPOINT_BATCH];
+	unsigned char *data = NULL, *batch[CHECKPOINT_BATCH];
+	size_t read;
+	int retval = RL_OK;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		goto cleanup;
+	}
+	driver = db->driver;
+	log = driver->log;
+	if (log->fd == -1 || (driver->mode & RLITE_OPEN_READWRITE) == 0) {
+		goto cleanup;
+	}
+	if (log->frames > 0) {
+		// latest frame of each page, in page order, as pairs of page and offset
+		RL_ARENA_MALLOC(&db->arena, entries, sizeof(long) * 2 * log->index_len);
+		for (i = 0, j = 0; i < log->index_alloc; i++) {
+			if (log->index_pages[i] != -1) {
+				entries[j * 2] = log->index_pages[i];
+				entries[j * 2 + 1] = (long)log->index_offsets[i];
+				j++;
+			}
+		}
+		qsort(entries, log->index_len, sizeof(long) * 2, compare_page_offsets);
+		RL_ARENA_MALLOC(&db->arena, data, (size_t)log->page_size * CHECKPOINT_BATCH);
+		for (i = 0; i < log->index_len; i += count) {
+			count = log->index_len - i < CHECKPOINT_BATCH ? log->index_len - i : CHECKPOINT_BATCH;
+			for (j = 0; j < count; j++) {
+				page_numbers[j] = entries[(i + j) * 2];
+				batch[j] = &data[log->page_size * j];
+				RL_CALL(log_pread, RL_OK, log->fd, batch[j], log->page_size, entries[(i + j) * 2 + 1], &read);
+				if (read != (size_t)log->page_size) {
+					retval = RL_UNEXPECTED;
+					goto cleanup;
+				}
+			}
+			RL_CALL(driver->io->write_pages, RL_OK, driver->handle, log->page_size, count, page_numbers, batch);
+		}
+		pages = log->index_len;
+		RL_CALL(driver->io->flush, RL_OK, driver->handle);
+		RL_CALL(driver->io->truncate, RL_OK, driver->handle, (long long)number_of_pages * log->page_size);
+		if (db->sync != RLITE_SYNC_OFF) {
+			// the database must have every page before the log is emptied
+			RL_CALL(driver->io->sync, RL_OK, driver->handle);
+		}
+	}
+	RL_CALL(log_start, RL_OK, db, log);
+	if (db->sync != RLITE_SYNC_OFF) {
+		RL_CALL(rl_io_sync_fd, RL_OK, log->fd);
+	}
+cleanup:
+	rl_arena_free(&db->arena, data);
+	rl_arena_free(&db->arena, entries);
+	if (_pages) {
+		*_pages = pages;
+	}
+	return retval;
+}
+
+int rl_wal_log_remove(rlite *db, long number_of_pages)
+{
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = driver->log;
+	int retval = RL_OK;
+	if (log->fd == -1) {
+		goto cleanup;
+	}
+	RL_CALL(rl_wal_checkpoint, RL_OK, db, number_of_pages, NULL);
+	unlink(log->path);
+	log_close(log);
+	if (db->sync == RLITE_SYNC_FULL) {
+		RL_CALL(rl_io_sync_dir, RL_OK, log->path);
+	}
+cleanup:
+	return retval;
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/type_hash.h"
+#include "../src/rlite/type_set.h"
+#include "../src/rlite/type_zset.h"
+#include "../src/rlite/util.h"
+
+#define ALLOCS_BENCH_FILE "rlite-bench.rld"
+#define ALLOCS_BENCH_KEYS 2000
+
+static long allocs = 0;
+
+#ifdef BENCH_COUNT_ALLOCS
+// the bench is linked with --wrap, so every allocation goes through these
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+#endif
+
+enum {
+	ALLOCS_SET,
+	ALLOCS_GET,
+	ALLOCS_HSET,
+	ALLOCS_HGET,
+	ALLOCS_SADD,
+	ALLOCS_ZADD,
+};
+
+static const char *command_names[] = {"set", "get", "hset", "hget", "sadd", "zadd"};
+
+static int run_command(rlite *db, int command, long i)
+{
+	int retval;
+	unsigned char key[32], member[32], value[100], *data = NULL, *members[1];
+	long keylen, memberlen, datalen, added;
+	for (datalen = 0; datalen < (long)sizeof(value); datalen++) {
+		value[datalen] = 'a' + datalen % 26;
+	}
+	keylen = snprintf((char *)key, sizeof(key), "%s%ld", command_names[command], i % 100);
+	memberlen = snprintf((char *)member, sizeof(member), "member%ld", i);
+	switch (command) {
+		case ALLOCS_SET:
+			keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+			RL_CALL(rl_set, RL_OK, db, key, keylen, value, sizeof(value), 0, 0);
+			break;
+		case ALLOCS_GET:
+			keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+			RL_CALL(rl_get, RL_OK, db, key, keylen, &data, &datalen);
+			break;
+		case ALLOCS_HSET:
+			RL_CALL(rl_hset, RL_OK, db, key, keylen, member, memberlen, value, sizeof(value), &added, 1);
+			break;
+		case ALLOCS_HGET:
+			keylen = snprintf((char *)key, sizeof(key), "%s%ld", command_names[ALLOCS_HSET], i % 100);
+			RL_CALL(rl_hget, RL_FOUND, db, key, keylen, member, memberlen, &data, &datalen);
+			break;
+		case ALLOCS_SADD:
+			members[0] = member;
+			RL_CALL(rl_sadd, RL_OK, db, key, keylen, 1, members, &memberlen, &added);
+			break;
+		case ALLOCS_ZADD:
+			RL_CALL(rl_zadd, RL_OK, db, key, keylen, (double)i, member, memberlen);
+			break;
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+/**
+ * Allocations made by every command, each one in its own transaction, with
+ * the pages they read cached by the previous ones.
+ */
+int allocs_bench()
+{
+	int retval, command;
+	rlite *db = NULL;
+	long i, start_allocs;
+	double start;
+	char name[64];
+
+	unlink(ALLOCS_BENCH_FILE);
+	RL_CALL(rl_open, RL_OK, ALLOCS_BENCH_FILE, &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	for (command = ALLOCS_SET; command <= ALLOCS_ZADD; command++) {
+		start_allocs = allocs;
+		start = bench_time();
+		for (i = 0; i < ALLOCS_BENCH_KEYS; i++) {
+			RL_CALL(run_command, RL_OK, db, command, i);
+			RL_CALL(rl_commit, RL_OK, db);
+		}
+		snprintf(name, sizeof(name), "%s", command_names[command]);
+		bench_report(name, ALLOCS_BENCH_KEYS, "command", bench_time() - start);
+#ifdef BENCH_COUNT_ALLOCS
+		snprintf(name, sizeof(name), "%s allocations", command_names[command]);
+		printf("%-40s %10ld %-8s %12.1f allocs/command\n", name, allocs - start_allocs, "alloc", (double)(allocs - start_allocs) / ALLOCS_BENCH_KEYS);
+#endif
+	}
+	(void)start_allocs;
+cleanup:
+	rl_close(db);
+	unlink(ALLOCS_BENCH_FILE);
+	return retval == RL_OK ? 0 : 1;
+}
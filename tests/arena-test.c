@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/status.h"
+#include "../src/rlite/arena.h"
+
+TEST arena_lifo_test()
+{
+	rl_arena arena;
+	unsigned char *first, *second, *third;
+	rl_arena_init(&arena);
+
+	first = rl_arena_malloc(&arena, 10);
+	ASSERT(first != NULL);
+	second = rl_arena_malloc(&arena, 100);
+	ASSERT(second != NULL);
+	ASSERT(second > first);
+	memset(first, 1, 10);
+	memset(second, 2, 100);
+
+	rl_arena_free(&arena, second);
+	third = rl_arena_malloc(&arena, 50);
+	EXPECT_PTR(second, third);
+
+	// not the last allocation, it is kept
+	rl_arena_free(&arena, first);
+	EXPECT_INT(first[0], 1);
+	rl_arena_free(&arena, third);
+	rl_arena_free(&arena, first);
+	third = rl_arena_malloc(&arena, 10);
+	EXPECT_PTR(first, third);
+
+	rl_arena_destroy(&arena);
+	PASS();
+}
+
+TEST arena_large_test()
+{
+	rl_arena arena;
+	unsigned char *small, *large, *next;
+	rl_arena_init(&arena);
+
+	small = rl_arena_malloc(&arena, 10);
+	ASSERT(small != NULL);
+	large = rl_arena_malloc(&arena, 1024 * 1024);
+	ASSERT(large != NULL);
+	memset(large, 3, 1024 * 1024);
+
+	// freeing the large allocation goes back to the first chunk
+	rl_arena_free(&arena, large);
+	next = rl_arena_malloc(&arena, 10);
+	EXPECT_PTR(small + 16, next - 16);
+
+	rl_arena_destroy(&arena);
+	PASS();
+}
+
+TEST arena_reset_test()
+{
+	rl_arena arena;
+	unsigned char *first, *ptr;
+	long i;
+	rl_arena_init(&arena);
+
+	first = rl_arena_malloc(&arena, 10);
+	ASSERT(first != NULL);
+	for (i = 0; i < 1000; i++) {
+		ptr = rl_arena_malloc(&arena, 1000);
+		ASSERT(ptr != NULL);
+		memset(ptr, 4, 1000);
+	}
+
+	rl_arena_reset(&arena);
+	ptr = rl_arena_malloc(&arena, 10);
+	EXPECT_PTR(first, ptr);
+
+	rl_arena_destroy(&arena);
+	PASS();
+}
+
+SUITE(arena_test)
+{
+	RUN_TEST(arena_lifo_test);
+	RUN_TEST(arena_large_test);
+	RUN_TEST(arena_reset_test);
+}
@@ -0,0 +1,201 @@
+#include <string.h>
+#include <unistd.h>
+#include "rlite/rlite.h"
+#include "rlite/hirlite.h"
+#include "util.h"
+
+static const char *backup_path = "rlite-backup-test.rld";
+
+static int set_keys(rlite *db, long from, long to)
+{
+	int retval = RL_OK;
+	unsigned char key[20];
+	long i, keylen;
+	for (i = from; i < to; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_set, RL_OK, db, key, keylen, key, keylen, 0, 0);
+		RL_CALL(rl_commit, RL_OK, db);
+	}
+cleanup:
+	return retval;
+}
+
+static int check_keys(rlite *db, long from, long to)
+{
+	int retval = RL_OK;
+	unsigned char key[20], *value;
+	long i, keylen, valuelen;
+	for (i = from; i < to; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_get, RL_OK, db, key, keylen, &value, &valuelen);
+		if (valuelen != keylen || memcmp(key, value, keylen) != 0) {
+			retval = RL_UNEXPECTED;
+		}
+		rl_free(value);
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+	}
+	RL_CALL(rl_discard, RL_OK, db);
+cleanup:
+	return retval;
+}
+
+static int open_destination(rlite **db, int file)
+{
+	int retval;
+	if (file && access(backup_path, F_OK) == 0) {
+		unlink(backup_path);
+	}
+	RL_CALL(rl_open, RL_OK, file ? backup_path : ":memory:", db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	// creating it is a write like any other
+	RL_CALL(rl_commit, RL_OK, *db);
+cleanup:
+	return retval;
+}
+
+TEST test_backup(int file)
+{
+	int retval;
+	rlite *db, *destination;
+	rl_backup *backup;
+	long steps = 0;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 500);
+	RL_CALL_VERBOSE(open_destination, RL_OK, &destination, file);
+
+	RL_CALL_VERBOSE(rl_backup_init, RL_OK, destination, db, &backup);
+	while ((retval = rl_backup_step(backup, 10)) == RL_OK) {
+		steps++;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(steps, (db->number_of_pages - 2) / 10);
+	EXPECT_LONG(rl_backup_remaining(backup), 0);
+	EXPECT_LONG(backup->restarts, 0);
+	RL_CALL_VERBOSE(rl_backup_finish, RL_OK, backup);
+	EXPECT_LONG(destination->number_of_pages, db->number_of_pages);
+	RL_CALL_VERBOSE(check_keys, RL_OK, destination, 0, 500);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, destination);
+
+	// the copy is a database of its own
+	RL_CALL_VERBOSE(set_keys, RL_OK, destination, 500, 600);
+	RL_CALL_VERBOSE(check_keys, RL_OK, destination, 0, 600);
+	rl_close(destination);
+	rl_close(db);
+	unlink(backup_path);
+	PASS();
+}
+
+TEST test_backup_patch(int flags)
+{
+	int retval;
+	rlite *db, *destination;
+	rl_backup *backup;
+	unsigned char *value;
+	long valuelen;
+	RL_CALL_VERBOSE(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | flags);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 300);
+	RL_CALL_VERBOSE(open_destination, RL_OK, &destination, 0);
+
+	RL_CALL_VERBOSE(rl_backup_init, RL_OK, destination, db, &backup);
+	RL_CALL_VERBOSE(rl_backup_step, RL_OK, backup, 5);
+	// pages already copied are written again by the next step
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 300, 400);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, UNSIGN("key0"), 4);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	while ((retval = rl_backup_step(backup, 5)) == RL_OK) {
+		RL_CALL_VERBOSE(set_keys, RL_OK, db, 400, 410);
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(backup->restarts, 0);
+	RL_CALL_VERBOSE(rl_backup_finish, RL_OK, backup);
+
+	RL_CALL_VERBOSE(check_keys, RL_OK, destination, 1, 410);
+	RL_CALL_VERBOSE(rl_get, RL_NOT_FOUND, destination, UNSIGN("key0"), 4, &value, &valuelen);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, destination);
+	rl_close(destination);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_backup_restart()
+{
+	int retval;
+	rlite *db, *db2, *destination;
+	rl_backup *backup;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 300);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db2, 1, 0);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+	RL_CALL_VERBOSE(open_destination, RL_OK, &destination, 0);
+
+	RL_CALL_VERBOSE(rl_backup_init, RL_OK, destination, db, &backup);
+	RL_CALL_VERBOSE(rl_backup_step, RL_OK, backup, 5);
+	// another connection cannot tell the backup what it wrote
+	RL_CALL_VERBOSE(set_keys, RL_OK, db2, 300, 310);
+	RL_CALL_VERBOSE(rl_backup_step, RL_OK, backup, 5);
+	EXPECT_LONG(backup->restarts, 1);
+	EXPECT_LONG(backup->next_page, 6);
+	RL_CALL_VERBOSE(rl_backup_step, RL_END, backup, -1);
+	RL_CALL_VERBOSE(rl_backup_finish, RL_OK, backup);
+	RL_CALL_VERBOSE(check_keys, RL_OK, destination, 0, 310);
+
+	// closing the source leaves the backup unable to go on
+	RL_CALL_VERBOSE(rl_backup_init, RL_OK, destination, db2, &backup);
+	rl_close(db2);
+	RL_CALL_VERBOSE(rl_backup_step, RL_INVALID_STATE, backup, -1);
+	RL_CALL_VERBOSE(rl_backup_finish, RL_OK, backup);
+
+	RL_CALL_VERBOSE(rl_backup_init, RL_INVALID_PARAMETERS, db, db, &backup);
+	rl_close(destination);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_backup_command()
+{
+	int retval;
+	rlite *db;
+	rliteReply *reply;
+	size_t argvlen[3];
+	rliteContext *context = rliteConnect(":memory:", 0);
+	ASSERT(context != NULL);
+	char *set_argv[] = {"set", "key", "value", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(set_argv, argvlen), set_argv, argvlen);
+	EXPECT_REPLY_STATUS(reply, "OK", 2);
+	rliteFreeReplyObject(reply);
+
+	if (access(backup_path, F_OK) == 0) {
+		unlink(backup_path);
+	}
+	char *argv[] = {"backup", (char *)backup_path, NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+	EXPECT_REPLY_STATUS(reply, "OK", 2);
+	rliteFreeReplyObject(reply);
+
+	char *self_argv[] = {"backup", ":memory:", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(self_argv, argvlen), self_argv, argvlen);
+	EXPECT_REPLY_ERROR(reply);
+	rliteFreeReplyObject(reply);
+	rliteFree(context);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, backup_path, &db, RLITE_OPEN_READONLY);
+	unsigned char *value;
+	long valuelen;
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key"), 3, &value, &valuelen);
+	EXPECT_BYTES(value, valuelen, "value", 5);
+	rl_free(value);
+	rl_close(db);
+	unlink(backup_path);
+	PASS();
+}
+
+SUITE(backup_test)
+{
+	RUN_TEST1(test_backup, 0);
+	RUN_TEST1(test_backup, 1);
+	RUN_TEST1(test_backup_patch, 0);
+	RUN_TEST1(test_backup_patch, RLITE_OPEN_RESIDENT);
+	RUN_TEST(test_backup_restart);
+	RUN_TEST(test_backup_command);
+}
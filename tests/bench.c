@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "bench.h"
+
+typedef struct {
+	const char *name;
+	int (*run)();
+} bench;
+
+static bench benchs[] = {
+	{"page_cache", page_cache_bench},
+	{"io", io_bench},
+	{"vacuum", vacuum_bench},
+	{"allocs", allocs_bench},
+	{"commit", commit_bench},
+	{"string", string_bench},
+};
+
+double bench_time()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void bench_report(const char *name, long count, const char *unit, double seconds)
+{
+	printf("%-40s %10ld %-8s %12.1f ns/%s\n", name, count, unit, seconds * 1000000000.0 / count, unit);
+	fflush(stdout);
+}
+
+void bench_shuffle(long *values, long len)
+{
+	long i, j, tmp;
+	for (i = len - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = values[i];
+		values[i] = values[j];
+		values[j] = tmp;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int retval = 0;
+	srand(1);
+	for (i = 0; i < sizeof(benchs) / sizeof(benchs[0]); i++) {
+		if (argc > 1 && strcmp(argv[1], benchs[i].name) != 0) {
+			continue;
+		}
+		printf("* %s\n", benchs[i].name);
+		if (benchs[i].run() != 0) {
+			fprintf(stderr, "%s failed\n", benchs[i].name);
+			retval = 1;
+		}
+	}
+	return retval;
+}
@@ -0,0 +1,22 @@
+#ifndef _RL_BENCH_H
+#define _RL_BENCH_H
+
+/**
+ * Benchmarks are not run by `make test`, use `make bench` to run them all or
+ * `./rlite-bench <name>` to run a single one.
+ * They print one line per measure so the results can be compared between
+ * builds.
+ */
+
+double bench_time();
+void bench_report(const char *name, long count, const char *unit, double seconds);
+void bench_shuffle(long *values, long len);
+
+int page_cache_bench();
+int io_bench();
+int vacuum_bench();
+int allocs_bench();
+int commit_bench();
+int string_bench();
+
+#endif
@@ -133,6 +133,55 @@ TEST btree_find_oom()
 	rl_close(db);
 	PASS();
 }
+TEST btree_materialize_oom()
+{
+	long btree_node_size = 10;
+	INIT();
+	long *key, *val, i, j;
+	void *tmp;
+	rl_btree_node *node;
+
+	long btree_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, btree->type->btree_type, btree_page, btree);
+	for (i = 0; i < 7; i++) {
+		key = malloc(sizeof(long));
+		val = malloc(sizeof(long));
+		*key = i + 1;
+		*val = i * 10;
+		RL_CALL_VERBOSE(rl_btree_add_element, RL_OK, db, btree, btree_page, key, val);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_cache_clear, RL_OK, db);
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_long_long, btree_page, &rl_btree_type_hash_long_long, &tmp, 1);
+	btree = tmp;
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, btree->type->btree_node_type, btree->root, btree, &tmp, 1);
+	node = tmp;
+
+	for (j = 1; ; j++) {
+		test_mode = 1;
+		test_mode_counter = j;
+		retval = rl_btree_node_materialize(db, btree, node);
+		test_mode = 0;
+		if (retval == RL_OK) {
+			if (j == 1) {
+				fprintf(stderr, "No OOM triggered\n");
+				FAIL();
+			}
+			break;
+		}
+		EXPECT_INT(retval, RL_OUT_OF_MEMORY);
+		// a failure leaves the node as it was read
+		EXPECT_INT(node->view != NULL, 1);
+	}
+	EXPECT_INT(node->view == NULL, 1);
+	for (i = 0; i < 7; i++) {
+		EXPECT_LONG(*(long *)node->scores[i], i + 1);
+		EXPECT_LONG(*(long *)node->values[i], i * 10);
+	}
+	RL_CALL_VERBOSE(rl_btree_is_balanced, RL_OK, db, btree);
+	rl_close(db);
+	PASS();
+}
 #endif
 
 TEST basic_insert_hash_test()
@@ -211,6 +260,66 @@ cleanup:
 	if (retval == 0) { PASS(); } else { FAIL(); }
 }
 
+TEST view_node_test()
+{
+	long btree_node_size = 10;
+	INIT();
+	long *key, *val, i, positions[2];
+	rl_btree_node *nodes[2];
+	void *tmp;
+
+	long btree_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, btree->type->btree_type, btree_page, btree);
+	for (i = 0; i < 20; i++) {
+		key = malloc(sizeof(long));
+		val = malloc(sizeof(long));
+		*key = i;
+		*val = i * 10;
+		RL_CALL_VERBOSE(rl_btree_add_element, RL_OK, db, btree, btree_page, key, val);
+	}
+	EXPECT_LONG(btree->height, 2);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_cache_clear, RL_OK, db);
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_long_long, btree_page, &rl_btree_type_hash_long_long, &tmp, 1);
+	btree = tmp;
+
+	// nodes read from a page are not copied element by element
+	i = 3;
+	RL_CALL_VERBOSE(rl_btree_find_score, RL_FOUND, db, btree, &i, NULL, nodes, positions);
+	EXPECT_INT(nodes[0]->view != NULL, 1);
+	EXPECT_INT(nodes[1]->view != NULL, 1);
+	EXPECT_LONG(*(long *)nodes[1]->values[positions[1]], 30);
+
+	// only the modified leaf is materialized
+	val = malloc(sizeof(long));
+	*val = 31;
+	RL_CALL_VERBOSE(rl_btree_update_element, RL_OK, db, btree, &i, val);
+	EXPECT_INT(nodes[0]->view != NULL, 1);
+	EXPECT_INT(nodes[1]->view == NULL, 1);
+	EXPECT_PTR(nodes[1]->values[positions[1]], val);
+
+	for (i = 0; i < 20; i += 2) {
+		RL_CALL_VERBOSE(rl_btree_remove_element, RL_OK, db, btree, btree_page, &i);
+		RL_CALL_VERBOSE(rl_btree_is_balanced, RL_OK, db, btree);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_cache_clear, RL_OK, db);
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_long_long, btree_page, &rl_btree_type_hash_long_long, &tmp, 1);
+	btree = tmp;
+	for (i = 0; i < 20; i++) {
+		if (i % 2 == 0) {
+			RL_CALL_VERBOSE(rl_btree_find_score, RL_NOT_FOUND, db, btree, &i, NULL, NULL, NULL);
+			continue;
+		}
+		RL_CALL_VERBOSE(rl_btree_find_score, RL_FOUND, db, btree, &i, &tmp, NULL, NULL);
+		EXPECT_LONG(*(long *)tmp, i == 3 ? 31 : i * 10);
+	}
+	retval = 0;
+cleanup:
+	rl_close(db);
+	if (retval == 0) { PASS(); } else { FAIL(); }
+}
+
 static int contains_element(long element, long *elements, long size)
 {
 	long i;
@@ -391,10 +500,12 @@ SUITE(btree_test)
 	RUN_TEST(basic_insert_hash_test);
 	RUN_TESTp(random_hash_test, 10, 2);
 	RUN_TESTp(random_hash_test, 100, 10);
+	RUN_TEST(view_node_test);
 #ifdef RL_DEBUG
 	RUN_TEST(btree_insert_oom);
 	RUN_TEST(btree_create_oom);
 	RUN_TEST(btree_find_oom);
+	RUN_TEST(btree_materialize_oom);
 #endif
 
 	long delete_tests[DELETE_TESTS_COUNT][2] = {
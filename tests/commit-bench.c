@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/util.h"
+
+#define COMMIT_BENCH_FILE "rlite-bench.rld"
+#define COMMIT_BENCH_KEYS 5000
+// syncing makes every commit wait for the disk
+#define COMMIT_BENCH_SYNC_KEYS 500
+
+static const char *sync_names[] = {"off", "normal", "full"};
+
+/**
+ * SET followed by rl_commit, like a bulk load does through hirlite, writing
+ * groups of max_commits commits.
+ */
+static int commit_bench_run(int journal_mode, int sync, long max_commits, long keys)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char key[32], value[100];
+	long i;
+	double start, seconds;
+	char name[64];
+	rl_open_options options;
+
+	for (i = 0; i < (long)sizeof(value); i++) {
+		value[i] = 'a' + i % 26;
+	}
+	unlink(COMMIT_BENCH_FILE);
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE;
+	options.journal_mode = journal_mode;
+	options.sync = sync;
+	RL_CALL(rl_open_v2, RL_OK, COMMIT_BENCH_FILE, &db, &options);
+	RL_CALL(rl_set_group_commit, RL_OK, db, max_commits, 0, 0);
+	start = bench_time();
+	for (i = 0; i < keys; i++) {
+		RL_CALL(rl_set, RL_OK, db, key, snprintf((char *)key, sizeof(key), "key%ld", i), value, sizeof(value), 0, 0);
+		RL_CALL(rl_commit, RL_OK, db);
+	}
+	RL_CALL(rl_flush, RL_OK, db);
+	seconds = bench_time() - start;
+	snprintf(name, sizeof(name), "set %s sync(%s) group_commit(%ld)", journal_mode == RLITE_JOURNAL_WAL ? "wal" : "delete", sync_names[sync], max_commits);
+	bench_report(name, keys, "command", seconds);
+	if (max_commits == 0) {
+		printf("%-40s %10ld %-8s %12.1f commits/s\n", name, keys, "command", keys / seconds);
+	}
+cleanup:
+	rl_close(db);
+	unlink(COMMIT_BENCH_FILE);
+	return retval;
+}
+
+int commit_bench()
+{
+	long max_commits[] = {0, 10, 100, 1000};
+	int journal_modes[] = {RLITE_JOURNAL_DELETE, RLITE_JOURNAL_WAL};
+	int sync;
+	size_t i, j;
+	for (j = 0; j < sizeof(journal_modes) / sizeof(journal_modes[0]); j++) {
+		for (i = 0; i < sizeof(max_commits) / sizeof(max_commits[0]); i++) {
+			if (commit_bench_run(journal_modes[j], RLITE_SYNC_OFF, max_commits[i], COMMIT_BENCH_KEYS) != RL_OK) {
+				return 1;
+			}
+		}
+	}
+	// commits per second at each durability level
+	for (j = 0; j < sizeof(journal_modes) / sizeof(journal_modes[0]); j++) {
+		for (sync = RLITE_SYNC_OFF; sync <= RLITE_SYNC_FULL; sync++) {
+			if (commit_bench_run(journal_modes[j], sync, 0, COMMIT_BENCH_SYNC_KEYS) != RL_OK) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -8,8 +8,7 @@
 #define FILEPATH "rlite-test.rld"
 #define INCREMENT_LIMIT 1000
 
-static void *increment(void *UNUSED(arg)) {
-	rliteContext *context = rliteConnect(FILEPATH, 0);
+static void increment_context(rliteContext *context) {
 	rliteReply* reply;
 	size_t argvlen[100];
 	char* argv[100] = {"INCR", "key", NULL};
@@ -25,6 +24,41 @@ static void *increment(void *UNUSED(arg)) {
 		}
 		rliteFreeReplyObject(reply);
 	} while (val < INCREMENT_LIMIT);
+}
+
+static void *increment(void *UNUSED(arg)) {
+	rliteContext *context = rliteConnect(FILEPATH, 0);
+	increment_context(context);
+	rliteFree(context);
+	return NULL;
+}
+
+static void *increment_shared(void *arg) {
+	increment_context(arg);
+	rliteFree(arg);
+	return NULL;
+}
+
+static int read_shared_failures;
+
+// reads a key of another database while the writers change the first one
+static void *read_shared(void *arg) {
+	rliteContext *context = arg;
+	rliteReply* reply;
+	size_t argvlen[100];
+	char* select_argv[100] = {"SELECT", "1", NULL};
+	char* argv[100] = {"GET", "other", NULL};
+	int argc, i;
+	reply = rliteCommandArgv(context, populateArgvlen(select_argv, argvlen), select_argv, argvlen);
+	rliteFreeReplyObject(reply);
+	argc = populateArgvlen(argv, argvlen);
+	for (i = 0; i < INCREMENT_LIMIT; i++) {
+		reply = rliteCommandArgv(context, argc, argv, argvlen);
+		if (reply->type != RLITE_REPLY_STRING || reply->len != 5 || memcmp(reply->str, "value", 5) != 0) {
+			__sync_fetch_and_add(&read_shared_failures, 1);
+		}
+		rliteFreeReplyObject(reply);
+	}
 	rliteFree(context);
 	return NULL;
 }
@@ -142,8 +176,82 @@ TEST multiple_writing_threads_concurrency() {
 	PASS();
 }
 
+TEST shared_threads_concurrency() {
+	delete_file();
+	rl_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | RLITE_OPEN_SHARED;
+	rliteContext *context = rliteConnectWithOptions(FILEPATH, &options);
+	ASSERT(context != NULL);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	{
+		char* argv[100] = {"SELECT", "1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"SET", "other", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	pthread_t threads[4];
+	read_shared_failures = 0;
+	pthread_create(&threads[0], NULL, increment_shared, rliteConnectThread(context));
+	pthread_create(&threads[1], NULL, increment_shared, rliteConnectThread(context));
+	pthread_create(&threads[2], NULL, read_shared, rliteConnectThread(context));
+	pthread_create(&threads[3], NULL, read_shared, rliteConnectThread(context));
+
+	char* argv[100] = {"GET", "key", NULL};
+	int argc, i;
+	long long val;
+	char tmp[40];
+	{
+		// the selected database is the context's own
+		char* select_argv[100] = {"SELECT", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(select_argv, argvlen), select_argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+		argc = populateArgvlen(argv, argvlen);
+	}
+	do {
+		reply = rliteCommandArgv(context, argc, argv, argvlen);
+		if (reply->type == RLITE_REPLY_NIL) {
+			val = 0;
+		} else if (reply->type != RLITE_REPLY_STRING) {
+			fprintf(stderr, "Expected incremented value to be a string, got %d instead on line %d\n", reply->type, __LINE__);
+			rliteFreeReplyObject(reply);
+			break;
+		} else {
+			memcpy(tmp, reply->str, reply->len);
+			tmp[reply->len] = 0;
+			val = strtoll(tmp, NULL, 10);
+		}
+		rliteFreeReplyObject(reply);
+	} while (val < INCREMENT_LIMIT);
+
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	EXPECT_INT(read_shared_failures, 0);
+	reply = rliteCommandArgv(context, argc, argv, argvlen);
+	ASSERT_EQ(reply->type, RLITE_REPLY_STRING);
+	// each writer stops once it sees the limit, the other may go one past
+	val = strtoll(reply->str, NULL, 10);
+	rliteFreeReplyObject(reply);
+	ASSERT(val == INCREMENT_LIMIT || val == INCREMENT_LIMIT + 1);
+	rliteFree(context);
+	unlink(FILEPATH);
+	PASS();
+}
+
 SUITE(concurrency_test) {
 	RUN_TEST(simple_concurrency);
 	RUN_TEST(threads_concurrency);
 	RUN_TEST(multiple_writing_threads_concurrency);
+	RUN_TEST(shared_threads_concurrency);
 }
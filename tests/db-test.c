@@ -10,6 +10,21 @@ TEST test_rlite_connect() {
 	PASS();
 }
 
+TEST test_rlite_connect_with_options() {
+	rl_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.page_size = 16384;
+	unlink("user.db");
+	rliteContext *context = rliteConnectWithOptions("user.db", &options);
+	ASSERT(context != NULL);
+	EXPECT_LONG(context->db->page_size, 16384);
+	rliteFree(context);
+
+	options.page_size = 1000;
+	ASSERT(rliteConnectWithOptions("user.db", &options) == NULL);
+	PASS();
+}
+
 TEST keys() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -561,6 +576,358 @@ TEST flushdb() {
 	PASS();
 }
 
+TEST vacuum() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	char key[32], value[2000];
+	int i;
+
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = 0;
+	for (i = 0; i < 50; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		char* argv[100] = {"set", key, value, NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	// the remaining key is at the end of the file
+	for (i = 0; i < 49; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		char* argv[100] = {"del", key, NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 1);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"vacuum", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_ERROR(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"vacuum", "10", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		ASSERT_EQ(reply->type, RLITE_REPLY_INTEGER);
+		ASSERT(reply->integer > 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"vacuum", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		ASSERT_EQ(reply->type, RLITE_REPLY_INTEGER);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		// nothing left to reclaim
+		char* argv[100] = {"vacuum", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key49", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, value, (long)strlen(value));
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+TEST checkpoint() {
+	rl_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.journal_mode = RLITE_JOURNAL_WAL;
+	unlink("rlite-test.rld");
+	unlink(".rlite-test.rld.log");
+	rliteContext *context = rliteConnectWithOptions("rlite-test.rld", &options);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"checkpoint", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		ASSERT_EQ(reply->type, RLITE_REPLY_INTEGER);
+		ASSERT(reply->integer > 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		// the log is empty
+		char* argv[100] = {"checkpoint", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+TEST snapshot_read() {
+	rl_open_options options;
+	rlite *db;
+	memset(&options, 0, sizeof(options));
+	options.journal_mode = RLITE_JOURNAL_WAL;
+	unlink("rlite-test.rld");
+	unlink(".rlite-test.rld.log");
+	rliteContext *context = rliteConnectWithOptions("rlite-test.rld", &options);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	options.flags = RLITE_OPEN_READWRITE;
+	ASSERT_EQ(rl_open_v2("rlite-test.rld", &db, &options), RL_OK);
+	ASSERT_EQ(rl_set(db, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0), RL_OK);
+
+	{
+		// does not wait for the other connection to commit
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	ASSERT_EQ(rl_commit(db), RL_OK);
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "other", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	rl_close(db);
+	rliteFree(context);
+	PASS();
+}
+
+TEST shared_handles() {
+	rl_open_options options;
+	rlite *db, *db2;
+	unsigned char *value;
+	long valuelen;
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | RLITE_OPEN_SHARED;
+	ASSERT_EQ(rl_open_v2(":memory:", &db, &options), RL_OK);
+	ASSERT_EQ(rl_open_thread(db, &db2), RL_OK);
+
+	ASSERT_EQ(rl_refresh(db), RL_OK);
+	ASSERT_EQ(rl_set(db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0), RL_OK);
+	ASSERT_EQ(rl_commit(db), RL_OK);
+
+	// the other handle reads the new header, with its own selected database
+	ASSERT_EQ(rl_begin_read(db2), RL_OK);
+	ASSERT_EQ(rl_get(db2, UNSIGN("key"), 3, &value, &valuelen), RL_OK);
+	EXPECT_BYTES(UNSIGN("value"), 5, value, valuelen);
+	rl_free(value);
+	ASSERT_EQ(rl_set(db2, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0), RL_INVALID_STATE);
+	ASSERT_EQ(rl_begin_read(db), RL_OK);
+	ASSERT_EQ(rl_get(db, UNSIGN("key"), 3, &value, &valuelen), RL_OK);
+	rl_free(value);
+	ASSERT_EQ(rl_discard(db), RL_OK);
+	ASSERT_EQ(rl_discard(db2), RL_OK);
+
+	ASSERT_EQ(rl_refresh(db2), RL_OK);
+	ASSERT_EQ(rl_select(db2, 1), RL_OK);
+	ASSERT_EQ(rl_set(db2, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0), RL_OK);
+	ASSERT_EQ(rl_commit(db2), RL_OK);
+	ASSERT_EQ(rl_refresh(db), RL_OK);
+	ASSERT_EQ(rl_get(db, UNSIGN("key"), 3, &value, &valuelen), RL_OK);
+	EXPECT_BYTES(UNSIGN("value"), 5, value, valuelen);
+	rl_free(value);
+	ASSERT_EQ(rl_discard(db), RL_OK);
+
+	// the database outlives the handle that opened it
+	rl_close(db);
+	ASSERT_EQ(rl_begin_read(db2), RL_OK);
+	ASSERT_EQ(rl_get(db2, UNSIGN("key"), 3, &value, &valuelen), RL_OK);
+	EXPECT_BYTES(UNSIGN("other"), 5, value, valuelen);
+	rl_free(value);
+	rl_close(db2);
+	PASS();
+}
+
+TEST resident_memory() {
+	rlite *db;
+	unsigned char key[20], *value;
+	long i, keylen, valuelen;
+	ASSERT_EQ(rl_open(":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | RLITE_OPEN_RESIDENT), RL_OK);
+	ASSERT(rl_is_resident(db));
+	for (i = 0; i < 200; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		ASSERT_EQ(rl_set(db, key, keylen, UNSIGN("value"), 5, 0, 0), RL_OK);
+	}
+	ASSERT_EQ(rl_commit(db), RL_OK);
+	// nothing is serialized, and the pages cannot be read again
+	EXPECT_LONG(((rl_memory_driver *)db->driver)->store.number_of_pages, 0);
+	ASSERT_EQ(rl_cache_clear(db), RL_OK);
+
+	// pages modified in place are put back by a rollback
+	for (i = 0; i < 200; i += 2) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		ASSERT_EQ(rl_set(db, key, keylen, UNSIGN("other"), 5, 0, 0), RL_OK);
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i + 1);
+		ASSERT_EQ(rl_key_delete_with_value(db, key, keylen), RL_OK);
+	}
+	ASSERT_EQ(rl_discard(db), RL_OK);
+	for (i = 0; i < 200; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		ASSERT_EQ(rl_get(db, key, keylen, &value, &valuelen), RL_OK);
+		EXPECT_BYTES(UNSIGN("value"), 5, value, valuelen);
+		rl_free(value);
+	}
+	ASSERT_EQ(rl_is_balanced(db), RL_OK);
+
+	ASSERT_EQ(rl_begin_read(db), RL_OK);
+	ASSERT_EQ(rl_get(db, UNSIGN("key0"), 4, &value, &valuelen), RL_OK);
+	rl_free(value);
+	ASSERT_EQ(rl_set(db, UNSIGN("key0"), 4, UNSIGN("other"), 5, 0, 0), RL_INVALID_STATE);
+	ASSERT_EQ(rl_refresh(db), RL_OK);
+	ASSERT_EQ(rl_set(db, UNSIGN("key0"), 4, UNSIGN("other"), 5, 0, 0), RL_OK);
+	ASSERT_EQ(rl_commit(db), RL_OK);
+	ASSERT_EQ(rl_get(db, UNSIGN("key0"), 4, &value, &valuelen), RL_OK);
+	EXPECT_BYTES(UNSIGN("other"), 5, value, valuelen);
+	rl_free(value);
+	rl_close(db);
+	PASS();
+}
+
+TEST config_sync() {
+	unlink("rlite-test.rld");
+	unlink(".rlite-test.rld.log");
+	rliteContext *context = rliteConnect("rlite-test.rld", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"config", "get", "sync", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		EXPECT_REPLY_STR(reply->element[1], "off", 3);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"config", "set", "sync", "FULL", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	EXPECT_INT(context->db->sync, RLITE_SYNC_FULL);
+
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"config", "get", "sync", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		EXPECT_REPLY_STR(reply->element[1], "full", 4);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"config", "set", "sync", "always", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_ERROR(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"config", "set", "maxmemory", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_ERROR_STR(reply, "ERR Unsupported CONFIG parameter: maxmemory", 43);
+		rliteFreeReplyObject(reply);
+	}
+
+	char name[300];
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	{
+		char* argv[100] = {"config", "set", name, "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_ERROR(reply);
+		ASSERT(reply->len < 128);
+		ASSERT(memcmp(reply->str, "ERR Unsupported CONFIG parameter: aaa", 37) == 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	// queued like any other command, with the error in its place
+	{
+		char* argv[100] = {"multi", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"config", "set", name, "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"exec", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		EXPECT_REPLY_ERROR(reply->element[0]);
+		EXPECT_REPLY_STR(reply->element[1], "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST flushdb_multidb() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -608,6 +975,7 @@ TEST flushdb_multidb() {
 
 SUITE(db_test) {
 	RUN_TEST(test_rlite_connect);
+	RUN_TEST(test_rlite_connect_with_options);
 	RUN_TEST(keys);
 	RUN_TEST(dbsize);
 	RUN_TESTp(expire, "expire", "-1");
@@ -624,4 +992,10 @@ SUITE(db_test) {
 	RUN_TEST(randomkey);
 	RUN_TEST(flushdb);
 	RUN_TEST(flushdb_multidb);
+	RUN_TEST(vacuum);
+	RUN_TEST(checkpoint);
+	RUN_TEST(snapshot_read);
+	RUN_TEST(shared_handles);
+	RUN_TEST(resident_memory);
+	RUN_TEST(config_sync);
 }
@@ -14,7 +14,7 @@ TEST basic_flock_check()
 	ASSERT_EQ(rl_is_flocked(path, RLITE_FLOCK_SH), RL_NOT_FOUND);
 	ASSERT_EQ(rl_is_flocked(path, RLITE_FLOCK_EX), RL_NOT_FOUND);
 
-	FILE *fp = fopen(path, "w");
+	FILE *fp = fopen(path, "w+");
 
 	ASSERT_EQ(rl_is_flocked(path, RLITE_FLOCK_SH), RL_NOT_FOUND);
 	ASSERT_EQ(rl_is_flocked(path, RLITE_FLOCK_EX), RL_NOT_FOUND);
@@ -35,8 +35,49 @@ TEST basic_flock_check()
 	PASS();
 }
 
+TEST pending_flock_check()
+{
+	const char *path = "flock-test";
+
+	remove(path);
+	FILE *reader = fopen(path, "w+");
+	FILE *writer = fopen(path, "r+");
+	FILE *late = fopen(path, "r+");
+
+	ASSERT_EQ(rl_flock(reader, RLITE_FLOCK_SH), RL_OK);
+	int retval = rl_flock(writer, RLITE_FLOCK_WRITER);
+	if (retval == RL_NOT_IMPLEMENTED) {
+		fclose(late);
+		fclose(writer);
+		fclose(reader);
+		remove(path);
+		SKIPm("no writer lock without open file description locks");
+	}
+	ASSERT_EQ(retval, RL_OK);
+	ASSERT_EQ(rl_flock(writer, RLITE_FLOCK_SH), RL_OK);
+	ASSERT_EQ(rl_flock(late, RLITE_FLOCK_WRITER | RLITE_FLOCK_NB), RL_BUSY);
+
+	// the reader is still in, but nobody else gets in meanwhile
+	ASSERT_EQ(rl_flock(writer, RLITE_FLOCK_EX | RLITE_FLOCK_NB), RL_BUSY);
+	ASSERT_EQ(rl_flock(late, RLITE_FLOCK_SH | RLITE_FLOCK_NB), RL_BUSY);
+
+	ASSERT_EQ(rl_flock(reader, RLITE_FLOCK_UN), RL_OK);
+	ASSERT_EQ(rl_flock(writer, RLITE_FLOCK_EX | RLITE_FLOCK_NB), RL_OK);
+	ASSERT_EQ(rl_is_flocked(path, RLITE_FLOCK_EX), RL_FOUND);
+	ASSERT_EQ(rl_flock(writer, RLITE_FLOCK_UN), RL_OK);
+	ASSERT_EQ(rl_flock(late, RLITE_FLOCK_SH | RLITE_FLOCK_NB), RL_OK);
+
+	fclose(late);
+	fclose(writer);
+	fclose(reader);
+	remove(path);
+
+	PASS();
+}
+
 SUITE(flock_test)
 {
 	RUN_TEST(basic_flock_check);
+	RUN_TEST(pending_flock_check);
 }
 
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/status.h"
+#include "../src/rlite/page_long.h"
+#include "../src/rlite/page_freelist.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/type_list.h"
+
+static int create_pages(rlite *db, long count, long *pages)
+{
+	int retval = RL_OK;
+	long i;
+	for (i = 0; i < count; i++) {
+		RL_CALL(rl_long_create, RL_OK, db, i, &pages[i]);
+	}
+cleanup:
+	return retval;
+}
+
+static int delete_pages(rlite *db, long count, long *pages)
+{
+	int retval = RL_OK;
+	long i;
+	for (i = 0; i < count; i++) {
+		// free them out of order
+		RL_CALL(rl_delete, RL_OK, db, pages[(i * 7) % count]);
+	}
+cleanup:
+	return retval;
+}
+
+TEST test_freelist_reuse(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	// more than one trunk worth of pages
+	long i, size = 600, number_of_pages, descending = 0, *pages = malloc(sizeof(long) * size);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+	RL_CALL_VERBOSE(create_pages, RL_OK, db, size, pages);
+	RL_COMMIT();
+	number_of_pages = db->number_of_pages;
+
+	RL_CALL_VERBOSE(delete_pages, RL_OK, db, size, pages);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	RL_COMMIT();
+	EXPECT_LONG(db->number_of_pages, number_of_pages);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	RL_CALL_VERBOSE(create_pages, RL_OK, db, size, pages);
+	RL_COMMIT();
+	EXPECT_LONG(db->number_of_pages, number_of_pages);
+	EXPECT_LONG(db->freelist, 0);
+	EXPECT_LONG(db->next_empty_page, db->number_of_pages);
+	for (i = 1; i < size; i++) {
+		// within a trunk pages are handed out in increasing order, the
+		// trunk page itself goes last
+		if (pages[i] < pages[i - 1]) {
+			descending++;
+		}
+	}
+	ASSERT(descending <= 2 * (size / 254 + 1));
+
+	RL_CALL_VERBOSE(delete_pages, RL_OK, db, size, pages);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	free(pages);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_freelist_legacy_chain(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	long i, size = 20, page, pages[20], number_of_pages;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+	RL_CALL_VERBOSE(create_pages, RL_OK, db, size, pages);
+	number_of_pages = db->number_of_pages;
+	// free them the way older versions did, each page linking to the next
+	for (i = 0; i < size; i++) {
+		RL_CALL_VERBOSE(rl_long_set, RL_OK, db, db->next_empty_page, pages[i]);
+		db->next_empty_page = pages[i];
+	}
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	EXPECT_LONG(db->freelist, 0);
+
+	// allocating from the old chain still works
+	RL_CALL_VERBOSE(rl_long_create, RL_OK, db, 1, &page);
+	EXPECT_LONG(page, pages[size - 1]);
+
+	// freeing moves the chain to a trunk
+	RL_CALL_VERBOSE(rl_delete, RL_OK, db, page);
+	ASSERT(db->freelist != 0);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	RL_COMMIT();
+
+	RL_CALL_VERBOSE(create_pages, RL_OK, db, size, pages);
+	EXPECT_LONG(db->number_of_pages, number_of_pages);
+	EXPECT_LONG(db->next_empty_page, number_of_pages);
+	RL_CALL_VERBOSE(delete_pages, RL_OK, db, size, pages);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	rl_close(db);
+	PASS();
+}
+
+static long vacuum_value(long i, unsigned char *value)
+{
+	long j, len = 100 + (i * 37) % 1500;
+	for (j = 0; j < len; j++) {
+		value[j] = 'a' + (i + j) % 26;
+	}
+	return len;
+}
+
+static int vacuum_populate(rlite *db, long count)
+{
+	int retval = RL_OK;
+	long i, size;
+	unsigned char key[32], value[1600], *values[1];
+	long valueslen[1];
+	for (i = 0; i < count; i++) {
+		RL_CALL(rl_set, RL_OK, db, key, snprintf((char *)key, sizeof(key), "string%ld", i), value, vacuum_value(i, value), 0, 0);
+		values[0] = value;
+		valueslen[0] = vacuum_value(i, value);
+		RL_CALL(rl_push, RL_OK, db, key, snprintf((char *)key, sizeof(key), "list%ld", i % 10), 1, 0, 1, values, valueslen, &size);
+	}
+cleanup:
+	return retval;
+}
+
+static int vacuum_check(rlite *db, long count, int deleted, long list_len)
+{
+	int retval = RL_OK;
+	long i, valuelen, len;
+	unsigned char key[32], value[1600], *data;
+	for (i = 0; i < count; i++) {
+		retval = rl_get(db, key, snprintf((char *)key, sizeof(key), "string%ld", i), &data, &valuelen);
+		if (deleted && i % 3 != 0) {
+			if (retval != RL_NOT_FOUND) {
+				retval = RL_UNEXPECTED;
+				goto cleanup;
+			}
+			continue;
+		}
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+		len = vacuum_value(i, value);
+		retval = valuelen == len && memcmp(data, value, len) == 0 ? RL_OK : RL_UNEXPECTED;
+		rl_free(data);
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+	}
+	for (i = 0; i < 10; i++) {
+		RL_CALL(rl_llen, RL_OK, db, key, snprintf((char *)key, sizeof(key), "list%ld", i), &len);
+		if (len != list_len) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+	}
+cleanup:
+	return retval;
+}
+
+TEST test_vacuum(int _commit, long max_pages)
+{
+	int retval;
+	rlite *db = NULL;
+	long i, count = 300, number_of_pages, previous;
+	unsigned char key[32];
+	struct stat st;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+	RL_CALL_VERBOSE(vacuum_populate, RL_OK, db, count);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	for (i = 0; i < count; i++) {
+		if (i % 3 != 0) {
+			RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, snprintf((char *)key, sizeof(key), "string%ld", i));
+		}
+	}
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	number_of_pages = db->number_of_pages;
+
+	do {
+		previous = db->number_of_pages;
+		RL_CALL_VERBOSE(rl_vacuum, RL_OK, db, max_pages);
+		RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+		RL_COMMIT();
+	} while (max_pages > 0 && db->number_of_pages < previous);
+	// short key names have no pages of their own to free
+	ASSERT(db->number_of_pages < number_of_pages * 7 / 10);
+	if (max_pages == 0) {
+		EXPECT_LONG(db->freelist, 0);
+		EXPECT_LONG(db->next_empty_page, db->number_of_pages);
+	}
+	if (_commit == 1) {
+		EXPECT_INT(stat("rlite-test.rld", &st), 0);
+		EXPECT_LONG(st.st_size, db->number_of_pages * db->page_size);
+	}
+	RL_CALL_VERBOSE(vacuum_check, RL_OK, db, count, 1, count / 10);
+
+	// the file keeps working after being vacuumed
+	RL_CALL_VERBOSE(vacuum_populate, RL_OK, db, count);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	RL_CALL_VERBOSE(vacuum_check, RL_OK, db, count, 0, count / 5);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_vacuum_reopen()
+{
+	int retval;
+	rlite *db = NULL;
+	long i, count = 100;
+	unsigned char key[32];
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(vacuum_populate, RL_OK, db, count);
+	for (i = 0; i < count; i++) {
+		if (i % 3 != 0) {
+			RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, snprintf((char *)key, sizeof(key), "string%ld", i));
+		}
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_vacuum, RL_OK, db, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	RL_CALL_VERBOSE(vacuum_check, RL_OK, db, count, 1, count / 10);
+	rl_close(db);
+	PASS();
+}
+
+SUITE(freelist_test)
+{
+	RUN_TEST1(test_freelist_reuse, 0);
+	RUN_TEST1(test_freelist_reuse, 1);
+	RUN_TEST1(test_freelist_reuse, 2);
+	RUN_TEST1(test_freelist_legacy_chain, 0);
+	RUN_TEST1(test_freelist_legacy_chain, 1);
+	RUN_TEST1(test_freelist_legacy_chain, 2);
+	RUN_TESTp(test_vacuum, 0, 0);
+	RUN_TESTp(test_vacuum, 1, 0);
+	RUN_TESTp(test_vacuum, 2, 0);
+	RUN_TESTp(test_vacuum, 0, 20);
+	RUN_TESTp(test_vacuum, 1, 20);
+	RUN_TESTp(test_vacuum, 2, 20);
+	RUN_TEST(test_vacuum_reopen);
+}
@@ -299,6 +299,83 @@ TEST test_multi_discard() {
 	PASS();
 }
 
+static char written_commands[10][10];
+static int written_commands_len;
+
+static void write_command(int UNUSED(dbid), int argc, char **argv, size_t *argvlen) {
+	if (argc > 0 && written_commands_len < 10 && argvlen[0] < 10) {
+		memcpy(written_commands[written_commands_len], argv[0], argvlen[0]);
+		written_commands[written_commands_len++][argvlen[0]] = 0;
+	}
+}
+
+TEST test_multi_write_command() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+	context->writeCommand = write_command;
+	written_commands_len = 0;
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"del", "nokey", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"multi", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"incr", "counter", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"exec", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	EXPECT_INT(written_commands_len, 4);
+	EXPECT_STR("set", written_commands[0], strlen(written_commands[0]));
+	EXPECT_STR("multi", written_commands[1], strlen(written_commands[1]));
+	EXPECT_STR("incr", written_commands[2], strlen(written_commands[2]));
+	EXPECT_STR("exec", written_commands[3], strlen(written_commands[3]));
+
+	rliteFree(context);
+	PASS();
+}
+
 SUITE(hmulti_test)
 {
 	RUN_TEST(test_multi_nowatch);
@@ -307,4 +384,5 @@ SUITE(hmulti_test)
 	RUN_TEST(test_multi_watch_changed);
 	RUN_TEST(test_multi_unwatch_changed);
 	RUN_TEST(test_multi_discard);
+	RUN_TEST(test_multi_write_command);
 }
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/page_key.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/util.h"
+
+#define IO_BENCH_FILE "rlite-bench.rld"
+
+static int open_db(rlite **db, rl_io_ops *io)
+{
+	int retval;
+	char *wal_path;
+	if (access(IO_BENCH_FILE, F_OK) == 0) {
+		unlink(IO_BENCH_FILE);
+	}
+	wal_path = rl_get_filename_with_suffix(IO_BENCH_FILE, ".wal");
+	if (wal_path && access(wal_path, F_OK) == 0) {
+		unlink(wal_path);
+	}
+	rl_free(wal_path);
+	RL_CALL(rl_open, RL_OK, IO_BENCH_FILE, db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	RL_CALL(rl_set_io, RL_OK, *db, io);
+cleanup:
+	return retval;
+}
+
+/**
+ * `commits` transactions setting `keys` new keys each, so every commit
+ * writes the wal and a handful of mostly adjacent pages to the database.
+ */
+static int io_bench_commits(rl_io_ops *io, long commits, long keys)
+{
+	int retval;
+	rlite *db = NULL;
+	long i, j;
+	unsigned char key[32], value[100];
+	double start;
+	char name[64];
+
+	RL_CALL(open_db, RL_OK, &db, io);
+	for (i = 0; i < (long)sizeof(value); i++) {
+		value[i] = 'a' + i % 26;
+	}
+	start = bench_time();
+	for (i = 0; i < commits; i++) {
+		for (j = 0; j < keys; j++) {
+			RL_CALL(rl_set, RL_OK, db, key, snprintf((char *)key, sizeof(key), "key%ld", i * keys + j), value, sizeof(value), 0, 0);
+		}
+		RL_CALL(rl_commit, RL_OK, db);
+	}
+	snprintf(name, sizeof(name), "%s %ld keys/commit", io->name, keys);
+	bench_report(name, commits, "commit", bench_time() - start);
+
+	start = bench_time();
+	for (i = 0; i < commits * keys; i++) {
+		RL_CALL(rl_key_get, RL_FOUND, db, key, snprintf((char *)key, sizeof(key), "key%ld", i), NULL, NULL, NULL, NULL, NULL);
+		if (i % keys == keys - 1) {
+			// drop the page cache so reads go to the file
+			RL_CALL(rl_cache_clear, RL_OK, db);
+			RL_CALL(rl_discard, RL_OK, db);
+		}
+	}
+	snprintf(name, sizeof(name), "%s cold read", io->name);
+	bench_report(name, commits * keys, "key", bench_time() - start);
+	retval = RL_OK;
+cleanup:
+	rl_close(db);
+	unlink(IO_BENCH_FILE);
+	return retval;
+}
+
+int io_bench()
+{
+	rl_io_ops *ios[] = {&rl_io_stdio, &rl_io_positional, &rl_io_mmap};
+	long keys[] = {1, 10, 100};
+	size_t i, j;
+	for (j = 0; j < sizeof(keys) / sizeof(keys[0]); j++) {
+		for (i = 0; i < sizeof(ios) / sizeof(ios[0]); i++) {
+			if (io_bench_commits(ios[i], 1000, keys[j]) != RL_OK) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
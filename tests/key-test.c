@@ -681,6 +681,150 @@ TEST watch_test(int _commit)
 	PASS();
 }
 
+static int set_names(rlite *db, long count, long namelen)
+{
+	int retval = RL_OK;
+	unsigned char name[200];
+	long i;
+	for (i = 0; i < count; i++) {
+		memset(name, 'a' + i % 26, namelen);
+		snprintf((char *)name, namelen, "%ld", i);
+		RL_CALL(rl_set, RL_OK, db, name, namelen, name, namelen, 0, 0);
+	}
+cleanup:
+	return retval;
+}
+
+static int expect_names(rlite *db, long count, long namelen, int inline_name)
+{
+	int retval = RL_OK;
+	unsigned char name[200], *value;
+	long i, string_page, valuelen;
+	for (i = 0; i < count; i++) {
+		memset(name, 'a' + i % 26, namelen);
+		snprintf((char *)name, namelen, "%ld", i);
+		RL_CALL(rl_key_get, RL_FOUND, db, name, namelen, NULL, &string_page, NULL, NULL, NULL);
+		if ((string_page == 0) != inline_name) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		RL_CALL(rl_get, RL_OK, db, name, namelen, &value, &valuelen);
+		retval = valuelen == namelen && memcmp(value, name, namelen) == 0 ? RL_OK : RL_UNEXPECTED;
+		rl_free(value);
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+	}
+cleanup:
+	return retval;
+}
+
+TEST test_inline_name(int _commit)
+{
+	int retval;
+	rlite *db;
+	long len = 0, *keyslen = NULL, i;
+	unsigned char **keys = NULL, *testkey;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	// records have 27 bytes past their fixed part at a 1024 byte page size
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 10);
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 26);
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, RL_KEY_NAME_INLINE_SIZE);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN(""), 0, UNSIGN(""), 0, 0, 0);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 10, 1);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 26, 1);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, RL_KEY_NAME_INLINE_SIZE, 0);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_keys, RL_OK, db, UNSIGN("*"), 1, &len, &keys, &keyslen);
+	EXPECT_LONG(len, 301);
+	FREE_KEYS();
+	RL_CALL_VERBOSE(rl_randomkey, RL_OK, db, &testkey, &len);
+	rl_free(testkey);
+
+	// renaming moves the name in and out of the record
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_rename, RL_OK, db, UNSIGN("key"), 3, UNSIGN("a longer name that does not fit in the record"), 45, 1);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, UNSIGN("a longer name that does not fit in the record"), 45, NULL, &i, NULL, NULL, NULL);
+	ASSERT(i != 0);
+	RL_CALL_VERBOSE(rl_rename, RL_OK, db, UNSIGN("a longer name that does not fit in the record"), 45, UNSIGN("short"), 5, 1);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, UNSIGN("short"), 5, NULL, &i, NULL, NULL, NULL);
+	EXPECT_LONG(i, 0);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_flushdb, RL_OK, db);
+	RL_COMMIT();
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_inline_name_fan_out()
+{
+	int retval;
+	rlite *db;
+	rl_btree *btree;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	// trees holding more records per node have less room per record
+	RL_CALL_VERBOSE(rl_btree_create_size, RL_OK, db, &btree, &rl_btree_type_hash_sha1_key, 20);
+	db->databases[rl_get_selected_db(db)] = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_key, db->databases[rl_get_selected_db(db)], btree);
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 4);
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 10);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 4, 1);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 10, 0);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+
+	// and none at all when a node cannot hold its records
+	RL_CALL_VERBOSE(rl_select, RL_OK, db, 1);
+	RL_CALL_VERBOSE(rl_btree_create_size, RL_OK, db, &btree, &rl_btree_type_hash_sha1_key, 40);
+	db->databases[rl_get_selected_db(db)] = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_key, db->databases[rl_get_selected_db(db)], btree);
+	RL_CALL_VERBOSE(rl_set, RL_UNEXPECTED, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_inline_name_legacy_header()
+{
+	int retval;
+	rlite *db;
+	FILE *fp;
+	unsigned char *name = UNSIGN("a name too long to be stored in the key record");
+	long namelen = strlen((char *)name);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, name, namelen, name, namelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+	fp = fopen("rlite-test.rld", "r+");
+	ASSERT(fp != NULL);
+	fwrite("rlite0.0", 1, 8, fp);
+	fclose(fp);
+
+	// no names in the records of a 0.0 file...
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, name, namelen, NULL, NULL, NULL, NULL, NULL);
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 4);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 4, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	// ...until the commit upgrades it
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(set_names, RL_OK, db, 100, 10);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 4, 0);
+	RL_CALL_VERBOSE(expect_names, RL_OK, db, 100, 10, 1);
+	RL_CALL_VERBOSE(rl_is_balanced, RL_OK, db);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(key_test)
 {
 	long i;
@@ -706,7 +850,10 @@ SUITE(key_test)
 		RUN_TESTp(zset_version_test, i);
 		RUN_TESTp(hash_version_test, i);
 		RUN_TESTp(watch_test, i);
+		RUN_TESTp(test_inline_name, i);
 	}
+	RUN_TEST(test_inline_name_fan_out);
+	RUN_TEST(test_inline_name_legacy_header);
 	RUN_TEST(basic_test_get_unexisting);
 	RUN_TEST(basic_test_set_delete);
 }
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <limits.h>
 #include "../src/rlite/rlite.h"
+#include "../src/rlite/page_list.h"
 #include "../src/rlite/page_multi_string.h"
 #include "../src/rlite/util.h"
 #include "util.h"
@@ -285,6 +286,101 @@ TEST test_setrange(long initialsize, long index, long updatesize)
 	PASS();
 }
 
+TEST test_replace(long initialsize, long size, int same_page)
+{
+	int retval;
+	long page, newpage, testdatalen, i;
+	unsigned char *testdata;
+	unsigned char *initialdata = malloc(sizeof(unsigned char) * initialsize);
+	unsigned char *data = malloc(sizeof(unsigned char) * size);
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	for (i = 0; i < initialsize; i++) {
+		initialdata[i] = i % 123;
+	}
+	for (i = 0; i < size; i++) {
+		data[i] = i % 151;
+	}
+
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &page, initialdata, initialsize);
+	newpage = page;
+	RL_CALL_VERBOSE(rl_multi_string_replace, RL_OK, db, &newpage, data, size);
+	EXPECT_INT(newpage == page, same_page);
+	RL_CALL_VERBOSE(rl_multi_string_get, RL_OK, db, newpage, &testdata, &testdatalen);
+	EXPECT_BYTES(data, size, testdata, testdatalen);
+	rl_free(testdata);
+	RL_CALL_VERBOSE(rl_multi_string_delete, RL_OK, db, newpage);
+
+	free(initialdata);
+	free(data);
+	rl_close(db);
+	PASS();
+}
+
+static int read_extents(rlite *db, long page, rl_multi_string_extents **extents)
+{
+	void *tmp;
+	rl_list *list;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 1);
+	list = tmp;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_multi_string_extents, list->left, NULL, &tmp, 1);
+	*extents = tmp;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+TEST test_extents(int file)
+{
+	int retval;
+	long size = 20 * 1024, append_size = 10 * 1024, i, page, testdatalen;
+	unsigned char *data = malloc(sizeof(unsigned char) * (size + append_size)), *testdata;
+	rl_multi_string_extents *extents;
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, file, 1);
+	for (i = 0; i < size + append_size; i++) {
+		data[i] = i % 123;
+	}
+
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &page, data, size);
+	RL_CALL_VERBOSE(read_extents, RL_OK, db, page, &extents);
+	EXPECT_LONG(extents->size, 1);
+	EXPECT_LONG(extents->pages[0], size / db->page_size);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	// the last extent is at the end of the file and grows in place
+	RL_CALL_VERBOSE(rl_multi_string_append, RL_OK, db, page, &data[size], append_size, &testdatalen);
+	EXPECT_LONG(testdatalen, size + append_size);
+	RL_CALL_VERBOSE(read_extents, RL_OK, db, page, &extents);
+	EXPECT_LONG(extents->size, 1);
+	EXPECT_LONG(extents->pages[0], (size + append_size) / db->page_size);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_multi_string_get, RL_OK, db, page, &testdata, &testdatalen);
+	EXPECT_BYTES(testdata, testdatalen, data, size + append_size);
+	rl_free(testdata);
+	RL_CALL_VERBOSE(rl_multi_string_getrange, RL_OK, db, page, &testdata, &testdatalen, 1000, 25000);
+	EXPECT_BYTES(testdata, testdatalen, &data[1000], 24001);
+	rl_free(testdata);
+
+	long pages = db->number_of_pages;
+	RL_CALL_VERBOSE(rl_multi_string_delete, RL_OK, db, page);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	// a value of the same size takes the pages just freed
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &page, data, size);
+	RL_CALL_VERBOSE(read_extents, RL_OK, db, page, &extents);
+	EXPECT_LONG(extents->size, 1);
+	EXPECT_LONG(db->number_of_pages, pages);
+	RL_CALL_VERBOSE(rl_multi_string_get, RL_OK, db, page, &testdata, &testdatalen);
+	EXPECT_BYTES(testdata, testdatalen, data, size);
+	rl_free(testdata);
+
+	free(data);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(multi_string_test)
 {
 	RUN_TEST(basic_set_get);
@@ -313,4 +409,19 @@ SUITE(multi_string_test)
 	RUN_TESTp(test_setrange, 1024, 1024, 1024);
 	RUN_TESTp(test_setrange, 1024, 100, 1024);
 	RUN_TESTp(test_setrange, 1024, 1024, 100);
+	RUN_TESTp(test_sha, 10000);
+	RUN_TESTp(test_append, 10000, 3000);
+	RUN_TESTp(test_append, 3000, 10000);
+	RUN_TESTp(test_substr, 10000, 100, -100, 100, 9801);
+	RUN_TESTp(test_setrange, 10000, 5000, 100);
+	RUN_TESTp(test_setrange, 10000, 12000, 1000);
+	RUN_TESTp(test_replace, 10, 20, 1);
+	RUN_TESTp(test_replace, 2000, 100, 1);
+	RUN_TESTp(test_replace, 100, 3000, 1);
+	RUN_TESTp(test_replace, 3000, 20000, 0);
+	RUN_TESTp(test_replace, 20000, 10000, 1);
+	RUN_TESTp(test_replace, 10000, 30000, 1);
+	RUN_TESTp(test_replace, 20000, 100, 0);
+	RUN_TESTp(test_extents, 0);
+	RUN_TESTp(test_extents, 1);
 }
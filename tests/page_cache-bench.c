@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/page_long.h"
+
+/**
+ * A transaction touching `size` pages in random order: writes them, reads
+ * them back and discards them. The cost per page should not depend on the
+ * size of the transaction.
+ */
+static int page_cache_bench_size(long size)
+{
+	int retval;
+	rlite *db = NULL;
+	long i, base, *pages = NULL, *value;
+	void *obj;
+	double start;
+	char name[64];
+
+	RL_CALL(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	RL_MALLOC(pages, sizeof(long) * size);
+	// leave room after next_empty_page so no page gets allocated
+	base = db->number_of_pages + 1;
+	for (i = 0; i < size; i++) {
+		pages[i] = base + i;
+	}
+
+	bench_shuffle(pages, size);
+	start = bench_time();
+	for (i = 0; i < size; i++) {
+		RL_MALLOC(value, sizeof(long));
+		*value = i;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_long, pages[i], value);
+	}
+	snprintf(name, sizeof(name), "write %ld pages", size);
+	bench_report(name, size, "page", bench_time() - start);
+
+	bench_shuffle(pages, size);
+	start = bench_time();
+	for (i = 0; i < size; i++) {
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_long, pages[i], NULL, &obj, 1);
+	}
+	snprintf(name, sizeof(name), "read %ld pages", size);
+	bench_report(name, size, "page", bench_time() - start);
+
+	bench_shuffle(pages, size);
+	start = bench_time();
+	for (i = 0; i < size; i++) {
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_long, pages[i], NULL, &obj, 1);
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_long, pages[i], obj);
+	}
+	snprintf(name, sizeof(name), "rewrite %ld pages", size);
+	bench_report(name, size, "page", bench_time() - start);
+
+	start = bench_time();
+	RL_CALL(rl_discard, RL_OK, db);
+	snprintf(name, sizeof(name), "discard %ld pages", size);
+	bench_report(name, size, "page", bench_time() - start);
+	retval = RL_OK;
+cleanup:
+	rl_free(pages);
+	rl_close(db);
+	return retval;
+}
+
+int page_cache_bench()
+{
+	long sizes[] = {10000, 100000, 1000000};
+	size_t i;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (page_cache_bench_size(sizes[i]) != RL_OK) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/status.h"
+#include "../src/rlite/page_store.h"
+
+TEST page_store_grow_test()
+{
+	rl_page_store store;
+	unsigned char *first, *data;
+	long i;
+	int retval;
+	rl_page_store_init(&store, 1024);
+
+	RL_CALL_VERBOSE(rl_page_store_put, RL_OK, &store, 0, &first);
+	memset(first, 1, 1024);
+	// many chunks later, the first page has not moved
+	for (i = 1; i < 10 * store.chunk_pages; i++) {
+		RL_CALL_VERBOSE(rl_page_store_put, RL_OK, &store, i, &data);
+		memset(data, i & 0xff, 1024);
+	}
+	EXPECT_PTR(first, rl_page_store_get(&store, 0));
+	EXPECT_INT(first[1023], 1);
+	data = rl_page_store_get(&store, 5 * store.chunk_pages + 3);
+	ASSERT(data != NULL);
+	EXPECT_INT(data[0], (5 * store.chunk_pages + 3) & 0xff);
+	EXPECT_PTR(rl_page_store_get(&store, 10 * store.chunk_pages), NULL);
+
+	rl_page_store_destroy(&store);
+	PASS();
+}
+
+TEST page_store_sparse_test()
+{
+	rl_page_store store;
+	unsigned char *data;
+	int retval;
+	rl_page_store_init(&store, 4096);
+
+	RL_CALL_VERBOSE(rl_page_store_put, RL_OK, &store, 100 * store.chunk_pages, &data);
+	EXPECT_LONG(store.number_of_pages, 100 * store.chunk_pages + 1);
+	// chunks nothing was written to are not allocated
+	EXPECT_PTR(store.chunks[0], NULL);
+	EXPECT_PTR(rl_page_store_get(&store, 1), NULL);
+
+	rl_page_store_destroy(&store);
+	PASS();
+}
+
+TEST page_store_truncate_test()
+{
+	rl_page_store store;
+	unsigned char *data;
+	long i;
+	int retval;
+	rl_page_store_init(&store, 1024);
+
+	for (i = 0; i < 3 * store.chunk_pages; i++) {
+		RL_CALL_VERBOSE(rl_page_store_put, RL_OK, &store, i, &data);
+		memset(data, 2, 1024);
+	}
+	rl_page_store_truncate(&store, store.chunk_pages + 1);
+	EXPECT_LONG(store.number_of_pages, store.chunk_pages + 1);
+	ASSERT(store.chunks[1] != NULL);
+	EXPECT_PTR(store.chunks[2], NULL);
+	data = rl_page_store_get(&store, store.chunk_pages);
+	ASSERT(data != NULL);
+	EXPECT_INT(data[0], 2);
+	EXPECT_PTR(rl_page_store_get(&store, store.chunk_pages + 1), NULL);
+
+	rl_page_store_truncate(&store, 0);
+	EXPECT_PTR(store.chunks[0], NULL);
+	EXPECT_PTR(rl_page_store_get(&store, 0), NULL);
+
+	rl_page_store_destroy(&store);
+	PASS();
+}
+
+SUITE(page_store_test)
+{
+	RUN_TEST(page_store_grow_test);
+	RUN_TEST(page_store_sparse_test);
+	RUN_TEST(page_store_truncate_test);
+}
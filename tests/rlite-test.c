@@ -5,35 +5,62 @@
 #include "util.h"
 #include "../src/rlite/rlite.h"
 #include "rlite/util.h"
+#include "rlite/flock.h"
 
 TEST test_rlite_page_cache()
 {
-	rlite *db = malloc(sizeof(rlite));
+	rlite *db = calloc(1, sizeof(rlite));
+	rl_page_cache read_pages;
+	rl_memory_driver driver;
+	memset(&driver, 0, sizeof(driver));
 	db->driver_type = RL_MEMORY_DRIVER;
+	db->driver = &driver;
+	db->page_cache_clock = 0;
+	db->read_pages = &read_pages;
+	db->shared = NULL;
+	db->shared_locked = 0;
 	int retval;
 	void *obj;
+	rl_page *page;
 
 	int size = 15;
-	db->write_pages_len = 0;
-	db->read_pages = malloc(sizeof(rl_page *) * size);
-	db->read_pages_len = size;
-	db->read_pages_alloc = size;
+	RL_CALL_VERBOSE(rl_page_cache_init, RL_OK, &db->write_pages, 0);
+	RL_CALL_VERBOSE(rl_page_cache_init, RL_OK, db->read_pages, 4);
 	long i;
 	for (i = 0; i < size; i++) {
-		db->read_pages[i] = malloc(sizeof(rl_page));
-		db->read_pages[i]->page_number = i;
-		db->read_pages[i]->type = &rl_data_type_header;
+		page = malloc(sizeof(rl_page));
+		page->page_number = i;
+		page->type = &rl_data_type_header;
 		// not a real life scenario, we just need any pointer
-		db->read_pages[i]->obj = db->read_pages[i];
+		page->obj = page;
+		RL_CALL_VERBOSE(rl_page_cache_add, RL_OK, db->read_pages, page);
 	}
 	for (i = 0; i < size; i++) {
 		RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_header, i, NULL, &obj, 1);
-		EXPECT_PTR(obj, db->read_pages[i])
+		EXPECT_LONG(((rl_page *)obj)->page_number, i);
 	}
+	for (i = 0; i < size; i += 2) {
+		page = rl_page_cache_remove(db->read_pages, i);
+		EXPECT_PTR(page, page->obj);
+		rl_free(page);
+	}
+	EXPECT_LONG(db->read_pages->len, size / 2);
 	for (i = 0; i < size; i++) {
-		rl_free(db->read_pages[i]);
+		page = rl_page_cache_get(db->read_pages, i);
+		if (i % 2 == 0) {
+			EXPECT_PTR(page, NULL);
+		}
+		else {
+			EXPECT_LONG(page->page_number, i);
+		}
+	}
+	RL_CALL_VERBOSE(rl_page_cache_sort, RL_OK, db->read_pages);
+	for (i = 0; i < db->read_pages->len; i++) {
+		EXPECT_LONG(db->read_pages->pages[i]->page_number, i * 2 + 1);
+		rl_free(db->read_pages->pages[i]);
 	}
-	rl_free(db->read_pages);
+	rl_page_cache_destroy(db->read_pages);
+	rl_page_cache_destroy(&db->write_pages);
 	rl_free(db);
 	PASS();
 }
@@ -60,6 +87,337 @@ TEST test_has_key()
 	PASS();
 }
 
+TEST test_page_cache_commit()
+{
+	rlite *db = NULL;
+	int retval;
+	rl_btree *btree, *btree2;
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *testvalue;
+	long keylen = 3, valuelen = 5, testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_INT(db->read_pages->len > 0, 1);
+
+	RL_CALL_VERBOSE(rl_get_key_btree, RL_OK, db, &btree, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get_key_btree, RL_OK, db, &btree2, 0);
+	EXPECT_PTR(btree, btree2);
+
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_page_cache_invalidation()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *value2 = UNSIGN("other value"), *testvalue;
+	long keylen = 3, valuelen = 5, value2len = 11, testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db2, 1, 0);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, key, keylen, value2, value2len, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	rl_close(db2);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value2, value2len, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_page_cache_size(int size)
+{
+	rlite *db = NULL;
+	int retval;
+	long i;
+	unsigned char key[20];
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_OK, db, size);
+	for (i = 0; i < 200; i++) {
+		snprintf((char *)key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, key, strlen((char *)key), key, strlen((char *)key), 0, 0);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_INT(db->read_pages->len <= size, 1);
+	for (i = 0; i < 200; i++) {
+		snprintf((char *)key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, strlen((char *)key), NULL, NULL, NULL, NULL, NULL);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_INT(db->read_pages->len <= size, 1);
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_INVALID_PARAMETERS, db, -1);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_file_kept_open()
+{
+	rlite *db = NULL;
+	int retval;
+	void *handle;
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *testvalue;
+	long keylen = 3, valuelen = 5, testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	handle = ((rl_file_driver *)db->driver)->handle;
+	ASSERT(handle != NULL);
+	EXPECT_INT(rl_is_flocked("rlite-test.rld", RLITE_FLOCK_EX), RL_NOT_FOUND);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	EXPECT_INT(rl_is_flocked("rlite-test.rld", RLITE_FLOCK_EX), RL_FOUND);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_PTR(((rl_file_driver *)db->driver)->handle, handle);
+	EXPECT_INT(rl_is_flocked("rlite-test.rld", RLITE_FLOCK_EX), RL_NOT_FOUND);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_exclusive()
+{
+	rlite *db = NULL;
+	int retval;
+	const char *filepath = "rlite-test.rld";
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *testvalue;
+	long keylen = 3, valuelen = 5, testvaluelen;
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE | RLITE_OPEN_EXCLUSIVE);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_INT(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_FOUND);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db);
+	EXPECT_INT(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_FOUND);
+	rl_close(db);
+	EXPECT_INT(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_NOT_FOUND);
+	PASS();
+}
+
+TEST test_discard_new_file()
+{
+	rlite *db = NULL;
+	int retval;
+	const char *filepath = "rlite-test.rld";
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *testvalue;
+	long keylen = 3, valuelen = 5, testvaluelen, page_size;
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE);
+	page_size = db->page_size;
+	// the file is still empty when the next transaction locks it
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	EXPECT_LONG(db->page_size, page_size);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	EXPECT_LONG(db->page_size, page_size);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_io(rl_io_ops *io)
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	unsigned char *key = UNSIGN("key"), *value = UNSIGN("value"), *testvalue;
+	long keylen = 3, valuelen = 5, testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_io, RL_OK, db, io);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db2, 1, 0);
+	RL_CALL_VERBOSE(rl_set_io, RL_OK, db2, io);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_readonly_mmap()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	unsigned char key[20], value[100], *testvalue;
+	long i, keylen, testvaluelen;
+	memset(value, 'a', sizeof(value));
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, value, sizeof(value), 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, "rlite-test.rld", &db2, RLITE_OPEN_READONLY);
+	EXPECT_PTR(((rl_file_driver *)db2->driver)->io, &rl_io_mmap);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, sizeof(value), testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+
+	// grow the file past the current mapping
+	for (i = 0; i < 200; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, sizeof(value), 0, 0);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	for (i = 0; i < 200; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+		EXPECT_BYTES(value, sizeof(value), testvalue, testvaluelen);
+		rl_free(testvalue);
+	}
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_open_options()
+{
+	rlite *db = NULL;
+	int retval;
+	const char *filepath = "rlite-test.rld";
+	rl_open_options options;
+	unsigned char *key = UNSIGN("key"), *value = NULL, *testvalue;
+	long i, keylen = 3, valuelen = 100 * 1024, testvaluelen;
+	long invalid_page_sizes[] = {512, 3000, 131072};
+
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE;
+	for (i = 0; i < 3; i++) {
+		options.page_size = invalid_page_sizes[i];
+		RL_CALL_VERBOSE(rl_open_v2, RL_INVALID_PARAMETERS, filepath, &db, &options);
+	}
+	options.page_size = 0;
+	options.sync = RLITE_SYNC_FULL + 1;
+	RL_CALL_VERBOSE(rl_open_v2, RL_INVALID_PARAMETERS, filepath, &db, &options);
+
+	options.page_size = 4096;
+	options.sync = RLITE_SYNC_OFF;
+	RL_CALL_VERBOSE(rl_open_v2, RL_OK, ":memory:", &db, &options);
+	EXPECT_LONG(db->page_size, 4096);
+	rl_close(db);
+
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	options.page_size = 65536;
+	options.cache_size = 64 * 65536;
+	options.sync = RLITE_SYNC_FULL;
+	options.lock_mode = RLITE_LOCK_EXCLUSIVE;
+	RL_CALL_VERBOSE(rl_open_v2, RL_OK, filepath, &db, &options);
+	EXPECT_LONG(db->page_size, 65536);
+	EXPECT_LONG(db->page_cache_size, 64);
+	value = malloc(valuelen);
+	for (i = 0; i < valuelen; i++) {
+		value[i] = i % 251;
+	}
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_INT(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_FOUND);
+	rl_close(db);
+
+	// the page size of an existing database comes from its header
+	options.page_size = 1024;
+	options.cache_size = 0;
+	options.lock_mode = RLITE_LOCK_NORMAL;
+	RL_CALL_VERBOSE(rl_open_v2, RL_OK, filepath, &db, &options);
+	EXPECT_LONG(db->page_size, 65536);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db);
+	free(value);
+	PASS();
+}
+
+TEST test_group_commit()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	unsigned char key[10], *testvalue;
+	long i, keylen, testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_group_commit, RL_INVALID_PARAMETERS, db, -1, 0, 0);
+	RL_CALL_VERBOSE(rl_set_group_commit, RL_OK, db, 3, 0, 0);
+
+	for (i = 0; i < 3; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, key, keylen, 0, 0);
+		RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+		// the group is written by the third commit
+		EXPECT_LONG(db->group_commits, i < 2 ? i + 1 : 0);
+		EXPECT_INT(rl_is_flocked("rlite-test.rld", RLITE_FLOCK_EX), i < 2 ? RL_FOUND : RL_NOT_FOUND);
+		// pending commits are visible to this connection, across refreshes
+		RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+		EXPECT_BYTES(key, keylen, testvalue, testvaluelen);
+		rl_free(testvalue);
+	}
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("flushed"), 7, UNSIGN("1"), 1, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_LONG(db->group_commits, 1);
+	RL_CALL_VERBOSE(rl_flush, RL_OK, db);
+	EXPECT_LONG(db->group_commits, 0);
+	RL_CALL_VERBOSE(rl_flush, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_set_group_commit, RL_OK, db, 0, 0, 1);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("delayed"), 7, UNSIGN("1"), 1, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_LONG(db->group_commits, 1);
+	usleep(2000);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_LONG(db->group_commits, 0);
+
+	RL_CALL_VERBOSE(rl_set_group_commit, RL_OK, db, 0, 1000, 0);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("closed"), 6, UNSIGN("1"), 1, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	EXPECT_LONG(db->group_commits, 1);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, "rlite-test.rld", &db2, RLITE_OPEN_READWRITE);
+	for (i = 0; i < 3; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db2, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	}
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db2, UNSIGN("flushed"), 7, NULL, NULL, NULL, NULL, NULL);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db2, UNSIGN("delayed"), 7, NULL, NULL, NULL, NULL, NULL);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db2, UNSIGN("closed"), 6, NULL, NULL, NULL, NULL, NULL);
+	rl_close(db2);
+	PASS();
+}
+
 #ifdef RL_DEBUG
 TEST rl_open_oom()
 {
@@ -91,6 +449,19 @@ SUITE(rlite_test)
 {
 	RUN_TEST(test_rlite_page_cache);
 	RUN_TEST(test_has_key);
+	RUN_TEST(test_page_cache_commit);
+	RUN_TEST(test_page_cache_invalidation);
+	RUN_TEST1(test_page_cache_size, 0);
+	RUN_TEST1(test_page_cache_size, 4);
+	RUN_TEST(test_file_kept_open);
+	RUN_TEST(test_exclusive);
+	RUN_TEST(test_discard_new_file);
+	RUN_TEST1(test_io, &rl_io_positional);
+	RUN_TEST1(test_io, &rl_io_stdio);
+	RUN_TEST1(test_io, &rl_io_mmap);
+	RUN_TEST(test_readonly_mmap);
+	RUN_TEST(test_open_options);
+	RUN_TEST(test_group_commit);
 #ifdef RL_DEBUG
 	RUN_TEST(rl_open_oom);
 #endif
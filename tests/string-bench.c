@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/util.h"
+
+#define STRING_BENCH_KEYS 20000
+#define STRING_BENCH_COUNTERS 1000
+
+/**
+ * SET, GET and SET again of values of one size on a memory database, short
+ * values are kept in the key record and long ones in pages of their own.
+ */
+static int string_bench_run(long valuelen)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char key[32], *value = NULL, *got;
+	long i, keylen, gotlen;
+	double start;
+	char name[64];
+
+	RL_MALLOC(value, valuelen);
+	for (i = 0; i < valuelen; i++) {
+		value[i] = 'a' + i % 26;
+	}
+	RL_CALL(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	start = bench_time();
+	for (i = 0; i < STRING_BENCH_KEYS; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	}
+	RL_CALL(rl_commit, RL_OK, db);
+	snprintf(name, sizeof(name), "set %ld bytes", valuelen);
+	bench_report(name, STRING_BENCH_KEYS, "command", bench_time() - start);
+
+	start = bench_time();
+	for (i = 0; i < STRING_BENCH_KEYS; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_get, RL_OK, db, key, keylen, &got, &gotlen);
+		rl_free(got);
+	}
+	snprintf(name, sizeof(name), "get %ld bytes", valuelen);
+	bench_report(name, STRING_BENCH_KEYS, "command", bench_time() - start);
+
+	// a cache refresh, every key is there already
+	start = bench_time();
+	for (i = 0; i < STRING_BENCH_KEYS; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	}
+	RL_CALL(rl_commit, RL_OK, db);
+	snprintf(name, sizeof(name), "set existing %ld bytes", valuelen);
+	bench_report(name, STRING_BENCH_KEYS, "command", bench_time() - start);
+	RL_CALL(rl_discard, RL_OK, db);
+cleanup:
+	rl_free(value);
+	rl_close(db);
+	return retval;
+}
+
+// INCR on a few counters, the values stay short numbers
+static int string_bench_incr()
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char key[32];
+	long i, keylen;
+	long long value;
+	double start;
+
+	RL_CALL(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	start = bench_time();
+	for (i = 0; i < STRING_BENCH_KEYS; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "counter%ld", i % STRING_BENCH_COUNTERS);
+		RL_CALL(rl_incr, RL_OK, db, key, keylen, 1, &value);
+	}
+	RL_CALL(rl_commit, RL_OK, db);
+	bench_report("incr", STRING_BENCH_KEYS, "command", bench_time() - start);
+cleanup:
+	rl_close(db);
+	return retval;
+}
+
+int string_bench()
+{
+	long sizes[] = {16, 32, 64, 128, 256};
+	size_t i;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (string_bench_run(sizes[i]) != RL_OK) {
+			return 1;
+		}
+	}
+	if (string_bench_incr() != RL_OK) {
+		return 1;
+	}
+	return 0;
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include "greatest.h"
 
+extern SUITE(arena_test);
+extern SUITE(page_store_test);
 extern SUITE(btree_test);
 extern SUITE(concurrency_test);
 extern SUITE(db_test);
@@ -18,6 +20,7 @@ extern SUITE(type_zset_test);
 extern SUITE(type_hash_test);
 extern SUITE(skiplist_test);
 extern SUITE(long_test);
+extern SUITE(freelist_test);
 extern SUITE(restore_test);
 extern SUITE(hyperloglog_test);
 extern SUITE(dump_test);
@@ -37,11 +40,14 @@ extern SUITE(flock_test);
 extern SUITE(signal_test);
 extern SUITE(pubsub_test);
 extern SUITE(hpubsub_test);
+extern SUITE(backup_test);
 
 GREATEST_MAIN_DEFS();
 
 int main(int argc, char **argv) {
 	GREATEST_MAIN_BEGIN();
+	RUN_SUITE(arena_test);
+	RUN_SUITE(page_store_test);
 	RUN_SUITE(btree_test);
 	RUN_SUITE(concurrency_test);
 	RUN_SUITE(db_test);
@@ -58,6 +64,7 @@ int main(int argc, char **argv) {
 	RUN_SUITE(type_hash_test);
 	RUN_SUITE(skiplist_test);
 	RUN_SUITE(long_test);
+	RUN_SUITE(freelist_test);
 	RUN_SUITE(restore_test);
 	RUN_SUITE(hyperloglog_test);
 	RUN_SUITE(dump_test);
@@ -77,5 +84,6 @@ int main(int argc, char **argv) {
 	RUN_SUITE(signal_test);
 	RUN_SUITE(pubsub_test);
 	RUN_SUITE(hpubsub_test);
+	RUN_SUITE(backup_test);
 	GREATEST_MAIN_END();
 }
@@ -4,6 +4,7 @@
 #include <math.h>
 #include "../src/rlite/rlite.h"
 #include "../src/rlite/type_string.h"
+#include "../src/rlite/type_list.h"
 #include "util.h"
 
 TEST basic_test_set_get(int _commit)
@@ -689,6 +690,186 @@ TEST basic_test_pfadd_empty(int _commit)
 	PASS();
 }
 
+static int expect_value(rlite *db, unsigned char *key, long keylen, unsigned char *value, long valuelen, int inline_value)
+{
+	int retval;
+	rl_key record;
+	unsigned char *testvalue;
+	long testvaluelen;
+	RL_CALL(rl_key_get_record, RL_FOUND, db, key, keylen, &record);
+	if ((record.value_page == 0) != inline_value) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	RL_CALL(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	// an empty value may come back as NULL
+	retval = testvaluelen == valuelen && (valuelen == 0 || memcmp(testvalue, value, valuelen) == 0) ? RL_OK : RL_UNEXPECTED;
+	rl_free(testvalue);
+cleanup:
+	return retval;
+}
+
+TEST test_inline_value(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("key"), *key2 = UNSIGN("a name too long to be stored in the key record"), *testvalue;
+	long keylen = 3, key2len = strlen((char *)key2), newlength, testvaluelen;
+	unsigned char value[RL_KEY_INLINE_SIZE * 2];
+	long long counter;
+	memset(value, 'a', sizeof(value));
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, 16, 0, 0);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key, keylen, value, 16, 1);
+	RL_CALL_VERBOSE(rl_getrange, RL_OK, db, key, keylen, -4, -1, &testvalue, &testvaluelen);
+	EXPECT_BYTES(testvalue, testvaluelen, value, 4);
+	rl_free(testvalue);
+
+	// the value moves to pages of its own once it does not fit, past 22
+	// bytes next to this name at a 1024 byte page size
+	value[21] = 'b';
+	RL_CALL_VERBOSE(rl_setrange, RL_OK, db, key, keylen, 16, &value[16], 6, &newlength);
+	EXPECT_LONG(newlength, 22);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key, keylen, value, 22, 1);
+	RL_CALL_VERBOSE(rl_append, RL_OK, db, key, keylen, UNSIGN("a"), 1, &newlength);
+	EXPECT_LONG(newlength, 23);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key, keylen, value, 23, 0);
+
+	// and back when it is set again
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN("10"), 2, 0, 0);
+	RL_CALL_VERBOSE(rl_incr, RL_OK, db, key, keylen, 5, &counter);
+	EXPECT_LONG(counter, 15);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key, keylen, UNSIGN("15"), 2, 1);
+
+	// keys keep their value when renamed
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, 22, 0, 0);
+	RL_CALL_VERBOSE(rl_key_expires, RL_OK, db, key, keylen, rl_mstime() + 100000);
+	RL_CALL_VERBOSE(rl_rename, RL_OK, db, key, keylen, key2, key2len, 1);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key2, key2len, value, 22, 1);
+	RL_CALL_VERBOSE(rl_move, RL_OK, db, key2, key2len, 1);
+	RL_CALL_VERBOSE(rl_select, RL_OK, db, 1);
+	RL_CALL_VERBOSE(expect_value, RL_OK, db, key2, key2len, value, 22, 1);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key2, key2len);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
+static int expect_encoding(rlite *db, unsigned char *key, long keylen, const char *value, int encoding)
+{
+	int retval;
+	rl_key record;
+	RL_CALL(rl_key_get_record, RL_FOUND, db, key, keylen, &record);
+	if (!RL_KEY_VALUE_INLINE(&record) || record.encoding != encoding) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	RL_CALL(expect_value, RL_OK, db, key, keylen, UNSIGN(value), strlen(value), 1);
+cleanup:
+	return retval;
+}
+
+TEST test_int_encoding(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("a name too long to be stored in the key record"), *testvalue;
+	long keylen = strlen((char *)key), string_page, testvaluelen, newlength;
+	const char *not_numbers[] = {"0123", "-0", "+1", " 1", "1 ", "", "9223372036854775808", "-9223372036854775809"};
+	long long counter;
+	unsigned long long expires = rl_mstime() + 100000, testexpires;
+	size_t i;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	for (i = 0; i < sizeof(not_numbers) / sizeof(not_numbers[0]); i++) {
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN(not_numbers[i]), strlen(not_numbers[i]), 0, 0);
+		RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, not_numbers[i], RL_KEY_ENCODING_RAW);
+	}
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN("-9223372036854775808"), 20, 0, 0);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "-9223372036854775808", RL_KEY_ENCODING_INT);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN("100"), 3, 0, expires);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "100", RL_KEY_ENCODING_INT);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, &string_page, NULL, NULL, NULL);
+
+	// counters keep their record, name and expiration
+	for (i = 0; i < 10; i++) {
+		RL_CALL_VERBOSE(rl_incr, RL_OK, db, key, keylen, -3, &counter);
+	}
+	EXPECT_LL(counter, 70);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, &testvaluelen, NULL, &testexpires, NULL);
+	EXPECT_LONG(testvaluelen, string_page);
+	EXPECT_LLU(testexpires, expires);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "70", RL_KEY_ENCODING_INT);
+	RL_CALL_VERBOSE(rl_getrange, RL_OK, db, key, keylen, 1, 1, &testvalue, &testvaluelen);
+	EXPECT_BYTES(testvalue, testvaluelen, "0", 1);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_incr, RL_OVERFLOW, db, key, keylen, LLONG_MAX, &counter);
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_append, RL_OK, db, key, keylen, UNSIGN("1"), 1, &newlength);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "701", RL_KEY_ENCODING_INT);
+	RL_CALL_VERBOSE(rl_setrange, RL_OK, db, key, keylen, 0, UNSIGN("a"), 1, &newlength);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "a01", RL_KEY_ENCODING_RAW);
+	RL_CALL_VERBOSE(rl_incr, RL_NAN, db, key, keylen, 1, &counter);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN("9"), 1, 0, 0);
+	RL_CALL_VERBOSE(rl_incr, RL_OK, db, key, keylen, 1, &counter);
+	RL_CALL_VERBOSE(expect_encoding, RL_OK, db, key, keylen, "10", RL_KEY_ENCODING_INT);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, keylen);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_set_existing(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("a name too long to be stored in the key record"), *value;
+	long keylen = strlen((char *)key), sizes[] = {100, 2000, 3000, 20000, 10000, 30000, 10, 500}, i, j;
+	long string_page, value_page, testpage, testvaluelen;
+	long long counter;
+	value = calloc(30000, sizeof(unsigned char));
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	// a key of another type first
+	RL_CALL_VERBOSE(rl_push, RL_OK, db, key, keylen, 1, 0, 1, &value, &keylen, NULL);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, &string_page, NULL, NULL, NULL);
+	for (i = 0; i < (long)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		for (j = 0; j < sizes[i]; j++) {
+			value[j] = 'a' + (i + j) % 26;
+		}
+		RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, NULL, &value_page, NULL, NULL);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, sizes[i], 0, 0);
+		RL_BALANCED();
+		// the key keeps the pages of its name, and of its value while it
+		// is stored the same way
+		RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, &testpage, NULL, NULL, NULL);
+		EXPECT_LONG(testpage, string_page);
+		if (i == 2 || i == 5) {
+			RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db, key, keylen, NULL, NULL, &testpage, NULL, NULL);
+			EXPECT_LONG(testpage, value_page);
+		}
+		RL_CALL_VERBOSE(expect_value, RL_OK, db, key, keylen, value, sizes[i], sizes[i] <= RL_KEY_INLINE_SIZE);
+	}
+	RL_CALL_VERBOSE(rl_incr, RL_NAN, db, key, keylen, 1, &counter);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, NULL, &testvaluelen);
+	EXPECT_LONG(testvaluelen, 500);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, keylen);
+	RL_BALANCED();
+
+	free(value);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(type_string_test)
 {
 	int i;
@@ -716,5 +897,8 @@ SUITE(type_string_test)
 		RUN_TEST1(basic_test_pfadd_pfdebug_encoding, i);
 		RUN_TEST1(basic_test_pfadd_pfdebug_todense, i);
 		RUN_TEST1(basic_test_pfadd_empty, i);
+		RUN_TEST1(test_inline_value, i);
+		RUN_TEST1(test_int_encoding, i);
+		RUN_TEST1(test_set_existing, i);
 	}
 }
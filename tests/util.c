@@ -5,6 +5,7 @@ int setup_db(rlite **_db, int file, int del)
 {
 	const char *filepath = "rlite-test.rld";
 	const char *wal_filepath = ".rlite-test.rld.wal";
+	const char *log_filepath = ".rlite-test.rld.log";
 	if (del) {
 		if (access(filepath, F_OK) == 0) {
 			unlink(filepath);
@@ -12,6 +13,9 @@ int setup_db(rlite **_db, int file, int del)
 		if (access(wal_filepath, F_OK) == 0) {
 			unlink(wal_filepath);
 		}
+		if (access(log_filepath, F_OK) == 0) {
+			unlink(log_filepath);
+		}
 	}
 	rlite *db;
 	int retval = rl_open(file == 1 ? filepath : ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/type_string.h"
+#include "../src/rlite/type_hash.h"
+#include "../src/rlite/util.h"
+
+#define VACUUM_BENCH_FILE "rlite-bench.rld"
+#define VACUUM_BENCH_KEYS 6000
+#define VACUUM_BENCH_HASHES 100
+
+/**
+ * Strings and hashes written together, then two thirds of the strings are
+ * deleted so what is left is spread over the file.
+ */
+static int populate(rlite *db)
+{
+	int retval;
+	long i, added;
+	unsigned char key[32], field[32], value[300];
+	for (i = 0; i < (long)sizeof(value); i++) {
+		value[i] = 'a' + i % 26;
+	}
+	for (i = 0; i < VACUUM_BENCH_KEYS; i++) {
+		RL_CALL(rl_set, RL_OK, db, key, snprintf((char *)key, sizeof(key), "key%ld", i), value, sizeof(value), 0, 0);
+		RL_CALL(rl_hset, RL_OK, db, key, snprintf((char *)key, sizeof(key), "hash%ld", i % VACUUM_BENCH_HASHES), field, snprintf((char *)field, sizeof(field), "field%ld", i), value, 100, &added, 1);
+		if (i % 1000 == 999) {
+			RL_CALL(rl_commit, RL_OK, db);
+		}
+	}
+	for (i = 0; i < VACUUM_BENCH_KEYS; i++) {
+		if (i % 3 != 0) {
+			RL_CALL(rl_key_delete_with_value, RL_OK, db, key, snprintf((char *)key, sizeof(key), "key%ld", i));
+		}
+	}
+	RL_CALL(rl_commit, RL_OK, db);
+cleanup:
+	return retval;
+}
+
+/**
+ * KEYS, then GET or HGETALL on every key, starting with a cold cache.
+ */
+static int scan(rlite *db, const char *name)
+{
+	int retval;
+	long i, len, *keyslen = NULL, valuelen, fieldlen, memberlen;
+	unsigned char **keys = NULL, *value, *field, *member;
+	rl_hash_iterator *iterator;
+	double start;
+
+	RL_CALL(rl_cache_clear, RL_OK, db);
+	start = bench_time();
+	RL_CALL(rl_keys, RL_OK, db, (unsigned char *)"*", 1, &len, &keys, &keyslen);
+	for (i = 0; i < len; i++) {
+		if (keys[i][0] == 'k') {
+			RL_CALL(rl_get, RL_OK, db, keys[i], keyslen[i], &value, &valuelen);
+			rl_free(value);
+			continue;
+		}
+		RL_CALL(rl_hgetall, RL_OK, db, &iterator, keys[i], keyslen[i]);
+		while ((retval = rl_hash_iterator_next(iterator, NULL, &field, &fieldlen, NULL, &member, &memberlen)) == RL_OK) {
+			rl_free(field);
+			rl_free(member);
+		}
+		if (retval != RL_END) {
+			goto cleanup;
+		}
+	}
+	bench_report(name, len, "key", bench_time() - start);
+	RL_CALL(rl_discard, RL_OK, db);
+	retval = RL_OK;
+cleanup:
+	if (keys) {
+		for (i = 0; i < len; i++) {
+			rl_free(keys[i]);
+		}
+	}
+	rl_free(keys);
+	rl_free(keyslen);
+	return retval;
+}
+
+static int vacuum_bench_run(long max_pages)
+{
+	int retval;
+	rlite *db = NULL;
+	long number_of_pages, steps = 0, previous;
+	double start;
+	char name[64];
+
+	unlink(VACUUM_BENCH_FILE);
+	RL_CALL(rl_open, RL_OK, VACUUM_BENCH_FILE, &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	RL_CALL(populate, RL_OK, db);
+	snprintf(name, sizeof(name), "scan before vacuum(%ld)", max_pages);
+	RL_CALL(scan, RL_OK, db, name);
+
+	number_of_pages = db->number_of_pages;
+	start = bench_time();
+	do {
+		previous = db->number_of_pages;
+		RL_CALL(rl_vacuum, RL_OK, db, max_pages);
+		RL_CALL(rl_commit, RL_OK, db);
+		steps++;
+	} while (max_pages > 0 && db->number_of_pages < previous);
+	snprintf(name, sizeof(name), "vacuum(%ld) %ld steps", max_pages, steps);
+	bench_report(name, number_of_pages, "page", bench_time() - start);
+	printf("%-40s %10ld bytes\n", "reclaimed", (number_of_pages - db->number_of_pages) * db->page_size);
+
+	snprintf(name, sizeof(name), "scan after vacuum(%ld)", max_pages);
+	RL_CALL(scan, RL_OK, db, name);
+cleanup:
+	rl_close(db);
+	unlink(VACUUM_BENCH_FILE);
+	return retval;
+}
+
+int vacuum_bench()
+{
+	if (vacuum_bench_run(0) != RL_OK) {
+		return 1;
+	}
+	if (vacuum_bench_run(1000) != RL_OK) {
+		return 1;
+	}
+	return 0;
+}
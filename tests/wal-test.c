@@ -1,5 +1,6 @@
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include "rlite/rlite.h"
 #include "util.h"
@@ -7,6 +8,52 @@
 
 static const char *db_path = "rlite-test.rld";
 static const char *wal_path = ".rlite-test.rld.wal";
+static const char *log_path = ".rlite-test.rld.log";
+
+static int open_wal_mode(rlite **db, long wal_autocheckpoint)
+{
+	rl_open_options options;
+	memset(&options, 0, sizeof(options));
+	options.flags = RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE;
+	options.journal_mode = RLITE_JOURNAL_WAL;
+	options.wal_autocheckpoint = wal_autocheckpoint;
+	return rl_open_v2(db_path, db, &options);
+}
+
+static int set_keys(rlite *db, long from, long to)
+{
+	int retval = RL_OK;
+	unsigned char key[20];
+	long i, keylen;
+	for (i = from; i < to; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_set, RL_OK, db, key, keylen, key, keylen, 0, 0);
+		RL_CALL(rl_commit, RL_OK, db);
+	}
+cleanup:
+	return retval;
+}
+
+static int check_keys(rlite *db, long from, long to)
+{
+	int retval = RL_OK;
+	unsigned char key[20], *value;
+	long i, keylen, valuelen;
+	for (i = from; i < to; i++) {
+		keylen = snprintf((char *)key, sizeof(key), "key%ld", i);
+		RL_CALL(rl_get, RL_OK, db, key, keylen, &value, &valuelen);
+		if (valuelen != keylen || memcmp(key, value, keylen) != 0) {
+			retval = RL_UNEXPECTED;
+		}
+		rl_free(value);
+		if (retval != RL_OK) {
+			goto cleanup;
+		}
+	}
+	RL_CALL(rl_discard, RL_OK, db);
+cleanup:
+	return retval;
+}
 
 TEST test_full_wal(int _commit) {
 	int retval;
@@ -120,10 +167,189 @@ TEST test_partial_wal_readonly(int _commit) {
 	PASS();
 }
 
+TEST test_log() {
+	int retval;
+	rlite *db, *db2, *db3;
+	long pages;
+	struct stat st;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_close(db);
+	stat(db_path, &st);
+
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db, -1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 100);
+	ASSERT_EQm("Expected log path to exist", access(log_path, F_OK), 0);
+	ASSERT_EQm("Expected wal path not to exist", access(wal_path, F_OK), -1);
+	// commits only append to the log
+	EXPECT_LONG(((rl_file_driver *)db->driver)->log->frames > 100, 1);
+	{
+		struct stat st2;
+		stat(db_path, &st2);
+		EXPECT_LONG(st.st_size, st2.st_size);
+	}
+
+	// other connections find the pages in the log
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READONLY);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 100);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db3, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db3, 0, 100);
+
+	// and the commits made after they read it
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 100, 110);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 110);
+
+	RL_CALL_VERBOSE(rl_checkpoint, RL_OK, db, &pages);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(pages > 0);
+	EXPECT_LONG(((rl_file_driver *)db->driver)->log->frames, 0);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 110);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 110, 120);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 120);
+
+	// a connection not in wal mode writes to the database, without the log
+	RL_CALL_VERBOSE(set_keys, RL_OK, db3, 120, 130);
+	ASSERT_EQm("Expected log path not to exist", access(log_path, F_OK), -1);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db, 0, 130);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 130);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 130, 140);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db3, 0, 140);
+	rl_close(db3);
+	rl_close(db2);
+
+	// closing leaves the database without the log
+	rl_close(db);
+	ASSERT_EQm("Expected log path not to exist", access(log_path, F_OK), -1);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db, 0, 140);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_log_autocheckpoint() {
+	int retval;
+	rlite *db;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_close(db);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db, 20);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 100);
+	ASSERT(((rl_file_driver *)db->driver)->log->frames < 20);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db, 0, 100);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_log_torn_commit() {
+	int retval;
+	rlite *db, *db2;
+	struct stat st;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_close(db);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db, -1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 10);
+	stat(log_path, &st);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 10, 11);
+
+	// the last commit was not completely written
+	ASSERT_EQ(truncate(log_path, st.st_size + 100), 0);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READONLY);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 0, 10);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db2, UNSIGN("key10"), 5, NULL, NULL, NULL, NULL, NULL);
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_log_snapshot() {
+	int retval;
+	rlite *db, *db2, *db3;
+	unsigned char *value;
+	long valuelen, pages;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_close(db);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db, -1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 10);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db2, -1);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+
+	// a transaction writing does not block readers
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key0"), 4, UNSIGN("new"), 3, 0, 0);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key0"), 4, &value, &valuelen);
+	EXPECT_BYTES(UNSIGN("key0"), 4, value, valuelen);
+	rl_free(value);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db3, RLITE_OPEN_READONLY);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db3, 0, 10);
+
+	// which keep reading what was committed when they started
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key0"), 4, &value, &valuelen);
+	EXPECT_BYTES(UNSIGN("key0"), 4, value, valuelen);
+	rl_free(value);
+	RL_CALL_VERBOSE(rl_set, RL_INVALID_STATE, db2, UNSIGN("key1"), 4, UNSIGN("new"), 3, 0, 0);
+	// and keep the log from being checkpointed
+	RL_CALL_VERBOSE(rl_lock_checkpoint, RL_BUSY, db, 0);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key0"), 4, &value, &valuelen);
+	EXPECT_BYTES(UNSIGN("new"), 3, value, valuelen);
+	rl_free(value);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db2, 1, 10);
+
+	RL_CALL_VERBOSE(rl_checkpoint, RL_OK, db, &pages);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(pages > 0);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db3, 1, 10);
+	rl_close(db3);
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_log_busy_timeout() {
+	int retval;
+	rlite *db, *db2;
+	long pages;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_close(db);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db, -1);
+	RL_CALL_VERBOSE(set_keys, RL_OK, db, 0, 10);
+	RL_CALL_VERBOSE(open_wal_mode, RL_OK, &db2, -1);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_set_busy_timeout, RL_OK, db2, 20);
+
+	// a second writer gives up once the timeout passes
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key0"), 4, UNSIGN("new"), 3, 0, 0);
+	RL_CALL_VERBOSE(rl_set, RL_BUSY, db2, UNSIGN("key1"), 4, UNSIGN("new"), 3, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, UNSIGN("key1"), 4, UNSIGN("new"), 3, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	// and so does a checkpoint waiting for a reader
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db);
+	RL_CALL_VERBOSE(check_keys, RL_OK, db, 2, 10);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_checkpoint, RL_BUSY, db2, &pages);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db);
+	RL_CALL_VERBOSE(rl_checkpoint, RL_OK, db2, &pages);
+	ASSERT(pages > 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(wal_test)
 {
 	RUN_TEST1(test_full_wal, 1);
 	RUN_TEST1(test_full_wal_readonly, 1);
 	RUN_TEST1(test_partial_wal, 1);
 	RUN_TEST1(test_partial_wal_readonly, 1);
+	RUN_TEST(test_log);
+	RUN_TEST(test_log_autocheckpoint);
+	RUN_TEST(test_log_torn_commit);
+	RUN_TEST(test_log_snapshot);
+	RUN_TEST(test_log_busy_timeout);
 }